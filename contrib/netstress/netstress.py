@@ -0,0 +1,296 @@
+#!/usr/bin/env python
+#
+# netstress.py: Open many fake peers to a local node and measure how fast it
+#               accepts them, how quickly it answers pings and how much CPU
+#               it uses while doing so.
+#
+# Copyright (c) 2017-2018 The LitecoinZ developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+from __future__ import print_function, division
+import argparse
+import errno
+import hashlib
+import os
+import random
+import resource
+import select
+import socket
+import struct
+import sys
+import time
+
+PROTOCOL_VERSION = 170002
+
+NETWORKS = {
+    'main':    (b'\xd8\xcf\xcd\x93', 29333),
+    'testnet': (b'\xfe\x90\x86\x5d', 39333),
+    'regtest': (b'\xea\x8c\x71\x19', 49444),
+}
+
+def sha256d(data):
+    return hashlib.sha256(hashlib.sha256(data).digest()).digest()
+
+def ser_string(s):
+    assert len(s) < 253
+    return struct.pack('<B', len(s)) + s
+
+def ser_address(host, port):
+    ip = socket.inet_pton(socket.AF_INET6, '::ffff:' + host)
+    return struct.pack('<Q', 0) + ip + struct.pack('>H', port)
+
+class Peer(object):
+    def __init__(self, magic, host, port):
+        self.magic = magic
+        self.host = host
+        self.port = port
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.sock.setblocking(False)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.recvbuf = b''
+        self.sendbuf = b''
+        self.connected = False
+        self.closed = False
+        self.tconnect = None
+        self.taccepted = None
+        self.tping = None
+        self.pingnonce = None
+        self.pings = 0
+        self.rtts = []
+
+    def fileno(self):
+        return self.sock.fileno()
+
+    def connect(self):
+        self.tconnect = time.time()
+        err = self.sock.connect_ex((self.host, self.port))
+        if err not in (0, errno.EINPROGRESS):
+            raise socket.error(err, os.strerror(err))
+
+    def message(self, command, payload=b''):
+        header = self.magic + command.ljust(12, b'\x00')
+        header += struct.pack('<I', len(payload)) + sha256d(payload)[:4]
+        self.sendbuf += header + payload
+
+    def send_version(self):
+        payload = struct.pack('<iQq', PROTOCOL_VERSION, 0, int(time.time()))
+        payload += ser_address(self.host, self.port)
+        payload += ser_address('127.0.0.1', 0)
+        payload += struct.pack('<Q', random.getrandbits(64))
+        payload += ser_string(b'/netstress:0.1/')
+        payload += struct.pack('<iB', 0, 0)
+        self.message(b'version', payload)
+
+    def send_ping(self):
+        self.pingnonce = random.getrandbits(64)
+        self.tping = time.time()
+        self.message(b'ping', struct.pack('<Q', self.pingnonce))
+
+    def flush(self):
+        while self.sendbuf:
+            try:
+                n = self.sock.send(self.sendbuf)
+            except socket.error as e:
+                if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+                    return
+                raise
+            self.sendbuf = self.sendbuf[n:]
+
+    def receive(self):
+        """Read what is available and return the complete messages in it."""
+        while True:
+            try:
+                data = self.sock.recv(65536)
+            except socket.error as e:
+                if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+                    break
+                raise
+            if not data:
+                self.closed = True
+                break
+            self.recvbuf += data
+        messages = []
+        while len(self.recvbuf) >= 24:
+            if self.recvbuf[:4] != self.magic:
+                raise ValueError('bad message start')
+            command = self.recvbuf[4:16].rstrip(b'\x00')
+            length = struct.unpack('<I', self.recvbuf[16:20])[0]
+            if len(self.recvbuf) < 24 + length:
+                break
+            messages.append((command, self.recvbuf[24:24 + length]))
+            self.recvbuf = self.recvbuf[24 + length:]
+        return messages
+
+def node_cpu_seconds(pid):
+    """User plus system CPU time of a process, or None if it is not known."""
+    if pid is None:
+        return None
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+class Harness(object):
+    def __init__(self, args):
+        self.args = args
+        self.magic = NETWORKS[args.network][0]
+        self.port = args.port or NETWORKS[args.network][1]
+        self.poller = select.epoll()
+        self.peers = {}
+        self.accepted = 0
+        self.failed = 0
+
+    def watch(self, peer):
+        mask = select.EPOLLIN
+        if peer.sendbuf or not peer.connected:
+            mask |= select.EPOLLOUT
+        self.poller.modify(peer.fileno(), mask)
+
+    def drop(self, peer):
+        self.poller.unregister(peer.fileno())
+        del self.peers[peer.fileno()]
+        peer.sock.close()
+        self.failed += 1
+
+    def handle(self, peer, command, payload):
+        if command == b'version':
+            peer.taccepted = time.time()
+            self.accepted += 1
+            peer.message(b'verack')
+        elif command == b'ping':
+            peer.message(b'pong', payload[:8])
+        elif command == b'pong' and peer.pingnonce is not None:
+            if struct.unpack('<Q', payload[:8])[0] == peer.pingnonce:
+                peer.rtts.append(time.time() - peer.tping)
+                peer.pingnonce = None
+                peer.pings += 1
+                if peer.pings < self.args.pings:
+                    peer.send_ping()
+
+    def poll(self, timeout):
+        for fd, mask in self.poller.poll(timeout):
+            peer = self.peers.get(fd)
+            if peer is None:
+                continue
+            try:
+                if not peer.connected and mask & (select.EPOLLOUT | select.EPOLLERR | select.EPOLLHUP):
+                    err = peer.sock.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR)
+                    if err:
+                        raise socket.error(err, os.strerror(err))
+                    peer.connected = True
+                    peer.send_version()
+                if mask & (select.EPOLLIN | select.EPOLLERR | select.EPOLLHUP):
+                    for command, payload in peer.receive():
+                        self.handle(peer, command, payload)
+                    if peer.closed:
+                        raise socket.error(errno.ECONNRESET, 'connection closed by node')
+                peer.flush()
+                self.watch(peer)
+            except (socket.error, ValueError) as e:
+                if self.args.verbose:
+                    print('peer %d: %s' % (fd, e), file=sys.stderr)
+                self.drop(peer)
+
+    def run_until(self, done, timeout):
+        deadline = time.time() + timeout
+        while not done() and time.time() < deadline:
+            self.poll(0.05)
+
+    def connect(self):
+        """Open the peers in batches, and wait until the node has sent each its version."""
+        start = time.time()
+        for i in range(self.args.peers):
+            peer = Peer(self.magic, self.args.host, self.port)
+            try:
+                peer.connect()
+            except socket.error as e:
+                print('connect failed after %d peers: %s' % (i, e), file=sys.stderr)
+                break
+            self.peers[peer.fileno()] = peer
+            self.poller.register(peer.fileno(), select.EPOLLOUT)
+            if i % self.args.batch == self.args.batch - 1:
+                self.poll(0)
+        self.run_until(lambda: all(p.taccepted for p in self.peers.values()), self.args.timeout)
+        return time.time() - start
+
+    def idle(self):
+        self.run_until(lambda: False, self.args.idle)
+        return self.args.idle
+
+    def ping(self):
+        start = time.time()
+        for peer in self.peers.values():
+            peer.send_ping()
+            peer.flush()
+            self.watch(peer)
+        self.run_until(lambda: all(p.pings >= self.args.pings for p in self.peers.values()), self.args.timeout)
+        return time.time() - start
+
+def measure(pid, fn):
+    cpu = node_cpu_seconds(pid)
+    ours = os.times()
+    elapsed = fn()
+    node = None if cpu is None else node_cpu_seconds(pid) - cpu
+    ours = sum(os.times()[:2]) - sum(ours[:2])
+    return elapsed, node, ours
+
+def report_cpu(label, elapsed, node, ours):
+    if node is not None:
+        print('  node cpu during %s: %.2fs (%.1f%% of one core)' % (label, node, 100 * node / max(elapsed, 1e-9)))
+    print('  harness cpu during %s: %.2fs' % (label, ours))
+
+def main():
+    parser = argparse.ArgumentParser(description='Stress the P2P socket layer of a local litecoinzd.')
+    parser.add_argument('--host', default='127.0.0.1', help='address of the node (default: %(default)s)')
+    parser.add_argument('--port', type=int, default=0, help='P2P port of the node (default: the network\'s)')
+    parser.add_argument('--network', choices=sorted(NETWORKS), default='regtest', help='network of the node (default: %(default)s)')
+    parser.add_argument('--peers', type=int, default=1000, help='number of fake peers to open (default: %(default)s)')
+    parser.add_argument('--batch', type=int, default=100, help='connections opened between polls (default: %(default)s)')
+    parser.add_argument('--pings', type=int, default=10, help='pings each peer sends, one after the other (default: %(default)s)')
+    parser.add_argument('--idle', type=float, default=10, help='seconds to hold the peers idle (default: %(default)s)')
+    parser.add_argument('--timeout', type=float, default=120, help='seconds to wait for each phase (default: %(default)s)')
+    parser.add_argument('--pid', type=int, help='process id of the node, to measure its CPU use')
+    parser.add_argument('--pidfile', help='pid file of the node, to measure its CPU use')
+    parser.add_argument('--verbose', action='store_true', help='report every failed peer')
+    args = parser.parse_args()
+
+    pid = args.pid
+    if pid is None and args.pidfile:
+        with open(args.pidfile) as f:
+            pid = int(f.read().strip())
+
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    want = args.peers + 64
+    if soft < want:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(want, hard), hard))
+
+    harness = Harness(args)
+
+    print('connecting %d peers' % args.peers)
+    elapsed, node, ours = measure(pid, harness.connect)
+    rtts = [p.taccepted - p.tconnect for p in harness.peers.values() if p.taccepted]
+    print('  accepted %d peers in %.2fs (%.0f/s), %d failed' % (harness.accepted, elapsed, harness.accepted / max(elapsed, 1e-9), harness.failed))
+    if rtts:
+        print('  connect to version: median %.1fms, p99 %.1fms' % (1000 * percentile(rtts, 50), 1000 * percentile(rtts, 99)))
+    report_cpu('connect', elapsed, node, ours)
+
+    print('holding %d peers idle for %.0fs' % (len(harness.peers), args.idle))
+    elapsed, node, ours = measure(pid, harness.idle)
+    report_cpu('idle', elapsed, node, ours)
+
+    print('sending %d pings from each peer' % args.pings)
+    elapsed, node, ours = measure(pid, harness.ping)
+    rtts = [rtt for p in harness.peers.values() for rtt in p.rtts]
+    print('  %d pongs in %.2fs (%.0f/s)' % (len(rtts), elapsed, len(rtts) / max(elapsed, 1e-9)))
+    if rtts:
+        print('  ping latency: median %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms' % tuple(
+            1000 * x for x in (percentile(rtts, 50), percentile(rtts, 90), percentile(rtts, 99), max(rtts))))
+    report_cpu('pings', elapsed, node, ours)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,344 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencoding.h"
+
+#include "clientversion.h"
+#include "crypto/common.h"
+#include "lz4.h"
+#include "primitives/transaction.h"
+#include "serialize.h"
+#include "streams.h"
+
+#include <string.h>
+
+namespace {
+
+const unsigned char FRAME_MARKER[] = {0xff, 0xff, 0xff, 0xff};
+
+enum FrameFormat {
+    FRAME_PLAIN = 0,          //!< A single column holding the serialization
+    FRAME_BLOCK_COLUMNS = 1,  //!< A block split into BLOCK_COLUMN_COUNT columns
+};
+
+enum ColumnCodec {
+    COLUMN_STORED = 0,
+    COLUMN_LZ4 = 1,
+};
+
+enum BlockColumn {
+    COLUMN_SIZES,       //!< Compact sizes: counts and lengths
+    COLUMN_INTEGERS,    //!< Versions, times, indexes, sequence numbers, amounts and lock times
+    COLUMN_HASHES,      //!< Hashes, nonces, anchors, nullifiers, commitments, keys and MACs
+    COLUMN_SCRIPTS,
+    COLUMN_PROOFS,      //!< Equihash solutions, zk-SNARK proofs and JoinSplit signatures
+    COLUMN_CIPHERTEXTS, //!< Note ciphertexts
+    BLOCK_COLUMN_COUNT
+};
+
+/** Serialized sizes of the parts of a JoinSplit description */
+struct CJoinSplitLayout
+{
+    size_t nAmounts;
+    size_t nHashes;
+    size_t nProof;
+    size_t nCiphertexts;
+
+    CJoinSplitLayout()
+    {
+        JSDescription js;
+        nAmounts = ::GetSerializeSize(js.vpub_old, SER_DISK, CLIENT_VERSION) +
+                   ::GetSerializeSize(js.vpub_new, SER_DISK, CLIENT_VERSION);
+        nProof = ::GetSerializeSize(js.proof, SER_DISK, CLIENT_VERSION);
+        nCiphertexts = ::GetSerializeSize(js.ciphertexts, SER_DISK, CLIENT_VERSION);
+        // The anchor, nullifiers, commitments, ephemeral key, random seed and
+        // MACs sit between the amounts and the proof
+        nHashes = ::GetSerializeSize(js, SER_DISK, CLIENT_VERSION) - nAmounts - nProof - nCiphertexts;
+    }
+};
+
+const CJoinSplitLayout& GetJoinSplitLayout()
+{
+    static const CJoinSplitLayout layout;
+    return layout;
+}
+
+/** Splits a serialized block into its columns */
+class CColumnSplitter
+{
+private:
+    const char* pcur;
+    const char* pend;
+
+public:
+    std::vector<char> vColumns[BLOCK_COLUMN_COUNT];
+
+    CColumnSplitter(const char* pbegin, const char* pendIn) : pcur(pbegin), pend(pendIn) {}
+
+    bool empty() const { return pcur == pend; }
+
+    const unsigned char* Peek(int nColumn, uint64_t nSize) const
+    {
+        if (nSize > (uint64_t)(pend - pcur))
+            throw std::ios_base::failure("CColumnSplitter::Peek(): end of data");
+        return (const unsigned char*)pcur;
+    }
+
+    void Copy(int nColumn, uint64_t nSize)
+    {
+        Peek(nColumn, nSize);
+        vColumns[nColumn].insert(vColumns[nColumn].end(), pcur, pcur + nSize);
+        pcur += nSize;
+    }
+};
+
+/** Interleaves the columns of a block back into its serialization */
+class CColumnJoiner
+{
+private:
+    const char* vpcur[BLOCK_COLUMN_COUNT];
+    const char* vpend[BLOCK_COLUMN_COUNT];
+    std::vector<char>& vOut;
+
+public:
+    CColumnJoiner(const std::vector<std::vector<char> >& vColumns, std::vector<char>& vOutIn) : vOut(vOutIn)
+    {
+        for (int i = 0; i < BLOCK_COLUMN_COUNT; i++) {
+            vpcur[i] = vColumns[i].empty() ? NULL : &vColumns[i][0];
+            vpend[i] = vpcur[i] + vColumns[i].size();
+        }
+    }
+
+    bool empty() const
+    {
+        for (int i = 0; i < BLOCK_COLUMN_COUNT; i++) {
+            if (vpcur[i] != vpend[i])
+                return false;
+        }
+        return true;
+    }
+
+    const unsigned char* Peek(int nColumn, uint64_t nSize) const
+    {
+        if (nSize > (uint64_t)(vpend[nColumn] - vpcur[nColumn]))
+            throw std::ios_base::failure("CColumnJoiner::Peek(): end of column");
+        return (const unsigned char*)vpcur[nColumn];
+    }
+
+    void Copy(int nColumn, uint64_t nSize)
+    {
+        Peek(nColumn, nSize);
+        vOut.insert(vOut.end(), vpcur[nColumn], vpcur[nColumn] + nSize);
+        vpcur[nColumn] += nSize;
+    }
+};
+
+/** Pass a compact size through, as it is, and return its value */
+template<typename Walker>
+uint64_t WalkCompactSize(Walker& walker)
+{
+    unsigned char chSize = *walker.Peek(COLUMN_SIZES, 1);
+    if (chSize < 253) {
+        walker.Copy(COLUMN_SIZES, 1);
+        return chSize;
+    }
+    size_t nBytes = chSize == 253 ? 3 : chSize == 254 ? 5 : 9;
+    const unsigned char* p = walker.Peek(COLUMN_SIZES, nBytes);
+    uint64_t nSize = chSize == 253 ? ReadLE16(p + 1) : chSize == 254 ? ReadLE32(p + 1) : ReadLE64(p + 1);
+    walker.Copy(COLUMN_SIZES, nBytes);
+    return nSize;
+}
+
+/**
+ * Walk the fields of a serialized block in order, passing each to its column.
+ * Every field is copied byte for byte, so a block always comes back exactly
+ * as it was written, whether or not its encoding is canonical.
+ */
+template<typename Walker>
+void WalkBlock(Walker& walker)
+{
+    const CJoinSplitLayout& layout = GetJoinSplitLayout();
+
+    // Version, then the previous block, Merkle root and reserved hashes
+    walker.Copy(COLUMN_INTEGERS, 4);
+    walker.Copy(COLUMN_HASHES, 3 * 32);
+    // Time and bits, then the nonce and the Equihash solution
+    walker.Copy(COLUMN_INTEGERS, 8);
+    walker.Copy(COLUMN_HASHES, 32);
+    walker.Copy(COLUMN_PROOFS, WalkCompactSize(walker));
+
+    for (uint64_t nTx = WalkCompactSize(walker); nTx > 0; nTx--) {
+        int32_t nVersion = ReadLE32(walker.Peek(COLUMN_INTEGERS, 4));
+        walker.Copy(COLUMN_INTEGERS, 4);
+        for (uint64_t nIn = WalkCompactSize(walker); nIn > 0; nIn--) {
+            walker.Copy(COLUMN_HASHES, 32);
+            walker.Copy(COLUMN_INTEGERS, 4);
+            walker.Copy(COLUMN_SCRIPTS, WalkCompactSize(walker));
+            walker.Copy(COLUMN_INTEGERS, 4);
+        }
+        for (uint64_t nOut = WalkCompactSize(walker); nOut > 0; nOut--) {
+            walker.Copy(COLUMN_INTEGERS, 8);
+            walker.Copy(COLUMN_SCRIPTS, WalkCompactSize(walker));
+        }
+        walker.Copy(COLUMN_INTEGERS, 4);
+        if (nVersion >= 2) {
+            uint64_t nJoinSplit = WalkCompactSize(walker);
+            for (uint64_t i = 0; i < nJoinSplit; i++) {
+                walker.Copy(COLUMN_INTEGERS, layout.nAmounts);
+                walker.Copy(COLUMN_HASHES, layout.nHashes);
+                walker.Copy(COLUMN_PROOFS, layout.nProof);
+                walker.Copy(COLUMN_CIPHERTEXTS, layout.nCiphertexts);
+            }
+            if (nJoinSplit > 0) {
+                walker.Copy(COLUMN_HASHES, 32);
+                walker.Copy(COLUMN_PROOFS, sizeof(CTransaction::joinsplit_sig_t));
+            }
+        }
+    }
+}
+
+/** Appends to a vector, for the serialization helpers */
+class CFrameWriter
+{
+private:
+    std::vector<char>& vData;
+
+public:
+    CFrameWriter(std::vector<char>& vDataIn) : vData(vDataIn) {}
+
+    CFrameWriter& write(const char* pch, size_t nSize)
+    {
+        vData.insert(vData.end(), pch, pch + nSize);
+        return (*this);
+    }
+};
+
+void WriteFrame(FrameFormat format, size_t nRawSize, const std::vector<char>* pcolumns, size_t nColumns, std::vector<char>& vFrame)
+{
+    vFrame.clear();
+    CFrameWriter writer(vFrame);
+    writer.write((const char*)FRAME_MARKER, sizeof(FRAME_MARKER));
+    ser_writedata8(writer, format);
+    WriteCompactSize(writer, nRawSize);
+    WriteCompactSize(writer, nColumns);
+
+    std::vector<unsigned char> vCompressed;
+    for (size_t i = 0; i < nColumns; i++) {
+        const std::vector<char>& vColumn = pcolumns[i];
+        const char* pbegin = vColumn.empty() ? NULL : &vColumn[0];
+        LZ4Compress((const unsigned char*)pbegin, vColumn.size(), vCompressed);
+        if (vCompressed.size() + GetSizeOfCompactSize(vCompressed.size()) < vColumn.size()) {
+            ser_writedata8(writer, COLUMN_LZ4);
+            WriteCompactSize(writer, vColumn.size());
+            WriteCompactSize(writer, vCompressed.size());
+            writer.write((const char*)&vCompressed[0], vCompressed.size());
+        } else {
+            ser_writedata8(writer, COLUMN_STORED);
+            WriteCompactSize(writer, vColumn.size());
+            writer.write(pbegin, vColumn.size());
+        }
+    }
+}
+
+} // namespace
+
+bool IsCompressedRecord(const char* pbegin, size_t nSize)
+{
+    return nSize >= sizeof(FRAME_MARKER) && memcmp(pbegin, FRAME_MARKER, sizeof(FRAME_MARKER)) == 0;
+}
+
+bool CompressBlockRecord(const char* pbegin, size_t nSize, std::vector<char>& vFrame)
+{
+    CColumnSplitter splitter(pbegin, pbegin + nSize);
+    try {
+        WalkBlock(splitter);
+    } catch (const std::ios_base::failure&) {
+        return CompressRecord(pbegin, nSize, vFrame);
+    }
+    // Anything that is not laid out like a block is compressed as it is
+    if (!splitter.empty())
+        return CompressRecord(pbegin, nSize, vFrame);
+
+    WriteFrame(FRAME_BLOCK_COLUMNS, nSize, splitter.vColumns, BLOCK_COLUMN_COUNT, vFrame);
+    if (vFrame.size() >= nSize) {
+        vFrame.clear();
+        return false;
+    }
+    return true;
+}
+
+bool CompressRecord(const char* pbegin, size_t nSize, std::vector<char>& vFrame)
+{
+    std::vector<char> vColumn(pbegin, pbegin + nSize);
+    WriteFrame(FRAME_PLAIN, nSize, &vColumn, 1, vFrame);
+    if (vFrame.size() >= nSize) {
+        vFrame.clear();
+        return false;
+    }
+    return true;
+}
+
+bool DecompressRecord(const char* pbegin, size_t nSize, std::vector<char>& vRecord)
+{
+    vRecord.clear();
+    if (!IsCompressedRecord(pbegin, nSize))
+        return false;
+
+    try {
+        CMemoryReader reader(pbegin + sizeof(FRAME_MARKER), pbegin + nSize, SER_DISK, CLIENT_VERSION);
+        unsigned char nFormat = ser_readdata8(reader);
+        uint64_t nRawSize = ReadCompactSize(reader);
+        if (nFormat != FRAME_PLAIN && nFormat != FRAME_BLOCK_COLUMNS)
+            return false;
+        uint64_t nColumns = ReadCompactSize(reader);
+        if (nColumns != (nFormat == FRAME_PLAIN ? 1 : BLOCK_COLUMN_COUNT))
+            return false;
+
+        std::vector<std::vector<char> > vColumns(nColumns);
+        std::vector<unsigned char> vCompressed;
+        uint64_t nTotal = 0;
+        for (size_t i = 0; i < nColumns; i++) {
+            unsigned char nCodec = ser_readdata8(reader);
+            uint64_t nColumnSize = ReadCompactSize(reader);
+            nTotal += nColumnSize;
+            if (nTotal > nRawSize)
+                return false;
+            std::vector<char>& vColumn = vColumns[i];
+            vColumn.resize(nColumnSize);
+            if (nCodec == COLUMN_STORED) {
+                if (nColumnSize)
+                    reader.read(&vColumn[0], nColumnSize);
+            } else if (nCodec == COLUMN_LZ4) {
+                uint64_t nCompressedSize = ReadCompactSize(reader);
+                if (nCompressedSize > reader.size())
+                    return false;
+                vCompressed.resize(nCompressedSize);
+                if (nCompressedSize)
+                    reader.read((char*)&vCompressed[0], nCompressedSize);
+                if (!LZ4Decompress(vCompressed.data(), vCompressed.size(), (unsigned char*)vColumn.data(), vColumn.size()))
+                    return false;
+            } else {
+                return false;
+            }
+        }
+        if (nTotal != nRawSize || !reader.empty())
+            return false;
+
+        if (nFormat == FRAME_PLAIN) {
+            vRecord.swap(vColumns[0]);
+            return true;
+        }
+        vRecord.reserve(nRawSize);
+        CColumnJoiner joiner(vColumns, vRecord);
+        WalkBlock(joiner);
+        if (!joiner.empty() || vRecord.size() != nRawSize) {
+            vRecord.clear();
+            return false;
+        }
+    } catch (const std::ios_base::failure&) {
+        vRecord.clear();
+        return false;
+    }
+    return true;
+}
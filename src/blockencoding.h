@@ -0,0 +1,43 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODING_H
+#define BITCOIN_BLOCKENCODING_H
+
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Compressed frames for block and undo records.
+ *
+ * The payload of a record in a blk?????.dat or rev?????.dat file is either
+ * the plain serialization or a compressed frame. A frame starts with four
+ * 0xff bytes, which neither serialization can start with: a block starts with
+ * its version, which is never negative, and undo data with the compact size
+ * of its transaction count, which never needs a 0xff prefix.
+ *
+ * The frame is followed by a format byte, the size of the serialization, and
+ * a list of columns. Each column holds its size and is either stored as it is
+ * or LZ4 compressed, whichever is smaller. Blocks are split into columns of
+ * like fields (integers, hashes, scripts, proofs, ciphertexts) before being
+ * compressed, so similar bytes end up next to each other; undo data is
+ * compressed as a single column.
+ */
+
+/** Whether a record payload is a compressed frame rather than a serialization */
+bool IsCompressedRecord(const char* pbegin, size_t nSize);
+
+/**
+ * Compress a serialized block into a frame. Returns false, leaving vFrame
+ * empty, if the frame would not be smaller than the serialization.
+ */
+bool CompressBlockRecord(const char* pbegin, size_t nSize, std::vector<char>& vFrame);
+
+/** Compress serialized undo data (or any other record) into a frame */
+bool CompressRecord(const char* pbegin, size_t nSize, std::vector<char>& vFrame);
+
+/** Restore the serialization held in a compressed frame */
+bool DecompressRecord(const char* pbegin, size_t nSize, std::vector<char>& vRecord);
+
+#endif // BITCOIN_BLOCKENCODING_H
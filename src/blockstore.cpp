@@ -0,0 +1,274 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+
+#include "blockencoding.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "compat.h"
+#include "consensus/consensus.h"
+#include "crypto/common.h"
+#include "main.h"
+#include "streams.h"
+#include "undo.h"
+#include "util.h"
+
+#include <map>
+
+#ifndef WIN32
+#include <sys/stat.h>
+#endif
+
+#include <boost/thread/mutex.hpp>
+
+/** Number of block files kept mapped at a time */
+static const size_t MAX_MAPPED_BLOCK_FILES = sizeof(void*) > 4 ? 256 : 8;
+
+void CBlockBytes::Set(const std::shared_ptr<const void>& holderIn, const char* pbeginIn, size_t nSizeIn)
+{
+    holder = holderIn;
+    pbegin = pbeginIn;
+    nSize = nSizeIn;
+}
+
+void CBlockBytes::SetNull()
+{
+    holder.reset();
+    pbegin = NULL;
+    nSize = 0;
+}
+
+namespace {
+
+#ifndef WIN32
+/** A read-only mapping of a whole block file */
+class CMappedBlockFile
+{
+public:
+    const char* pdata;
+    size_t nLength;
+
+    CMappedBlockFile(const char* pdataIn, size_t nLengthIn) : pdata(pdataIn), nLength(nLengthIn) {}
+    ~CMappedBlockFile()
+    {
+        munmap((void*)pdata, nLength);
+    }
+};
+
+class CBlockFileMappings
+{
+private:
+    boost::mutex cs;
+    //! Mapped files, and the sequence number of their last use
+    std::map<int, std::pair<std::shared_ptr<CMappedBlockFile>, uint64_t> > mapFiles;
+    uint64_t nUseSequence;
+
+    std::shared_ptr<CMappedBlockFile> Map(int nFile)
+    {
+        boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd == -1)
+            return std::shared_ptr<CMappedBlockFile>();
+        struct stat st;
+        void* pdata = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+            pdata = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (pdata == MAP_FAILED) {
+            LogPrintf("%s: unable to map %s, reading it instead\n", __func__, path.string());
+            return std::shared_ptr<CMappedBlockFile>();
+        }
+        return std::shared_ptr<CMappedBlockFile>(new CMappedBlockFile((const char*)pdata, st.st_size));
+    }
+
+public:
+    CBlockFileMappings() : nUseSequence(0) {}
+
+    /**
+     * Get a mapping of block file nFile that is at least nMinLength bytes
+     * long, mapping the file again if it has grown since it was mapped.
+     */
+    std::shared_ptr<CMappedBlockFile> Get(int nFile, size_t nMinLength)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        std::map<int, std::pair<std::shared_ptr<CMappedBlockFile>, uint64_t> >::iterator it = mapFiles.find(nFile);
+        if (it != mapFiles.end() && it->second.first->nLength >= nMinLength) {
+            it->second.second = ++nUseSequence;
+            return it->second.first;
+        }
+
+        // Mappings still in use by readers stay valid until they let go of them
+        std::shared_ptr<CMappedBlockFile> file = Map(nFile);
+        if (!file || file->nLength < nMinLength)
+            return std::shared_ptr<CMappedBlockFile>();
+        mapFiles[nFile] = std::make_pair(file, ++nUseSequence);
+
+        if (mapFiles.size() > MAX_MAPPED_BLOCK_FILES) {
+            std::map<int, std::pair<std::shared_ptr<CMappedBlockFile>, uint64_t> >::iterator itOldest = mapFiles.begin();
+            for (it = mapFiles.begin(); it != mapFiles.end(); ++it) {
+                if (it->second.second < itOldest->second.second)
+                    itOldest = it;
+            }
+            mapFiles.erase(itOldest);
+        }
+        return file;
+    }
+
+    void Release(int nFile)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        mapFiles.erase(nFile);
+    }
+};
+
+CBlockFileMappings blockFileMappings;
+#endif
+
+bool fBlockFileMapping = DEFAULT_BLOCK_MMAP;
+bool fBlockCompression = DEFAULT_COMPRESS_BLOCKS;
+
+bool CheckRecordHeader(const char* pheader, const CDiskBlockPos& pos, unsigned int& nSize)
+{
+    if (memcmp(pheader, Params().MessageStart(), MESSAGE_START_SIZE))
+        return error("%s: block magic mismatch at %s", __func__, pos.ToString());
+    nSize = ReadLE32((const unsigned char*)pheader + MESSAGE_START_SIZE);
+    if (nSize > MAX_BLOCK_SIZE)
+        return error("%s: block size %u too large at %s", __func__, nSize, pos.ToString());
+    return true;
+}
+
+/** Replace the bytes of a compressed record by the serialization it holds */
+bool DecodeRecord(CBlockBytes& bytes, const CDiskBlockPos& pos)
+{
+    if (!IsCompressedRecord(bytes.begin(), bytes.size()))
+        return true;
+    std::shared_ptr<std::vector<char> > buffer(new std::vector<char>());
+    if (!DecompressRecord(bytes.begin(), bytes.size(), *buffer)) {
+        bytes.SetNull();
+        return error("%s: invalid compressed block at %s", __func__, pos.ToString());
+    }
+    bytes.Set(buffer, buffer->empty() ? NULL : &(*buffer)[0], buffer->size());
+    return true;
+}
+
+} // namespace
+
+void SetBlockFileMapping(bool fEnable)
+{
+#ifndef WIN32
+    fBlockFileMapping = fEnable;
+#endif
+}
+
+void SetBlockCompression(bool fEnable)
+{
+    fBlockCompression = fEnable;
+}
+
+void EncodeBlockRecord(const CBlock& block, std::vector<char>& vRecord)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    vRecord.assign(ss.begin(), ss.end());
+    std::vector<char> vFrame;
+    if (fBlockCompression && CompressBlockRecord(&vRecord[0], vRecord.size(), vFrame))
+        vRecord.swap(vFrame);
+}
+
+void EncodeUndoRecord(const CBlockUndo& blockundo, std::vector<char>& vRecord)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << blockundo;
+    vRecord.assign(ss.begin(), ss.end());
+    std::vector<char> vFrame;
+    if (fBlockCompression && CompressRecord(&vRecord[0], vRecord.size(), vFrame))
+        vRecord.swap(vFrame);
+}
+
+void ReleaseBlockFile(int nFile)
+{
+#ifndef WIN32
+    blockFileMappings.Release(nFile);
+#endif
+}
+
+bool ReadRawBlockFromDisk(CBlockBytes& bytes, const CDiskBlockPos& pos)
+{
+    bytes.SetNull();
+    if (pos.IsNull() || pos.nPos < BLOCK_RECORD_HEADER_SIZE)
+        return error("%s: invalid position %s", __func__, pos.ToString());
+
+    unsigned int nSize;
+#ifndef WIN32
+    if (fBlockFileMapping) {
+        std::shared_ptr<CMappedBlockFile> file = blockFileMappings.Get(pos.nFile, pos.nPos);
+        if (file) {
+            if (!CheckRecordHeader(file->pdata + pos.nPos - BLOCK_RECORD_HEADER_SIZE, pos, nSize))
+                return false;
+            if (file->nLength < pos.nPos + nSize) {
+                file = blockFileMappings.Get(pos.nFile, pos.nPos + nSize);
+                if (!file)
+                    return error("%s: block at %s extends past the end of the file", __func__, pos.ToString());
+            }
+            bytes.Set(file, file->pdata + pos.nPos, nSize);
+            return DecodeRecord(bytes, pos);
+        }
+        // Fall back to reading the file if it cannot be mapped
+    }
+#endif
+
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - BLOCK_RECORD_HEADER_SIZE), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+    try {
+        char header[BLOCK_RECORD_HEADER_SIZE];
+        filein.read(header, sizeof(header));
+        if (!CheckRecordHeader(header, pos, nSize))
+            return false;
+        std::shared_ptr<std::vector<char> > buffer(new std::vector<char>(nSize));
+        if (nSize)
+            filein.read(&(*buffer)[0], nSize);
+        bytes.Set(buffer, buffer->empty() ? NULL : &(*buffer)[0], nSize);
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    return DecodeRecord(bytes, pos);
+}
+
+bool CBlockView::Read(const CBlockIndex* pindex)
+{
+    pblock.reset();
+    if (!ReadRawBlockFromDisk(bytes, pindex->GetBlockPos()))
+        return false;
+    try {
+        CMemoryReader reader(bytes.begin(), bytes.end(), SER_DISK, CLIENT_VERSION);
+        reader >> header;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pindex->GetBlockPos().ToString());
+    }
+    // The index only holds blocks whose header passed the proof-of-work
+    // checks, so a matching hash is all that needs checking here
+    if (header.GetHash() != pindex->GetBlockHash())
+        return error("%s: GetHash() doesn't match index for %s at %s", __func__,
+                pindex->ToString(), pindex->GetBlockPos().ToString());
+    return true;
+}
+
+const CBlock* CBlockView::GetBlock() const
+{
+    if (!pblock) {
+        std::shared_ptr<CBlock> pblockNew(new CBlock());
+        try {
+            CMemoryReader reader(bytes.begin(), bytes.end(), SER_DISK, CLIENT_VERSION);
+            reader >> *pblockNew;
+        } catch (const std::exception& e) {
+            error("%s: Deserialize or I/O error - %s", __func__, e.what());
+            return NULL;
+        }
+        pblock = pblockNew;
+    }
+    return pblock.get();
+}
@@ -0,0 +1,120 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKSTORE_H
+#define BITCOIN_BLOCKSTORE_H
+
+#include "primitives/block.h"
+#include "protocol.h"
+
+#include <memory>
+#include <stddef.h>
+#include <vector>
+
+class CBlockIndex;
+class CBlockUndo;
+struct CDiskBlockPos;
+
+/** Size of the message start and length in front of each record in a block or undo file */
+static const unsigned int BLOCK_RECORD_HEADER_SIZE = MESSAGE_START_SIZE + sizeof(uint32_t);
+
+/** Default for -blockmmap */
+#ifdef WIN32
+static const bool DEFAULT_BLOCK_MMAP = false;
+#else
+static const bool DEFAULT_BLOCK_MMAP = true;
+#endif
+
+/** Default for -compressblocks */
+static const bool DEFAULT_COMPRESS_BLOCKS = false;
+
+/**
+ * The serialized bytes of a block as stored in a blk?????.dat file.
+ *
+ * The bytes either point into a read-only mapping of the file or are held in
+ * a buffer of their own, as they are for records that were stored compressed;
+ * in both cases this object keeps them alive, and
+ * copies of it share them. Serializing it writes the bytes as they are, so
+ * a block can be passed on without being decoded and encoded again.
+ */
+class CBlockBytes
+{
+private:
+    std::shared_ptr<const void> holder;
+    const char* pbegin;
+    size_t nSize;
+
+public:
+    CBlockBytes() : pbegin(NULL), nSize(0) {}
+
+    void Set(const std::shared_ptr<const void>& holderIn, const char* pbeginIn, size_t nSizeIn);
+    void SetNull();
+
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pbegin + nSize; }
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    unsigned int GetSerializeSize(int, int=0) const
+    {
+        return nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int, int=0) const
+    {
+        if (nSize)
+            s.write(pbegin, nSize);
+    }
+};
+
+/**
+ * A block on disk, read without decoding it.
+ *
+ * Only the header is parsed when the block is read; the transactions are
+ * deserialized the first time GetBlock() is called.
+ */
+class CBlockView
+{
+private:
+    CBlockBytes bytes;
+    CBlockHeader header;
+    mutable std::shared_ptr<CBlock> pblock;
+
+public:
+    //! Read the block of pindex, and check that its header matches the index
+    bool Read(const CBlockIndex* pindex);
+
+    const CBlockBytes& GetBytes() const { return bytes; }
+    const CBlockHeader& GetHeader() const { return header; }
+
+    //! The fully deserialized block, or NULL if it fails to deserialize
+    const CBlock* GetBlock() const;
+};
+
+/** Whether to memory-map block files for reading (-blockmmap) */
+void SetBlockFileMapping(bool fEnable);
+
+/** Whether to compress blocks and undo data as they are written (-compressblocks) */
+void SetBlockCompression(bool fEnable);
+
+/**
+ * The record to store for a block: a compressed frame if compression is
+ * enabled and makes it smaller, the plain serialization otherwise.
+ */
+void EncodeBlockRecord(const CBlock& block, std::vector<char>& vRecord);
+
+/** The record to store for the undo data of a block, like EncodeBlockRecord */
+void EncodeUndoRecord(const CBlockUndo& blockundo, std::vector<char>& vRecord);
+
+/**
+ * Read the serialized bytes of the block at pos, as written by
+ * WriteBlockToDisk, decompressing them if they were stored compressed.
+ */
+bool ReadRawBlockFromDisk(CBlockBytes& bytes, const CDiskBlockPos& pos);
+
+/** Stop using the mapping of a block file that has been truncated or deleted */
+void ReleaseBlockFile(int nFile);
+
+#endif // BITCOIN_BLOCKSTORE_H
@@ -6,19 +6,85 @@
 
 #include "chain.h"
 
+#include <new>
+
 using namespace std;
 
+/**
+ * CBlockIndexPool implementation
+ */
+CBlockIndex* CBlockIndexPool::Next() {
+    if (nLastChunkUsed == CHUNK_SIZE) {
+        vChunks.push_back(static_cast<CBlockIndex*>(::operator new(CHUNK_SIZE * sizeof(CBlockIndex))));
+        nLastChunkUsed = 0;
+    }
+    return vChunks.back() + nLastChunkUsed;
+}
+
+CBlockIndex* CBlockIndexPool::Allocate() {
+    CBlockIndex* pindex = new (Next()) CBlockIndex();
+    nLastChunkUsed++;
+    return pindex;
+}
+
+CBlockIndex* CBlockIndexPool::Allocate(const CBlockHeader& block) {
+    CBlockIndex* pindex = new (Next()) CBlockIndex(block);
+    nLastChunkUsed++;
+    return pindex;
+}
+
+void CBlockIndexPool::Clear() {
+    for (size_t i = 0; i < vChunks.size(); i++) {
+        size_t nUsed = i + 1 == vChunks.size() ? nLastChunkUsed : CHUNK_SIZE;
+        for (size_t j = 0; j < nUsed; j++)
+            vChunks[i][j].~CBlockIndex();
+        ::operator delete(vChunks[i]);
+    }
+    vChunks.clear();
+    nLastChunkUsed = CHUNK_SIZE;
+}
+
+size_t CBlockIndexPool::Size() const {
+    return vChunks.empty() ? 0 : (vChunks.size() - 1) * CHUNK_SIZE + nLastChunkUsed;
+}
+
+/** Turn the lowest '1' bit in the binary representation of a number into a '0'. */
+int static inline InvertLowestOne(int n) { return n & (n - 1); }
+
+/** Compute what height to jump back to with the CBlockIndex::pskip pointer. */
+int static inline GetSkipHeight(int height) {
+    if (height < 2)
+        return 0;
+
+    // Determine which height to jump back to. Any number strictly lower than height is acceptable,
+    // but the following expression seems to perform well in simulations (max 110 steps to go back
+    // up to 2**18 blocks).
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
 /**
  * CChain implementation
  */
 void CChain::SetTip(CBlockIndex *pindex) {
     if (pindex == NULL) {
         vChain.clear();
+        vHash.clear();
+        vTime.clear();
+        vBits.clear();
+        vChainWork.clear();
         return;
     }
     vChain.resize(pindex->nHeight + 1);
+    vHash.resize(pindex->nHeight + 1);
+    vTime.resize(pindex->nHeight + 1);
+    vBits.resize(pindex->nHeight + 1);
+    vChainWork.resize(pindex->nHeight + 1);
     while (pindex && vChain[pindex->nHeight] != pindex) {
         vChain[pindex->nHeight] = pindex;
+        vHash[pindex->nHeight] = pindex->GetBlockHash();
+        vTime[pindex->nHeight] = pindex->nTime;
+        vBits[pindex->nHeight] = pindex->nBits;
+        vChainWork[pindex->nHeight] = pindex->nChainWork;
         pindex = pindex->pprev;
     }
 }
@@ -30,20 +96,22 @@ CBlockLocator CChain::GetLocator(const CBlockIndex *pindex) const {
 
     if (!pindex)
         pindex = Tip();
-    while (pindex) {
-        vHave.push_back(pindex->GetBlockHash());
+    if (!pindex)
+        return CBlockLocator(vHave);
+    int nHeight = pindex->nHeight;
+    while (true) {
+        // Once the block is in this chain, so is the rest of the locator, and
+        // its hashes are read by height.
+        if (pindex && Contains(pindex))
+            pindex = NULL;
+        vHave.push_back(pindex ? pindex->GetBlockHash() : vHash[nHeight]);
         // Stop when we have added the genesis block.
-        if (pindex->nHeight == 0)
+        if (nHeight == 0)
             break;
         // Exponentially larger steps back, plus the genesis block.
-        int nHeight = std::max(pindex->nHeight - nStep, 0);
-        if (Contains(pindex)) {
-            // Use O(1) CChain index if possible.
-            pindex = (*this)[nHeight];
-        } else {
-            // Otherwise, use O(log n) skiplist.
+        nHeight = std::max(nHeight - nStep, 0);
+        if (pindex)
             pindex = pindex->GetAncestor(nHeight);
-        }
         if (vHave.size() > 10)
             nStep *= 2;
     }
@@ -59,20 +127,51 @@ const CBlockIndex *CChain::FindFork(const CBlockIndex *pindex) const {
     return pindex;
 }
 
-/** Turn the lowest '1' bit in the binary representation of a number into a '0'. */
-int static inline InvertLowestOne(int n) { return n & (n - 1); }
+int64_t CChain::GetMedianTimePast(int nHeight) const {
+    int64_t pmedian[CBlockIndex::nMedianTimeSpan];
+    int64_t* pbegin = &pmedian[CBlockIndex::nMedianTimeSpan];
+    int64_t* pend = &pmedian[CBlockIndex::nMedianTimeSpan];
 
-/** Compute what height to jump back to with the CBlockIndex::pskip pointer. */
-int static inline GetSkipHeight(int height) {
-    if (height < 2)
-        return 0;
+    for (int i = 0; i < CBlockIndex::nMedianTimeSpan && nHeight - i >= 0; i++)
+        *(--pbegin) = vTime[nHeight - i];
 
-    // Determine which height to jump back to. Any number strictly lower than height is acceptable,
-    // but the following expression seems to perform well in simulations (max 110 steps to go back
-    // up to 2**18 blocks).
-    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+    std::sort(pbegin, pend);
+    return pbegin[(pend - pbegin)/2];
+}
+
+int64_t CChain::GetMedianTimePast(const CBlockIndex *pindex) const {
+    if (Contains(pindex))
+        return GetMedianTimePast(pindex->nHeight);
+    return pindex->GetMedianTimePast();
 }
 
+CBlockIndex *CChain::GetAncestor(const CBlockIndex *pindex, int nHeight) const {
+    if (nHeight > pindex->nHeight || nHeight < 0)
+        return NULL;
+
+    // The same walk as CBlockIndex::GetAncestor, until it reaches this chain
+    CBlockIndex* pindexWalk = const_cast<CBlockIndex*>(pindex);
+    int heightWalk = pindex->nHeight;
+    while (heightWalk > nHeight) {
+        if (Contains(pindexWalk))
+            return vChain[nHeight];
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (heightSkip == nHeight ||
+             (heightSkip > nHeight && !(heightSkipPrev < heightSkip - 2 &&
+                                        heightSkipPrev >= nHeight)))) {
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+
 CBlockIndex* CBlockIndex::GetAncestor(int height)
 {
     if (height > nHeight || height < 0)
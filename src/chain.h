@@ -391,10 +391,51 @@ public:
     }
 };
 
+/**
+ * Storage for the block index entries. Entries are constructed in place in
+ * chunks of consecutive entries rather than allocated one by one, which saves
+ * the allocator's overhead on each of them and keeps entries loaded together
+ * next to each other. They stay valid until Clear().
+ */
+class CBlockIndexPool
+{
+private:
+    static const size_t CHUNK_SIZE = 4096;
+
+    std::vector<CBlockIndex*> vChunks;
+    //! Number of entries constructed in the last chunk
+    size_t nLastChunkUsed;
+
+    CBlockIndexPool(const CBlockIndexPool&);
+    void operator=(const CBlockIndexPool&);
+
+    //! Where the next entry goes, starting a chunk if needed
+    CBlockIndex* Next();
+
+public:
+    CBlockIndexPool() : nLastChunkUsed(CHUNK_SIZE) {}
+    ~CBlockIndexPool() { Clear(); }
+
+    CBlockIndex* Allocate();
+    CBlockIndex* Allocate(const CBlockHeader& block);
+
+    //! Destroy all entries
+    void Clear();
+
+    size_t Size() const;
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain {
 private:
     std::vector<CBlockIndex*> vChain;
+    //! Header fields of the blocks in vChain, by height. Walks over the chain
+    //! read these contiguous arrays instead of chasing pprev pointers across
+    //! entries that are scattered over the heap.
+    std::vector<uint256> vHash;
+    std::vector<uint32_t> vTime;
+    std::vector<uint32_t> vBits;
+    std::vector<arith_uint256> vChainWork;
 
 public:
     /** Returns the index entry for the genesis block of this chain, or NULL if none. */
@@ -438,6 +479,25 @@ public:
         return vChain.size() - 1;
     }
 
+    /** Header fields of the block at a height in this chain, which must exist. */
+    const uint256& GetBlockHash(int nHeight) const { return vHash[nHeight]; }
+    int64_t GetBlockTime(int nHeight) const { return vTime[nHeight]; }
+    uint32_t GetBits(int nHeight) const { return vBits[nHeight]; }
+    const arith_uint256& GetChainWork(int nHeight) const { return vChainWork[nHeight]; }
+
+    /** The median time past of the block at a height in this chain, which must exist. */
+    int64_t GetMedianTimePast(int nHeight) const;
+
+    /** The median time past of any block, using this chain for the part of its history it shares. */
+    int64_t GetMedianTimePast(const CBlockIndex *pindex) const;
+
+    /**
+     * The ancestor of any block at a height, or NULL if there is none. Once
+     * the walk back through the skiplist reaches this chain, the rest is a
+     * lookup by height.
+     */
+    CBlockIndex *GetAncestor(const CBlockIndex *pindex, int nHeight) const;
+
     /** Set/initialize a chain with a given tip. */
     void SetTip(CBlockIndex *pindex);
 
@@ -94,8 +94,14 @@ typedef u_int SOCKET;
 size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
+#ifdef HAVE_SYS_EPOLL_H
+// Sockets are watched with epoll(7) and waited on with poll(2), neither of
+// which limits the value of a descriptor to FD_SETSIZE.
+#define USE_EPOLL 1
+#endif
+
 bool static inline IsSelectableSocket(SOCKET s) {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_EPOLL)
     return true;
 #else
     return (s < FD_SETSIZE);
@@ -0,0 +1,213 @@
+// Copyright (c) 2017-2020 The Bitcoin Core developers
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+
+#include "sodium.h"
+
+namespace {
+
+typedef Num3072::limb_t limb_t;
+typedef Num3072::double_limb_t double_limb_t;
+
+/** 2^3072 - 1103717 is the largest 3072-bit safe prime */
+const limb_t MAX_PRIME_DIFF = 1103717;
+
+const limb_t LIMB_MAX = ~(limb_t)0;
+
+inline limb_t ReadLimb(const unsigned char* ptr)
+{
+#ifdef __SIZEOF_INT128__
+    return ReadLE64(ptr);
+#else
+    return ReadLE32(ptr);
+#endif
+}
+
+inline void WriteLimb(unsigned char* ptr, limb_t x)
+{
+#ifdef __SIZEOF_INT128__
+    WriteLE64(ptr, x);
+#else
+    WriteLE32(ptr, x);
+#endif
+}
+
+/** [c0,c1,c2] += a * b */
+inline void MulAdd3(limb_t& c0, limb_t& c1, limb_t& c2, limb_t a, limb_t b)
+{
+    double_limb_t t = (double_limb_t)a * b;
+    limb_t th = t >> Num3072::LIMB_SIZE;
+    limb_t tl = (limb_t)t;
+
+    c0 += tl;
+    th += (c0 < tl);
+    c1 += th;
+    c2 += (c1 < th);
+}
+
+} // namespace
+
+Num3072::Num3072(const unsigned char (&data)[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        limbs[i] = ReadLimb(data + i * (LIMB_SIZE / 8));
+    }
+    // A 3072-bit number is less than twice the modulus, so one subtraction suffices.
+    if (IsOverflow()) FullReduce();
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; ++i) {
+        limbs[i] = 0;
+    }
+}
+
+/** Whether this is at least the modulus (but, as it fits in 3072 bits, less than twice it) */
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] <= LIMB_MAX - MAX_PRIME_DIFF) return false;
+    for (int i = 1; i < LIMBS; ++i) {
+        if (limbs[i] != LIMB_MAX) return false;
+    }
+    return true;
+}
+
+/** Subtract the modulus, by adding 2^3072 - p and dropping the carry out of the top limb */
+void Num3072::FullReduce()
+{
+    double_limb_t c = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS && c; ++i) {
+        c += limbs[i];
+        limbs[i] = (limb_t)c;
+        c >>= LIMB_SIZE;
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    limb_t tmp[2 * LIMBS];
+
+    // Compute the 6144-bit product one column at a time, so the running sum
+    // stays in registers.
+    limb_t c0 = 0, c1 = 0, c2 = 0;
+    for (int k = 0; k < 2 * LIMBS - 1; ++k) {
+        int lo = k < LIMBS ? 0 : k - LIMBS + 1;
+        int hi = k < LIMBS ? k : LIMBS - 1;
+        for (int i = lo; i <= hi; ++i) {
+            MulAdd3(c0, c1, c2, limbs[i], a.limbs[k - i]);
+        }
+        tmp[k] = c0;
+        c0 = c1;
+        c1 = c2;
+        c2 = 0;
+    }
+    tmp[2 * LIMBS - 1] = c0;
+
+    // As 2^3072 = MAX_PRIME_DIFF (mod p), the high half folds into the low
+    // half after multiplying it by MAX_PRIME_DIFF.
+    double_limb_t c = 0;
+    for (int i = 0; i < LIMBS; ++i) {
+        c += (double_limb_t)tmp[LIMBS + i] * MAX_PRIME_DIFF + tmp[i];
+        limbs[i] = (limb_t)c;
+        c >>= LIMB_SIZE;
+    }
+    // What carries out of the top limb is at most MAX_PRIME_DIFF; fold it in
+    // the same way until nothing is left.
+    while (c) {
+        double_limb_t d = c * MAX_PRIME_DIFF;
+        for (int i = 0; i < LIMBS && d; ++i) {
+            d += limbs[i];
+            limbs[i] = (limb_t)d;
+            d >>= LIMB_SIZE;
+        }
+        c = d;
+    }
+    if (IsOverflow()) FullReduce();
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // By Fermat's little theorem, a^(p - 2) is the inverse of a, and
+    // p - 2 = 2^3072 - 1103719 has every bit set except in the lowest limb.
+    Num3072 out;
+    for (int i = LIMBS - 1; i >= 0; --i) {
+        limb_t e = i == 0 ? LIMB_MAX - MAX_PRIME_DIFF - 1 : LIMB_MAX;
+        for (int b = LIMB_SIZE - 1; b >= 0; --b) {
+            out.Multiply(out);
+            if ((e >> b) & 1) out.Multiply(*this);
+        }
+    }
+    return out;
+}
+
+void Num3072::Divide(const Num3072& a)
+{
+    Multiply(a.GetInverse());
+}
+
+void Num3072::ToBytes(unsigned char (&out)[BYTE_SIZE]) const
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        WriteLimb(out + i * (LIMB_SIZE / 8), limbs[i]);
+    }
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    // Expand the SHA256 of the element into 3072 bits with ChaCha20.
+    unsigned char hashed[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(hashed);
+    static const unsigned char nonce[crypto_stream_chacha20_NONCEBYTES] = {0};
+    unsigned char tmp[Num3072::BYTE_SIZE];
+    crypto_stream_chacha20(tmp, sizeof(tmp), nonce, hashed);
+    return Num3072(tmp);
+}
+
+MuHash3072::MuHash3072(const unsigned char* data, size_t len)
+{
+    numerator = ToNum3072(data, len);
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& mul)
+{
+    numerator.Multiply(mul.numerator);
+    denominator.Multiply(mul.denominator);
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator/=(const MuHash3072& div)
+{
+    numerator.Multiply(div.denominator);
+    denominator.Multiply(div.numerator);
+    return *this;
+}
+
+void MuHash3072::Finalize(uint256& out)
+{
+    numerator.Divide(denominator);
+    denominator.SetToOne(); // keep representing the same set
+
+    unsigned char data[Num3072::BYTE_SIZE];
+    numerator.ToBytes(data);
+    CSHA256().Write(data, sizeof(data)).Finalize(out.begin());
+}
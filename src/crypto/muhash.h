@@ -0,0 +1,104 @@
+// Copyright (c) 2017-2020 The Bitcoin Core developers
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** An element of the multiplicative group of integers modulo 2^3072 - 1103717. */
+class Num3072
+{
+public:
+    static const size_t BYTE_SIZE = 384;
+
+#ifdef __SIZEOF_INT128__
+    typedef unsigned __int128 double_limb_t;
+    typedef uint64_t limb_t;
+    static const int LIMBS = 48;
+    static const int LIMB_SIZE = 64;
+#else
+    typedef uint64_t double_limb_t;
+    typedef uint32_t limb_t;
+    static const int LIMBS = 96;
+    static const int LIMB_SIZE = 32;
+#endif
+    limb_t limbs[LIMBS];
+
+    //! Sets this to 1
+    Num3072() { SetToOne(); }
+    //! Interprets data as a little-endian number and reduces it
+    explicit Num3072(const unsigned char (&data)[BYTE_SIZE]);
+
+    void SetToOne();
+    void Multiply(const Num3072& a);
+    void Divide(const Num3072& a);
+    void ToBytes(unsigned char (&out)[BYTE_SIZE]) const;
+
+private:
+    bool IsOverflow() const;
+    void FullReduce();
+    Num3072 GetInverse() const;
+};
+
+/**
+ * A rolling hash of a multiset of byte strings (MuHash, Clarke et al.).
+ *
+ * Each element is hashed to a number modulo a 3072-bit prime, and the set is
+ * represented by the product of its elements. Since multiplication is
+ * commutative and elements can be removed again by division, the result does
+ * not depend on the order of insertions and removals, and the hash of a set
+ * can be computed in parts, on different threads, and combined afterwards.
+ *
+ * Insert and Remove are cheap; the division is only carried out by Finalize.
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const unsigned char* data, size_t len);
+
+public:
+    //! Hash of the empty set
+    MuHash3072() {}
+    //! Hash of the set containing a single element
+    MuHash3072(const unsigned char* data, size_t len);
+
+    MuHash3072& Insert(const unsigned char* data, size_t len);
+    MuHash3072& Remove(const unsigned char* data, size_t len);
+
+    //! Add all elements of another set to this one
+    MuHash3072& operator*=(const MuHash3072& mul);
+    //! Remove all elements of another set from this one
+    MuHash3072& operator/=(const MuHash3072& div);
+
+    //! Compute the 256-bit hash of the set. This is expensive (a modular inversion).
+    void Finalize(uint256& out);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        unsigned char num[Num3072::BYTE_SIZE], den[Num3072::BYTE_SIZE];
+        if (!ser_action.ForRead()) {
+            numerator.ToBytes(num);
+            denominator.ToBytes(den);
+        }
+        READWRITE(FLATDATA(num));
+        READWRITE(FLATDATA(den));
+        if (ser_action.ForRead()) {
+            numerator = Num3072(num);
+            denominator = Num3072(den);
+        }
+    }
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
@@ -7,9 +7,37 @@
 
 #include "crypto/common.h"
 
+#include <algorithm>
 #include <string.h>
 #include <stdexcept>
 
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#if defined(ENABLE_SSE41) && !defined(BUILD_BITCOIN_INTERNAL)
+namespace sha256_sse41
+{
+void TransformD64_4way(unsigned char* out, const unsigned char* in);
+void Compress64_4way(unsigned char* out, const unsigned char* in);
+}
+#endif
+
+#if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+namespace sha256_avx2
+{
+void TransformD64_8way(unsigned char* out, const unsigned char* in);
+void Compress64_8way(unsigned char* out, const unsigned char* in);
+}
+#endif
+
+#if defined(ENABLE_SHANI) && !defined(BUILD_BITCOIN_INTERNAL)
+namespace sha256_shani
+{
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
+}
+#endif
+
 // Internal implementation code.
 namespace
 {
@@ -45,93 +73,425 @@ void inline Initialize(uint32_t* s)
     s[7] = 0x5be0cd19ul;
 }
 
-/** Perform one SHA-256 transformation, processing a 64-byte chunk. */
-void Transform(uint32_t* s, const unsigned char* chunk)
-{
-    uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
-    uint32_t w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
-
-    Round(a, b, c, d, e, f, g, h, 0x428a2f98, w0 = ReadBE32(chunk + 0));
-    Round(h, a, b, c, d, e, f, g, 0x71374491, w1 = ReadBE32(chunk + 4));
-    Round(g, h, a, b, c, d, e, f, 0xb5c0fbcf, w2 = ReadBE32(chunk + 8));
-    Round(f, g, h, a, b, c, d, e, 0xe9b5dba5, w3 = ReadBE32(chunk + 12));
-    Round(e, f, g, h, a, b, c, d, 0x3956c25b, w4 = ReadBE32(chunk + 16));
-    Round(d, e, f, g, h, a, b, c, 0x59f111f1, w5 = ReadBE32(chunk + 20));
-    Round(c, d, e, f, g, h, a, b, 0x923f82a4, w6 = ReadBE32(chunk + 24));
-    Round(b, c, d, e, f, g, h, a, 0xab1c5ed5, w7 = ReadBE32(chunk + 28));
-    Round(a, b, c, d, e, f, g, h, 0xd807aa98, w8 = ReadBE32(chunk + 32));
-    Round(h, a, b, c, d, e, f, g, 0x12835b01, w9 = ReadBE32(chunk + 36));
-    Round(g, h, a, b, c, d, e, f, 0x243185be, w10 = ReadBE32(chunk + 40));
-    Round(f, g, h, a, b, c, d, e, 0x550c7dc3, w11 = ReadBE32(chunk + 44));
-    Round(e, f, g, h, a, b, c, d, 0x72be5d74, w12 = ReadBE32(chunk + 48));
-    Round(d, e, f, g, h, a, b, c, 0x80deb1fe, w13 = ReadBE32(chunk + 52));
-    Round(c, d, e, f, g, h, a, b, 0x9bdc06a7, w14 = ReadBE32(chunk + 56));
-    Round(b, c, d, e, f, g, h, a, 0xc19bf174, w15 = ReadBE32(chunk + 60));
-
-    Round(a, b, c, d, e, f, g, h, 0xe49b69c1, w0 += sigma1(w14) + w9 + sigma0(w1));
-    Round(h, a, b, c, d, e, f, g, 0xefbe4786, w1 += sigma1(w15) + w10 + sigma0(w2));
-    Round(g, h, a, b, c, d, e, f, 0x0fc19dc6, w2 += sigma1(w0) + w11 + sigma0(w3));
-    Round(f, g, h, a, b, c, d, e, 0x240ca1cc, w3 += sigma1(w1) + w12 + sigma0(w4));
-    Round(e, f, g, h, a, b, c, d, 0x2de92c6f, w4 += sigma1(w2) + w13 + sigma0(w5));
-    Round(d, e, f, g, h, a, b, c, 0x4a7484aa, w5 += sigma1(w3) + w14 + sigma0(w6));
-    Round(c, d, e, f, g, h, a, b, 0x5cb0a9dc, w6 += sigma1(w4) + w15 + sigma0(w7));
-    Round(b, c, d, e, f, g, h, a, 0x76f988da, w7 += sigma1(w5) + w0 + sigma0(w8));
-    Round(a, b, c, d, e, f, g, h, 0x983e5152, w8 += sigma1(w6) + w1 + sigma0(w9));
-    Round(h, a, b, c, d, e, f, g, 0xa831c66d, w9 += sigma1(w7) + w2 + sigma0(w10));
-    Round(g, h, a, b, c, d, e, f, 0xb00327c8, w10 += sigma1(w8) + w3 + sigma0(w11));
-    Round(f, g, h, a, b, c, d, e, 0xbf597fc7, w11 += sigma1(w9) + w4 + sigma0(w12));
-    Round(e, f, g, h, a, b, c, d, 0xc6e00bf3, w12 += sigma1(w10) + w5 + sigma0(w13));
-    Round(d, e, f, g, h, a, b, c, 0xd5a79147, w13 += sigma1(w11) + w6 + sigma0(w14));
-    Round(c, d, e, f, g, h, a, b, 0x06ca6351, w14 += sigma1(w12) + w7 + sigma0(w15));
-    Round(b, c, d, e, f, g, h, a, 0x14292967, w15 += sigma1(w13) + w8 + sigma0(w0));
-
-    Round(a, b, c, d, e, f, g, h, 0x27b70a85, w0 += sigma1(w14) + w9 + sigma0(w1));
-    Round(h, a, b, c, d, e, f, g, 0x2e1b2138, w1 += sigma1(w15) + w10 + sigma0(w2));
-    Round(g, h, a, b, c, d, e, f, 0x4d2c6dfc, w2 += sigma1(w0) + w11 + sigma0(w3));
-    Round(f, g, h, a, b, c, d, e, 0x53380d13, w3 += sigma1(w1) + w12 + sigma0(w4));
-    Round(e, f, g, h, a, b, c, d, 0x650a7354, w4 += sigma1(w2) + w13 + sigma0(w5));
-    Round(d, e, f, g, h, a, b, c, 0x766a0abb, w5 += sigma1(w3) + w14 + sigma0(w6));
-    Round(c, d, e, f, g, h, a, b, 0x81c2c92e, w6 += sigma1(w4) + w15 + sigma0(w7));
-    Round(b, c, d, e, f, g, h, a, 0x92722c85, w7 += sigma1(w5) + w0 + sigma0(w8));
-    Round(a, b, c, d, e, f, g, h, 0xa2bfe8a1, w8 += sigma1(w6) + w1 + sigma0(w9));
-    Round(h, a, b, c, d, e, f, g, 0xa81a664b, w9 += sigma1(w7) + w2 + sigma0(w10));
-    Round(g, h, a, b, c, d, e, f, 0xc24b8b70, w10 += sigma1(w8) + w3 + sigma0(w11));
-    Round(f, g, h, a, b, c, d, e, 0xc76c51a3, w11 += sigma1(w9) + w4 + sigma0(w12));
-    Round(e, f, g, h, a, b, c, d, 0xd192e819, w12 += sigma1(w10) + w5 + sigma0(w13));
-    Round(d, e, f, g, h, a, b, c, 0xd6990624, w13 += sigma1(w11) + w6 + sigma0(w14));
-    Round(c, d, e, f, g, h, a, b, 0xf40e3585, w14 += sigma1(w12) + w7 + sigma0(w15));
-    Round(b, c, d, e, f, g, h, a, 0x106aa070, w15 += sigma1(w13) + w8 + sigma0(w0));
-
-    Round(a, b, c, d, e, f, g, h, 0x19a4c116, w0 += sigma1(w14) + w9 + sigma0(w1));
-    Round(h, a, b, c, d, e, f, g, 0x1e376c08, w1 += sigma1(w15) + w10 + sigma0(w2));
-    Round(g, h, a, b, c, d, e, f, 0x2748774c, w2 += sigma1(w0) + w11 + sigma0(w3));
-    Round(f, g, h, a, b, c, d, e, 0x34b0bcb5, w3 += sigma1(w1) + w12 + sigma0(w4));
-    Round(e, f, g, h, a, b, c, d, 0x391c0cb3, w4 += sigma1(w2) + w13 + sigma0(w5));
-    Round(d, e, f, g, h, a, b, c, 0x4ed8aa4a, w5 += sigma1(w3) + w14 + sigma0(w6));
-    Round(c, d, e, f, g, h, a, b, 0x5b9cca4f, w6 += sigma1(w4) + w15 + sigma0(w7));
-    Round(b, c, d, e, f, g, h, a, 0x682e6ff3, w7 += sigma1(w5) + w0 + sigma0(w8));
-    Round(a, b, c, d, e, f, g, h, 0x748f82ee, w8 += sigma1(w6) + w1 + sigma0(w9));
-    Round(h, a, b, c, d, e, f, g, 0x78a5636f, w9 += sigma1(w7) + w2 + sigma0(w10));
-    Round(g, h, a, b, c, d, e, f, 0x84c87814, w10 += sigma1(w8) + w3 + sigma0(w11));
-    Round(f, g, h, a, b, c, d, e, 0x8cc70208, w11 += sigma1(w9) + w4 + sigma0(w12));
-    Round(e, f, g, h, a, b, c, d, 0x90befffa, w12 += sigma1(w10) + w5 + sigma0(w13));
-    Round(d, e, f, g, h, a, b, c, 0xa4506ceb, w13 += sigma1(w11) + w6 + sigma0(w14));
-    Round(c, d, e, f, g, h, a, b, 0xbef9a3f7, w14 + sigma1(w12) + w7 + sigma0(w15));
-    Round(b, c, d, e, f, g, h, a, 0xc67178f2, w15 + sigma1(w13) + w8 + sigma0(w0));
-
-    s[0] += a;
-    s[1] += b;
-    s[2] += c;
-    s[3] += d;
-    s[4] += e;
-    s[5] += f;
-    s[6] += g;
-    s[7] += h;
+/** Perform a number of SHA-256 transformations, processing 64-byte chunks. */
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    while (blocks--) {
+        uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        uint32_t w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
+
+        Round(a, b, c, d, e, f, g, h, 0x428a2f98, w0 = ReadBE32(chunk + 0));
+        Round(h, a, b, c, d, e, f, g, 0x71374491, w1 = ReadBE32(chunk + 4));
+        Round(g, h, a, b, c, d, e, f, 0xb5c0fbcf, w2 = ReadBE32(chunk + 8));
+        Round(f, g, h, a, b, c, d, e, 0xe9b5dba5, w3 = ReadBE32(chunk + 12));
+        Round(e, f, g, h, a, b, c, d, 0x3956c25b, w4 = ReadBE32(chunk + 16));
+        Round(d, e, f, g, h, a, b, c, 0x59f111f1, w5 = ReadBE32(chunk + 20));
+        Round(c, d, e, f, g, h, a, b, 0x923f82a4, w6 = ReadBE32(chunk + 24));
+        Round(b, c, d, e, f, g, h, a, 0xab1c5ed5, w7 = ReadBE32(chunk + 28));
+        Round(a, b, c, d, e, f, g, h, 0xd807aa98, w8 = ReadBE32(chunk + 32));
+        Round(h, a, b, c, d, e, f, g, 0x12835b01, w9 = ReadBE32(chunk + 36));
+        Round(g, h, a, b, c, d, e, f, 0x243185be, w10 = ReadBE32(chunk + 40));
+        Round(f, g, h, a, b, c, d, e, 0x550c7dc3, w11 = ReadBE32(chunk + 44));
+        Round(e, f, g, h, a, b, c, d, 0x72be5d74, w12 = ReadBE32(chunk + 48));
+        Round(d, e, f, g, h, a, b, c, 0x80deb1fe, w13 = ReadBE32(chunk + 52));
+        Round(c, d, e, f, g, h, a, b, 0x9bdc06a7, w14 = ReadBE32(chunk + 56));
+        Round(b, c, d, e, f, g, h, a, 0xc19bf174, w15 = ReadBE32(chunk + 60));
+
+        Round(a, b, c, d, e, f, g, h, 0xe49b69c1, w0 += sigma1(w14) + w9 + sigma0(w1));
+        Round(h, a, b, c, d, e, f, g, 0xefbe4786, w1 += sigma1(w15) + w10 + sigma0(w2));
+        Round(g, h, a, b, c, d, e, f, 0x0fc19dc6, w2 += sigma1(w0) + w11 + sigma0(w3));
+        Round(f, g, h, a, b, c, d, e, 0x240ca1cc, w3 += sigma1(w1) + w12 + sigma0(w4));
+        Round(e, f, g, h, a, b, c, d, 0x2de92c6f, w4 += sigma1(w2) + w13 + sigma0(w5));
+        Round(d, e, f, g, h, a, b, c, 0x4a7484aa, w5 += sigma1(w3) + w14 + sigma0(w6));
+        Round(c, d, e, f, g, h, a, b, 0x5cb0a9dc, w6 += sigma1(w4) + w15 + sigma0(w7));
+        Round(b, c, d, e, f, g, h, a, 0x76f988da, w7 += sigma1(w5) + w0 + sigma0(w8));
+        Round(a, b, c, d, e, f, g, h, 0x983e5152, w8 += sigma1(w6) + w1 + sigma0(w9));
+        Round(h, a, b, c, d, e, f, g, 0xa831c66d, w9 += sigma1(w7) + w2 + sigma0(w10));
+        Round(g, h, a, b, c, d, e, f, 0xb00327c8, w10 += sigma1(w8) + w3 + sigma0(w11));
+        Round(f, g, h, a, b, c, d, e, 0xbf597fc7, w11 += sigma1(w9) + w4 + sigma0(w12));
+        Round(e, f, g, h, a, b, c, d, 0xc6e00bf3, w12 += sigma1(w10) + w5 + sigma0(w13));
+        Round(d, e, f, g, h, a, b, c, 0xd5a79147, w13 += sigma1(w11) + w6 + sigma0(w14));
+        Round(c, d, e, f, g, h, a, b, 0x06ca6351, w14 += sigma1(w12) + w7 + sigma0(w15));
+        Round(b, c, d, e, f, g, h, a, 0x14292967, w15 += sigma1(w13) + w8 + sigma0(w0));
+
+        Round(a, b, c, d, e, f, g, h, 0x27b70a85, w0 += sigma1(w14) + w9 + sigma0(w1));
+        Round(h, a, b, c, d, e, f, g, 0x2e1b2138, w1 += sigma1(w15) + w10 + sigma0(w2));
+        Round(g, h, a, b, c, d, e, f, 0x4d2c6dfc, w2 += sigma1(w0) + w11 + sigma0(w3));
+        Round(f, g, h, a, b, c, d, e, 0x53380d13, w3 += sigma1(w1) + w12 + sigma0(w4));
+        Round(e, f, g, h, a, b, c, d, 0x650a7354, w4 += sigma1(w2) + w13 + sigma0(w5));
+        Round(d, e, f, g, h, a, b, c, 0x766a0abb, w5 += sigma1(w3) + w14 + sigma0(w6));
+        Round(c, d, e, f, g, h, a, b, 0x81c2c92e, w6 += sigma1(w4) + w15 + sigma0(w7));
+        Round(b, c, d, e, f, g, h, a, 0x92722c85, w7 += sigma1(w5) + w0 + sigma0(w8));
+        Round(a, b, c, d, e, f, g, h, 0xa2bfe8a1, w8 += sigma1(w6) + w1 + sigma0(w9));
+        Round(h, a, b, c, d, e, f, g, 0xa81a664b, w9 += sigma1(w7) + w2 + sigma0(w10));
+        Round(g, h, a, b, c, d, e, f, 0xc24b8b70, w10 += sigma1(w8) + w3 + sigma0(w11));
+        Round(f, g, h, a, b, c, d, e, 0xc76c51a3, w11 += sigma1(w9) + w4 + sigma0(w12));
+        Round(e, f, g, h, a, b, c, d, 0xd192e819, w12 += sigma1(w10) + w5 + sigma0(w13));
+        Round(d, e, f, g, h, a, b, c, 0xd6990624, w13 += sigma1(w11) + w6 + sigma0(w14));
+        Round(c, d, e, f, g, h, a, b, 0xf40e3585, w14 += sigma1(w12) + w7 + sigma0(w15));
+        Round(b, c, d, e, f, g, h, a, 0x106aa070, w15 += sigma1(w13) + w8 + sigma0(w0));
+
+        Round(a, b, c, d, e, f, g, h, 0x19a4c116, w0 += sigma1(w14) + w9 + sigma0(w1));
+        Round(h, a, b, c, d, e, f, g, 0x1e376c08, w1 += sigma1(w15) + w10 + sigma0(w2));
+        Round(g, h, a, b, c, d, e, f, 0x2748774c, w2 += sigma1(w0) + w11 + sigma0(w3));
+        Round(f, g, h, a, b, c, d, e, 0x34b0bcb5, w3 += sigma1(w1) + w12 + sigma0(w4));
+        Round(e, f, g, h, a, b, c, d, 0x391c0cb3, w4 += sigma1(w2) + w13 + sigma0(w5));
+        Round(d, e, f, g, h, a, b, c, 0x4ed8aa4a, w5 += sigma1(w3) + w14 + sigma0(w6));
+        Round(c, d, e, f, g, h, a, b, 0x5b9cca4f, w6 += sigma1(w4) + w15 + sigma0(w7));
+        Round(b, c, d, e, f, g, h, a, 0x682e6ff3, w7 += sigma1(w5) + w0 + sigma0(w8));
+        Round(a, b, c, d, e, f, g, h, 0x748f82ee, w8 += sigma1(w6) + w1 + sigma0(w9));
+        Round(h, a, b, c, d, e, f, g, 0x78a5636f, w9 += sigma1(w7) + w2 + sigma0(w10));
+        Round(g, h, a, b, c, d, e, f, 0x84c87814, w10 += sigma1(w8) + w3 + sigma0(w11));
+        Round(f, g, h, a, b, c, d, e, 0x8cc70208, w11 += sigma1(w9) + w4 + sigma0(w12));
+        Round(e, f, g, h, a, b, c, d, 0x90befffa, w12 += sigma1(w10) + w5 + sigma0(w13));
+        Round(d, e, f, g, h, a, b, c, 0xa4506ceb, w13 += sigma1(w11) + w6 + sigma0(w14));
+        Round(c, d, e, f, g, h, a, b, 0xbef9a3f7, w14 + sigma1(w12) + w7 + sigma0(w15));
+        Round(b, c, d, e, f, g, h, a, 0xc67178f2, w15 + sigma1(w13) + w8 + sigma0(w0));
+
+        s[0] += a;
+        s[1] += b;
+        s[2] += c;
+        s[3] += d;
+        s[4] += e;
+        s[5] += f;
+        s[6] += g;
+        s[7] += h;
+        chunk += 64;
+    }
+}
+
+typedef void (*TransformType)(uint32_t*, const unsigned char*, size_t);
+typedef void (*TransformD64Type)(unsigned char*, const unsigned char*);
+
+/** Double-SHA256 of a 64-byte blob, built on a single-lane Transform. */
+template<TransformType tr>
+void TransformD64Wrapper(unsigned char* out, const unsigned char* in)
+{
+    // The padding block of a 64-byte message, and the second message with
+    // room for the first hash and the padding of a 32-byte message.
+    static const unsigned char padding1[64] = {
+        0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0
+    };
+    unsigned char buffer2[64] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0
+    };
+    uint32_t s[8];
+    Initialize(s);
+    tr(s, in, 1);
+    tr(s, padding1, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(buffer2 + 4 * i, s[i]);
+    Initialize(s);
+    tr(s, buffer2, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
+}
+
+/** SHA256Compress of a 64-byte blob, built on a single-lane Transform. */
+template<TransformType tr>
+void Compress64Wrapper(unsigned char* out, const unsigned char* in)
+{
+    uint32_t s[8];
+    Initialize(s);
+    tr(s, in, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
 }
 
 } // namespace sha256
+
+/** A set of implementations to hash with. The multi-lane ones are NULL when
+ *  the CPU can't run them. */
+struct Backends
+{
+    sha256::TransformType Transform;
+    sha256::TransformD64Type TransformD64;
+    sha256::TransformD64Type TransformD64_4way;
+    sha256::TransformD64Type TransformD64_8way;
+    sha256::TransformD64Type Compress64;
+    sha256::TransformD64Type Compress64_4way;
+    sha256::TransformD64Type Compress64_8way;
+};
+
+const Backends standard = {
+    sha256::Transform,
+    sha256::TransformD64Wrapper<sha256::Transform>, NULL, NULL,
+    sha256::Compress64Wrapper<sha256::Transform>, NULL, NULL,
+};
+
+// The implementations in use, picked by SHA256AutoDetect
+Backends active = standard;
+
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+// We can't use cpuid.h's __get_cpuid as it does not support subleafs.
+void inline cpuid(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+}
+
+/** Check whether the OS has enabled AVX registers. */
+bool AVXEnabled()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (a & 6) == 6;
+}
+#endif
+
+/** Check the implementations in b against known answers: Transform over 0
+ *  to 8 blocks, and the 64-byte double hash and compression one lane and four
+ *  and eight lanes at a time. The input is misaligned on purpose. */
+bool SelfTest(const Backends& b)
+{
+    // Some input data to test with
+    static const unsigned char data[514] = "-"
+        "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+        "eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut e"
+        "nim ad minim veniam, quis nostrud exercitation ullamco laboris n"
+        "isi ut aliquip ex ea commodo consequat. Duis aute irure dolor in"
+        " reprehenderit in voluptate velit esse cillum dolore eu fugiat n"
+        "ulla pariatur. Excepteur sint occaecat cupidatat non proident, s"
+        "unt in culpa qui officia deserunt mollit anim id est laborum. Se"
+        "d ut perspiciatis unde omnis iste natus error sit voluptatem acc";
+    // Expected state after applying Transform to the first i blocks of the input, without padding
+    static const uint32_t result[9][8] = {
+        {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+        {0x91f8ec6b, 0x4da10fe3, 0x1c9c292c, 0x45e18185, 0x435cc111, 0x3ca26f09, 0xeb954cae, 0x402a7069},
+        {0x63d2d8de, 0x989a4e29, 0x8e6531cb, 0x4fd4ff72, 0xe7bbfb0f, 0x6c81c90a, 0x8e78ce53, 0x276373d8},
+        {0x7b6bede4, 0x277f89b8, 0xab264a2b, 0x95690fa8, 0x5b971be1, 0x5df60310, 0x72bc484f, 0x2d50bd44},
+        {0x9938a139, 0xa91be09e, 0x05226d3f, 0x5797330c, 0x63d5d77c, 0x2c50b523, 0x7c585f94, 0x57ef7da9},
+        {0xa5dfccb6, 0xdb113a20, 0x916492af, 0x3a9ecf6b, 0x664fda9d, 0xf6de6c81, 0xd678bbd7, 0x7b4944e2},
+        {0xc5c3810e, 0x0be0b336, 0x7197eabd, 0x1bcd913a, 0x9da337ea, 0xee3136c8, 0xb5f024d5, 0x160ea467},
+        {0xd8881407, 0xe72f8de8, 0x5acd8553, 0xb16cd537, 0xaeda0cde, 0x19ed60a0, 0xbd04ca4d, 0x85ff55de},
+        {0x171bb1d0, 0x89726680, 0xf1b335ec, 0x4fc432eb, 0x51937159, 0x60bb4672, 0x7877987f, 0x1da409a3},
+    };
+    // Expected double-SHA256 of each of the 64-byte blocks of the input
+    static const unsigned char result_d64[256] = {
+        0x09, 0x3a, 0xc4, 0xd0, 0x0f, 0xf7, 0x57, 0xe1, 0x72, 0x85, 0x79, 0x42, 0xfe, 0xe7, 0xe0, 0xa0,
+        0xfc, 0x52, 0xd7, 0xdb, 0x07, 0x63, 0x45, 0xfb, 0x53, 0x14, 0x7d, 0x17, 0x22, 0x86, 0xf0, 0x52,
+        0x08, 0x09, 0xa4, 0xe9, 0x1b, 0xac, 0x7a, 0x08, 0xa0, 0xc8, 0x48, 0x2d, 0x7f, 0xcb, 0xb4, 0x71,
+        0x49, 0xf4, 0xd9, 0xef, 0xa3, 0x9b, 0x74, 0x21, 0xf3, 0x52, 0x34, 0x34, 0x2b, 0x07, 0xa2, 0xa9,
+        0xa4, 0xa5, 0x45, 0x66, 0x8a, 0x73, 0xa8, 0x99, 0x54, 0xf8, 0x8b, 0xbf, 0x46, 0x42, 0x04, 0xb0,
+        0x1d, 0xf0, 0x39, 0xfe, 0x8f, 0x61, 0x0c, 0xd7, 0x3c, 0xa5, 0xbb, 0x32, 0xc1, 0xc7, 0x6d, 0x7c,
+        0x51, 0x5f, 0x63, 0x7e, 0xfc, 0xac, 0xf4, 0xfb, 0xa0, 0xcc, 0x1c, 0x3d, 0x50, 0xd1, 0xf4, 0xff,
+        0xf2, 0xf5, 0x37, 0xdc, 0x83, 0x52, 0x91, 0xbb, 0x65, 0x4d, 0x36, 0xbe, 0xc9, 0xf8, 0x92, 0x65,
+        0xe0, 0x71, 0x24, 0xf8, 0x5e, 0xb6, 0x47, 0xf4, 0xe9, 0x87, 0x43, 0xcb, 0xd0, 0x86, 0x57, 0xe3,
+        0x4e, 0x96, 0x21, 0xfa, 0xec, 0xb0, 0x90, 0x94, 0x3c, 0x89, 0xca, 0xf0, 0x8e, 0x4d, 0x90, 0x70,
+        0xa3, 0xaf, 0x36, 0xf6, 0x6e, 0x93, 0xfb, 0x77, 0xc4, 0x69, 0x86, 0xe0, 0x74, 0x3e, 0x56, 0xdf,
+        0xb9, 0xde, 0x9d, 0xf0, 0x9a, 0x41, 0x93, 0x53, 0x26, 0xf6, 0xcf, 0xd4, 0x96, 0x78, 0x12, 0x5b,
+        0xc0, 0xcd, 0xce, 0xd0, 0xe9, 0xee, 0x23, 0x3e, 0x37, 0x5d, 0x65, 0x0c, 0xca, 0xab, 0x4d, 0x3e,
+        0x17, 0x5c, 0xa6, 0x29, 0xfd, 0x85, 0x2b, 0xe0, 0x98, 0x22, 0xf2, 0x9d, 0x33, 0xa0, 0x08, 0x9b,
+        0x7b, 0xda, 0x6d, 0x03, 0xc5, 0xa8, 0x97, 0x97, 0x31, 0x1e, 0xfd, 0x8b, 0x63, 0xb1, 0x3f, 0x75,
+        0x64, 0x8a, 0x87, 0xd8, 0x29, 0x3b, 0xfa, 0x73, 0x31, 0xc1, 0x5f, 0x75, 0xa4, 0x95, 0x1d, 0x4b,
+    };
+    // Expected SHA256Compress of each of the 64-byte blocks of the input
+    static const unsigned char result_c64[256] = {
+        0x91, 0xf8, 0xec, 0x6b, 0x4d, 0xa1, 0x0f, 0xe3, 0x1c, 0x9c, 0x29, 0x2c, 0x45, 0xe1, 0x81, 0x85,
+        0x43, 0x5c, 0xc1, 0x11, 0x3c, 0xa2, 0x6f, 0x09, 0xeb, 0x95, 0x4c, 0xae, 0x40, 0x2a, 0x70, 0x69,
+        0x49, 0x54, 0x88, 0x80, 0x37, 0xcf, 0x7e, 0x86, 0x4a, 0xa3, 0x79, 0x8a, 0x66, 0x16, 0x81, 0xba,
+        0x1f, 0x9a, 0xa5, 0x1c, 0x78, 0xb7, 0x6d, 0xfd, 0x72, 0xfc, 0x82, 0x21, 0xd0, 0x9f, 0x20, 0x0e,
+        0x8a, 0xcb, 0x61, 0x5c, 0xc9, 0x84, 0x8f, 0xf8, 0x2f, 0xc3, 0x3d, 0x55, 0x8d, 0xa2, 0xd9, 0x2f,
+        0xdc, 0x2f, 0x89, 0x71, 0xb4, 0xd9, 0x82, 0x87, 0x15, 0xc3, 0xb8, 0x60, 0xe3, 0x53, 0x9d, 0x30,
+        0x51, 0xda, 0xa9, 0x11, 0xe4, 0x3a, 0x50, 0x5e, 0x2f, 0x55, 0x7f, 0xd7, 0x19, 0xfc, 0x75, 0xa5,
+        0x3d, 0xf7, 0x60, 0x3e, 0xed, 0x06, 0x30, 0x1a, 0x23, 0x71, 0xe3, 0x0e, 0xca, 0xc1, 0x4a, 0x48,
+        0xf2, 0x1a, 0x7e, 0x6b, 0xb3, 0x73, 0x1c, 0xc4, 0xd7, 0x62, 0x8c, 0xb8, 0x7e, 0x7e, 0x8a, 0xfd,
+        0x8b, 0xf8, 0xfc, 0x92, 0x20, 0xb3, 0x0c, 0x9a, 0xab, 0x0a, 0x70, 0x2b, 0x9b, 0x67, 0x18, 0x23,
+        0xfb, 0xee, 0x22, 0xbb, 0x36, 0x66, 0xe3, 0x4c, 0x57, 0xf0, 0x7c, 0x19, 0x88, 0xba, 0x55, 0x94,
+        0xf8, 0x2f, 0x0a, 0x66, 0x3c, 0x90, 0x3b, 0x0c, 0x72, 0x00, 0x45, 0xaf, 0x05, 0xff, 0x31, 0xde,
+        0xc4, 0x33, 0x19, 0x6e, 0x14, 0xbd, 0x7b, 0x75, 0x3f, 0x99, 0x5b, 0xbb, 0xe6, 0x3f, 0x59, 0xcc,
+        0x4b, 0x9e, 0x05, 0x66, 0x9a, 0x2a, 0xdd, 0x6d, 0xef, 0xa1, 0x47, 0x0f, 0x7d, 0x4c, 0x77, 0x64,
+        0x99, 0xa3, 0xd2, 0xf4, 0xb8, 0x65, 0x23, 0xfb, 0x7c, 0x9a, 0x79, 0x25, 0x02, 0x46, 0xae, 0xde,
+        0xd4, 0xef, 0x1a, 0x67, 0x27, 0xc9, 0x78, 0x5e, 0x35, 0xa0, 0x1b, 0x08, 0x79, 0xec, 0xcf, 0x7b,
+    };
+
+    for (size_t i = 0; i <= 8; i++) {
+        uint32_t state[8];
+        std::copy(result[0], result[0] + 8, state);
+        b.Transform(state, data + 1, i);
+        if (!std::equal(state, state + 8, result[i]))
+            return false;
+    }
+
+    unsigned char out[256];
+    for (size_t i = 0; i < 8; i++) {
+        b.TransformD64(out, data + 1 + 64 * i);
+        if (!std::equal(out, out + 32, result_d64 + 32 * i))
+            return false;
+        b.Compress64(out, data + 1 + 64 * i);
+        if (!std::equal(out, out + 32, result_c64 + 32 * i))
+            return false;
+    }
+    if (b.TransformD64_4way) {
+        b.TransformD64_4way(out, data + 1);
+        b.TransformD64_4way(out + 128, data + 1 + 256);
+        if (!std::equal(out, out + 256, result_d64))
+            return false;
+    }
+    if (b.Compress64_4way) {
+        b.Compress64_4way(out, data + 1);
+        b.Compress64_4way(out + 128, data + 1 + 256);
+        if (!std::equal(out, out + 256, result_c64))
+            return false;
+    }
+    if (b.TransformD64_8way) {
+        b.TransformD64_8way(out, data + 1);
+        if (!std::equal(out, out + 256, result_d64))
+            return false;
+    }
+    if (b.Compress64_8way) {
+        b.Compress64_8way(out, data + 1);
+        if (!std::equal(out, out + 256, result_c64))
+            return false;
+    }
+    return true;
+}
+
+/** Pick the implementations in use_implementation that this CPU can run
+ *  into b; returns their name. */
+std::string Detect(sha256_implementation::UseImplementation use_implementation, Backends& b)
+{
+    std::string ret = "standard";
+    b = standard;
+
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+    bool have_sse41 = false;
+    bool have_xsave = false;
+    bool have_avx = false;
+    bool have_avx2 = false;
+    bool have_shani = false;
+    bool enabled_avx = false;
+
+    (void)have_sse41;
+    (void)have_xsave;
+    (void)have_avx;
+    (void)have_avx2;
+    (void)have_shani;
+    (void)enabled_avx;
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, eax, ebx, ecx, edx);
+    have_sse41 = (ecx >> 19) & 1;
+    have_xsave = (ecx >> 27) & 1;
+    have_avx = (ecx >> 28) & 1;
+    if (have_xsave && have_avx) {
+        enabled_avx = AVXEnabled();
+    }
+    cpuid(0, 0, eax, ebx, ecx, edx);
+    if (eax >= 7) {
+        cpuid(7, 0, eax, ebx, ecx, edx);
+        have_avx2 = (ebx >> 5) & 1;
+        have_shani = (ebx >> 29) & 1;
+    }
+
+    std::string sep = "(";
+#if defined(ENABLE_SHANI) && !defined(BUILD_BITCOIN_INTERNAL)
+    if (have_shani && have_sse41 && (use_implementation & sha256_implementation::USE_SHANI)) {
+        b.Transform = sha256_shani::Transform;
+        b.TransformD64 = sha256::TransformD64Wrapper<sha256_shani::Transform>;
+        b.Compress64 = sha256::Compress64Wrapper<sha256_shani::Transform>;
+        ret = "shani";
+    }
+#endif
+
+#if defined(ENABLE_SSE41) && !defined(BUILD_BITCOIN_INTERNAL)
+    if (have_sse41 && (use_implementation & sha256_implementation::USE_SSE41)) {
+        b.TransformD64_4way = sha256_sse41::TransformD64_4way;
+        b.Compress64_4way = sha256_sse41::Compress64_4way;
+        ret += sep + "sse41";
+        sep = ",";
+    }
+#endif
+
+#if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+    if (have_avx2 && have_avx && enabled_avx && (use_implementation & sha256_implementation::USE_AVX2)) {
+        b.TransformD64_8way = sha256_avx2::TransformD64_8way;
+        b.Compress64_8way = sha256_avx2::Compress64_8way;
+        ret += sep + "avx2";
+        sep = ",";
+    }
+#endif
+
+    if (sep == ",")
+        ret += ")";
+#endif
+
+    return ret;
+}
+
+/** SHA256D64 with the implementations in b */
+void D64(const Backends& b, unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    if (b.TransformD64_8way) {
+        while (blocks >= 8) {
+            b.TransformD64_8way(out, in);
+            out += 256;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (b.TransformD64_4way) {
+        while (blocks >= 4) {
+            b.TransformD64_4way(out, in);
+            out += 128;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        b.TransformD64(out, in);
+        out += 32;
+        in += 64;
+        --blocks;
+    }
+}
+
+/** SHA256Compress64 with the implementations in b */
+void Compress(const Backends& b, unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    if (b.Compress64_8way) {
+        while (blocks >= 8) {
+            b.Compress64_8way(out, in);
+            out += 256;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (b.Compress64_4way) {
+        while (blocks >= 4) {
+            b.Compress64_4way(out, in);
+            out += 128;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        b.Compress64(out, in);
+        out += 32;
+        in += 64;
+        --blocks;
+    }
+}
 } // namespace
 
+std::string SHA256AutoDetect(sha256_implementation::UseImplementation use_implementation)
+{
+    Backends detected;
+    std::string ret = Detect(use_implementation, detected);
+    active = detected;
+    return ret;
+}
+
+bool SHA256SelfTest()
+{
+    return SelfTest(active);
+}
+
 
 ////// SHA-256
 
@@ -149,14 +509,15 @@ CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
         memcpy(buf + bufsize, data, 64 - bufsize);
         bytes += 64 - bufsize;
         data += 64 - bufsize;
-        sha256::Transform(s, buf);
+        active.Transform(s, buf, 1);
         bufsize = 0;
     }
-    while (end >= data + 64) {
+    if (end - data >= 64) {
         // Process full chunks directly from the source.
-        sha256::Transform(s, data);
-        bytes += 64;
-        data += 64;
+        size_t blocks = (end - data) / 64;
+        active.Transform(s, data, blocks);
+        data += 64 * blocks;
+        bytes += 64 * blocks;
     }
     if (end > data) {
         // Fill the buffer with what remains.
@@ -198,3 +559,34 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    D64(active, out, in, blocks);
+}
+
+void SHA256Compress64(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    Compress(active, out, in, blocks);
+}
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks, sha256_implementation::UseImplementation use_implementation)
+{
+    Backends b;
+    Detect(use_implementation, b);
+    D64(b, out, in, blocks);
+}
+
+void SHA256Compress64(unsigned char* out, const unsigned char* in, size_t blocks, sha256_implementation::UseImplementation use_implementation)
+{
+    Backends b;
+    Detect(use_implementation, b);
+    Compress(b, out, in, blocks);
+}
+
+void SHA256Transform(uint32_t* s, const unsigned char* chunk, size_t blocks, sha256_implementation::UseImplementation use_implementation)
+{
+    Backends b;
+    Detect(use_implementation, b);
+    b.Transform(s, chunk, blocks);
+}
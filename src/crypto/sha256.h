@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -30,4 +31,49 @@ private:
     void FinalizeNoPadding(unsigned char hash[OUTPUT_SIZE], bool enforce_compression);
 };
 
+namespace sha256_implementation {
+/** Back ends SHA256AutoDetect may pick, if the CPU supports them. */
+enum UseImplementation : uint8_t {
+    STANDARD = 0,
+    USE_SSE41 = 1 << 0,
+    USE_AVX2 = 1 << 1,
+    USE_SHANI = 1 << 2,
+    USE_ALL = USE_SSE41 | USE_AVX2 | USE_SHANI,
+};
+}
+
+/** Autodetect the best available SHA256 implementation, restricted to
+ *  use_implementation, and use it from now on. Must not be called while
+ *  other threads are hashing. Returns the name of the implementation.
+ */
+std::string SHA256AutoDetect(sha256_implementation::UseImplementation use_implementation = sha256_implementation::USE_ALL);
+
+/** Check the implementation picked by SHA256AutoDetect against known answers. */
+bool SHA256SelfTest();
+
+/** Compute multiple double-SHA256's of 64-byte blobs.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*64 byte input buffer
+ *  blocks:  the number of hashes to compute.
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
+/** Apply the SHA-256 compression function, from the standard initial state
+ *  and without padding, to multiple 64-byte blobs (SHA256Compress in the
+ *  Zcash protocol specification).
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*64 byte input buffer
+ *  blocks:  the number of blobs to compress.
+ */
+void SHA256Compress64(unsigned char* output, const unsigned char* input, size_t blocks);
+
+/** SHA256D64, SHA256Compress64 and the SHA-256 transform of whole 64-byte
+ *  blocks into the state s, with the implementations SHA256AutoDetect would
+ *  pick for use_implementation, leaving the ones in use alone. The CPU is
+ *  probed on every call; these are meant for benchmarks.
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks, sha256_implementation::UseImplementation use_implementation);
+void SHA256Compress64(unsigned char* output, const unsigned char* input, size_t blocks, sha256_implementation::UseImplementation use_implementation);
+void SHA256Transform(uint32_t* s, const unsigned char* chunk, size_t blocks, sha256_implementation::UseImplementation use_implementation);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
@@ -391,3 +391,27 @@ TEST(checktransaction_tests, non_canonical_ed25519_signature) {
     EXPECT_CALL(state, DoS(100, false, REJECT_INVALID, "bad-txns-invalid-joinsplit-signature", false)).Times(1);
     CheckTransactionWithoutProofVerification(tx, state);
 }
+
+TEST(checktransaction_tests, deferred_joinsplit_signature) {
+    CMutableTransaction mtx = GetValidTransaction();
+
+    // The signature check is queued instead of being performed
+    {
+        CTransaction tx(mtx);
+        CValidationState state;
+        std::vector<CJoinSplitCheck> vChecks;
+        EXPECT_TRUE(CheckTransactionWithoutProofVerification(tx, state, &vChecks));
+        ASSERT_EQ(vChecks.size(), 1);
+        EXPECT_TRUE(vChecks[0]());
+    }
+
+    mtx.joinSplitSig[0] += 1;
+    {
+        CTransaction tx(mtx);
+        CValidationState state;
+        std::vector<CJoinSplitCheck> vChecks;
+        EXPECT_TRUE(CheckTransactionWithoutProofVerification(tx, state, &vChecks));
+        ASSERT_EQ(vChecks.size(), 1);
+        EXPECT_FALSE(vChecks[0]());
+    }
+}
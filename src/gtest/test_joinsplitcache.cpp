@@ -0,0 +1,56 @@
+#include <gtest/gtest.h>
+
+#include "joinsplitcache.h"
+#include "primitives/transaction.h"
+#include "random.h"
+
+static CMutableTransaction GetJoinSplitTransaction()
+{
+    CMutableTransaction mtx;
+    mtx.nVersion = 2;
+    mtx.vjoinsplit.resize(2);
+    mtx.vjoinsplit[0].nullifiers.at(0) = GetRandHash();
+    mtx.vjoinsplit[1].nullifiers.at(0) = GetRandHash();
+    mtx.joinSplitPubKey = GetRandHash();
+    GetRandBytes(&mtx.joinSplitSig[0], mtx.joinSplitSig.size());
+    return mtx;
+}
+
+TEST(joinsplitcache, GetAfterSet) {
+    CTransaction tx(GetJoinSplitTransaction());
+
+    CJoinSplitCacheStats before = JoinSplitCacheGetStats();
+    EXPECT_FALSE(JoinSplitProofCacheGet(tx, 0));
+    EXPECT_FALSE(JoinSplitProofCacheGet(tx, 1));
+    EXPECT_FALSE(JoinSplitSigCacheGet(tx));
+
+    JoinSplitCacheSet(tx);
+    EXPECT_TRUE(JoinSplitProofCacheGet(tx, 0));
+    EXPECT_TRUE(JoinSplitProofCacheGet(tx, 1));
+    EXPECT_TRUE(JoinSplitSigCacheGet(tx));
+
+    CJoinSplitCacheStats after = JoinSplitCacheGetStats();
+    EXPECT_GE(after.nProofCapacity, DEFAULT_MAX_JOINSPLIT_CACHE_SIZE);
+    EXPECT_GE(after.nSigCapacity, DEFAULT_MAX_JOINSPLIT_CACHE_SIZE);
+    EXPECT_EQ(before.nProofHits + 2, after.nProofHits);
+    EXPECT_EQ(before.nProofMisses + 2, after.nProofMisses);
+    EXPECT_EQ(before.nSigHits + 1, after.nSigHits);
+    EXPECT_EQ(before.nSigMisses + 1, after.nSigMisses);
+}
+
+TEST(joinsplitcache, ModifiedTransactionMisses) {
+    CMutableTransaction mtx = GetJoinSplitTransaction();
+    JoinSplitCacheSet(CTransaction(mtx));
+
+    // A different signature changes the txid, so nothing matches.
+    CMutableTransaction mtx2 = mtx;
+    mtx2.joinSplitSig[0] ^= 1;
+    CTransaction tx2(mtx2);
+    EXPECT_FALSE(JoinSplitProofCacheGet(tx2, 0));
+    EXPECT_FALSE(JoinSplitSigCacheGet(tx2));
+
+    // Nor does a JoinSplit that was never added.
+    CMutableTransaction mtx3 = mtx;
+    mtx3.vjoinsplit.resize(3);
+    EXPECT_FALSE(JoinSplitProofCacheGet(CTransaction(mtx3), 2));
+}
@@ -8,9 +8,11 @@
 #include "test/data/merkle_commitments.json.h"
 
 #include <iostream>
+#include <list>
 
 #include <stdexcept>
 
+#include "random.h"
 #include "utilstrencodings.h"
 #include "version.h"
 #include "serialize.h"
@@ -299,3 +301,84 @@ TEST(merkletree, testZeroElements) {
         ASSERT_TRUE(newTree.root() == oldroot);
     }
 }
+
+TEST(merkletree, witnessUpdater) {
+    ZCIncrementalMerkleTree tree;
+    std::list<ZCIncrementalWitness> witnesses;
+    std::list<ZCIncrementalWitness> expected;
+
+    // Witnesses are updated a "block" at a time, and new ones are created
+    // part way through, as the wallet does.
+    for (int block = 0; block < 30; block++) {
+        ZCIncrementalWitnessUpdater updater(tree);
+        for (ZCIncrementalWitness& witness : witnesses) {
+            updater.add(&witness);
+        }
+
+        for (int i = 0; i < block; i++) {
+            uint256 commitment = GetRandHash();
+            tree.append(commitment);
+            updater.append(commitment);
+            for (ZCIncrementalWitness& witness : expected) {
+                witness.append(commitment);
+            }
+
+            if (i % 3 == 0) {
+                witnesses.push_back(tree.witness());
+                expected.push_back(tree.witness());
+                updater.add(&witnesses.back());
+            }
+        }
+        updater.finish();
+
+        ASSERT_EQ(witnesses.size(), expected.size());
+        auto it = expected.begin();
+        for (const ZCIncrementalWitness& witness : witnesses) {
+            ASSERT_TRUE(witness == *it);
+            ASSERT_EQ(witness.root(), tree.root());
+            it++;
+        }
+    }
+}
+
+TEST(merkletree, batchRoots) {
+    ZCTestingIncrementalMerkleTree tree;
+    std::vector<ZCTestingIncrementalMerkleTree> trees;
+    std::vector<ZCTestingIncrementalWitness> witnesses;
+
+    // Trees and witnesses of every size up to a full tree, so the batch
+    // covers every shape of parents, fillers and cursors.
+    trees.push_back(tree);
+    for (size_t i = 0; i < (1 << INCREMENTAL_MERKLE_TREE_DEPTH_TESTING); i++) {
+        uint256 commitment = GetRandHash();
+        tree.append(commitment);
+        for (ZCTestingIncrementalWitness& witness : witnesses) {
+            witness.append(commitment);
+        }
+        trees.push_back(tree);
+        witnesses.push_back(tree.witness());
+    }
+
+    std::vector<const ZCTestingIncrementalMerkleTree*> tree_ptrs;
+    for (const ZCTestingIncrementalMerkleTree& t : trees) {
+        tree_ptrs.push_back(&t);
+    }
+    std::vector<libzcash::SHA256Compress> tree_roots = ZCTestingIncrementalMerkleTree::roots(tree_ptrs);
+    ASSERT_EQ(tree_roots.size(), trees.size());
+    for (size_t i = 0; i < trees.size(); i++) {
+        ASSERT_EQ(tree_roots[i], trees[i].root());
+    }
+
+    std::vector<const ZCTestingIncrementalWitness*> witness_ptrs;
+    for (const ZCTestingIncrementalWitness& w : witnesses) {
+        witness_ptrs.push_back(&w);
+    }
+    std::vector<libzcash::SHA256Compress> witness_roots = ZCTestingIncrementalWitness::roots(witness_ptrs);
+    ASSERT_EQ(witness_roots.size(), witnesses.size());
+    for (size_t i = 0; i < witnesses.size(); i++) {
+        ASSERT_EQ(witness_roots[i], witnesses[i].root());
+        ASSERT_EQ(witness_roots[i], tree.root());
+    }
+
+    ASSERT_TRUE(ZCTestingIncrementalMerkleTree::roots({}).empty());
+}
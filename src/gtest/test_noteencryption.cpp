@@ -78,6 +78,17 @@ void test_encryption(
             // Test wrong nonce
             ASSERT_THROW(decrypter.decrypt(ciphertext, b.get_epk(), uint256(), (i == 0) ? 1 : (i - 1)),
                          libzcash::note_decryption_failed);
+
+            // Test trial decryption
+            {
+                uint256 dhsecret;
+                ASSERT_TRUE(decrypter.get_dhsecret(dhsecret, b.get_epk()));
+
+                ZCNoteDecryption::Plaintext trial;
+                ASSERT_TRUE(decrypter.try_decrypt(trial, ciphertext, dhsecret, b.get_epk(), uint256(), i));
+                ASSERT_TRUE(trial == message);
+                ASSERT_FALSE(decrypter.try_decrypt(trial, ciphertext, dhsecret, b.get_epk(), uint256(), (i == 0) ? 1 : (i - 1)));
+            }
         
             // Test wrong ephemeral key
             {
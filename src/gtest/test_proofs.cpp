@@ -517,6 +517,73 @@ TEST(proofs, zksnark_serializes_properly)
     }
 }
 
+TEST(proofs, batch_verification)
+{
+    auto example = libsnark::generate_r1cs_example_with_field_input<curve_Fr>(250, 4);
+    example.constraint_system.swap_AB_if_beneficial();
+    auto kp = libsnark::r1cs_ppzksnark_generator<curve_pp>(example.constraint_system);
+    auto vkprecomp = libsnark::r1cs_ppzksnark_verifier_process_vk(kp.vk);
+
+    std::vector<libsnark::r1cs_ppzksnark_proof<curve_pp>> proofs;
+    for (size_t i = 0; i < 5; i++) {
+        proofs.push_back(libsnark::r1cs_ppzksnark_prover<curve_pp>(
+            kp.pk,
+            example.primary_input,
+            example.auxiliary_input,
+            example.constraint_system
+        ));
+    }
+
+    // An empty batch is trivially valid
+    {
+        auto verifier = ProofVerifier::Batch();
+        ASSERT_EQ(0, verifier.BatchSize());
+        ASSERT_TRUE(verifier.VerifyBatch());
+    }
+
+    // Valid proofs are deferred, then accepted together
+    {
+        auto verifier = ProofVerifier::Batch();
+        for (auto& proof : proofs) {
+            ASSERT_TRUE(verifier.check(kp.vk, vkprecomp, example.primary_input, proof));
+        }
+        ASSERT_EQ(proofs.size(), verifier.BatchSize());
+        ASSERT_TRUE(verifier.VerifyBatch());
+        ASSERT_EQ(0, verifier.BatchSize());
+    }
+
+    // A proof for a different primary input fails the batch
+    {
+        auto verifier = ProofVerifier::Batch();
+        auto wrong_input = example.primary_input;
+        wrong_input[0] = wrong_input[0] + curve_Fr::one();
+        for (size_t i = 0; i < proofs.size(); i++) {
+            ASSERT_TRUE(verifier.check(kp.vk, vkprecomp,
+                                       i == 3 ? wrong_input : example.primary_input,
+                                       proofs[i]));
+        }
+        ASSERT_FALSE(verifier.VerifyBatch());
+        ASSERT_EQ(0, verifier.BatchSize());
+    }
+
+    // Random invalid proofs are rejected
+    for (size_t i = 0; i < 5; i++) {
+        auto badproof = ZCProof::random_invalid().to_libsnark_proof<libsnark::r1cs_ppzksnark_proof<curve_pp>>();
+        auto verifier = ProofVerifier::Batch();
+        ASSERT_TRUE(verifier.check(kp.vk, vkprecomp, example.primary_input, proofs[0]));
+        ASSERT_TRUE(verifier.check(kp.vk, vkprecomp, example.primary_input, badproof));
+        ASSERT_FALSE(verifier.VerifyBatch());
+    }
+
+    // Disabled and strict verifiers have nothing to batch
+    {
+        auto verifier = ProofVerifier::Strict();
+        ASSERT_TRUE(verifier.check(kp.vk, vkprecomp, example.primary_input, proofs[0]));
+        ASSERT_EQ(0, verifier.BatchSize());
+        ASSERT_TRUE(verifier.VerifyBatch());
+    }
+}
+
 TEST(proofs, g1_deserialization)
 {
     CompressedG1 g;
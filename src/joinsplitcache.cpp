@@ -0,0 +1,167 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "joinsplitcache.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "cuckoocache.h"
+#include "hash.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "uint256.h"
+#include "util.h"
+
+#include <atomic>
+
+#include <boost/thread.hpp>
+
+namespace {
+
+/**
+ * Cache of verified items, identified by a salted hash so that an attacker
+ * cannot predict which entries collide or get evicted.
+ */
+class CJoinSplitCache
+{
+private:
+    uint256 nonce;
+    //! Entries are already salted hashes, so SignatureCacheHasher suits them too
+    typedef CuckooCache::cache<uint256, SignatureCacheHasher> map_type;
+    map_type setValid;
+    //! Lookups only need a shared lock, as erasing is done through atomic
+    //! flags; only inserts take it exclusively.
+    boost::shared_mutex cs_jscache;
+    uint32_t nCapacity;
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nMisses;
+
+public:
+    CJoinSplitCache() : nonce(GetRandHash()), nCapacity(0), nHits(0), nMisses(0) { }
+
+    //! Starts a salted hash of an entry; the caller writes the entry data.
+    CSHA256 Hasher() const
+    {
+        CSHA256 hasher;
+        hasher.Write(nonce.begin(), 32);
+        return hasher;
+    }
+
+    uint32_t Setup(uint32_t nEntries)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_jscache);
+        nCapacity = setValid.setup(nEntries);
+        return nCapacity;
+    }
+
+    bool Get(const uint256& entry, bool erase)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_jscache);
+        if (setValid.contains(entry, erase)) {
+            nHits++;
+            return true;
+        }
+        nMisses++;
+        return false;
+    }
+
+    void Set(const uint256& entry)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_jscache);
+        setValid.insert(entry);
+    }
+
+    void GetStats(size_t& nCapacityOut, uint64_t& nHitsOut, uint64_t& nMissesOut)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_jscache);
+        nCapacityOut = nCapacity;
+        nHitsOut = nHits;
+        nMissesOut = nMisses;
+    }
+};
+
+CJoinSplitCache& ProofCache()
+{
+    static CJoinSplitCache proofCache;
+    return proofCache;
+}
+
+CJoinSplitCache& SigCache()
+{
+    static CJoinSplitCache sigCache;
+    return sigCache;
+}
+
+// The txid commits to the whole transaction, but the proof hash is
+// included so that an entry can only ever match the proof it was made for.
+uint256 ProofEntry(const CTransaction& tx, size_t nJoinSplit)
+{
+    uint256 txid = tx.GetHash();
+    uint256 proofHash = SerializeHash(tx.vjoinsplit[nJoinSplit].proof);
+    unsigned char index[4];
+    WriteLE32(index, nJoinSplit);
+
+    uint256 entry;
+    ProofCache().Hasher()
+        .Write(txid.begin(), 32)
+        .Write(index, sizeof(index))
+        .Write(proofHash.begin(), 32)
+        .Finalize(entry.begin());
+    return entry;
+}
+
+uint256 SigEntry(const CTransaction& tx)
+{
+    uint256 txid = tx.GetHash();
+
+    uint256 entry;
+    SigCache().Hasher()
+        .Write(txid.begin(), 32)
+        .Write(tx.joinSplitPubKey.begin(), 32)
+        .Write(&tx.joinSplitSig[0], tx.joinSplitSig.size())
+        .Finalize(entry.begin());
+    return entry;
+}
+
+}
+
+void InitJoinSplitCache()
+{
+    // If -maxjoinsplitcachesize is zero, setup creates the minimum possible
+    // caches (2 elements each).
+    uint32_t nEntries = std::min(std::max((int64_t)0, GetArg("-maxjoinsplitcachesize", DEFAULT_MAX_JOINSPLIT_CACHE_SIZE)), MAX_MAX_JOINSPLIT_CACHE_SIZE);
+    ProofCache().Setup(nEntries);
+    uint32_t nCapacity = SigCache().Setup(nEntries);
+    LogPrintf("Using JoinSplit proof and signature caches able to store %u elements each\n", nCapacity);
+}
+
+bool JoinSplitProofCacheGet(const CTransaction& tx, size_t nJoinSplit, bool erase)
+{
+    return ProofCache().Get(ProofEntry(tx, nJoinSplit), erase);
+}
+
+bool JoinSplitSigCacheGet(const CTransaction& tx, bool erase)
+{
+    return SigCache().Get(SigEntry(tx), erase);
+}
+
+void JoinSplitCacheSet(const CTransaction& tx)
+{
+    if (tx.vjoinsplit.empty())
+        return;
+
+    for (size_t i = 0; i < tx.vjoinsplit.size(); i++) {
+        ProofCache().Set(ProofEntry(tx, i));
+    }
+    SigCache().Set(SigEntry(tx));
+}
+
+CJoinSplitCacheStats JoinSplitCacheGetStats()
+{
+    CJoinSplitCacheStats stats;
+    ProofCache().GetStats(stats.nProofCapacity, stats.nProofHits, stats.nProofMisses);
+    SigCache().GetStats(stats.nSigCapacity, stats.nSigHits, stats.nSigMisses);
+    return stats;
+}
@@ -0,0 +1,50 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_JOINSPLITCACHE_H
+#define BITCOIN_JOINSPLITCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class CTransaction;
+
+/** Default for -maxjoinsplitcachesize, the number of cached proofs and signatures */
+static const unsigned int DEFAULT_MAX_JOINSPLIT_CACHE_SIZE = 20000;
+/** Maximum -maxjoinsplitcachesize allowed */
+static const int64_t MAX_MAX_JOINSPLIT_CACHE_SIZE = 1 << 24;
+
+struct CJoinSplitCacheStats
+{
+    size_t nProofCapacity;
+    uint64_t nProofHits;
+    uint64_t nProofMisses;
+    size_t nSigCapacity;
+    uint64_t nSigHits;
+    uint64_t nSigMisses;
+};
+
+/**
+ * Valid JoinSplit cache, to avoid verifying the zk-SNARK proofs and the
+ * joinSplitSig of a shielded transaction twice (once when accepted into
+ * the memory pool, and again when the block containing it is connected).
+ */
+
+/** Sizes the caches from -maxjoinsplitcachesize. Must be called before they are used. */
+void InitJoinSplitCache();
+
+/** Returns true if JoinSplit nJoinSplit of tx is known to have a valid proof.
+ *  With erase, a hit is taken to be the last use of the entry (as when
+ *  connecting a block), and it may make room for new ones. */
+bool JoinSplitProofCacheGet(const CTransaction& tx, size_t nJoinSplit, bool erase = false);
+
+/** Returns true if the joinSplitSig of tx is known to be valid; erase as above */
+bool JoinSplitSigCacheGet(const CTransaction& tx, bool erase = false);
+
+/** Records that all JoinSplit proofs and the joinSplitSig of tx are valid */
+void JoinSplitCacheSet(const CTransaction& tx);
+
+CJoinSplitCacheStats JoinSplitCacheGetStats();
+
+#endif // BITCOIN_JOINSPLITCACHE_H
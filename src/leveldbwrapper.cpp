@@ -6,8 +6,15 @@
 #include "leveldbwrapper.h"
 
 #include "util.h"
+#include "utilstrencodings.h"
 
+#include <algorithm>
+#include <stdio.h>
+
+#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <leveldb/cache.h>
 #include <leveldb/env.h>
@@ -28,14 +35,120 @@ void HandleError(const leveldb::Status& status)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+CLevelDBProfile::CLevelDBProfile() :
+    nMaxOpenFiles(64), nBloomBits(10), nBlockCachePercent(50), nWriteBufferPercent(25),
+    nBlockSize(4096), nBlockRestartInterval(16)
+{
+}
+
+bool CLevelDBProfile::Set(const std::string& strSetting, int64_t nValue)
+{
+    // The ranges are those LevelDB accepts, or at least makes sense of
+    if (strSetting == "maxopenfiles" && nValue >= 64 && nValue <= 50000)
+        nMaxOpenFiles = nValue;
+    else if (strSetting == "bloombits" && nValue >= 0 && nValue <= 64)
+        nBloomBits = nValue;
+    else if (strSetting == "blockcache" && nValue >= 0 && nValue <= 100)
+        nBlockCachePercent = nValue;
+    else if (strSetting == "writebuffer" && nValue >= 1 && nValue <= 50)
+        nWriteBufferPercent = nValue;
+    else if (strSetting == "blocksize" && nValue >= (1 << 10) && nValue <= (4 << 20))
+        nBlockSize = nValue;
+    else if (strSetting == "restartinterval" && nValue >= 1 && nValue <= 1024)
+        nBlockRestartInterval = nValue;
+    else
+        return false;
+    return true;
+}
+
+namespace {
+
+const char* const LEVELDB_PROFILE_NAMES[] = {"chainstate", "index", "paymentdisclosure"};
+
+/** The profile of database strName before any -dbtune settings */
+CLevelDBProfile DefaultLevelDBProfile(const std::string& strName)
+{
+    CLevelDBProfile profile;
+    if (strName == "paymentdisclosure") {
+        // It used to be opened with LevelDB's own defaults; keep them
+        profile.nMaxOpenFiles = 1000;
+        profile.nBloomBits = 0;
+    }
+    return profile;
+}
+
+/** Apply the -dbtune settings for database strName to profile */
+bool ApplyLevelDBSettings(const std::string& strName, CLevelDBProfile& profile, std::string& strError)
+{
+    BOOST_FOREACH(const std::string& strTune, mapMultiArgs["-dbtune"]) {
+        size_t nDot = strTune.find('.');
+        size_t nEquals = strTune.find('=');
+        int64_t nValue;
+        if (nDot == std::string::npos || nEquals == std::string::npos || nDot > nEquals ||
+                !ParseInt64(strTune.substr(nEquals + 1), &nValue)) {
+            strError = strprintf("Invalid -dbtune setting '%s', expected <database>.<setting>=<value>", strTune);
+            return false;
+        }
+        if (strTune.compare(0, nDot, strName) != 0)
+            continue;
+        if (!profile.Set(strTune.substr(nDot + 1, nEquals - nDot - 1), nValue)) {
+            strError = strprintf("Unknown or out of range -dbtune setting '%s'", strTune);
+            return false;
+        }
+    }
+    if (profile.nBlockCachePercent + 2 * profile.nWriteBufferPercent > 100) {
+        strError = strprintf("-dbtune settings for %s use more than the whole cache", strName);
+        return false;
+    }
+    return true;
+}
+
+boost::mutex csOpenDBs;
+std::vector<CLevelDBInfo> vOpenDBs;
+
+} // namespace
+
+bool CheckLevelDBProfiles(std::string& strError)
+{
+    BOOST_FOREACH(const std::string& strTune, mapMultiArgs["-dbtune"]) {
+        std::string strName = strTune.substr(0, strTune.find('.'));
+        if (std::find(LEVELDB_PROFILE_NAMES, std::end(LEVELDB_PROFILE_NAMES), strName) == std::end(LEVELDB_PROFILE_NAMES)) {
+            strError = strprintf("Unknown database '%s' in -dbtune setting '%s'", strName, strTune);
+            return false;
+        }
+    }
+    BOOST_FOREACH(const char* pszName, LEVELDB_PROFILE_NAMES) {
+        CLevelDBProfile profile = DefaultLevelDBProfile(pszName);
+        if (!ApplyLevelDBSettings(pszName, profile, strError))
+            return false;
+    }
+    return true;
+}
+
+CLevelDBProfile GetLevelDBProfile(const std::string& strName)
+{
+    CLevelDBProfile profile = DefaultLevelDBProfile(strName);
+    std::string strError;
+    if (!ApplyLevelDBSettings(strName, profile, strError)) {
+        // Settings are checked at startup, so this only happens to databases
+        // opened without going through it
+        LogPrintf("%s; using the default profile for %s\n", strError, strName);
+        profile = DefaultLevelDBProfile(strName);
+    }
+    return profile;
+}
+
+leveldb::Options GetLevelDBOptions(const CLevelDBProfile& profile, size_t nCacheSize)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    options.block_cache = leveldb::NewLRUCache((uint64_t)nCacheSize * profile.nBlockCachePercent / 100);
+    // up to two write buffers may be held in memory simultaneously
+    options.write_buffer_size = (uint64_t)nCacheSize * profile.nWriteBufferPercent / 100;
+    options.filter_policy = profile.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(profile.nBloomBits) : NULL;
     options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.max_open_files = profile.nMaxOpenFiles;
+    options.block_size = profile.nBlockSize;
+    options.block_restart_interval = profile.nBlockRestartInterval;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -44,6 +157,85 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
+void RegisterLevelDB(const CLevelDBInfo& info)
+{
+    boost::unique_lock<boost::mutex> lock(csOpenDBs);
+    vOpenDBs.push_back(info);
+}
+
+void UnregisterLevelDB(const leveldb::DB* pdb)
+{
+    boost::unique_lock<boost::mutex> lock(csOpenDBs);
+    for (std::vector<CLevelDBInfo>::iterator it = vOpenDBs.begin(); it != vOpenDBs.end(); ++it) {
+        if (it->pdb == pdb) {
+            vOpenDBs.erase(it);
+            break;
+        }
+    }
+}
+
+std::vector<CLevelDBStats> GetLevelDBStats()
+{
+    std::vector<CLevelDBStats> vStats;
+    boost::unique_lock<boost::mutex> lock(csOpenDBs);
+    BOOST_FOREACH(const CLevelDBInfo& info, vOpenDBs) {
+        CLevelDBStats stats;
+        stats.strName = info.strName;
+        stats.strPath = info.strPath;
+        stats.profile = info.profile;
+        stats.nBlockCacheSize = (uint64_t)info.nCacheSize * info.profile.nBlockCachePercent / 100;
+        stats.nWriteBufferSize = (uint64_t)info.nCacheSize * info.profile.nWriteBufferPercent / 100;
+        info.pdb->GetProperty("leveldb.stats", &stats.strStats);
+
+        stats.nReadAmplification = 0;
+        std::string strFiles;
+        for (int nLevel = 0; info.pdb->GetProperty(strprintf("leveldb.num-files-at-level%d", nLevel), &strFiles); nLevel++) {
+            int nFiles = atoi(strFiles);
+            stats.vFilesAtLevel.push_back(nFiles);
+            stats.nReadAmplification += nLevel == 0 ? nFiles : nFiles > 0;
+        }
+
+        // The stats list each level as: level, files, size, and the time,
+        // megabytes read and megabytes written by its compactions
+        stats.dCompactionTime = 0;
+        stats.nCompactionRead = 0;
+        stats.nCompactionWritten = 0;
+        std::vector<std::string> vLines;
+        boost::split(vLines, stats.strStats, boost::is_any_of("\n"));
+        BOOST_FOREACH(const std::string& strLine, vLines) {
+            int nLevel, nFiles;
+            double dSize, dTime, dRead, dWritten;
+            if (sscanf(strLine.c_str(), "%d %d %lf %lf %lf %lf", &nLevel, &nFiles, &dSize, &dTime, &dRead, &dWritten) == 6) {
+                stats.dCompactionTime += dTime;
+                stats.nCompactionRead += dRead * 1048576;
+                stats.nCompactionWritten += dWritten * 1048576;
+            }
+        }
+
+        std::vector<std::string> vKeys(257);
+        for (int i = 0; i < 256; i++)
+            vKeys[i] = std::string(1, (char)i);
+        vKeys[256] = std::string(32, '\xff');
+        std::vector<leveldb::Range> vRanges;
+        for (int i = 0; i < 256; i++)
+            vRanges.push_back(leveldb::Range(vKeys[i], vKeys[i + 1]));
+        std::vector<uint64_t> vSizes(vRanges.size());
+        info.pdb->GetApproximateSizes(&vRanges[0], vRanges.size(), &vSizes[0]);
+        stats.nApproximateSize = 0;
+        for (int i = 0; i < 256; i++) {
+            if (vSizes[i] > 0)
+                stats.mapPrefixSizes[i] = vSizes[i];
+            stats.nApproximateSize += vSizes[i];
+        }
+
+        stats.nReads = info.pcounters->nReads;
+        stats.nBatches = info.pcounters->nBatches;
+        stats.nBytesWritten = info.pcounters->nBytesWritten;
+        vStats.push_back(stats);
+    }
+    return vStats;
+}
+
 CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
 {
     penv = NULL;
@@ -51,7 +243,8 @@ CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCa
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    CLevelDBProfile profile = GetLevelDBProfile(path.filename().string());
+    options = GetLevelDBOptions(profile, nCacheSize);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -68,10 +261,20 @@ CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCa
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
     LogPrintf("Opened LevelDB successfully\n");
+
+    CLevelDBInfo info;
+    info.strName = path.filename().string();
+    info.strPath = fMemory ? "" : path.string();
+    info.profile = profile;
+    info.nCacheSize = nCacheSize;
+    info.pdb = pdb;
+    info.pcounters = &counters;
+    RegisterLevelDB(info);
 }
 
 CLevelDBWrapper::~CLevelDBWrapper()
 {
+    UnregisterLevelDB(pdb);
     delete pdb;
     pdb = NULL;
     delete options.filter_policy;
@@ -86,5 +289,7 @@ bool CLevelDBWrapper::WriteBatch(CLevelDBBatch& batch, bool fSync)
 {
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
     HandleError(status);
+    counters.nBatches.fetch_add(1, std::memory_order_relaxed);
+    counters.nBytesWritten.fetch_add(batch.SizeEstimate(), std::memory_order_relaxed);
     return true;
 }
@@ -12,6 +12,11 @@
 #include "util.h"
 #include "version.h"
 
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
 #include <boost/filesystem/path.hpp>
 
 #include <leveldb/db.h>
@@ -25,6 +30,102 @@ public:
 
 void HandleError(const leveldb::Status& status);
 
+/**
+ * Tuning of a LevelDB database. Each database has a profile named after its
+ * directory (chainstate, index or paymentdisclosure), and any setting of it
+ * can be changed with -dbtune=<name>.<setting>=<value>.
+ */
+struct CLevelDBProfile
+{
+    //! maxopenfiles: table files kept open
+    int nMaxOpenFiles;
+    //! bloombits: Bloom filter bits per key, or 0 for no filter
+    int nBloomBits;
+    //! blockcache: percentage of the cache used for table blocks
+    int nBlockCachePercent;
+    //! writebuffer: percentage of the cache used for each of the (up to two)
+    //! write buffers; filling one triggers a compaction into a new table
+    int nWriteBufferPercent;
+    //! blocksize: approximate size of the data in a table block, in bytes
+    int nBlockSize;
+    //! restartinterval: keys between restart points within a table block
+    int nBlockRestartInterval;
+
+    CLevelDBProfile();
+
+    //! Change a setting, or return false if it is unknown or out of range
+    bool Set(const std::string& strSetting, int64_t nValue);
+};
+
+/** Check the -dbtune settings, setting strError to describe any invalid one */
+bool CheckLevelDBProfiles(std::string& strError);
+
+/** The profile of database strName, with its -dbtune settings applied */
+CLevelDBProfile GetLevelDBProfile(const std::string& strName);
+
+/**
+ * The options to open a database with, given its profile and a cache of
+ * nCacheSize bytes. The caller owns block_cache and filter_policy, and has
+ * to delete them after closing the database.
+ */
+leveldb::Options GetLevelDBOptions(const CLevelDBProfile& profile, size_t nCacheSize);
+
+/** Usage counters of an open database */
+struct CLevelDBCounters
+{
+    std::atomic<uint64_t> nReads;
+    std::atomic<uint64_t> nBatches;
+    std::atomic<uint64_t> nBytesWritten;
+
+    CLevelDBCounters() : nReads(0), nBatches(0), nBytesWritten(0) {}
+};
+
+/** An open database, and how it was opened */
+struct CLevelDBInfo
+{
+    std::string strName;
+    std::string strPath;
+    CLevelDBProfile profile;
+    size_t nCacheSize;
+    leveldb::DB* pdb;
+    const CLevelDBCounters* pcounters;
+};
+
+/** Add a database to those reported by GetLevelDBStats, once it is open */
+void RegisterLevelDB(const CLevelDBInfo& info);
+
+/** Remove a database from those reported, before it is closed */
+void UnregisterLevelDB(const leveldb::DB* pdb);
+
+/** Statistics of an open database, for getdbstats */
+struct CLevelDBStats
+{
+    std::string strName;
+    std::string strPath;
+    CLevelDBProfile profile;
+    size_t nBlockCacheSize;
+    size_t nWriteBufferSize;
+    //! The leveldb.stats property
+    std::string strStats;
+    std::vector<int> vFilesAtLevel;
+    //! Approximate size on disk, in total and by the first byte of the keys
+    uint64_t nApproximateSize;
+    std::map<unsigned char, uint64_t> mapPrefixSizes;
+    //! Totals of all compactions since the database was opened
+    double dCompactionTime;
+    uint64_t nCompactionRead;
+    uint64_t nCompactionWritten;
+    //! Tables that a read may have to look in: each table in level 0, and
+    //! one in each deeper level that is not empty
+    int nReadAmplification;
+    uint64_t nReads;
+    uint64_t nBatches;
+    uint64_t nBytesWritten;
+};
+
+/** Statistics of every open database */
+std::vector<CLevelDBStats> GetLevelDBStats();
+
 /** Batch of changes queued to be written to a CLevelDBWrapper */
 class CLevelDBBatch
 {
@@ -32,8 +133,17 @@ class CLevelDBBatch
 
 private:
     leveldb::WriteBatch batch;
+    size_t size_estimate;
 
 public:
+    CLevelDBBatch() : size_estimate(0) {}
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
+
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
@@ -48,6 +158,14 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        // The formula below assumes the key and value are both less than 16k.
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
     }
 
     template <typename K>
@@ -59,7 +177,16 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        // LevelDB serializes erases as:
+        // - byte: header
+        // - varint: key length
+        // - byte[]: key
+        // The formula below assumes the key is less than 16kB.
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
     }
+
+    //! Approximate number of bytes the batch will write
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CLevelDBWrapper
@@ -86,20 +213,27 @@ private:
     //! the database itself
     leveldb::DB* pdb;
 
+    //! usage counters, reported by getdbstats
+    mutable CLevelDBCounters counters;
+
 public:
     CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
     ~CLevelDBWrapper();
 
+    //! Read a value, from the given snapshot if there is one
     template <typename K, typename V>
-    bool Read(const K& key, V& value) const
+    bool Read(const K& key, V& value, const leveldb::Snapshot* snapshot = NULL) const
     {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
+        leveldb::ReadOptions options = readoptions;
+        options.snapshot = snapshot;
+        counters.nReads.fetch_add(1, std::memory_order_relaxed);
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(options, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -131,6 +265,7 @@ public:
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
+        counters.nReads.fetch_add(1, std::memory_order_relaxed);
         std::string strValue;
         leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
         if (!status.ok()) {
@@ -165,9 +300,37 @@ public:
     }
 
     // not exactly clean encapsulation, but it's easiest for now
-    leveldb::Iterator* NewIterator()
+    leveldb::Iterator* NewIterator(const leveldb::Snapshot* snapshot = NULL) const
+    {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = snapshot;
+        return pdb->NewIterator(options);
+    }
+
+    //! A consistent, read-only view of the database, for reads that must
+    //! not see concurrent writes. Release it with ReleaseSnapshot.
+    const leveldb::Snapshot* GetSnapshot() const
+    {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot* snapshot) const
+    {
+        pdb->ReleaseSnapshot(snapshot);
+    }
+
+    //! Compact the keys in [key_begin, key_end] in the underlying storage
+    template <typename K>
+    void CompactRange(const K& key_begin, const K& key_end) const
     {
-        return pdb->NewIterator(iteroptions);
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(ssKey1.GetSerializeSize(key_begin));
+        ssKey2.reserve(ssKey2.GetSerializeSize(key_end));
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        pdb->CompactRange(&slKey1, &slKey2);
     }
 };
 
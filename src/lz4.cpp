@@ -0,0 +1,156 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "lz4.h"
+
+#include "crypto/common.h"
+
+#include <string.h>
+
+namespace {
+
+/** Shortest match the format can encode */
+const size_t MIN_MATCH = 4;
+/** The last bytes of the input are always literals */
+const size_t LAST_LITERALS = 5;
+/** No match may start within this many bytes of the end of the input */
+const size_t MF_LIMIT = 12;
+/** Matches are encoded as a 16-bit offset back into the output */
+const size_t MAX_DISTANCE = 65535;
+
+const int HASH_LOG = 12;
+
+inline size_t HashSequence(uint32_t nSequence)
+{
+    return (nSequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/** Write a length of at least 15 as a run of 255s and a final byte */
+void WriteLength(std::vector<unsigned char>& vOut, size_t nLength)
+{
+    for (nLength -= 15; nLength >= 255; nLength -= 255)
+        vOut.push_back(255);
+    vOut.push_back(nLength);
+}
+
+void WriteSequence(std::vector<unsigned char>& vOut, const unsigned char* pliterals, size_t nLiterals, size_t nOffset, size_t nMatch)
+{
+    size_t nMatchCode = nMatch - MIN_MATCH;
+    vOut.push_back(((nLiterals < 15 ? nLiterals : 15) << 4) | (nMatchCode < 15 ? nMatchCode : 15));
+    if (nLiterals >= 15)
+        WriteLength(vOut, nLiterals);
+    vOut.insert(vOut.end(), pliterals, pliterals + nLiterals);
+    vOut.push_back(nOffset & 0xff);
+    vOut.push_back(nOffset >> 8);
+    if (nMatchCode >= 15)
+        WriteLength(vOut, nMatchCode);
+}
+
+/** Read the extra bytes of a length whose 4-bit code was 15 */
+bool ReadLength(const unsigned char*& p, const unsigned char* pend, size_t& nLength)
+{
+    unsigned char b;
+    do {
+        if (p == pend)
+            return false;
+        b = *p++;
+        nLength += b;
+    } while (b == 255);
+    return true;
+}
+
+} // namespace
+
+void LZ4Compress(const unsigned char* pbegin, size_t nSize, std::vector<unsigned char>& vOut)
+{
+    vOut.clear();
+    vOut.reserve(nSize + nSize / 255 + 16);
+
+    size_t nAnchor = 0;
+    if (nSize > MF_LIMIT) {
+        size_t vTable[1 << HASH_LOG];
+        memset(vTable, 0, sizeof(vTable));
+
+        const size_t nMatchLimit = nSize - LAST_LITERALS;
+        const size_t nPosLimit = nSize - MF_LIMIT;
+        size_t nPos = 0;
+        while (nPos < nPosLimit) {
+            uint32_t nSequence = ReadLE32(pbegin + nPos);
+            size_t& nEntry = vTable[HashSequence(nSequence)];
+            size_t nRef = nEntry;
+            nEntry = nPos;
+            if (nRef >= nPos || nPos - nRef > MAX_DISTANCE || ReadLE32(pbegin + nRef) != nSequence) {
+                // Step further ahead the longer nothing has matched, so
+                // incompressible data passes through quickly
+                nPos += 1 + ((nPos - nAnchor) >> 6);
+                continue;
+            }
+
+            while (nPos > nAnchor && nRef > 0 && pbegin[nPos - 1] == pbegin[nRef - 1]) {
+                nPos--;
+                nRef--;
+            }
+            size_t nMatch = MIN_MATCH;
+            while (nPos + nMatch < nMatchLimit && pbegin[nPos + nMatch] == pbegin[nRef + nMatch])
+                nMatch++;
+
+            WriteSequence(vOut, pbegin + nAnchor, nPos - nAnchor, nPos - nRef, nMatch);
+            nPos += nMatch;
+            nAnchor = nPos;
+        }
+    }
+
+    // The last sequence only holds literals
+    size_t nLiterals = nSize - nAnchor;
+    vOut.push_back((nLiterals < 15 ? nLiterals : 15) << 4);
+    if (nLiterals >= 15)
+        WriteLength(vOut, nLiterals);
+    vOut.insert(vOut.end(), pbegin + nAnchor, pbegin + nSize);
+}
+
+bool LZ4Decompress(const unsigned char* pbegin, size_t nSize, unsigned char* pout, size_t nOutSize)
+{
+    const unsigned char* p = pbegin;
+    const unsigned char* pend = pbegin + nSize;
+    size_t nOut = 0;
+    while (p < pend) {
+        unsigned char nToken = *p++;
+
+        size_t nLiterals = nToken >> 4;
+        if (nLiterals == 15 && !ReadLength(p, pend, nLiterals))
+            return false;
+        if (nLiterals > (size_t)(pend - p) || nLiterals > nOutSize - nOut)
+            return false;
+        if (nLiterals)
+            memcpy(pout + nOut, p, nLiterals);
+        p += nLiterals;
+        nOut += nLiterals;
+        if (p == pend)
+            break;
+
+        if (pend - p < 2)
+            return false;
+        size_t nOffset = p[0] | (p[1] << 8);
+        p += 2;
+        if (nOffset == 0 || nOffset > nOut)
+            return false;
+        size_t nMatch = nToken & 15;
+        if (nMatch == 15 && !ReadLength(p, pend, nMatch))
+            return false;
+        nMatch += MIN_MATCH;
+        if (nMatch > nOutSize - nOut)
+            return false;
+
+        // Matches may overlap the bytes they produce
+        const unsigned char* pmatch = pout + nOut - nOffset;
+        if (nOffset >= nMatch) {
+            memcpy(pout + nOut, pmatch, nMatch);
+        } else {
+            for (size_t i = 0; i < nMatch; i++)
+                pout[nOut + i] = pmatch[i];
+        }
+        nOut += nMatch;
+    }
+    return nOut == nOutSize;
+}
@@ -0,0 +1,28 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_LZ4_H
+#define BITCOIN_LZ4_H
+
+#include <stddef.h>
+#include <vector>
+
+/**
+ * A compressor for the LZ4 block format.
+ *
+ * This favours speed over ratio: a single pass with a small hash table of
+ * recent 4-byte sequences, as in the reference implementation's fast mode.
+ * The output follows the block format (no frame, checksum or sizes), so the
+ * caller has to store the decompressed size alongside it.
+ */
+void LZ4Compress(const unsigned char* pbegin, size_t nSize, std::vector<unsigned char>& vOut);
+
+/**
+ * Decompress an LZ4 block into exactly nOutSize bytes at pout. Returns false
+ * if the input is malformed or does not decompress to exactly nOutSize bytes;
+ * nothing is read or written out of bounds in that case.
+ */
+bool LZ4Decompress(const unsigned char* pbegin, size_t nSize, unsigned char* pout, size_t nOutSize);
+
+#endif // BITCOIN_LZ4_H
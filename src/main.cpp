@@ -11,12 +11,16 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencoding.h"
+#include "blockstore.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "compactblock.h"
 #include "consensus/validation.h"
 #include "deprecation.h"
 #include "init.h"
+#include "joinsplitcache.h"
 #include "merkleblock.h"
 #include "metrics.h"
 #include "net.h"
@@ -54,12 +58,16 @@ using namespace std;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+/** Owns the entries of mapBlockIndex */
+static CBlockIndexPool blockIndexPool;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nJoinSplitCheckThreads = 0;
+int nHeaderCheckThreads = 0;
 bool fExperimentalMode = false;
 bool fImporting = false;
 bool fReindex = false;
@@ -190,6 +198,9 @@ namespace {
         uint256 hash;
         CBlockIndex *pindex;  //! Optional.
         bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
+        std::shared_ptr<PartiallyDownloadedBlock> partialBlock;  //! Optional, set while the block is rebuilt from a cmpctblock.
+        int64_t nTimeRequested;  //! When the block was requested (in microseconds).
+        bool fRerequested;  //! Whether the block was taken over from a peer that was late with it.
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -204,6 +215,9 @@ namespace {
 
     /** Number of peers from which we're downloading blocks. */
     int nPeersWithValidatedDownloads = 0;
+
+    /** Peers we asked to announce new blocks as cmpctblock, most recent first. Protected by cs_main. */
+    std::list<NodeId> lNodesAnnouncingHeaderAndIDs;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -255,6 +269,24 @@ struct CNodeState {
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer can send us compact blocks (it sent a sendcmpct of our version).
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks announced to it as cmpctblock.
+    bool fPreferHeaderAndIDs;
+    //! Number of requested blocks this peer sent us, that the averages below are taken over.
+    int nBlocksDownloaded;
+    //! Average time between two requested blocks arriving from this peer while it has more in flight (in microseconds).
+    double dAvgBlockInterval;
+    //! Average time from requesting a block from this peer to receiving it (in microseconds).
+    double dAvgBlockLatency;
+    //! Average size of the requested blocks this peer sent us, in bytes.
+    double dAvgBlockSize;
+    //! When the last requested block arrived from this peer, or the first of a batch was requested (in microseconds).
+    int64_t nLastBlockReceived;
+    //! Number of blocks that may be in flight from this peer.
+    int nBlockDownloadWindow;
+    //! Number of blocks re-requested from other peers because this peer was late with them.
+    int nBlocksRerequested;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -269,6 +301,15 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
+        nBlocksDownloaded = 0;
+        dAvgBlockInterval = 0;
+        dAvgBlockLatency = 0;
+        dAvgBlockSize = 0;
+        nLastBlockReceived = 0;
+        nBlockDownloadWindow = DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+        nBlocksRerequested = 0;
     }
 };
 
@@ -323,16 +364,36 @@ void FinalizeNode(NodeId nodeid) {
     nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
 
+/** Fold a sample into a running average, with the weight TCP gives a new round trip time. */
+void UpdateAverage(double& dAverage, double dSample, int nSamples) {
+    if (nSamples == 0)
+        dAverage = dSample;
+    else
+        dAverage += (dSample - dAverage) / 8;
+}
+
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived(const uint256& hash) {
+// If it came from nodeFrom, the peer we requested it from, that peer's
+// download speed is updated with a block of nBlockSize bytes.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1, unsigned int nBlockSize = 0) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (itInFlight->second.first == nodeFrom && !itInFlight->second.second->partialBlock) {
+            // Blocks rebuilt from a cmpctblock say nothing of the link
+            int64_t nNow = GetTimeMicros();
+            UpdateAverage(state->dAvgBlockInterval, nNow - state->nLastBlockReceived, state->nBlocksDownloaded);
+            UpdateAverage(state->dAvgBlockLatency, nNow - itInFlight->second.second->nTimeRequested, state->nBlocksDownloaded);
+            UpdateAverage(state->dAvgBlockSize, nBlockSize, state->nBlocksDownloaded);
+            state->nBlocksDownloaded++;
+            state->nLastBlockReceived = nNow;
+        }
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         if (state->nBlocksInFlightValidHeaders == 0 && itInFlight->second.second->fValidatedHeaders) {
             // Last validated block on the queue was received.
@@ -352,20 +413,23 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL,
+                         std::shared_ptr<PartiallyDownloadedBlock> partialBlock = std::shared_ptr<PartiallyDownloadedBlock>()) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    QueuedBlock newentry = {hash, pindex, pindex != NULL};
+    int64_t nNow = GetTimeMicros();
+    QueuedBlock newentry = {hash, pindex, pindex != NULL, partialBlock, nNow, false};
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
         // We're starting a block download (batch) from this peer.
-        state->nDownloadingSince = GetTimeMicros();
+        state->nDownloadingSince = nNow;
+        state->nLastBlockReceived = nNow;
     }
     if (state->nBlocksInFlightValidHeaders == 1 && pindex != NULL) {
         nPeersWithValidatedDownloads++;
@@ -406,13 +470,49 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
+/**
+ * Ask a peer that just gave us a new block to announce its next ones as
+ * cmpctblock, without waiting for us to ask. At most three peers are asked at
+ * a time; the one that has gone longest without giving us a block is told to
+ * stop. Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom) {
+    if (!nodestate->fProvidesHeaderAndIDs)
+        return;
+    for (std::list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
+        if (*it == pfrom->GetId()) {
+            lNodesAnnouncingHeaderAndIDs.erase(it);
+            lNodesAnnouncingHeaderAndIDs.push_front(pfrom->GetId());
+            return;
+        }
+    }
+    bool fAnnounceUsingCMPCTBLOCK = false;
+    uint64_t nCMPCTBLOCKVersion = COMPACT_BLOCK_VERSION;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= 3) {
+        // As per BIP152, we only get 3 of our peers to announce
+        // blocks using compact encodings.
+        NodeId nodeOldest = lNodesAnnouncingHeaderAndIDs.back();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeOldest) {
+                pnode->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+        lNodesAnnouncingHeaderAndIDs.pop_back();
+    }
+    fAnnounceUsingCMPCTBLOCK = true;
+    pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_front(pfrom->GetId());
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
     if (pa->nHeight > pb->nHeight) {
-        pa = pa->GetAncestor(pb->nHeight);
+        pa = chainActive.GetAncestor(pa, pb->nHeight);
     } else if (pb->nHeight > pa->nHeight) {
-        pb = pb->GetAncestor(pa->nHeight);
+        pb = chainActive.GetAncestor(pb, pa->nHeight);
     }
 
     while (pa != pb && pa && pb) {
@@ -426,8 +526,9 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+ *  at most count entries. If the first missing block is in flight from another peer, it is returned
+ *  in pindexWaitingFor. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexWaitingFor) {
     if (count == 0)
         return;
 
@@ -469,7 +570,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
         // as iterating over ~100 CBlockIndex* entries anyway.
         int nToFetch = std::min(nMaxHeight - pindexWalk->nHeight, std::max<int>(count - vBlocks.size(), 128));
         vToFetch.resize(nToFetch);
-        pindexWalk = state->pindexBestKnownBlock->GetAncestor(pindexWalk->nHeight + nToFetch);
+        pindexWalk = chainActive.GetAncestor(state->pindexBestKnownBlock, pindexWalk->nHeight + nToFetch);
         vToFetch[nToFetch - 1] = pindexWalk;
         for (unsigned int i = nToFetch - 1; i > 0; i--) {
             vToFetch[i - 1] = vToFetch[i]->pprev;
@@ -504,13 +605,47 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                if (vBlocks.empty() && waitingfor != nodeid)
+                    pindexWaitingFor = pindex;
             }
         }
     }
 }
 
+/**
+ * Whether a block in flight from another peer should be requested from this
+ * one instead: it has been outstanding twice as long as that peer usually
+ * takes, and this peer would likely deliver it in less time than it has
+ * waited already. Requires cs_main.
+ */
+bool ShouldRerequestBlock(const CNodeState* state, const QueuedBlock& queued, const CNodeState* stateFrom, int64_t nNow) {
+    if (queued.fRerequested || state->nBlocksDownloaded < MIN_BLOCKS_DOWNLOADED_FOR_WINDOW)
+        return false;
+    int64_t nOutstanding = nNow - queued.nTimeRequested;
+    // A peer we have not measured yet is given half the stalling timeout
+    double dExpected = 500000.0 * BLOCK_STALLING_TIMEOUT;
+    if (stateFrom->nBlocksDownloaded >= MIN_BLOCKS_DOWNLOADED_FOR_WINDOW)
+        dExpected = stateFrom->dAvgBlockLatency;
+    if (nOutstanding < 2 * dExpected)
+        return false;
+    return (state->nBlocksInFlight + 1) * state->dAvgBlockInterval < nOutstanding;
+}
+
 } // anon namespace
 
+int GetBlockDownloadWindow(int64_t nBlockIntervalMicros, int64_t nPingUsecTime)
+{
+    if (nBlockIntervalMicros <= 0 || nPingUsecTime < 0 || nPingUsecTime == std::numeric_limits<int64_t>::max())
+        return DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+    // A round trip takes as long as the peer needs to send this many blocks.
+    // While the window is what limits the peer, the interval is about the
+    // round trip time divided by the window, so asking for two round trips
+    // doubles the window until the link becomes the limit.
+    double dWindow = 2.0 * (nPingUsecTime + nBlockIntervalMicros) / nBlockIntervalMicros;
+    dWindow = std::min(dWindow, (double)MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    return std::max(MIN_BLOCKS_IN_TRANSIT_PER_PEER, (int)std::ceil(dWindow));
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
@@ -523,6 +658,11 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.dDownloadRate = state->dAvgBlockInterval > 0 ? state->dAvgBlockSize * 1000000 / state->dAvgBlockInterval : 0;
+    stats.dDownloadLatency = state->dAvgBlockLatency / 1000000;
+    stats.nDownloadWindow = state->nBlockDownloadWindow;
+    stats.nBlocksRerequested = state->nBlocksRerequested;
+    stats.fStalling = state->nStallingSince != 0;
     return true;
 }
 
@@ -559,6 +699,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
     return chain.Genesis();
 }
 
+CCoinsViewDB *pcoinsdbview = NULL;
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
@@ -744,7 +885,7 @@ bool CheckFinalTx(const CTransaction &tx, int flags)
     // and there aren't timestamp applications where it matters.
     // However this changes once median past time-locks are enforced:
     const int64_t nBlockTime = (flags & LOCKTIME_MEDIAN_TIME_PAST)
-                             ? chainActive.Tip()->GetMedianTimePast()
+                             ? chainActive.GetMedianTimePast(chainActive.Height())
                              : GetAdjustedTime();
 
     return IsFinalTx(tx, nBlockHeight, nBlockTime);
@@ -766,7 +907,7 @@ bool AreInputsStandard(const CTransaction& tx, const CCoinsViewCache& mapInputs)
 
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
-        const CTxOut& prev = mapInputs.GetOutputFor(tx.vin[i]);
+        const CTxOut& prev = mapInputs.AccessCoin(tx.vin[i].prevout).out;
 
         vector<vector<unsigned char> > vSolutions;
         txnouttype whichType;
@@ -840,7 +981,7 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
     unsigned int nSigOps = 0;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
-        const CTxOut &prevout = inputs.GetOutputFor(tx.vin[i]);
+        const CTxOut &prevout = inputs.AccessCoin(tx.vin[i].prevout).out;
         if (prevout.scriptPubKey.IsPayToScriptHash())
             nSigOps += prevout.scriptPubKey.GetSigOpCount(tx.vin[i].scriptSig);
     }
@@ -848,19 +989,27 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
 }
 
 bool CheckTransaction(const CTransaction& tx, CValidationState &state,
-                      libzcash::ProofVerifier& verifier)
+                      libzcash::ProofVerifier& verifier,
+                      std::vector<CJoinSplitCheck> *pvChecks, bool fCacheErase)
 {
     // Don't count coinbase transactions because mining skews the count
     if (!tx.IsCoinBase()) {
         transactionsValidated.increment();
     }
 
-    if (!CheckTransactionWithoutProofVerification(tx, state)) {
+    if (!CheckTransactionWithoutProofVerification(tx, state, pvChecks, fCacheErase)) {
         return false;
+    } else if (pvChecks) {
+        if (!tx.vjoinsplit.empty()) {
+            pvChecks->push_back(CJoinSplitCheck(CJoinSplitCheck::PROOFS, tx, fCacheErase));
+        }
+        return true;
     } else {
-        // Ensure that zk-SNARKs verify
-        BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
-            if (!joinsplit.Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
+        // Ensure that zk-SNARKs verify, unless already verified in the mempool
+        for (size_t i = 0; i < tx.vjoinsplit.size(); i++) {
+            if (JoinSplitProofCacheGet(tx, i, fCacheErase))
+                continue;
+            if (!tx.vjoinsplit[i].Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
                 return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
                                     REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
             }
@@ -869,7 +1018,39 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state,
     }
 }
 
-bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state)
+static bool CheckJoinSplitSig(const CTransaction& tx, CValidationState &state, bool fCacheErase)
+{
+    if (JoinSplitSigCacheGet(tx, fCacheErase))
+        return true;
+
+    // Empty output script.
+    CScript scriptCode;
+    uint256 dataToBeSigned;
+    try {
+        dataToBeSigned = SignatureHash(scriptCode, tx, NOT_AN_INPUT, SIGHASH_ALL);
+    } catch (std::logic_error ex) {
+        return state.DoS(100, error("CheckTransaction(): error computing signature hash"),
+                         REJECT_INVALID, "error-computing-signature-hash");
+    }
+
+    BOOST_STATIC_ASSERT(crypto_sign_PUBLICKEYBYTES == 32);
+
+    // We rely on libsodium to check that the signature is canonical.
+    // https://github.com/jedisct1/libsodium/commit/62911edb7ff2275cccd74bf1c8aefcc4d76924e0
+    if (crypto_sign_verify_detached(&tx.joinSplitSig[0],
+                                    dataToBeSigned.begin(), 32,
+                                    tx.joinSplitPubKey.begin()
+                                   ) != 0) {
+        return state.DoS(100, error("CheckTransaction(): invalid joinsplit signature"),
+                         REJECT_INVALID, "bad-txns-invalid-joinsplit-signature");
+    }
+
+    return true;
+}
+
+bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state,
+                                              std::vector<CJoinSplitCheck> *pvChecks,
+                                              bool fCacheErase)
 {
     // Basic checks that don't depend on any context
 
@@ -1006,26 +1187,10 @@ bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidatio
                                  REJECT_INVALID, "bad-txns-prevout-null");
 
         if (tx.vjoinsplit.size() > 0) {
-            // Empty output script.
-            CScript scriptCode;
-            uint256 dataToBeSigned;
-            try {
-                dataToBeSigned = SignatureHash(scriptCode, tx, NOT_AN_INPUT, SIGHASH_ALL);
-            } catch (std::logic_error ex) {
-                return state.DoS(100, error("CheckTransaction(): error computing signature hash"),
-                                 REJECT_INVALID, "error-computing-signature-hash");
-            }
-
-            BOOST_STATIC_ASSERT(crypto_sign_PUBLICKEYBYTES == 32);
-
-            // We rely on libsodium to check that the signature is canonical.
-            // https://github.com/jedisct1/libsodium/commit/62911edb7ff2275cccd74bf1c8aefcc4d76924e0
-            if (crypto_sign_verify_detached(&tx.joinSplitSig[0],
-                                            dataToBeSigned.begin(), 32,
-                                            tx.joinSplitPubKey.begin()
-                                           ) != 0) {
-                return state.DoS(100, error("CheckTransaction(): invalid joinsplit signature"),
-                                 REJECT_INVALID, "bad-txns-invalid-joinsplit-signature");
+            if (pvChecks) {
+                pvChecks->push_back(CJoinSplitCheck(CJoinSplitCheck::SIGNATURE, tx, fCacheErase));
+            } else if (!CheckJoinSplitSig(tx, state, fCacheErase)) {
+                return false;
             }
         }
     }
@@ -1063,8 +1228,16 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit)
+{
+    std::list<CTransaction> removed;
+    pool.TrimToSize(limit, &removed);
+    if (!removed.empty())
+        LogPrint("mempool", "Evicted %u transactions to stay below -maxmempool\n", removed.size());
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1141,14 +1314,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         view.SetBackend(viewMemPool);
 
         // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
+        for (size_t out = 0; out < tx.vout.size(); out++) {
+            if (view.HaveCoin(COutPoint(hash, out)))
+                return false;
+        }
 
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
+        // Spent and missing outputs cannot be told apart, so both are
+        // reported through pfMissingInputs.
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!view.HaveCoin(txin.prevout)) {
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
@@ -1210,6 +1385,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                 REJECT_INSUFFICIENTFEE, "insufficient fee");
         }
 
+        // Once the pool has had to evict, don't let in anything paying less
+        // than what was evicted
+        double dPriorityDelta = 0;
+        CAmount nFeeDelta = 0;
+        pool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nFees + nFeeDelta < mempoolRejectFee) {
+            return state.DoS(0, error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d",
+                                      hash.ToString(), nFees, mempoolRejectFee),
+                             REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+        }
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", false) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1265,8 +1452,30 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             return error("AcceptToMemoryPool: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+            return state.DoS(0, error("AcceptToMemoryPool: %s %s", hash.ToString(), errString),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Store transaction in memory
-        pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
+        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+
+        // trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
+
+        // Remember the verified JoinSplits so ConnectBlock can skip them
+        JoinSplitCacheSet(tx);
     }
 
     SyncWithWallets(tx, NULL);
@@ -1310,10 +1519,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
         int nHeight = -1;
         {
-            CCoinsViewCache &view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
         if (nHeight > 0)
             pindexSlow = chainActive[nHeight];
@@ -1345,7 +1553,7 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 // CBlock and CBlockIndex
 //
 
-bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+bool WriteBlockToDisk(const std::vector<char>& vRecord, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
 {
     // Open history file to append
     CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
@@ -1353,7 +1561,7 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
         return error("WriteBlockToDisk: OpenBlockFile failed");
 
     // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(block);
+    unsigned int nSize = vRecord.size();
     fileout << FLATDATA(messageStart) << nSize;
 
     // Write block
@@ -1361,7 +1569,8 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     if (fileOutPos < 0)
         return error("WriteBlockToDisk: ftell failed");
     pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+    if (nSize)
+        fileout.write(&vRecord[0], nSize);
 
     return true;
 }
@@ -1370,14 +1579,13 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
-
-    // Read block
+    // Read block, straight out of the mapped file if possible
+    CBlockBytes bytes;
+    if (!ReadRawBlockFromDisk(bytes, pos))
+        return error("ReadBlockFromDisk: ReadRawBlockFromDisk failed for %s", pos.ToString());
     try {
-        filein >> block;
+        CMemoryReader reader(bytes.begin(), bytes.end(), SER_DISK, CLIENT_VERSION);
+        reader >> block;
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
@@ -1518,6 +1726,8 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    // Message handler threads call this with and without cs_main held
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1574,20 +1784,10 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.push_back(Coin());
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
 
@@ -1599,7 +1799,7 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     }
 
     // add outputs
-    inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, int nHeight)
@@ -1616,6 +1816,27 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
+bool CJoinSplitCheck::operator()() {
+    if (kind == SIGNATURE) {
+        CValidationState state;
+        return CheckJoinSplitSig(*ptxTo, state, cacheErase);
+    }
+
+    // The proofs of a transaction are checked together, see ProofVerifier::Batch()
+    auto verifier = libzcash::ProofVerifier::Batch();
+    for (size_t i = 0; i < ptxTo->vjoinsplit.size(); i++) {
+        if (JoinSplitProofCacheGet(*ptxTo, i, cacheErase))
+            continue;
+        if (!ptxTo->vjoinsplit[i].Verify(*pzcashParams, verifier, ptxTo->joinSplitPubKey)) {
+            return error("CJoinSplitCheck(): %s joinsplit does not verify", ptxTo->GetHash().ToString());
+        }
+    }
+    if (!verifier.VerifyBatch()) {
+        return error("CJoinSplitCheck(): %s joinsplit does not verify", ptxTo->GetHash().ToString());
+    }
+    return true;
+}
+
 int GetSpendHeight(const CCoinsViewCache& inputs)
 {
     LOCK(cs_main);
@@ -1640,14 +1861,14 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
-            if (coins->IsCoinBase()) {
+            if (coin.IsCoinBase()) {
                 // Ensure that coinbases are matured
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY) {
                     return state.Invalid(
-                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight),
+                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
                 }
 
@@ -1663,8 +1884,8 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs(): txin values out of range"),
                                  REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
@@ -1714,11 +1935,11 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(coin.out.scriptPubKey, tx, i, flags, cacheStore);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1730,7 +1951,7 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check(*coins, tx, i,
+                        CScriptCheck check(coin.out.scriptPubKey, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -1753,7 +1974,7 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
 
 namespace {
 
-bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
+bool UndoWriteToDisk(const CBlockUndo& blockundo, const std::vector<char>& vRecord, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
 {
     // Open history file to append
     CAutoFile fileout(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
@@ -1761,17 +1982,18 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
         return error("%s: OpenUndoFile failed", __func__);
 
     // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(blockundo);
+    unsigned int nSize = vRecord.size();
     fileout << FLATDATA(messageStart) << nSize;
 
-    // Write undo data
+    // Write undo data, as encoded by EncodeUndoRecord
     long fileOutPos = ftell(fileout.Get());
     if (fileOutPos < 0)
         return error("%s: ftell failed", __func__);
     pos.nPos = (unsigned int)fileOutPos;
-    fileout << blockundo;
+    if (nSize)
+        fileout.write(&vRecord[0], nSize);
 
-    // calculate & write checksum
+    // calculate & write checksum, over the undo data as serialized
     CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
     hasher << hashBlock;
     hasher << blockundo;
@@ -1782,16 +2004,37 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (pos.nPos < BLOCK_RECORD_HEADER_SIZE)
+        return error("%s: invalid position %s", __func__, pos.ToString());
+
+    // Open history file to read, at the header in front of the undo data
+    CAutoFile filein(OpenUndoFile(CDiskBlockPos(pos.nFile, pos.nPos - BLOCK_RECORD_HEADER_SIZE), true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
         return error("%s: OpenBlockFile failed", __func__);
 
     // Read block
     uint256 hashChecksum;
     try {
-        filein >> blockundo;
+        unsigned char buf[MESSAGE_START_SIZE];
+        unsigned int nSize;
+        filein >> FLATDATA(buf) >> nSize;
+        if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+            return error("%s: undo magic mismatch at %s", __func__, pos.ToString());
+        if (nSize > MAX_SIZE)
+            return error("%s: undo size %u too large at %s", __func__, nSize, pos.ToString());
+        std::vector<char> vRecord(nSize);
+        if (nSize)
+            filein.read(&vRecord[0], nSize);
         filein >> hashChecksum;
+
+        if (IsCompressedRecord(vRecord.data(), vRecord.size())) {
+            std::vector<char> vDecoded;
+            if (!DecompressRecord(vRecord.data(), vRecord.size(), vDecoded))
+                return error("%s: invalid compressed undo data at %s", __func__, pos.ToString());
+            vRecord.swap(vDecoded);
+        }
+        CMemoryReader reader(vRecord.data(), vRecord.data() + vRecord.size(), SER_DISK, CLIENT_VERSION);
+        reader >> blockundo;
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s", __func__, e.what());
@@ -1828,38 +2071,52 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
-    }
-    if (coins->IsAvailable(out.n))
+    if (view.HaveCoin(out))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (!alternate.IsSpent()) {
+            undo.nHeight = alternate.nHeight;
+            undo.fCoinBase = alternate.fCoinBase;
+        } else {
+            return error("%s: undo data adding output to missing transaction", __func__);
+        }
+    }
+    // The potential_overwrite parameter to AddCoin is only allowed to be false if we know for
+    // sure that the coin did not already exist in the cache. As we have queried for that above
+    // using HaveCoin, we don't need to guess. When fClean is false, a coin already existed and
+    // it is an overwrite.
+    view.AddCoin(out, std::move(undo), !fClean);
 
     return fClean;
 }
 
+/** Record the outputs a transaction spends (given by its undo data) and creates in a commitment */
+static void CommitTxToSet(CCoinsSetCommitment& delta, const CTransaction& tx, const CTxUndo& txundo, int nHeight)
+{
+    for (size_t j = 0; j < txundo.vprevout.size(); j++) {
+        delta.Remove(tx.vin[j].prevout, txundo.vprevout[j]);
+    }
+    const uint256& hash = tx.GetHash();
+    for (size_t o = 0; o < tx.vout.size(); o++) {
+        if (!tx.vout[o].scriptPubKey.IsUnspendable())
+            delta.Add(COutPoint(hash, o), Coin(tx.vout[o], nHeight, tx.IsCoinBase()));
+    }
+}
+
 bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
@@ -1879,6 +2136,9 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock(): block and undo data inconsistent");
 
+    bool fUpdateCommitment = view.HaveSetCommitment();
+    CCoinsSetCommitment commitmentDelta;
+
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = block.vtx[i];
@@ -1886,21 +2146,17 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != (int)coin.nHeight || tx.IsCoinBase() != coin.IsCoinBase()) {
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+                }
+                if (is_spent && fUpdateCommitment)
+                    commitmentDelta.Remove(out, coin);
+            }
         }
 
         // unspend nullifiers
@@ -1912,18 +2168,22 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out))
                     fClean = false;
+                if (fUpdateCommitment && view.HaveCoinInCache(out))
+                    commitmentDelta.Add(out, view.AccessCoin(out));
             }
         }
     }
 
+    if (fUpdateCommitment)
+        view.UpdateSetCommitment(commitmentDelta);
+
     // set the old best anchor back
     view.PopAnchor(blockUndo.old_tree_root);
 
@@ -1946,8 +2206,10 @@ void static FlushBlockFile(bool fFinalize = false)
 
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
-        if (fFinalize)
+        if (fFinalize) {
             TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
+            ReleaseBlockFile(nLastBlockFile);
+        }
         FileCommit(fileOld);
         fclose(fileOld);
     }
@@ -1964,12 +2226,31 @@ void static FlushBlockFile(bool fFinalize = false)
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+// Each JoinSplit check takes milliseconds, so workers take them one at a time.
+static CCheckQueue<CJoinSplitCheck> joinsplitcheckqueue(1);
 
 void ThreadScriptCheck() {
     RenameThread("litecoinz-scriptch");
     scriptcheckqueue.Thread();
 }
 
+void ThreadJoinSplitCheck() {
+    RenameThread("litecoinz-jscheck");
+    joinsplitcheckqueue.Thread();
+}
+
+// Checking a header is dominated by its Equihash solution, so workers take
+// a few at a time.
+static CCheckQueue<CBlockHeaderCheck> headercheckqueue(8);
+// Headers messages from different peers may be handled at the same time,
+// but the queue has a single master.
+static CCriticalSection cs_headercheckqueue;
+
+void ThreadHeaderCheck() {
+    RenameThread("litecoinz-hdrcheck");
+    headercheckqueue.Thread();
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -2037,6 +2318,22 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
+/**
+ * Called when the deferred JoinSplit checks of a block failed. They are
+ * redone one transaction at a time on this thread so that the state
+ * reports which transaction is invalid.
+ */
+static bool ReportInvalidJoinSplits(const CBlock& block, CValidationState& state)
+{
+    auto strictVerifier = libzcash::ProofVerifier::Strict();
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!CheckTransaction(tx, state, strictVerifier))
+            return error("ConnectBlock(): CheckTransaction failed");
+    }
+    return state.DoS(100, error("ConnectBlock(): JoinSplit checks failed"),
+                     REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+}
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
 {
     const CChainParams& chainparams = Params();
@@ -2051,12 +2348,29 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    auto verifier = libzcash::ProofVerifier::Strict();
+    // JoinSplit proofs are only structurally checked by CheckBlock; the
+    // pairing checks for the whole block are then done together.
+    auto verifier = libzcash::ProofVerifier::Batch();
     auto disabledVerifier = libzcash::ProofVerifier::Disabled();
 
-    // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
-    if (!CheckBlock(block, state, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck))
+    // If there are JoinSplit checking threads, the proof and joinSplitSig
+    // checks are handed to them instead, and run while the inputs are connected.
+    bool fParallelJoinSplits = fExpensiveChecks && nJoinSplitCheckThreads;
+    CCheckQueueControl<CJoinSplitCheck> jscontrol(fParallelJoinSplits ? &joinsplitcheckqueue : NULL);
+    std::vector<CJoinSplitCheck> vJoinSplitChecks;
+
+    // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in.
+    // Once connected, its JoinSplits will not be looked up again, so their cache entries can go.
+    if (!CheckBlock(block, state, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck,
+                    fParallelJoinSplits ? &vJoinSplitChecks : NULL, !fJustCheck))
         return false;
+    jscontrol.Add(vJoinSplitChecks);
+
+    int64_t nTimeProofsStart = GetTimeMicros();
+    size_t nProofs = verifier.BatchSize();
+    if (!verifier.VerifyBatch())
+        return ReportInvalidJoinSplits(block, state);
+    LogPrint("bench", "    - Verify %u joinsplit proofs: %.2fms\n", (unsigned)nProofs, 0.001 * (GetTimeMicros() - nTimeProofsStart));
 
     // verify that the view's current state corresponds to the previous block
     uint256 hashPrevBlock = pindex->pprev == NULL ? uint256() : pindex->pprev->GetBlockHash();
@@ -2079,10 +2393,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
     BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-        const CCoins* coins = view.AccessCoins(tx.GetHash());
-        if (coins && !coins->IsPruned())
-            return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                             REJECT_INVALID, "bad-txns-BIP30");
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                 REJECT_INVALID, "bad-txns-BIP30");
+        }
     }
 
     unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
@@ -2191,8 +2506,23 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                                block.vtx[0].GetValueOut(), blockReward),
                                REJECT_INVALID, "bad-cb-amount");
 
+    // Update the commitment to the unspent output set while the script
+    // checks are still running.
+    if (!fJustCheck && view.HaveSetCommitment()) {
+        CCoinsSetCommitment delta;
+        CTxUndo undoDummy;
+        for (unsigned int i = 0; i < block.vtx.size(); i++) {
+            CommitTxToSet(delta, block.vtx[i], i == 0 ? undoDummy : blockundo.vtxundo[i-1], pindex->nHeight);
+        }
+        view.UpdateSetCommitment(delta);
+        int64_t nTimeCommit = GetTimeMicros();
+        LogPrint("bench", "      - Update UTXO set commitment: %.2fms\n", 0.001 * (nTimeCommit - nTime1));
+    }
+
     if (!control.Wait())
         return state.DoS(100, false);
+    if (!jscontrol.Wait())
+        return ReportInvalidJoinSplits(block, state);
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
 
@@ -2204,9 +2534,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     {
         if (pindex->GetUndoPos().IsNull()) {
             CDiskBlockPos pos;
-            if (!FindUndoPos(state, pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
+            std::vector<char> vUndoRecord;
+            EncodeUndoRecord(blockundo, vUndoRecord);
+            if (!FindUndoPos(state, pindex->nFile, pos, vUndoRecord.size() + 40))
                 return error("ConnectBlock(): FindUndoPos failed");
-            if (!UndoWriteToDisk(blockundo, pos, pindex->pprev->GetBlockHash(), chainparams.MessageStart()))
+            if (!UndoWriteToDisk(blockundo, vUndoRecord, pos, pindex->pprev->GetBlockHash(), chainparams.MessageStart()))
                 return AbortNode(state, "Failed to write undo data");
 
             // update nUndoPos in block index
@@ -2282,11 +2614,17 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     if (nLastSetChain == 0) {
         nLastSetChain = nNow;
     }
+    // A coin database write that failed in the background leaves nothing safe to continue with.
+    if (pcoinsdbview->HasWriteFailed())
+        return AbortNode(state, "Failed to write to coin database");
     size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // With write-behind, flushed entries stay in memory until they have been
+    // written, so the cache itself only gets half of the budget.
+    size_t nCacheLimit = pcoinsdbview->IsWriteBehind() ? nCoinCacheUsage / 2 : nCoinCacheUsage;
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
-    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
+    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCacheLimit;
     // The cache is over the limit, we have to write now.
-    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCacheLimit;
     // It's been a while since we wrote the block index to disk. Do this frequently, so we don't need to redownload after a crash.
     bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
@@ -2325,16 +2663,24 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
+        // Unless we are shutting down or pruning, a write-behind database
+        // takes the entries and writes them in the background.
+        int64_t nFlushStart = GetTimeMicros();
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsdbview->Sync())
+            return AbortNode(state, "Failed to write to coin database");
+        int64_t nStall = GetTimeMicros() - nFlushStart;
+        pcoinsdbview->RecordFlushStall(nStall);
+        LogPrint("bench", "  - Coin cache flush held up block processing for %.2fms\n", nStall * 0.001);
         nLastFlush = nNow;
     }
     if ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000) {
@@ -2423,13 +2769,25 @@ bool static DisconnectTip(CValidationState &state) {
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    std::vector<uint256> vHashUpdate;
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, true))
             mempool.remove(tx, removed, true);
-    }
+        else if (mempool.exists(tx.GetHash()))
+            vHashUpdate.push_back(tx.GetHash());
+    }
+    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    // no in-mempool children, which is generally not true when adding
+    // previously-confirmed transactions back to the mempool.
+    // UpdateTransactionsFromBlock finds descendants of any transactions in this
+    // block that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
+    // Resurrected transactions bypass the size limit above so that children
+    // already in the pool are not orphaned; trim once they are all back.
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
     if (anchorBeforeDisconnect != anchorAfterDisconnect) {
         // The anchor may not change between block disconnects,
         // in which case we don't want to evict from the mempool yet!
@@ -2623,7 +2981,7 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     int nTargetHeight = std::min(nHeight + 32, pindexMostWork->nHeight);
     vpindexToConnect.clear();
     vpindexToConnect.reserve(nTargetHeight - nHeight);
-    CBlockIndex *pindexIter = pindexMostWork->GetAncestor(nTargetHeight);
+    CBlockIndex *pindexIter = chainActive.GetAncestor(pindexMostWork, nTargetHeight);
     while (pindexIter && pindexIter->nHeight != nHeight) {
         vpindexToConnect.push_back(pindexIter);
         pindexIter = pindexIter->pprev;
@@ -2680,6 +3038,8 @@ bool ActivateBestChain(CValidationState &state, const CBlock *pblock) {
             break;
 
         bool fInitialDownload;
+        // Peers that asked for new blocks as cmpctblocks
+        std::set<NodeId> setPreferHeaderAndIDs;
         {
             LOCK(cs_main);
             pindexMostWork = FindMostWorkChain();
@@ -2693,6 +3053,12 @@ bool ActivateBestChain(CValidationState &state, const CBlock *pblock) {
 
             pindexNewTip = chainActive.Tip();
             fInitialDownload = IsInitialBlockDownload();
+            if (!fInitialDownload) {
+                BOOST_FOREACH(const PAIRTYPE(NodeId, CNodeState)& item, mapNodeState) {
+                    if (item.second.fPreferHeaderAndIDs)
+                        setPreferHeaderAndIDs.insert(item.first);
+                }
+            }
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
 
@@ -2703,11 +3069,26 @@ bool ActivateBestChain(CValidationState &state, const CBlock *pblock) {
             int nBlockEstimate = 0;
             if (fCheckpointsEnabled)
                 nBlockEstimate = Checkpoints::GetTotalBlocksEstimate(chainParams.Checkpoints());
+            // Peers that asked for it get the new tip as a cmpctblock right
+            // away; it is only built once, and shared between them
+            CSharedMessage msgCmpctBlock;
+            if (pblock && pblock->GetHash() == hashNewTip)
+                msgCmpctBlock = MakeSharedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(*pblock));
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (pindexNewTip->nHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        CInv inv(MSG_BLOCK, hashNewTip);
+                        if (msgCmpctBlock && setPreferHeaderAndIDs.count(pnode->GetId())) {
+                            LOCK(pnode->cs_inventory);
+                            if (pnode->setInventoryKnown.count(inv))
+                                continue;
+                            pnode->setInventoryKnown.insert(inv);
+                            pnode->PushSharedMessage(msgCmpctBlock);
+                        } else
+                            pnode->PushInventory(inv);
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             GetMainSignals().UpdatedBlockTip(pindexNewTip);
@@ -2800,8 +3181,7 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexPool.Allocate(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -3005,7 +3385,8 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
 
 bool CheckBlock(const CBlock& block, CValidationState& state,
                 libzcash::ProofVerifier& verifier,
-                bool fCheckPOW, bool fCheckMerkleRoot)
+                bool fCheckPOW, bool fCheckMerkleRoot,
+                std::vector<CJoinSplitCheck> *pvChecks, bool fCacheErase)
 {
     // These are checks that are independent of context.
 
@@ -3014,8 +3395,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
     if (!CheckBlockHeader(block, state, fCheckPOW))
         return false;
 
-    // Check the merkle root.
-    if (fCheckMerkleRoot) {
+    // Check the merkle root, unless whoever parsed the block already did.
+    if (fCheckMerkleRoot && !block.fMerkleChecked) {
         bool mutated;
         uint256 hashMerkleRoot2 = block.BuildMerkleTree(&mutated);
         if (block.hashMerkleRoot != hashMerkleRoot2)
@@ -3050,7 +3431,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
 
     // Check transactions
     BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state, verifier))
+        if (!CheckTransaction(tx, state, verifier, pvChecks, fCacheErase))
             return error("CheckBlock(): CheckTransaction failed");
 
     unsigned int nSigOps = 0;
@@ -3083,7 +3464,7 @@ bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& sta
                          REJECT_INVALID, "bad-diffbits");
 
     // Check timestamp against prev
-    if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+    if (block.GetBlockTime() <= chainActive.GetMedianTimePast(pindexPrev))
         return state.Invalid(error("%s: block's timestamp is too early", __func__),
                              REJECT_INVALID, "time-too-old");
 
@@ -3112,7 +3493,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     BOOST_FOREACH(const CTransaction& tx, block.vtx) {
         int nLockTimeFlags = 0;
         int64_t nLockTimeCutoff = (nLockTimeFlags & LOCKTIME_MEDIAN_TIME_PAST)
-                                ? pindexPrev->GetMedianTimePast()
+                                ? chainActive.GetMedianTimePast(pindexPrev)
                                 : block.GetBlockTime();
         if (!IsFinalTx(tx, nHeight, nLockTimeCutoff)) {
             return state.DoS(10, error("%s: contains a non-final transaction", __func__), REJECT_INVALID, "bad-txns-nonfinal");
@@ -3135,7 +3516,48 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
+bool CBlockHeaderCheck::operator()() {
+    CValidationState state;
+    *pfValid = CheckBlockHeader(*pheader, state);
+    return *pfValid;
+}
+
+void CheckBlockHeaders(const std::vector<CBlockHeader>& headers, std::vector<unsigned char>& vValid)
+{
+    vValid.assign(headers.size(), 0);
+    if (!nHeaderCheckThreads || headers.size() < 2)
+        return;
+
+    std::vector<CBlockHeaderCheck> vChecks;
+    vChecks.reserve(headers.size());
+    {
+        LOCK(cs_main);
+        // Only the headers that connect to the block index are worth the
+        // Equihash work: AcceptBlockHeader gives up at the first header whose
+        // parent is unknown or invalid, or that does not follow the one before.
+        BlockMap::iterator mi = mapBlockIndex.find(headers[0].hashPrevBlock);
+        if (mi == mapBlockIndex.end() || (mi->second->nStatus & BLOCK_FAILED_MASK))
+            return;
+        uint256 hashPrev = headers[0].hashPrevBlock;
+        for (size_t i = 0; i < headers.size(); i++) {
+            if (headers[i].hashPrevBlock != hashPrev)
+                break;
+            hashPrev = headers[i].GetHash();
+            mi = mapBlockIndex.find(hashPrev);
+            if (mi == mapBlockIndex.end())
+                vChecks.push_back(CBlockHeaderCheck(headers[i], vValid[i]));
+            else if (mi->second->nStatus & BLOCK_FAILED_MASK)
+                break;
+        }
+    }
+
+    LOCK(cs_headercheckqueue);
+    CCheckQueueControl<CBlockHeaderCheck> control(&headercheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex, bool fCheckedHeader)
 {
     const CChainParams& chainparams = Params();
     AssertLockHeld(cs_main);
@@ -3153,7 +3575,7 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
         return true;
     }
 
-    if (!CheckBlockHeader(block, state))
+    if (!fCheckedHeader && !CheckBlockHeader(block, state))
         return false;
 
     // Get prev block index
@@ -3179,7 +3601,7 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
     return true;
 }
 
-bool AcceptBlock(const CBlock& block, CValidationState& state, CBlockIndex** ppindex, bool fRequested, CDiskBlockPos* dbp)
+bool AcceptBlock(const CBlock& block, CValidationState& state, CBlockIndex** ppindex, bool fRequested, CDiskBlockPos* dbp, unsigned int nRecordSize)
 {
     const CChainParams& chainparams = Params();
     AssertLockHeld(cs_main);
@@ -3224,14 +3646,25 @@ bool AcceptBlock(const CBlock& block, CValidationState& state, CBlockIndex** ppi
 
     // Write block to history file
     try {
-        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        // A block that is already on disk takes up the record it was stored
+        // as, which is smaller than its serialization if it was compressed
+        std::vector<char> vRecord;
+        unsigned int nBlockSize;
+        if (dbp == NULL) {
+            EncodeBlockRecord(block, vRecord);
+            nBlockSize = vRecord.size();
+        } else if (nRecordSize != 0) {
+            nBlockSize = nRecordSize;
+        } else {
+            nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        }
         CDiskBlockPos blockPos;
         if (dbp != NULL)
             blockPos = *dbp;
         if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, block.GetBlockTime(), dbp != NULL))
             return error("AcceptBlock(): FindBlockPos failed");
         if (dbp == NULL)
-            if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart()))
+            if (!WriteBlockToDisk(vRecord, blockPos, chainparams.MessageStart()))
                 AbortNode(state, "Failed to write block");
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
             return error("AcceptBlock(): ReceivedBlockTransactions failed");
@@ -3258,7 +3691,7 @@ static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned
 }
 
 
-bool ProcessNewBlock(CValidationState &state, const CNode* pfrom, const CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp)
+bool ProcessNewBlock(CValidationState &state, const CNode* pfrom, const CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp, unsigned int nRecordSize)
 {
     // Preliminary checks
     auto verifier = libzcash::ProofVerifier::Disabled();
@@ -3266,7 +3699,8 @@ bool ProcessNewBlock(CValidationState &state, const CNode* pfrom, const CBlock*
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        unsigned int nBlockSize = pfrom ? ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION) : 0;
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1, nBlockSize);
         fRequested |= fForceProcessing;
         if (!checked) {
             return error("%s: CheckBlock FAILED", __func__);
@@ -3274,7 +3708,7 @@ bool ProcessNewBlock(CValidationState &state, const CNode* pfrom, const CBlock*
 
         // Store to disk
         CBlockIndex *pindex = NULL;
-        bool ret = AcceptBlock(*pblock, state, &pindex, fRequested, dbp);
+        bool ret = AcceptBlock(*pblock, state, &pindex, fRequested, dbp, nRecordSize);
         if (pindex && pfrom) {
             mapBlockSource[pindex->GetBlockHash()] = pfrom->GetId();
         }
@@ -3366,6 +3800,7 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        ReleaseBlockFile(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -3478,66 +3913,158 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex(): new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexPool.Allocate();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
-bool static LoadBlockIndexDB()
+/** Apply the effects of a block on the coin and shielded state, assuming it is already known to be valid. */
+static bool RollforwardBlock(const CBlockIndex* pindex, CCoinsViewCache& view)
 {
-    const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts())
-        return false;
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        return error("ReplayBlock(): ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
 
-    boost::this_thread::interruption_point();
+    ZCIncrementalMerkleTree tree;
+    assert(view.GetAnchorAt(view.GetBestAnchor(), tree));
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+                view.SpendCoin(txin.prevout);
+            }
+        }
+        BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
+            BOOST_FOREACH(const uint256 &nf, joinsplit.nullifiers) {
+                view.SetNullifier(nf, true);
+            }
+            BOOST_FOREACH(const uint256 &note_commitment, joinsplit.commitments) {
+                tree.append(note_commitment);
+            }
+        }
+        // Pass check = true as every addition may be an overwrite.
+        AddCoins(view, tx, pindex->nHeight, true);
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        // We can link the chain of blocks for which we've received transactions at some point.
-        // Pruned nodes may have deleted the block.
-        if (pindex->nTx > 0) {
-            if (pindex->pprev) {
-                if (pindex->pprev->nChainTx) {
-                    pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
-                    if (pindex->pprev->nChainSproutValue && pindex->nSproutValue) {
-                        pindex->nChainSproutValue = *pindex->pprev->nChainSproutValue + *pindex->nSproutValue;
-                    } else {
-                        pindex->nChainSproutValue = boost::none;
-                    }
+    view.PushAnchor(tree);
+    return true;
+}
+
+bool ReplayBlocks(const CChainParams& params, CCoinsView* view)
+{
+    LOCK(cs_main);
+
+    CCoinsViewCache cache(view);
+
+    std::vector<uint256> hashHeads = view->GetHeadBlocks();
+    if (hashHeads.empty()) return true; // We're already in a consistent state.
+    if (hashHeads.size() != 2) return error("ReplayBlocks(): unknown inconsistent state");
+
+    uiInterface.ShowProgress(_("Replaying blocks..."), 0);
+    LogPrintf("Replaying blocks\n");
+
+    const CBlockIndex* pindexOld = NULL;  // Old tip during the interrupted flush.
+    const CBlockIndex* pindexNew;         // New tip during the interrupted flush.
+    const CBlockIndex* pindexFork = NULL; // Latest block common to both the old and the new tip.
+
+    if (mapBlockIndex.count(hashHeads[0]) == 0) {
+        return error("ReplayBlocks(): reorganization to unknown block requested");
+    }
+    pindexNew = mapBlockIndex[hashHeads[0]];
+
+    if (!hashHeads[1].IsNull()) { // The old tip is allowed to be 0, indicating it's the first flush.
+        if (mapBlockIndex.count(hashHeads[1]) == 0) {
+            return error("ReplayBlocks(): reorganization from unknown block requested");
+        }
+        pindexOld = mapBlockIndex[hashHeads[1]];
+        pindexFork = LastCommonAncestor(mapBlockIndex[hashHeads[1]], mapBlockIndex[hashHeads[0]]);
+        assert(pindexFork != NULL);
+    }
+
+    // Rollback along the old branch.
+    while (pindexOld != pindexFork) {
+        if (pindexOld->nHeight > 0) { // Never disconnect the genesis block.
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindexOld)) {
+                return error("RollbackBlock(): ReadBlockFromDisk() failed at %d, hash=%s", pindexOld->nHeight, pindexOld->GetBlockHash().ToString());
+            }
+            LogPrintf("Rolling back %s (%i)\n", pindexOld->GetBlockHash().ToString(), pindexOld->nHeight);
+            CValidationState state;
+            bool fClean = true;
+            // Coins from the interrupted flush may be on either side of it;
+            // an unclean disconnect is expected here.
+            cache.SetBestBlock(pindexOld->GetBlockHash());
+            if (!DisconnectBlock(block, state, pindexOld, cache, &fClean)) {
+                return error("RollbackBlock(): DisconnectBlock failed at %d, hash=%s", pindexOld->nHeight, pindexOld->GetBlockHash().ToString());
+            }
+        }
+        pindexOld = pindexOld->pprev;
+    }
+
+    // Roll forward from the forking point to the new tip.
+    int nForkHeight = pindexFork ? pindexFork->nHeight : 0;
+    for (int nHeight = nForkHeight + 1; nHeight <= pindexNew->nHeight; ++nHeight) {
+        const CBlockIndex* pindex = pindexNew->GetAncestor(nHeight);
+        LogPrintf("Rolling forward %s (%i)\n", pindex->GetBlockHash().ToString(), nHeight);
+        if (!RollforwardBlock(pindex, cache)) return false;
+    }
+
+    cache.SetBestBlock(pindexNew->GetBlockHash());
+    if (!cache.Flush())
+        return error("ReplayBlocks(): failed to write to coin database");
+    if (pcoinsdbview && !pcoinsdbview->Sync())
+        return error("ReplayBlocks(): failed to write to coin database");
+    uiInterface.ShowProgress("", 100);
+    return true;
+}
+
+/**
+ * Compute the chain totals of a block index entry and add it to the candidate
+ * sets. Entries are loaded in order of height, so its parent is done already.
+ */
+static void LinkLoadedBlockIndex(CBlockIndex* pindex)
+{
+    pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+    // We can link the chain of blocks for which we've received transactions at some point.
+    // Pruned nodes may have deleted the block.
+    if (pindex->nTx > 0) {
+        if (pindex->pprev) {
+            if (pindex->pprev->nChainTx) {
+                pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+                if (pindex->pprev->nChainSproutValue && pindex->nSproutValue) {
+                    pindex->nChainSproutValue = *pindex->pprev->nChainSproutValue + *pindex->nSproutValue;
                 } else {
-                    pindex->nChainTx = 0;
                     pindex->nChainSproutValue = boost::none;
-                    mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
                 }
             } else {
-                pindex->nChainTx = pindex->nTx;
-                pindex->nChainSproutValue = pindex->nSproutValue;
+                pindex->nChainTx = 0;
+                pindex->nChainSproutValue = boost::none;
+                mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
             }
-        }
-        if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
-            setBlockIndexCandidates.insert(pindex);
-        if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
-            pindexBestInvalid = pindex;
-        if (pindex->pprev)
-            pindex->BuildSkip();
-        if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
-            pindexBestHeader = pindex;
-    }
+        } else {
+            pindex->nChainTx = pindex->nTx;
+            pindex->nChainSproutValue = pindex->nSproutValue;
+        }
+    }
+    if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
+        setBlockIndexCandidates.insert(pindex);
+    if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
+        pindexBestInvalid = pindex;
+    if (pindex->pprev)
+        pindex->BuildSkip();
+    if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
+        pindexBestHeader = pindex;
+}
+
+bool static LoadBlockIndexDB()
+{
+    const CChainParams& chainparams = Params();
+    // Chain work and the rest are computed as the entries stream in
+    if (!pblocktree->LoadBlockIndexGuts(LinkLoadedBlockIndex))
+        return false;
+
+    boost::this_thread::interruption_point();
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -3602,6 +4129,10 @@ bool static LoadBlockIndexDB()
         }
     }
 
+    // Finish a coin database flush that was interrupted by a crash
+    if (!ReplayBlocks(chainparams, pcoinsdbview))
+        return false;
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -3735,10 +4266,8 @@ void UnloadBlockIndex()
     mapNodeState.clear();
     recentRejects.reset(NULL);
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
+    blockIndexPool.Clear();
     fHavePruned = false;
 }
 
@@ -3772,12 +4301,14 @@ bool InitBlockIndex() {
         try {
             CBlock block = chainparams.GenesisBlock();
             // Start new block file
-            unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+            std::vector<char> vRecord;
+            EncodeBlockRecord(block, vRecord);
+            unsigned int nBlockSize = vRecord.size();
             CDiskBlockPos blockPos;
             CValidationState state;
             if (!FindBlockPos(state, blockPos, nBlockSize+8, 0, block.GetBlockTime()))
                 return error("LoadBlockIndex(): FindBlockPos failed");
-            if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart()))
+            if (!WriteBlockToDisk(vRecord, blockPos, chainparams.MessageStart()))
                 return error("LoadBlockIndex(): writing genesis block to disk failed");
             CBlockIndex *pindex = AddToBlockIndex(block);
             if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
@@ -3796,11 +4327,64 @@ bool InitBlockIndex() {
 
 
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+// Map of disk positions for blocks with unknown parent (only used for reindex)
+// and the size of the records they were stored as
+static std::multimap<uint256, std::pair<CDiskBlockPos, unsigned int> > mapBlocksUnknownParent;
+
+bool ProcessExternalBlock(const CBlock& block, const uint256& hash, CDiskBlockPos *dbp, unsigned int nRecordSize, int& nLoaded)
 {
     const CChainParams& chainparams = Params();
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+
+    // detect out of order blocks, and store them for later
+    if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                block.hashPrevBlock.ToString());
+        if (dbp)
+            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, std::make_pair(*dbp, nRecordSize)));
+        return true;
+    }
+
+    // process in case the block isn't known yet
+    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+        CValidationState state;
+        if (ProcessNewBlock(state, NULL, &block, true, dbp, nRecordSize))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+    } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+        LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+    }
+
+    // Recursively process earlier encountered successors of this block
+    deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<uint256, std::pair<CDiskBlockPos, unsigned int> >::iterator, std::multimap<uint256, std::pair<CDiskBlockPos, unsigned int> >::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while (range.first != range.second) {
+            std::multimap<uint256, std::pair<CDiskBlockPos, unsigned int> >::iterator it = range.first;
+            CBlock blockChild;
+            if (ReadBlockFromDisk(blockChild, it->second.first))
+            {
+                LogPrintf("%s: Processing out of order child %s of %s\n", __func__, blockChild.GetHash().ToString(),
+                        head.ToString());
+                CValidationState dummy;
+                if (ProcessNewBlock(dummy, NULL, &blockChild, true, &it->second.first, it->second.second))
+                {
+                    nLoaded++;
+                    queue.push_back(blockChild.GetHash());
+                }
+            }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
+        }
+    }
+    return true;
+}
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+{
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
@@ -3838,55 +4422,21 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                     dbp->nPos = nBlockPos;
                 blkdat.SetLimit(nBlockPos + nSize);
                 blkdat.SetPos(nBlockPos);
+                std::vector<char> vRecord(nSize);
+                blkdat.read(&vRecord[0], nSize);
+                if (IsCompressedRecord(&vRecord[0], nSize)) {
+                    std::vector<char> vDecoded;
+                    if (!DecompressRecord(&vRecord[0], nSize, vDecoded))
+                        throw std::ios_base::failure("invalid compressed block");
+                    vRecord.swap(vDecoded);
+                }
                 CBlock block;
-                blkdat >> block;
+                CMemoryReader reader(&vRecord[0], &vRecord[0] + vRecord.size(), SER_DISK, CLIENT_VERSION);
+                reader >> block;
                 nRewind = blkdat.GetPos();
 
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
-
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, true, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
-
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second))
-                        {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, true, &it->second))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                    }
-                }
+                if (!ProcessExternalBlock(block, block.GetHash(), dbp, nSize, nLoaded))
+                    break;
             } catch (const std::exception& e) {
                 LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
@@ -4127,7 +4677,8 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoins(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -4154,7 +4705,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -4179,14 +4730,47 @@ void static ProcessGetData(CNode* pfrom)
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    // A new block is asked for by most peers in turn, so the
+                    // last block message sent is kept to be shared with them
+                    static CSharedMessage msgRecentBlock;
+                    static uint256 hashRecentBlock;
+                    if (inv.type == MSG_BLOCK && msgRecentBlock && hashRecentBlock == inv.hash)
+                        pfrom->PushSharedMessage(msgRecentBlock);
+                    else if (inv.type == MSG_BLOCK)
+                    {
+                        // Send block from disk, as stored, without decoding it
+                        CBlockView view;
+                        if (!view.Read((*mi).second))
+                            assert(!"cannot load block from disk");
+                        msgRecentBlock = MakeSharedMessage("block", view.GetBytes());
+                        hashRecentBlock = inv.hash;
+                        pfrom->PushSharedMessage(msgRecentBlock);
+                    }
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        CBlockView view;
+                        if (!view.Read((*mi).second))
+                            assert(!"cannot load block from disk");
+                        // A peer that is this far behind is not going to have
+                        // the transactions in its mempool
+                        if (mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+                            const CBlock* pblock = view.GetBlock();
+                            if (!pblock)
+                                assert(!"cannot load block from disk");
+                            CBlockHeaderAndShortTxIDs cmpctblock(*pblock);
+                            pfrom->PushMessage("cmpctblock", cmpctblock);
+                        } else
+                            pfrom->PushMessage("block", view.GetBytes());
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        CBlockView view;
+                        if (!view.Read((*mi).second))
+                            assert(!"cannot load block from disk");
+                        const CBlock* pblock = view.GetBlock();
+                        if (!pblock)
+                            assert(!"cannot load block from disk");
+                        const CBlock& block = *pblock;
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -4226,9 +4810,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedMessage>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -4250,7 +4834,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4269,6 +4853,34 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/**
+ * Process a block a peer gave us, whether it was sent in full or rebuilt from
+ * a cmpctblock, and let the peer know if it was invalid.
+ */
+static void ProcessBlockFromPeer(CNode* pfrom, const CBlock& block, const std::string& strCommand)
+{
+    CValidationState state;
+    // Process all blocks from whitelisted peers, even if not requested,
+    // unless we're still syncing with the network.
+    // Such an unrequested block may still be processed, subject to the
+    // conditions in AcceptBlock().
+    bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
+    ProcessNewBlock(state, pfrom, &block, forceProcessing, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    } else {
+        LOCK(cs_main);
+        if (!IsInitialBlockDownload() && chainActive.Tip()->GetBlockHash() == block.GetHash())
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(State(pfrom->GetId()), pfrom);
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -4348,7 +4960,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        {
+            LOCK(cs_main);
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        }
 
         // Change version
         pfrom->PushMessage("verack");
@@ -4424,6 +5039,28 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell our peer we are willing to provide version 1 cmpctblocks,
+            // but don't ask it to announce blocks to us that way yet; that is
+            // left to the peers that turn out to give us new blocks first.
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = COMPACT_BLOCK_VERSION;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == COMPACT_BLOCK_VERSION) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -4499,6 +5136,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return error("message inv size() = %u", vInv.size());
         }
 
+        // Note what the peer has before taking cs_main, which is only
+        // needed to look up whether we have it too
+        BOOST_FOREACH(const CInv& inv, vInv)
+            pfrom->AddInventoryKnown(inv);
+
         LOCK(cs_main);
 
         std::vector<CInv> vToFetch;
@@ -4508,7 +5150,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             const CInv &inv = vInv[nInv];
 
             boost::this_thread::interruption_point();
-            pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(inv);
             LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
@@ -4530,8 +5171,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        nodestate->nBlocksInFlight < nodestate->nBlockDownloadWindow) {
+                        // A new block near the tip is mostly made of
+                        // transactions our mempool already has
+                        if (nodestate->fProvidesHeaderAndIDs && !IsInitialBlockDownload())
+                            vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                        else
+                            vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -4807,6 +5453,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Check the Equihash solutions in parallel before taking cs_main;
+        // the headers are still accepted one by one, in order, below.
+        std::vector<unsigned char> vValid;
+        CheckBlockHeaders(headers, vValid);
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -4815,13 +5466,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         CBlockIndex *pindexLast = NULL;
-        BOOST_FOREACH(const CBlockHeader& header, headers) {
+        for (unsigned int n = 0; n < nCount; n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            if (!AcceptBlockHeader(header, state, &pindexLast)) {
+            if (!AcceptBlockHeader(header, state, &pindexLast, vValid[n])) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -4855,23 +5507,181 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         pfrom->AddInventoryKnown(inv);
 
-        CValidationState state;
-        // Process all blocks from whitelisted peers, even if not requested,
-        // unless we're still syncing with the network.
-        // Such an unrequested block may still be processed, subject to the
-        // conditions in AcceptBlock().
-        bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
-        ProcessNewBlock(state, pfrom, &block, forceProcessing, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+        ProcessBlockFromPeer(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        CInv inv(MSG_BLOCK, cmpctblock.header.GetHash());
+        LogPrint("net", "received cmpctblock %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+
+        pfrom->AddInventoryKnown(inv);
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+                // Doesn't connect (or is genesis); rather than treat it as
+                // misbehaviour in AcceptBlockHeader, ask for the headers in between
+                if (!IsInitialBlockDownload())
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+                return true;
+            }
+
+            CBlockIndex *pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    return error("invalid header received in cmpctblock from peer=%d", pfrom->id);
+                }
+            }
+            UpdateBlockAvailability(pfrom->GetId(), inv.hash);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(inv.hash);
+            bool fInFlightFromPeer = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId();
+            bool fInFlightFromOther = itInFlight != mapBlocksInFlight.end() && !fInFlightFromPeer;
+            vector<CInv> vGetBlock(1, inv);
+
+            // Nothing to do if we have the block's transactions already, but
+            // don't leave it taking up one of this peer's download slots
+            if ((pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nTx != 0) {
+                if (fInFlightFromPeer)
+                    MarkBlockAsReceived(inv.hash);
+                return true;
+            }
+            // A block that would not advance our tip is not worth rebuilding
+            // from the mempool; if we asked this peer for it, get it in full
+            if (pindex->nChainWork <= chainActive.Tip()->nChainWork) {
+                if (fInFlightFromPeer)
+                    pfrom->PushMessage("getdata", vGetBlock);
+                return true;
+            }
+
+            // Only a block on top of our tip is rebuilt from the mempool; any
+            // other is left to the usual download, after its headers
+            if (pindex->pprev != chainActive.Tip()) {
+                if (fInFlightFromPeer)
+                    pfrom->PushMessage("getdata", vGetBlock);
+                return true;
+            }
+
+            std::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+            ReadStatus status = partialBlock->InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                if (fInFlightFromPeer)
+                    MarkBlockAsReceived(inv.hash);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid cmpctblock from peer=%d", pfrom->id);
+            }
+            if (status == READ_STATUS_OK && partialBlock->GetMissingIndexes().empty())
+                status = partialBlock->FillBlock(block, std::vector<CTransaction>());
+            if (status == READ_STATUS_FAILED) {
+                // A short id collision; fetch the block in full
+                if (!fInFlightFromOther) {
+                    MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus(), pindex);
+                    pfrom->PushMessage("getdata", vGetBlock);
+                }
+                return true;
+            }
+
+            if (block.IsNull()) {
+                // Ask for the transactions the mempool does not have, unless
+                // another peer is already sending us the whole block
+                if (fInFlightFromOther)
+                    return true;
+                CNodeState *nodestate = State(pfrom->GetId());
+                if (!fInFlightFromPeer && nodestate->nBlocksInFlight >= nodestate->nBlockDownloadWindow)
+                    return true;
+                MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus(), pindex, partialBlock);
+                BlockTransactionsRequest req;
+                req.blockhash = inv.hash;
+                req.indexes = partialBlock->GetMissingIndexes();
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
+            }
+        }
+
+        ProcessBlockFromPeer(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA) || !chainActive.Contains(it->second)) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Rebuilding an old block from its transactions is unlikely to
+            // save anything; send the whole block instead
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, it->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+            if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                    it->second.first != pfrom->GetId()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            ReadStatus status = it->second.second->partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us block transactions that do not match the cmpctblock", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Probably a short id collision; fetch the block in full
+                it->second.second->partialBlock.reset();
+                vector<CInv> vGetBlock(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vGetBlock);
+                return true;
             }
         }
 
+        ProcessBlockFromPeer(pfrom, block, strCommand);
     }
 
 
@@ -4890,7 +5700,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -5011,28 +5824,35 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CAlert alert;
         vRecv >> alert;
 
-        uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        bool fInvalid = false;
         {
-            if (alert.ProcessAlert(Params().AlertKey()))
+            // The setKnown of every node is guarded by cs_mapAlerts
+            LOCK(cs_mapAlerts);
+            uint256 alertHash = alert.GetHash();
+            if (pfrom->setKnown.count(alertHash) == 0)
             {
-                // Relay
-                pfrom->setKnown.insert(alertHash);
+                if (alert.ProcessAlert(Params().AlertKey()))
                 {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        alert.RelayTo(pnode);
+                    // Relay
+                    pfrom->setKnown.insert(alertHash);
+                    {
+                        LOCK(cs_vNodes);
+                        BOOST_FOREACH(CNode* pnode, vNodes)
+                            alert.RelayTo(pnode);
+                    }
                 }
+                else
+                    fInvalid = true;
             }
-            else {
-                // Small DoS penalty so peers that send us lots of
-                // duplicate/expired/invalid-signature/whatever alerts
-                // eventually get banned.
-                // This isn't a Misbehaving(100) (immediate ban) because the
-                // peer might be an older or different implementation with
-                // a different signature key, etc.
-                Misbehaving(pfrom->GetId(), 10);
-            }
+        }
+        if (fInvalid) {
+            // Small DoS penalty so peers that send us lots of
+            // duplicate/expired/invalid-signature/whatever alerts
+            // eventually get banned.
+            // This isn't a Misbehaving(100) (immediate ban) because the
+            // peer might be an older or different implementation with
+            // a different signature key, etc.
+            Misbehaving(pfrom->GetId(), 10);
         }
     }
 
@@ -5063,16 +5883,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
         // and thus, the maximum size any matched object can have) in a filteradd message
-        if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE)
-        {
-            Misbehaving(pfrom->GetId(), 100);
-        } else {
+        bool fBad = vData.size() > MAX_SCRIPT_ELEMENT_SIZE;
+        if (!fBad) {
             LOCK(pfrom->cs_filter);
             if (pfrom->pfilter)
                 pfrom->pfilter->insert(vData);
             else
-                Misbehaving(pfrom->GetId(), 100);
+                fBad = true;
         }
+        // Outside cs_filter, which is taken after cs_main elsewhere
+        if (fBad)
+            Misbehaving(pfrom->GetId(), 100);
     }
 
 
@@ -5199,6 +6020,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nTimeStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -5230,6 +6052,7 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        pfrom->RecordProcessTime(strCommand, GetTimeMicros() - nTimeStart);
 
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
@@ -5238,8 +6061,11 @@ bool ProcessMessages(CNode* pfrom)
     }
 
     // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
+    if (!pfrom->fDisconnect) {
+        for (std::deque<CNetMessage>::iterator itDone = pfrom->vRecvMsg.begin(); itDone != it; itDone++)
+            itDone->ReleaseBuffer();
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
@@ -5280,22 +6106,26 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!lockMain)
             return true;
 
-        // Address refresh broadcast
+        // Address refresh broadcast. Every 24 hours each peer gets our
+        // address again the next time it comes through here; cs_vNodes must
+        // not be taken to do them all at once, as pto->cs_vSend is held.
         static int64_t nLastRebroadcast;
-        if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60))
+        if (!IsInitialBlockDownload())
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            if (GetTime() - nLastRebroadcast > 24 * 60 * 60)
+                nLastRebroadcast = GetTime();
+            if (pto->nLastAddrRebroadcast < nLastRebroadcast)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
-                    pnode->addrKnown.reset();
+                if (pto->nLastAddrRebroadcast) {
+                    LOCK(pto->cs_vAddrToSend);
+                    pto->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
-                AdvertizeLocal(pnode);
+                AdvertizeLocal(pto);
+                pto->nLastAddrRebroadcast = nLastRebroadcast;
             }
-            if (!vNodes.empty())
-                nLastRebroadcast = GetTime();
         }
 
         //
@@ -5303,6 +6133,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            LOCK(pto->cs_vAddrToSend);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -5442,16 +6273,41 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        // Size the window of this peer from how fast it has sent us blocks
+        int64_t nBlockInterval = state.nBlocksDownloaded >= MIN_BLOCKS_DOWNLOADED_FOR_WINDOW ? state.dAvgBlockInterval : 0;
+        state.nBlockDownloadWindow = GetBlockDownloadWindow(nBlockInterval, pto->nMinPingUsecTime);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < state.nBlockDownloadWindow) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            CBlockIndex *pindexWaitingFor = NULL;
+            FindNextBlocksToDownload(pto->GetId(), state.nBlockDownloadWindow - state.nBlocksInFlight, vToDownload, staller, pindexWaitingFor);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
-                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                // The next block on top of our tip can mostly be rebuilt from
+                // our mempool, if the peer sends it as a compact block
+                if (pindex->pprev == chainActive.Tip() && state.fProvidesHeaderAndIDs && !IsInitialBlockDownload())
+                    vGetData.push_back(CInv(MSG_CMPCT_BLOCK, pindex->GetBlockHash()));
+                else
+                    vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
                 LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
+            // Validation cannot go on before the first missing block arrives.
+            // If the peer it was asked from is late with it, and this one is
+            // faster, ask this one too, well before the window runs out.
+            if (pindexWaitingFor != NULL && state.nBlocksInFlight < state.nBlockDownloadWindow) {
+                const uint256& hash = pindexWaitingFor->GetBlockHash();
+                NodeId nodeFrom = mapBlocksInFlight[hash].first;
+                CNodeState *stateFrom = State(nodeFrom);
+                if (ShouldRerequestBlock(&state, *mapBlocksInFlight[hash].second, stateFrom, nNow)) {
+                    stateFrom->nBlocksRerequested++;
+                    vGetData.push_back(CInv(MSG_BLOCK, hash));
+                    MarkBlockAsInFlight(pto->GetId(), hash, consensusParams, pindexWaitingFor);
+                    mapBlocksInFlight[hash].second->fRerequested = true;
+                    LogPrint("net", "Re-requesting block %s (%d) peer=%d, late from peer=%d\n", hash.ToString(),
+                        pindexWaitingFor->nHeight, pto->id, nodeFrom);
+                }
+            }
             if (state.nBlocksInFlight == 0 && staller != -1) {
                 if (State(staller)->nStallingSince == 0) {
                     State(staller)->nStallingSince = nNow;
@@ -5495,10 +6351,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexPool.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
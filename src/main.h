@@ -41,7 +41,9 @@
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
+class CCoinsViewDB;
 class CInv;
+class CJoinSplitCheck;
 class CScriptCheck;
 class CValidationInterface;
 class CValidationState;
@@ -65,6 +67,16 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -75,8 +87,25 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Maximum number of block parsing threads used by -reindex */
+static const int MAX_REINDEX_THREADS = 16;
+/** -reindexthreads default (number of block parsing threads, 0 = auto) */
+static const int DEFAULT_REINDEX_THREADS = 0;
+/** Maximum number of JoinSplit-checking threads allowed */
+static const int MAX_JOINSPLITCHECK_THREADS = 16;
+/** -parjoinsplit default (number of JoinSplit proof and signature checking threads, 0 = auto) */
+static const int DEFAULT_JOINSPLITCHECK_THREADS = 0;
+/** Maximum number of header-checking threads allowed */
+static const int MAX_HEADERCHECK_THREADS = 16;
+/** -parheaders default (number of threads checking the Equihash solutions of received headers, 0 = auto) */
+static const int DEFAULT_HEADERCHECK_THREADS = 0;
+/** Number of blocks that can be requested at any given time from a peer whose download speed we have not measured yet. */
+static const int DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds of the number of blocks in flight from a single peer, which is sized from its measured download speed. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 64;
+/** Number of blocks to receive from a peer before its download speed is used to size its window. */
+static const int MIN_BLOCKS_DOWNLOADED_FOR_WINDOW = 4;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -125,6 +154,8 @@ extern bool fExperimentalMode;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nJoinSplitCheckThreads;
+extern int nHeaderCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
@@ -177,9 +208,10 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
  * @param[in]   pblock  The block we want to process.
  * @param[in]   fForceProcessing Process this block even if unrequested; used for non-network block sources and whitelisted peers.
  * @param[out]  dbp     If pblock is stored to disk (or already there), this will be set to its location.
+ * @param[in]   nRecordSize The size of the record pblock is stored as, if it is already on disk; 0 if unknown.
  * @return True if state.IsValid()
  */
-bool ProcessNewBlock(CValidationState &state, const CNode* pfrom, const CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp);
+bool ProcessNewBlock(CValidationState &state, const CNode* pfrom, const CBlock* pblock, bool fForceProcessing, CDiskBlockPos *dbp, unsigned int nRecordSize = 0);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -190,10 +222,18 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/**
+ * Hand one block read from a block file to validation, holding it back until its parent is known.
+ * nRecordSize is the size of the record the block is stored as at dbp.
+ * Returns false if processing has to stop because of a system error.
+ */
+bool ProcessExternalBlock(const CBlock& block, const uint256& hash, CDiskBlockPos *dbp, unsigned int nRecordSize, int& nLoaded);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex();
+/** Finish a coin database flush that was interrupted, by replaying blocks on top of it */
+bool ReplayBlocks(const CChainParams& params, CCoinsView* view);
 /** Unload database information */
 void UnloadBlockIndex();
 /** Process protocol messages received from a given node */
@@ -207,6 +247,10 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the JoinSplit checking thread */
+void ThreadJoinSplitCheck();
+/** Run an instance of the header checking thread */
+void ThreadHeaderCheck();
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -251,10 +295,17 @@ void Misbehaving(NodeId nodeid, int howmuch);
 void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
+/**
+ * Number of blocks to keep in flight from a peer that delivers a block every
+ * nBlockIntervalMicros while busy and has a round trip time of nPingUsecTime:
+ * enough to keep it sending for two round trips. Without measurements of
+ * either, DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER.
+ */
+int GetBlockDownloadWindow(int64_t nBlockIntervalMicros, int64_t nPingUsecTime);
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false);
 
 
 struct CNodeStateStats {
@@ -262,6 +313,11 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    double dDownloadRate;
+    double dDownloadLatency;
+    int nDownloadWindow;
+    int nBlocksRerequested;
+    bool fStalling;
 };
 
 struct CDiskTxPos : public CDiskBlockPos
@@ -340,9 +396,18 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, int nHeight);
 
-/** Context-independent validity checks */
-bool CheckTransaction(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier);
-bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state);
+/**
+ * Context-independent validity checks
+ * If pvChecks is not NULL, the JoinSplit proof and joinSplitSig checks are
+ * appended to it instead of being performed inline, and are done with a
+ * strict verifier when run. fCacheErase removes the JoinSplit cache entries
+ * that the checks hit, for when the transaction is being connected.
+ */
+bool CheckTransaction(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier,
+                      std::vector<CJoinSplitCheck> *pvChecks = NULL, bool fCacheErase = false);
+bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state,
+                                              std::vector<CJoinSplitCheck> *pvChecks = NULL,
+                                              bool fCacheErase = false);
 
 /** Check for standard transaction types
  * @return True if all outputs (scriptPubKeys) use only standard transaction forms
@@ -380,8 +445,8 @@ private:
 
 public:
     CScriptCheck(): ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+    CScriptCheck(const CScript& scriptPubKeyIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
+        scriptPubKey(scriptPubKeyIn),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) { }
 
     bool operator()();
@@ -398,9 +463,64 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the JoinSplit checks of one transaction: either
+ * the zk-SNARK proofs of all of its JoinSplits, or its joinSplitSig.
+ * Note that this stores a reference to the transaction.
+ */
+class CJoinSplitCheck
+{
+public:
+    enum Kind {
+        PROOFS,
+        SIGNATURE
+    };
 
-/** Functions for disk access for blocks */
-bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
+private:
+    Kind kind;
+    const CTransaction *ptxTo;
+    bool cacheErase;
+
+public:
+    CJoinSplitCheck(): kind(PROOFS), ptxTo(0), cacheErase(false) {}
+    CJoinSplitCheck(Kind kindIn, const CTransaction& txToIn, bool cacheEraseIn) :
+        kind(kindIn), ptxTo(&txToIn), cacheErase(cacheEraseIn) { }
+
+    bool operator()();
+
+    void swap(CJoinSplitCheck &check) {
+        std::swap(kind, check.kind);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(cacheErase, check.cacheErase);
+    }
+};
+
+/**
+ * Closure representing the context-free checks of one block header (see
+ * CheckBlockHeader), which record their outcome in *pfValid.
+ * Note that this stores a reference to the header.
+ */
+class CBlockHeaderCheck
+{
+private:
+    const CBlockHeader *pheader;
+    unsigned char *pfValid;
+
+public:
+    CBlockHeaderCheck(): pheader(0), pfValid(0) {}
+    CBlockHeaderCheck(const CBlockHeader& headerIn, unsigned char& fValidIn) : pheader(&headerIn), pfValid(&fValidIn) { }
+
+    bool operator()();
+
+    void swap(CBlockHeaderCheck &check) {
+        std::swap(pheader, check.pheader);
+        std::swap(pfValid, check.pfValid);
+    }
+};
+
+
+/** Functions for disk access for blocks. WriteBlockToDisk takes the record made by EncodeBlockRecord. */
+bool WriteBlockToDisk(const std::vector<char>& vRecord, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 
@@ -420,7 +540,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
 bool CheckBlock(const CBlock& block, CValidationState& state,
                 libzcash::ProofVerifier& verifier,
-                bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+                bool fCheckPOW = true, bool fCheckMerkleRoot = true,
+                std::vector<CJoinSplitCheck> *pvChecks = NULL, bool fCacheErase = false);
 
 /** Context-dependent validity checks */
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex *pindexPrev);
@@ -434,10 +555,25 @@ bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex
  * JoinSplit proofs are never verified, because:
  * - AcceptBlock doesn't perform script checks either.
  * - The only caller of AcceptBlock verifies JoinSplit proofs elsewhere.
- * If dbp is non-NULL, the file is known to already reside on disk
+ * If dbp is non-NULL, the file is known to already reside on disk, as a record
+ * of nRecordSize bytes if that is non-zero
+ */
+bool AcceptBlock(const CBlock& block, CValidationState& state, CBlockIndex **pindex, bool fRequested, CDiskBlockPos* dbp, unsigned int nRecordSize = 0);
+/**
+ * Add a header to the block index. If fCheckedHeader, CheckBlockHeader is
+ * known to have passed for it already (see CheckBlockHeaders).
  */
-bool AcceptBlock(const CBlock& block, CValidationState& state, CBlockIndex **pindex, bool fRequested, CDiskBlockPos* dbp);
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL);
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL, bool fCheckedHeader = false);
+
+/**
+ * Run CheckBlockHeader on a run of headers on the header checking threads,
+ * without holding cs_main. Only the leading headers that connect to the
+ * block index, each to the one before it, are checked. vValid[i] is set if
+ * headers[i] passed; headers that are already known, failed, were skipped
+ * after a failure, or do not connect are left for AcceptBlockHeader to
+ * check in order.
+ */
+void CheckBlockHeaders(const std::vector<CBlockHeader>& headers, std::vector<unsigned char>& vValid);
 
 
 
@@ -518,6 +654,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coins database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
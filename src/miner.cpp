@@ -35,10 +35,11 @@
 #include "sodium.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 #ifdef ENABLE_MINING
 #include <functional>
 #endif
+#include <iterator>
+#include <limits>
 #include <mutex>
 
 using namespace std;
@@ -50,328 +51,822 @@ using namespace std;
 
 //
 // Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// transactions in the memory pool. The mempool tracks, for every entry, the
+// fees and size of the package formed by the entry and all its in-mempool
+// ancestors, and keeps an index sorted on that package fee rate. The block
+// is filled by repeatedly taking the best package from that index, adding
+// any ancestors not yet in the block together with the transaction itself.
 //
-class COrphan
+// Once part of a package is in the block, the remaining descendants have a
+// different (better) package fee rate than the index says. Those are copied
+// into mapModifiedTx with their ancestor totals adjusted, and the miner
+// always considers whichever of the index and mapModifiedTx has the better
+// package next.
+//
+
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+// Container for tracking updates to ancestor feerate as we include (parent)
+// transactions in a block
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+        nSigOpsWithAncestors = entry->GetSigOpCountWithAncestors();
+    }
+
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    const CTransaction& GetTx() const { return iter->GetTx(); }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    unsigned int nSigOpsWithAncestors;
+};
+
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
+    {
+        return entry.iter;
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash
+        >,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            // Reuse same tag from CTxMemPool's similar index
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareTxMemPoolEntryByAncestorFee
+        >
+    >
+> indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion
 {
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    void operator() (CTxMemPoolModifiedEntry &e)
     {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+        e.nSigOpsWithAncestors -= iter->GetSigOpCount();
     }
+
+    CTxMemPool::txiter iter;
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+// We want to sort transactions by coin age priority
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+class TxCoinAgePriorityCompare
 {
-    bool byFee;
+public:
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
+    {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByFeeRate()(*(a.second), *(b.second));
+        return a.first < b.first;
+    }
+};
 
+// A package's parents always have fewer in-mempool ancestors than it does,
+// so sorting on the ancestor count puts it in a valid block order.
+class CompareTxIterByAncestorCount
+{
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b)
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+/** Fills a block template with transactions from the mempool. Requires cs_main and mempool.cs. */
+class BlockAssembler
+{
+private:
+    CBlockTemplate* pblocktemplate;
+    CBlock* pblock;
+    CCoinsViewCache& view;
+
+    // Configuration parameters for the block size
+    unsigned int nBlockMaxSize, nBlockMinSize, nBlockPrioritySize;
+
+    // Information on the current status of the block
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+
+    // Chain context for the block
+    int nHeight;
+    int64_t nLockTimeCutoff;
+    bool fPrintPriority;
+
+public:
+    BlockAssembler(CBlockTemplate* pblocktemplateIn, CCoinsViewCache& viewIn, int nHeightIn, int64_t nLockTimeCutoffIn,
+                   unsigned int nBlockMaxSizeIn, unsigned int nBlockMinSizeIn, unsigned int nBlockPrioritySizeIn) :
+        pblocktemplate(pblocktemplateIn), pblock(&pblocktemplateIn->block), view(viewIn),
+        nBlockMaxSize(nBlockMaxSizeIn), nBlockMinSize(nBlockMinSizeIn), nBlockPrioritySize(nBlockPrioritySizeIn),
+        nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0),
+        nHeight(nHeightIn), nLockTimeCutoff(nLockTimeCutoffIn)
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        fPrintPriority = GetBoolArg("-printpriority", false);
     }
+
+    /** Add transactions based on coin age priority, up to nBlockPrioritySize */
+    void addPriorityTxs();
+    /** Add transactions based on the fee rate of their package with all
+      * in-mempool ancestors (which are added along with them) */
+    void addPackageTxs();
+
+    /** Continue filling a template that already holds transactions; fees
+      * reported afterwards only cover the transactions added from here on */
+    void Resume(uint64_t nBlockSizeIn, unsigned int nBlockSigOpsIn, const CTxMemPool::setEntries& inBlockIn);
+    /** Add the given transactions, each with its in-mempool ancestors that
+      * are not in the block yet, best package first and while they fit */
+    unsigned int addNewTxs(std::vector<CTxMemPool::txiter>& vNew);
+
+    uint64_t GetBlockSize() const { return nBlockSize; }
+    uint64_t GetBlockTx() const { return nBlockTx; }
+    unsigned int GetBlockSigOps() const { return nBlockSigOps; }
+    CAmount GetFees() const { return nFees; }
+
+private:
+    /** Test if a new package would "fit" in the block */
+    bool TestPackage(uint64_t packageSize, unsigned int packageSigOps) const;
+    /** Check every transaction of a package, in block order, against the
+      * block's coins view and add them to the block if all of them pass */
+    bool TryAddPackage(const std::vector<CTxMemPool::txiter>& sortedEntries, double dPriority);
+    /** Return true if given transaction from mapTx has already been evaluated,
+      * or if the transaction's cached data in mapTx is incorrect. */
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx) const;
+    /** Add descendants of given transactions to mapModifiedTx with ancestor
+      * state updated assuming given transactions are inBlock. */
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx) const;
+    /** Return true if a mempool parent of the transaction is not yet in the block */
+    bool isStillDependent(CTxMemPool::txiter iter) const;
 };
 
-void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
+bool BlockAssembler::TestPackage(uint64_t packageSize, unsigned int packageSigOps) const
 {
-    pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
+    if (nBlockSize + packageSize >= nBlockMaxSize)
+        return false;
+    // Legacy sigops only; P2SH sigops are counted against the coins view in TryAddPackage
+    if (nBlockSigOps + packageSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+    return true;
 }
 
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+bool BlockAssembler::TryAddPackage(const std::vector<CTxMemPool::txiter>& sortedEntries, double dPriority)
 {
-    const CChainParams& chainparams = Params();
-    // Create new block
-    std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
-        return NULL;
-    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
-
-    // -regtest only: allow overriding block.nVersion with
-    // -blockversion=N to test forking scenarios
-    if (Params().MineBlocksOnDemand())
-        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
+    // Apply the package to a scratch view so a failure part way through
+    // leaves the block's view untouched
+    CCoinsViewCache viewPackage(&view);
+    std::vector<CAmount> vTxFees;
+    std::vector<unsigned int> vTxSigOps;
+    unsigned int nPackageSigOps = 0;
+    BOOST_FOREACH(CTxMemPool::txiter it, sortedEntries) {
+        const CTransaction& tx = it->GetTx();
+        if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff))
+            return false;
+
+        if (!viewPackage.HaveInputs(tx))
+            return false;
+
+        // Nullifiers spent by transactions already in the block (or earlier
+        // in this package) are marked in the view, so this also rejects
+        // JoinSplit double-spends within the template
+        if (!viewPackage.HaveJoinSplitRequirements(tx))
+            return false;
+
+        unsigned int nTxSigOps = it->GetSigOpCount() + GetP2SHSigOpCount(tx, viewPackage);
+        nPackageSigOps += nTxSigOps;
+        if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        if (!ContextualCheckInputs(tx, state, viewPackage, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus()))
+            return false;
 
-    // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
-    pblocktemplate->vTxFees.push_back(-1); // updated at end
-    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+        vTxFees.push_back(viewPackage.GetValueIn(tx) - tx.GetValueOut());
+        vTxSigOps.push_back(nTxSigOps);
+        UpdateCoins(tx, state, viewPackage, nHeight);
+    }
+    viewPackage.Flush();
+
+    for (size_t i = 0; i < sortedEntries.size(); i++) {
+        CTxMemPool::txiter it = sortedEntries[i];
+        pblock->vtx.push_back(it->GetTx());
+        pblocktemplate->vTxFees.push_back(vTxFees[i]);
+        pblocktemplate->vTxSigOps.push_back(vTxSigOps[i]);
+        nBlockSize += it->GetTxSize();
+        ++nBlockTx;
+        nBlockSigOps += vTxSigOps[i];
+        nFees += vTxFees[i];
+        inBlock.insert(it);
+
+        if (fPrintPriority)
+        {
+            double dTxPriority = dPriority;
+            if (sortedEntries.size() > 1 || dTxPriority == 0) {
+                CAmount dummy = 0;
+                dTxPriority = it->GetPriority(nHeight);
+                mempool.ApplyDeltas(it->GetTx().GetHash(), dTxPriority, dummy);
+            }
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                dTxPriority, CFeeRate(it->GetModifiedFee(), it->GetTxSize()).ToString(), it->GetTx().GetHash().ToString());
+        }
+    }
+    return true;
+}
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter) const
+{
+    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
+    {
+        if (!inBlock.count(parent)) {
+            return true;
+        }
+    }
+    return false;
+}
 
+void BlockAssembler::addPriorityTxs()
+{
     // How much of the block should be dedicated to high-priority transactions,
     // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+    if (nBlockPrioritySize == 0) {
+        return;
+    }
 
-    // Collect memory pool transactions into the block
-    CAmount nFees = 0;
+    // Coin age priority changes with every block, so this part of the block
+    // still has to score the whole pool.
+    vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
 
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi)
     {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        pblock->nTime = GetAdjustedTime();
-        const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->second.GetTx();
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy = 0;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    while (!vecPriority.empty()) {
+        // Take highest priority transaction off the priority queue
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        double actualPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        // If tx already in block, skip
+        if (inBlock.count(iter)) {
+            continue;
+        }
 
-            int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                    ? nMedianTimePast
-                                    : pblock->GetBlockTime();
+        // If tx is dependent on other mempool txs which haven't yet been included
+        // then put it in the waitSet
+        if (isStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, actualPriority));
+            continue;
+        }
 
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff))
-                continue;
+        if (!TestPackage(iter->GetTxSize(), iter->GetSigOpCount()))
+            continue;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+        if (TryAddPackage(std::vector<CTxMemPool::txiter>(1, iter), actualPriority)) {
+            // If now that this tx is added we've surpassed our desired priority size
+            // or have dropped below the AllowFree threshold, then we're done adding priority txs
+            if (nBlockSize >= nBlockPrioritySize || !AllowFree(actualPriority)) {
+                break;
+            }
 
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
+            // This tx was successfully added, so add transactions that depend
+            // on this one to the priority queue to try again
+            BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
+            {
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
                 }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+            }
+        }
+    }
+}
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
+        indexed_modified_transaction_set& mapModifiedTx) const
+{
+    BOOST_FOREACH(const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        BOOST_FOREACH(CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                modEntry.nSigOpsWithAncestors -= it->GetSigOpCount();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
 
-                int nConf = nHeight - coins->nHeight;
+// Skip entries in mapTx that are already in a block or are present
+// in mapModifiedTx (which implies that the mapTx ancestor state is
+// stale due to ancestor inclusion in the block)
+// Also skip transactions that we've already failed to add. This can happen if
+// we consider a transaction in mapModifiedTx and it fails: we can then
+// potentially consider it again while walking mapTx.  It's currently
+// guaranteed to fail again, but as a belt-and-suspenders check we put it in
+// failedTx and avoid re-evaluation, since the re-evaluation would be using
+// cached size/sigops/fee values that are not actually correct.
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx) const
+{
+    assert(it != mempool.mapTx.end());
+    if (mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it))
+        return true;
+    return false;
+}
 
-                dPriority += (double)nValueIn * nConf;
+void BlockAssembler::addPackageTxs()
+{
+    // mapModifiedTx will store sorted packages after they are modified
+    // because some of their txs are already in the block
+    indexed_modified_transaction_set mapModifiedTx;
+    // Keep track of entries that failed inclusion, to avoid duplicate work
+    CTxMemPool::setEntries failedTx;
+
+    // Start by adding all descendants of previously added txs to mapModifiedTx
+    // and modifying them for their already included ancestors
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    typedef CTxMemPool::indexed_transaction_set::index<ancestor_score>::type ancestor_index;
+    const ancestor_index& byAncestorScore = mempool.mapTx.get<ancestor_score>();
+    ancestor_index::iterator mi = byAncestorScore.begin();
+    CTxMemPool::txiter iter;
+
+    // Limit the number of attempts to add transactions to the block when it is
+    // close to full; this is just a simple heuristic to finish quickly if the
+    // mempool has a lot of entries.
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    while (mi != byAncestorScore.end() || !mapModifiedTx.empty())
+    {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != byAncestorScore.end() &&
+                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == byAncestorScore.end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            // Try to compare the mapTx entry to the mapModifiedTx entry
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                    CompareTxMemPoolEntryByAncestorFee()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx.
+                // Switch which transaction (package) to consider
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                // Increment mi for the next loop iteration.
+                ++mi;
             }
-            nTotalIn += tx.GetJoinSplitValueIn();
+        }
 
-            if (fMissingInputs) continue;
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        unsigned int packageSigOps = iter->GetSigOpCountWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+            packageSigOps = modit->nSigOpsWithAncestors;
+        }
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
+        // Skip free transactions once we're past the minimum block size.
+        // Everything else we might consider has a lower fee rate.
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize) {
+            break;
+        }
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+        bool fAdded = false;
+        if (TestPackage(packageSize, packageSigOps)) {
+            CTxMemPool::setEntries ancestors;
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+
+            std::vector<CTxMemPool::txiter> sortedEntries;
+            BOOST_FOREACH(CTxMemPool::txiter ancestor, ancestors) {
+                if (!inBlock.count(ancestor))
+                    sortedEntries.push_back(ancestor);
+            }
+            sortedEntries.push_back(iter);
+            std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+
+            if (TryAddPackage(sortedEntries, 0)) {
+                fAdded = true;
+                CTxMemPool::setEntries added(sortedEntries.begin(), sortedEntries.end());
+                BOOST_FOREACH(CTxMemPool::txiter it, added) {
+                    // Erase from the modified set, if present
+                    mapModifiedTx.erase(it);
+                }
+                // Update transactions that depend on each of these
+                UpdatePackagesForAdded(added, mapModifiedTx);
+            }
+        }
 
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+        if (!fAdded) {
+            if (fUsingModified) {
+                // Since we always look at the best entry in mapModifiedTx,
+                // we must erase failed entries so that we can consider the
+                // next best entry on the next loop iteration
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
 
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
+            ++nConsecutiveFailed;
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 1000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
+            continue;
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        // This transaction will make it in; reset the failed counter.
+        nConsecutiveFailed = 0;
+    }
+}
 
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
+void BlockAssembler::Resume(uint64_t nBlockSizeIn, unsigned int nBlockSigOpsIn, const CTxMemPool::setEntries& inBlockIn)
+{
+    nBlockSize = nBlockSizeIn;
+    nBlockSigOps = nBlockSigOpsIn;
+    nBlockTx = pblock->vtx.size() - 1;
+    nFees = 0;
+    inBlock = inBlockIn;
+}
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+class CompareTxIterByAncestorFee
+{
+public:
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b)
+    {
+        return CompareTxMemPoolEntryByAncestorFee()(*a, *b);
+    }
+};
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
+unsigned int BlockAssembler::addNewTxs(std::vector<CTxMemPool::txiter>& vNew)
+{
+    std::sort(vNew.begin(), vNew.end(), CompareTxIterByAncestorFee());
+
+    unsigned int nAdded = 0;
+    BOOST_FOREACH(CTxMemPool::txiter iter, vNew) {
+        // Could have come in as the ancestor of an earlier package
+        if (inBlock.count(iter))
+            continue;
+
+        CTxMemPool::setEntries ancestors;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+
+        // The mempool's ancestor totals include whatever is already in the
+        // block, so count the package by hand
+        std::vector<CTxMemPool::txiter> sortedEntries;
+        uint64_t packageSize = iter->GetTxSize();
+        CAmount packageFees = iter->GetModifiedFee();
+        unsigned int packageSigOps = iter->GetSigOpCount();
+        BOOST_FOREACH(CTxMemPool::txiter ancestor, ancestors) {
+            if (inBlock.count(ancestor))
                 continue;
+            sortedEntries.push_back(ancestor);
+            packageSize += ancestor->GetTxSize();
+            packageFees += ancestor->GetModifiedFee();
+            packageSigOps += ancestor->GetSigOpCount();
+        }
+        sortedEntries.push_back(iter);
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize)
+            continue;
+        if (!TestPackage(packageSize, packageSigOps))
+            continue;
 
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
+        std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+        if (TryAddPackage(sortedEntries, 0))
+            nAdded += sortedEntries.size();
+    }
+    return nAdded;
+}
 
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
+/** Read the block size settings, clamped to what makes sense */
+static void GetBlockSizeLimits(unsigned int& nBlockMaxSize, unsigned int& nBlockMinSize, unsigned int& nBlockPrioritySize)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
 
-            if (!view.HaveInputs(tx))
-                continue;
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+}
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+static int64_t GetLockTimeCutoff(const CBlock& block, const CBlockIndex* pindexPrev)
+{
+    return (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+           ? pindexPrev->GetMedianTimePast()
+           : block.GetBlockTime();
+}
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus()))
-                continue;
+void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
+{
+    pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
+}
 
-            UpdateCoins(tx, state, view, nHeight);
+/**
+ * Build a block template on top of the current tip. The transactions chosen
+ * are applied to view, and the template's size and sigop count (including
+ * the coinbase reserve) are returned through nBlockSizeOut and
+ * nBlockSigOpsOut. Requires cs_main and mempool.cs.
+ */
+static CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CCoinsViewCache& view,
+                                      uint64_t& nBlockSizeOut, unsigned int& nBlockSigOpsOut)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+    const CChainParams& chainparams = Params();
+    // Create new block
+    std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
+    if(!pblocktemplate.get())
+        return NULL;
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
+    // -regtest only: allow overriding block.nVersion with
+    // -blockversion=N to test forking scenarios
+    if (Params().MineBlocksOnDemand())
+        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
+    // Add dummy coinbase tx as first transaction
+    pblock->vtx.push_back(CTransaction());
+    pblocktemplate->vTxFees.push_back(-1); // updated at end
+    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+
+    unsigned int nBlockMaxSize, nBlockMinSize, nBlockPrioritySize;
+    GetBlockSizeLimits(nBlockMaxSize, nBlockMinSize, nBlockPrioritySize);
+
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    const int nHeight = pindexPrev->nHeight + 1;
+    pblock->nTime = GetAdjustedTime();
+
+    // Collect memory pool transactions into the block
+    BlockAssembler assembler(pblocktemplate.get(), view, nHeight, GetLockTimeCutoff(*pblock, pindexPrev),
+                             nBlockMaxSize, nBlockMinSize, nBlockPrioritySize);
+    assembler.addPriorityTxs();
+    assembler.addPackageTxs();
+
+    CAmount nFees = assembler.GetFees();
+    nLastBlockTx = assembler.GetBlockTx();
+    nLastBlockSize = assembler.GetBlockSize();
+    nBlockSizeOut = assembler.GetBlockSize();
+    nBlockSigOpsOut = assembler.GetBlockSigOps();
+    LogPrintf("CreateNewBlock(): total size %u\n", nLastBlockSize);
+
+    // Create coinbase tx
+    CMutableTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+    txNew.vout[0].nValue = GetBlockSubsidy(nHeight, chainparams.GetConsensus());
+
+    // Add fees
+    txNew.vout[0].nValue += nFees;
+    txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+
+    pblock->vtx[0] = txNew;
+    pblocktemplate->vTxFees[0] = -nFees;
+
+    // Randomise nonce
+    arith_uint256 nonce = UintToArith256(GetRandHash());
+    // Clear the top and bottom 16 bits (for local use as thread flags and counters)
+    nonce <<= 32;
+    nonce >>= 16;
+    pblock->nNonce = ArithToUint256(nonce);
+
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    pblock->hashReserved   = uint256();
+    UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
+    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, Params().GetConsensus());
+    pblock->nSolution.clear();
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+
+    CValidationState state;
+    if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
+        throw std::runtime_error("CreateNewBlock(): TestBlockValidity failed");
+
+    return pblocktemplate.release();
+}
+
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    LOCK2(cs_main, mempool.cs);
+    CCoinsViewCache view(pcoinsTip);
+    uint64_t nBlockSize;
+    unsigned int nBlockSigOps;
+    return CreateNewBlock(scriptPubKeyIn, view, nBlockSize, nBlockSigOps);
+}
+
+CBlockTemplateBuilder::CBlockTemplateBuilder() :
+    pindexPrev(NULL), nTransactionsUpdatedLast(0), nDeltasUpdatedLast(0), nLastEntryTime(0),
+    nBlockSize(0), nBlockSigOps(0),
+    nRebuilds(0), nUpdates(0), nLastRebuildTime(0), nLastUpdateTime(0)
+{
+}
+
+CBlockTemplateBuilder::~CBlockTemplateBuilder()
+{
+}
+
+bool CBlockTemplateBuilder::NeedsRebuild() const
+{
+    AssertLockHeld(cs_main);
+    return !pblocktemplate || pindexPrev != chainActive.Tip() ||
+           nDeltasUpdatedLast != mempool.GetDeltasUpdated();
+}
+
+bool CBlockTemplateBuilder::Rebuild(const CScript& scriptPubKeyIn)
+{
+    AssertLockHeld(cs_main);
+    int64_t nTimeStart = GetTimeMicros();
+
+    // Clear pindexPrev so future calls make a new block, despite any failures from here on
+    pblocktemplate.reset();
+    pview.reset();
+    setTemplateTx.clear();
+    pindexPrev = NULL;
+
+    LOCK(mempool.cs);
+    std::unique_ptr<CCoinsViewCache> pviewNew(new CCoinsViewCache(pcoinsTip));
+    std::unique_ptr<CBlockTemplate> pblocktemplateNew(CreateNewBlock(scriptPubKeyIn, *pviewNew, nBlockSize, nBlockSigOps));
+    if (!pblocktemplateNew)
+        return false;
+
+    // Everything in the pool now has been considered; later updates only
+    // look at what arrives from here on
+    nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+    nDeltasUpdatedLast = mempool.GetDeltasUpdated();
+    nLastEntryTime = GetTime();
+    for (size_t i = 1; i < pblocktemplateNew->block.vtx.size(); i++)
+        setTemplateTx.insert(pblocktemplateNew->block.vtx[i].GetHash());
+
+    pblocktemplate.swap(pblocktemplateNew);
+    pview.swap(pviewNew);
+    pindexPrev = chainActive.Tip();
+
+    nLastRebuildTime = GetTimeMicros() - nTimeStart;
+    nRebuilds++;
+    LogPrint("bench", "Block template rebuilt with %u txs: %.2fms\n", setTemplateTx.size(), nLastRebuildTime * 0.001);
+    return true;
+}
+
+unsigned int CBlockTemplateBuilder::Update()
+{
+    AssertLockHeld(cs_main);
+    assert(!NeedsRebuild());
+    int64_t nTimeStart = GetTimeMicros();
+
+    LOCK(mempool.cs);
+    nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+
+    // Entry times only have a resolution of a second, so look at the
+    // second of the last update again and skip what is already in.
+    std::vector<CTxMemPool::txiter> vNew;
+    int64_t nNewestEntryTime = nLastEntryTime;
+    typedef CTxMemPool::indexed_transaction_set::index<entry_time>::type time_index;
+    const time_index& byTime = mempool.mapTx.get<entry_time>();
+    for (time_index::reverse_iterator mi = byTime.rbegin(); mi != byTime.rend() && mi->GetTime() >= nLastEntryTime; ++mi) {
+        nNewestEntryTime = std::max(nNewestEntryTime, mi->GetTime());
+        if (!setTemplateTx.count(mi->GetTx().GetHash()))
+            vNew.push_back(mempool.mapTx.project<0>(std::prev(mi.base())));
+    }
+    nLastEntryTime = nNewestEntryTime;
+    if (vNew.empty())
+        return 0;
+
+    // The in-mempool ancestors of new transactions that made it into the
+    // template don't have to be added again
+    CTxMemPool::setEntries inBlock;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    BOOST_FOREACH(CTxMemPool::txiter it, vNew) {
+        CTxMemPool::setEntries ancestors;
+        mempool.CalculateMemPoolAncestors(*it, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        BOOST_FOREACH(CTxMemPool::txiter ancestor, ancestors) {
+            if (setTemplateTx.count(ancestor->GetTx().GetHash()))
+                inBlock.insert(ancestor);
         }
+    }
 
-        nLastBlockTx = nBlockTx;
+    unsigned int nBlockMaxSize, nBlockMinSize, nBlockPrioritySize;
+    GetBlockSizeLimits(nBlockMaxSize, nBlockMinSize, nBlockPrioritySize);
+
+    CBlock* pblock = &pblocktemplate->block;
+    size_t nTxBefore = pblock->vtx.size();
+    BlockAssembler assembler(pblocktemplate.get(), *pview, pindexPrev->nHeight + 1, GetLockTimeCutoff(*pblock, pindexPrev),
+                             nBlockMaxSize, nBlockMinSize, nBlockPrioritySize);
+    assembler.Resume(nBlockSize, nBlockSigOps, inBlock);
+    unsigned int nAdded = assembler.addNewTxs(vNew);
+    if (nAdded > 0) {
+        for (size_t i = nTxBefore; i < pblock->vtx.size(); i++)
+            setTemplateTx.insert(pblock->vtx[i].GetHash());
+
+        // Pay the new fees to the coinbase
+        CAmount nNewFees = assembler.GetFees();
+        CMutableTransaction txCoinbase(pblock->vtx[0]);
+        txCoinbase.vout[0].nValue += nNewFees;
+        pblock->vtx[0] = txCoinbase;
+        pblocktemplate->vTxFees[0] -= nNewFees;
+
+        nBlockSize = assembler.GetBlockSize();
+        nBlockSigOps = assembler.GetBlockSigOps();
+        nLastBlockTx = assembler.GetBlockTx();
         nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
-
-        // Create coinbase tx
-        CMutableTransaction txNew;
-        txNew.vin.resize(1);
-        txNew.vin[0].prevout.SetNull();
-        txNew.vout.resize(1);
-        txNew.vout[0].scriptPubKey = scriptPubKeyIn;
-        txNew.vout[0].nValue = GetBlockSubsidy(nHeight, chainparams.GetConsensus());
-
-        // Add fees
-        txNew.vout[0].nValue += nFees;
-        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
-
-        pblock->vtx[0] = txNew;
-        pblocktemplate->vTxFees[0] = -nFees;
-
-        // Randomise nonce
-        arith_uint256 nonce = UintToArith256(GetRandHash());
-        // Clear the top and bottom 16 bits (for local use as thread flags and counters)
-        nonce <<= 32;
-        nonce >>= 16;
-        pblock->nNonce = ArithToUint256(nonce);
-
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        pblock->hashReserved   = uint256();
-        UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
-        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, Params().GetConsensus());
-        pblock->nSolution.clear();
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
 
+        // Same check CreateNewBlock does; if the appended transactions broke
+        // the template, start over rather than hand out an invalid block
         CValidationState state;
-        if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
-            throw std::runtime_error("CreateNewBlock(): TestBlockValidity failed");
+        if (!TestBlockValidity(state, *pblock, chainActive.Tip(), false, false)) {
+            LogPrintf("%s: updated block template failed TestBlockValidity (%s), rebuilding\n", __func__, state.GetRejectReason());
+            CScript scriptPubKey = pblock->vtx[0].vout[0].scriptPubKey;
+            Rebuild(scriptPubKey);
+            return 0;
+        }
     }
 
-    return pblocktemplate.release();
+    nLastUpdateTime = GetTimeMicros() - nTimeStart;
+    nUpdates++;
+    LogPrint("bench", "Block template updated with %u of %u new txs: %.2fms\n", nAdded, vNew.size(), nLastUpdateTime * 0.001);
+    return nAdded;
 }
 
 #ifdef ENABLE_WALLET
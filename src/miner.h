@@ -10,9 +10,12 @@
 #include "primitives/block.h"
 
 #include <boost/optional.hpp>
+#include <memory>
+#include <set>
 #include <stdint.h>
 
 class CBlockIndex;
+class CCoinsViewCache;
 class CScript;
 #ifdef ENABLE_WALLET
 class CReserveKey;
@@ -37,6 +40,59 @@ boost::optional<CScript> GetMinerScriptPubKey();
 CBlockTemplate* CreateNewBlockWithKey();
 #endif
 
+/**
+ * Keeps a block template on the current tip up to date with the mempool.
+ * A new tip needs a full rebuild; otherwise transactions that entered the
+ * mempool since the last update are appended to the existing template,
+ * together with any in-mempool ancestors it lacks, for as long as they fit.
+ * A prioritisetransaction call can reorder what is already in the pool, so
+ * it also forces a full rebuild. Callers must hold cs_main.
+ */
+class CBlockTemplateBuilder
+{
+private:
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    //! Coins view with the template's transactions applied
+    std::unique_ptr<CCoinsViewCache> pview;
+    std::set<uint256> setTemplateTx;
+    const CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    unsigned int nDeltasUpdatedLast;
+    //! Mempool entries older than this have already been considered
+    int64_t nLastEntryTime;
+    uint64_t nBlockSize;
+    unsigned int nBlockSigOps;
+
+    uint64_t nRebuilds;
+    uint64_t nUpdates;
+    int64_t nLastRebuildTime; //!< microseconds
+    int64_t nLastUpdateTime; //!< microseconds
+
+public:
+    CBlockTemplateBuilder();
+    ~CBlockTemplateBuilder();
+
+    /** Whether there is no template yet, it isn't on the current tip, or
+      * mempool priorities have changed since it was built */
+    bool NeedsRebuild() const;
+    /** Build a new template on the current tip, paying to scriptPubKeyIn */
+    bool Rebuild(const CScript& scriptPubKeyIn);
+    /** Add transactions that entered the mempool since the last rebuild or
+      * update; returns the number of transactions added. If the updated
+      * template fails TestBlockValidity it is rebuilt from scratch, and
+      * GetTemplate() returns NULL if that fails too. */
+    unsigned int Update();
+
+    CBlockTemplate* GetTemplate() const { return pblocktemplate.get(); }
+    const CBlockIndex* GetPrevBlock() const { return pindexPrev; }
+    unsigned int GetTransactionsUpdated() const { return nTransactionsUpdatedLast; }
+
+    uint64_t GetRebuildCount() const { return nRebuilds; }
+    uint64_t GetUpdateCount() const { return nUpdates; }
+    int64_t GetLastRebuildTime() const { return nLastRebuildTime; }
+    int64_t GetLastUpdateTime() const { return nLastUpdateTime; }
+};
+
 #ifdef ENABLE_MINING
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
@@ -24,9 +24,15 @@
 #include <fcntl.h>
 #endif
 
+#include <algorithm>
+
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 // Dump addresses to peers.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
 
@@ -66,12 +72,13 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+int nMessageHandlerThreads = 1;
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedMessage> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -91,10 +98,63 @@ CCriticalSection cs_nLastNodeId;
 static CSemaphore *semOutbound = NULL;
 boost::condition_variable messageHandlerCondition;
 
+// The message handler threads share rounds over the nodes: each round is a
+// snapshot of vNodes, holding a reference to each node, that the threads take
+// nodes from one at a time. A node is only worked on by one thread at a time,
+// so its messages are processed in order.
+static boost::mutex mutexMsgProc;
+static std::vector<CNode*> vNodesProcess;
+static size_t nNodesProcessNext = 0;
+static uint64_t nProcessRound = 0;
+static CNode* pnodeTrickle = NULL;
+// Whether a node was left with messages ready to process, so the next round
+// should start without waiting
+static bool fProcessMore = false;
+
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+#ifdef USE_EPOLL
+/**
+ * The epoll instance the listening sockets and the sockets of all nodes are
+ * registered with. Listening sockets are level-triggered and carry their
+ * index in vhListenSocket; node sockets are edge-triggered and carry the
+ * CNode, which is only deleted by the socket handler thread after its socket
+ * has been removed from the instance.
+ */
+static int hEpoll = -1;
+
+/** Maximum number of events handled per epoll_wait() */
+static const int MAX_EPOLL_EVENTS = 1024;
+/** Maximum number of connections accepted on a listening socket per pass */
+static const int MAX_ACCEPTS_PER_PASS = 64;
+/** Maximum number of full receive buffers read from one socket per pass */
+static const int MAX_RECVS_PER_PASS = 4;
+
+static uint32_t PollEvents(bool fSend)
+{
+    return EPOLLIN | EPOLLRDHUP | EPOLLET | (fSend ? EPOLLOUT : 0);
+}
+
+/** Start watching the socket of a node that was just added to vNodes. */
+static void PollAddNode(CNode* pnode)
+{
+    LOCK(pnode->cs_vSend);
+    if (pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.data.u64 = 0;
+    event.data.ptr = pnode;
+    pnode->fPollSend = !pnode->vSendMsg.empty();
+    event.events = PollEvents(pnode->fPollSend);
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(WSAGetLastError()));
+        pnode->CloseSocketDisconnect();
+    }
+}
+#endif
+
 void AddOneShot(const std::string& strDest)
 {
     LOCK(cs_vOneShots);
@@ -388,6 +448,9 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
+#ifdef USE_EPOLL
+            PollAddNode(pnode);
+#endif
         }
 
         pnode->nTimeConnected = GetTime();
@@ -408,6 +471,9 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting peer=%d\n", id);
+#ifdef USE_EPOLL
+        epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, NULL);
+#endif
         CloseSocket(hSocket);
     }
 
@@ -615,9 +681,126 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_mapProcessTimePerMsgCmd);
+        stats.mapProcessTimePerMsgCmd = mapProcessTimePerMsgCmd;
+    }
 }
 #undef X
 
+void CMessageTimeStats::Add(int64_t nMicros)
+{
+    nCount++;
+    nTotalMicros += nMicros;
+    nMaxMicros = std::max(nMaxMicros, nMicros);
+    int nBucket = 0;
+    for (int64_t nLimit = 10; nBucket < HISTOGRAM_BUCKETS - 1 && nMicros >= nLimit; nLimit *= 10)
+        nBucket++;
+    vHistogram[nBucket]++;
+}
+
+void CNode::RecordProcessTime(const std::string& strCommand, int64_t nMicros)
+{
+    const std::vector<std::string>& vCommands = getAllNetMessageTypes();
+    bool fKnown = std::find(vCommands.begin(), vCommands.end(), strCommand) != vCommands.end();
+    LOCK(cs_mapProcessTimePerMsgCmd);
+    mapProcessTimePerMsgCmd[fKnown ? strCommand : NET_MESSAGE_COMMAND_OTHER].Add(nMicros);
+}
+
+/** Buffers are pooled by capacity, in classes of powers of two */
+static const int MIN_POOLED_BUFFER_BITS = 12;
+static const int MAX_POOLED_BUFFER_BITS = 22;
+static const size_t MIN_POOLED_BUFFER_SIZE = (size_t)1 << MIN_POOLED_BUFFER_BITS;
+/** Total capacity the pool may hold on to */
+static const size_t MAX_POOLED_BUFFER_BYTES = 16 * 1024 * 1024;
+
+static CCriticalSection cs_vBufferPool;
+// vBufferPool[n] holds buffers with a capacity of at least 2^n bytes, and less than 2^(n+1)
+static std::vector<CSerializeData> vBufferPool[MAX_POOLED_BUFFER_BITS + 1];
+static size_t nBufferPoolBytes = 0;
+
+static int FloorLog2(size_t n)
+{
+    int nBits = 0;
+    while (n >>= 1)
+        nBits++;
+    return nBits;
+}
+
+bool TakeMessageBuffer(CSerializeData& data, size_t nSize)
+{
+    int nClass = FloorLog2(std::max(nSize, MIN_POOLED_BUFFER_SIZE) - 1) + 1;
+    if (nClass > MAX_POOLED_BUFFER_BITS)
+        return false;
+
+    LOCK(cs_vBufferPool);
+    for (int n = nClass; n <= std::min(nClass + 1, MAX_POOLED_BUFFER_BITS); n++) {
+        if (vBufferPool[n].empty())
+            continue;
+        nBufferPoolBytes -= vBufferPool[n].back().capacity();
+        data.swap(vBufferPool[n].back());
+        vBufferPool[n].pop_back();
+        return true;
+    }
+    return false;
+}
+
+void GiveMessageBuffer(CSerializeData& data)
+{
+    // Only network messages go through the pool, so the memory is not wiped
+    // before it is reused; it still is once it is freed.
+    size_t nCapacity = data.capacity();
+    if (nCapacity >= MIN_POOLED_BUFFER_SIZE && FloorLog2(nCapacity) <= MAX_POOLED_BUFFER_BITS) {
+        LOCK(cs_vBufferPool);
+        if (nBufferPoolBytes + nCapacity <= MAX_POOLED_BUFFER_BYTES) {
+            data.clear();
+            nBufferPoolBytes += nCapacity;
+            vBufferPool[FloorLog2(nCapacity)].push_back(CSerializeData());
+            vBufferPool[FloorLog2(nCapacity)].back().swap(data);
+            return;
+        }
+    }
+    CSerializeData().swap(data);
+}
+
+static void ReleaseSharedMessage(CSerializeData* pdata)
+{
+    GiveMessageBuffer(*pdata);
+    delete pdata;
+}
+
+void BeginSharedMessage(CDataStream& ss, const char* pszCommand)
+{
+    assert(ss.size() == 0);
+    ss << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+}
+
+CSharedMessage EndSharedMessage(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    WriteLE32((uint8_t*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    // Small messages are copied out, so the stream keeps its buffer for the
+    // next one; large ones take the buffer along with them.
+    CSerializeData* pdata = new CSerializeData();
+    if (ss.size() < MIN_POOLED_BUFFER_SIZE) {
+        pdata->assign(ss.begin(), ss.end());
+        ss.clear();
+    } else {
+        ss.Swap(*pdata);
+    }
+    return CSharedMessage(pdata, ReleaseSharedMessage);
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -657,6 +840,29 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+// requires LOCK(cs_vRecvMsg)
+char* CNode::GetRecvPayloadSpace(unsigned int& nSpace)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    // The end of a payload is read along with whatever follows it
+    if (msg.hdr.nMessageSize - msg.nDataPos < MIN_POOLED_BUFFER_SIZE)
+        return NULL;
+    return msg.ReserveData(nSpace);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::ReceivedPayloadBytes(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.nDataPos += nBytes;
+    if (msg.complete()) {
+        msg.nTime = GetTimeMicros();
+        messageHandlerCondition.notify_one();
+    }
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -682,6 +888,14 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     if (hdr.nMessageSize > MAX_SIZE)
             return -1;
 
+    // Use a buffer from the pool for the payload if there is one to spare,
+    // but do not allocate the whole size a peer claims up front
+    if (hdr.nMessageSize >= MIN_POOLED_BUFFER_SIZE) {
+        CSerializeData data;
+        if (TakeMessageBuffer(data, hdr.nMessageSize))
+            vRecv.Swap(data);
+    }
+
     // switch state to reading message data
     in_data = true;
 
@@ -689,19 +903,33 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 }
 
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
+{
+    unsigned int nCopy = nBytes;
+    memcpy(ReserveData(nCopy), pch, nCopy);
+    nDataPos += nCopy;
+
+    return nCopy;
+}
+
+char* CNetMessage::ReserveData(unsigned int& nBytes)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
+    assert(nRemaining > 0);
+    nBytes = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
+    if (vRecv.size() < nDataPos + nBytes) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nBytes + 256 * 1024));
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    return &vRecv[nDataPos];
+}
 
-    return nCopy;
+void CNetMessage::ReleaseBuffer()
+{
+    CSerializeData data;
+    vRecv.Swap(data);
+    GiveMessageBuffer(data);
 }
 
 
@@ -715,10 +943,10 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSharedMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -754,6 +982,95 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+#ifdef USE_EPOLL
+    // Only wait for the socket to become writable while there is something
+    // left to send. Until the node is registered this is left to PollAddNode.
+    bool fPollSend = !pnode->vSendMsg.empty();
+    if (fPollSend != pnode->fPollSend && pnode->hSocket != INVALID_SOCKET) {
+        struct epoll_event event;
+        event.data.u64 = 0;
+        event.data.ptr = pnode;
+        event.events = PollEvents(fPollSend);
+        if (epoll_ctl(hEpoll, EPOLL_CTL_MOD, pnode->hSocket, &event) == 0)
+            pnode->fPollSend = fPollSend;
+    }
+#endif
+}
+
+/**
+ * Receive what is available on the socket of a node, up to one buffer.
+ * Returns whether the buffer was filled, so more may be waiting. The caller
+ * must hold cs_vRecvMsg.
+ */
+static bool SocketRecvData(CNode *pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    unsigned int nSpace = sizeof(pchBuf);
+    // The payload of a large message is read straight into place, rather
+    // than copied there from pchBuf
+    char* pchPayload = pnode->GetRecvPayloadSpace(nSpace);
+    int nBytes = recv(pnode->hSocket, pchPayload ? pchPayload : pchBuf, nSpace, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (pchPayload)
+            pnode->ReceivedPayloadBytes(nBytes);
+        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return (unsigned int)nBytes == nSpace;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return 0;
+}
+
+/** Disconnect a node that has been silent, or has not answered a ping, for too long. */
+static void InactivityCheck(CNode *pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
 }
 
 static list<CNode*> vNodesDisconnected;
@@ -912,7 +1229,8 @@ static bool AttemptToEvictConnection(bool fPreferNewConnection) {
     return true;
 }
 
-void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
+// Returns false if there was no connection waiting to be accepted.
+bool CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
     struct sockaddr_storage sockaddr;
     socklen_t len = sizeof(sockaddr);
     SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
@@ -937,21 +1255,21 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
         int nErr = WSAGetLastError();
         if (nErr != WSAEWOULDBLOCK)
             LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-        return;
+        return false;
     }
 
     if (!IsSelectableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
-        return;
+        return true;
     }
 
     if (CNode::IsBanned(addr) && !whitelisted)
     {
         LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
         CloseSocket(hSocket);
-        return;
+        return true;
     }
 
     if (nInbound >= nMaxInbound)
@@ -960,7 +1278,7 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
             // No connection to evict, disconnect the new connection
             LogPrint("net", "failed to find an eviction candidate - connection dropped (full)\n");
             CloseSocket(hSocket);
-            return;
+            return true;
         }
     }
 
@@ -982,77 +1300,225 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
+#ifdef USE_EPOLL
+        PollAddNode(pnode);
+#endif
     }
+    return true;
 }
 
-void CConnman::ThreadSocketHandler()
+void CConnman::DisconnectNodes(unsigned int& nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
+    //
+    // Disconnect nodes
+    //
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+#ifdef USE_EPOLL
+void CConnman::ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastDisconnect = 0;
+    int64_t nLastInactivityCheck = 0;
+    // Nodes whose socket may have unread data, each holding a reference
+    vector<CNode*> vNodesRecv;
+    bool fRecvBacklog = false;
+    vector<struct epoll_event> vEvents(MAX_EPOLL_EVENTS);
+    while (true)
+    {
+        // Disconnect nodes as often as the select() loop used to, not on
+        // every pass
+        int64_t nNow = GetTimeMillis();
+        if (nNow - nLastDisconnect >= 50) {
+            DisconnectNodes(nPrevNodeCount);
+            nLastDisconnect = nNow;
+        }
+
+        //
+        // Wait for sockets to become ready, or for a node that had to stop
+        // reading to be allowed to read again. Nodes that stopped only to
+        // let others have a turn are served again at once.
+        //
+        int nEvents = epoll_wait(hEpoll, vEvents.data(), vEvents.size(), fRecvBacklog ? 0 : 50);
+        boost::this_thread::interruption_point();
+        if (nEvents < 0) {
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEINTR) {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
+        vector<CNode*> vNodesReady;
+        for (int i = 0; i < nEvents; i++)
+        {
+            const struct epoll_event& event = vEvents[i];
+
+            //
+            // Accept new connections
+            //
+            if (event.data.u64 < vhListenSocket.size()) {
+                const ListenSocket& hListenSocket = vhListenSocket[event.data.u64];
+                for (int n = 0; n < MAX_ACCEPTS_PER_PASS && AcceptConnection(hListenSocket); n++) {}
+                continue;
+            }
+
+            // Errors and hangups are found by reading from the socket
+            CNode* pnode = static_cast<CNode*>(event.data.ptr);
+            if (!pnode->fPollRecv) {
+                pnode->fPollRecv = true;
+                vNodesReady.push_back(pnode);
+            }
+
+            //
+            // Send
+            //
+            if (event.events & EPOLLOUT) {
+                LOCK(pnode->cs_vSend);
+                if (pnode->hSocket != INVALID_SOCKET && !pnode->vSendMsg.empty())
+                    SocketSendData(pnode);
+            }
+        }
+        if (!vNodesReady.empty()) {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesReady)
+                pnode->AddRef();
+            vNodesRecv.insert(vNodesRecv.end(), vNodesReady.begin(), vNodesReady.end());
+        }
+
+        //
+        // Receive
+        //
+        fRecvBacklog = false;
+        vector<CNode*> vNodesDone;
+        for (size_t i = 0; i < vNodesRecv.size(); )
+        {
+            boost::this_thread::interruption_point();
+
+            CNode* pnode = vNodesRecv[i];
+            bool fDone = pnode->hSocket == INVALID_SOCKET;
+            if (!fDone) {
+                // As in the select() loop, drain the send buffer before
+                // receiving more, and don't receive while a complete message
+                // is waiting and the receive buffer is full.
+                bool fHold = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    fHold = lockSend && !pnode->vSendMsg.empty();
+                }
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (!lockRecv) {
+                    fRecvBacklog = true;
+                } else if (!fHold && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                                      pnode->GetTotalRecvSize() <= ReceiveFloodSize())) {
+                    // The socket is drained once a read does not fill the
+                    // buffer; any data arriving after that is a new edge.
+                    fDone = true;
+                    for (int n = 0; n < MAX_RECVS_PER_PASS && pnode->hSocket != INVALID_SOCKET; n++) {
+                        if (!SocketRecvData(pnode))
+                            break;
+                        if (n == MAX_RECVS_PER_PASS - 1) {
+                            fDone = false;
+                            fRecvBacklog = true;
+                        }
                     }
                 }
             }
+            if (fDone) {
+                pnode->fPollRecv = false;
+                vNodesDone.push_back(pnode);
+                vNodesRecv[i] = vNodesRecv.back();
+                vNodesRecv.pop_back();
+            } else {
+                i++;
+            }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+        if (!vNodesDone.empty()) {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesDone)
+                pnode->Release();
         }
 
+        //
+        // Inactivity checking
+        //
+        if (nNow - nLastInactivityCheck >= 1000) {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (pnode->hSocket != INVALID_SOCKET)
+                    InactivityCheck(pnode);
+            nLastInactivityCheck = nNow;
+        }
+    }
+}
+#else
+void CConnman::ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
+
         //
         // Find which sockets have data to receive
         //
@@ -1169,39 +1635,7 @@ void CConnman::ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1219,30 +1653,7 @@ void CConnman::ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1251,6 +1662,7 @@ void CConnman::ThreadSocketHandler()
         }
     }
 }
+#endif
 
 
 void CConnman::ThreadDNSAddressSeed()
@@ -1547,71 +1959,105 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void CConnman::ThreadMessageHandler()
+CNode* CConnman::NextNodeToProcess(bool& fSendTrickle)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
-
-    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    boost::unique_lock<boost::mutex> lock(mutexMsgProc);
     while (true)
     {
-        vector<CNode*> vNodesCopy;
+        while (nNodesProcessNext < vNodesProcess.size()) {
+            CNode* pnode = vNodesProcess[nNodesProcessNext++];
+            // A node still being worked on from an earlier round waits for the next one
+            if (pnode->fProcessing || pnode->fDisconnect) {
+                LOCK(cs_vNodes);
+                pnode->Release();
+                continue;
+            }
+            pnode->fProcessing = true;
+            fSendTrickle = (pnode == pnodeTrickle);
+            return pnode;
+        }
+
+        // Wait before starting the next round, unless a node has messages
+        // ready, and let whoever wakes first start it
+        uint64_t nRound = nProcessRound;
+        if (!fProcessMore) {
+            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+            if (nProcessRound != nRound)
+                continue;
+        }
+
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            vNodesProcess = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesProcess) {
                 pnode->AddRef();
             }
         }
+        nNodesProcessNext = 0;
+        nProcessRound++;
+        fProcessMore = false;
 
         // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+        pnodeTrickle = NULL;
+        if (!vNodesProcess.empty())
+            pnodeTrickle = vNodesProcess[GetRand(vNodesProcess.size())];
+        messageHandlerCondition.notify_all();
+    }
+}
+
+void CConnman::FinishNodeProcessing(CNode* pnode, bool fMoreWork)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+        pnode->fProcessing = false;
+        if (fMoreWork) {
+            fProcessMore = true;
+            messageHandlerCondition.notify_one();
+        }
+    }
+    {
+        LOCK(cs_vNodes);
+        pnode->Release();
+    }
+}
 
-        bool fSleep = true;
+void CConnman::ThreadMessageHandler()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        bool fSendTrickle = false;
+        CNode* pnode = NextNodeToProcess(fSendTrickle);
+        bool fMoreWork = false;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Receive messages
         {
-            if (pnode->fDisconnect)
-                continue;
-
-            // Receive messages
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
+                if (!g_signals.ProcessMessages(pnode))
+                    pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize())
+                if (pnode->nSendSize < SendBufferSize())
+                {
+                    if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
+                        fMoreWork = true;
                     }
                 }
             }
-            boost::this_thread::interruption_point();
-
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
-            }
-            boost::this_thread::interruption_point();
         }
 
+        // Send messages
+        if (!boost::this_thread::interruption_requested())
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
+                g_signals.SendMessages(pnode, fSendTrickle || pnode->fWhitelisted);
         }
 
-        if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        FinishNodeProcessing(pnode, fMoreWork);
+        boost::this_thread::interruption_point();
     }
 }
 
@@ -1818,6 +2264,25 @@ bool CConnman::Start(boost::thread_group& threadGroup, std::string& strNodeError
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+#ifdef USE_EPOLL
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll < 0) {
+        strNodeError = strprintf("Error: Couldn't create the epoll instance for the network sockets (epoll_create1 returned error %s)", NetworkErrorString(WSAGetLastError()));
+        LogPrintf("%s\n", strNodeError);
+        return false;
+    }
+    for (size_t i = 0; i < vhListenSocket.size(); i++) {
+        struct epoll_event event;
+        event.data.u64 = i;
+        event.events = EPOLLIN;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, vhListenSocket[i].socket, &event) != 0) {
+            strNodeError = strprintf("Error: Couldn't watch a socket for incoming connections (epoll_ctl returned error %s)", NetworkErrorString(WSAGetLastError()));
+            LogPrintf("%s\n", strNodeError);
+            return false;
+        }
+    }
+#endif
+
     //
     // Start threads
     //
@@ -1837,7 +2302,9 @@ bool CConnman::Start(boost::thread_group& threadGroup, std::string& strNodeError
     threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "opencon", boost::function<void()>(boost::bind(&CConnman::ThreadOpenConnections, this))));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&CConnman::ThreadMessageHandler, this))));
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&CConnman::ThreadMessageHandler, this))));
 
     return true;
 }
@@ -1887,6 +2354,12 @@ void CConnman::Stop()
                 LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
 
     // clean up some globals (to help leak detection)
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+        vNodesProcess.clear();
+        nNodesProcessNext = 0;
+        pnodeTrickle = NULL;
+    }
     BOOST_FOREACH(CNode *pnode, vNodes)
         delete pnode;
     BOOST_FOREACH(CNode *pnode, vNodesDisconnected)
@@ -1894,6 +2367,12 @@ void CConnman::Stop()
     vNodes.clear();
     vNodesDisconnected.clear();
     vhListenSocket.clear();
+#ifdef USE_EPOLL
+    if (hEpoll >= 0) {
+        close(hEpoll);
+        hEpoll = -1;
+    }
+#endif
     delete semOutbound;
     semOutbound = NULL;
     delete pnodeLocalHost;
@@ -1925,7 +2404,7 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
         }
 
         // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, MakeSharedMessage("tx", ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -2033,9 +2512,12 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    fPollSend = false;
+    fPollRecv = false;
     hashContinue = uint256();
     nStartingHeight = -1;
     fGetAddr = false;
+    nLastAddrRebroadcast = 0;
     fRelayTxes = false;
     fSentAddr = false;
     pfilter = new CBloomFilter();
@@ -2043,6 +2525,7 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nPingUsecStart = 0;
     nPingUsecTime = 0;
     fPingQueued = false;
+    fProcessing = false;
     nMinPingUsecTime = std::numeric_limits<int64_t>::max();
 
     {
@@ -2142,30 +2625,42 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    CSharedMessage msg = EndSharedMessage(ssSend);
+    if (msg->size() >= MIN_POOLED_BUFFER_SIZE) {
+        // The message took the buffer of ssSend along; replace it from the pool
+        CSerializeData data;
+        if (TakeMessageBuffer(data, MIN_POOLED_BUFFER_SIZE))
+            ssSend.Swap(data);
+    }
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    LogPrint("net", "(%d bytes) peer=%d\n", msg->size() - CMessageHeader::HEADER_SIZE, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
+void CNode::PushSharedMessage(const CSharedMessage& msg)
+{
+    LOCK(cs_vSend);
+    CMessageHeader hdr(Params().MessageStart());
+    CDataStream(msg->begin(), msg->begin() + CMessageHeader::HEADER_SIZE, SER_NETWORK, PROTOCOL_VERSION) >> hdr;
+    LogPrint("net", "sending: %s (%d bytes) peer=%d\n", SanitizeString(hdr.GetCommand()), hdr.nMessageSize, id);
+
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
 void DumpBanlist()
 {
     int64_t nStart = GetTimeMillis();
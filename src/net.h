@@ -22,7 +22,9 @@
 #include "utilstrencodings.h"
 
 #include <deque>
+#include <map>
 #include <stdint.h>
+#include <string.h>
 #include <memory>
 
 #ifndef WIN32
@@ -42,6 +44,13 @@ namespace boost {
     class thread_group;
 } // namespace boost
 
+/**
+ * A complete message, header and payload, ready to go out on the wire. It is
+ * never changed once made, so one message can be queued for any number of
+ * peers without copying it.
+ */
+typedef std::shared_ptr<const CSerializeData> CSharedMessage;
+
 /** Time between pings automatically sent out for latency probing and keepalive (in seconds). */
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
@@ -62,6 +71,10 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
+/** Maximum number of threads processing peer messages */
+static const int MAX_MSGHANDLER_THREADS = 8;
+/** -msghandlers default (number of threads processing peer messages, 0 = auto) */
+static const int DEFAULT_MSGHANDLER_THREADS = 0;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -94,7 +107,10 @@ private:
     void ProcessOneShot();
     void ThreadOpenConnections();
     void ThreadMessageHandler();
-    void AcceptConnection(const ListenSocket& hListenSocket);
+    CNode* NextNodeToProcess(bool& fSendTrickle);
+    void FinishNodeProcessing(CNode* pnode, bool fMoreWork);
+    bool AcceptConnection(const ListenSocket& hListenSocket);
+    void DisconnectNodes(unsigned int& nPrevNodeCount);
     void ThreadSocketHandler();
     void ThreadDNSAddressSeed();
 };
@@ -170,10 +186,12 @@ extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
+/** Number of threads processing peer messages */
+extern int nMessageHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -195,6 +213,33 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/**
+ * How long the messages of one command took to process, as a histogram of
+ * powers of ten: under 10us, under 100us, ... under 1s, and 1s or more.
+ */
+class CMessageTimeStats
+{
+public:
+    static const int HISTOGRAM_BUCKETS = 7;
+
+    uint64_t nCount;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    uint64_t vHistogram[HISTOGRAM_BUCKETS];
+
+    CMessageTimeStats() : nCount(0), nTotalMicros(0), nMaxMicros(0)
+    {
+        memset(vHistogram, 0, sizeof(vHistogram));
+    }
+
+    void Add(int64_t nMicros);
+};
+
+typedef std::map<std::string, CMessageTimeStats> mapMsgCmdTime;
+
+/** The key under which the times of commands we do not know are counted */
+#define NET_MESSAGE_COMMAND_OTHER "*other*"
+
 class CNodeStats
 {
 public:
@@ -215,11 +260,38 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    mapMsgCmdTime mapProcessTimePerMsgCmd;
 };
 
 
 
 
+/**
+ * Message buffers are pooled: a buffer that is no longer needed goes back to
+ * the pool with its capacity, instead of being wiped and freed, and is handed
+ * out again for a later message of about the same size.
+ */
+
+/** Swap a pooled buffer with room for at least nSize bytes into data, if the pool has one */
+bool TakeMessageBuffer(CSerializeData& data, size_t nSize);
+/** Give the storage of data back to the pool (or free it), leaving data empty */
+void GiveMessageBuffer(CSerializeData& data);
+
+/** Start a message in ss, which must be empty, with a header for pszCommand */
+void BeginSharedMessage(CDataStream& ss, const char* pszCommand);
+/** Fill in the header of the message in ss, and move it into a shared message */
+CSharedMessage EndSharedMessage(CDataStream& ss);
+
+/** Serialize a message once, to be sent to any number of peers */
+template<typename T>
+CSharedMessage MakeSharedMessage(const char* pszCommand, const T& payload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    BeginSharedMessage(ss, pszCommand);
+    ss << payload;
+    return EndSharedMessage(ss);
+}
+
 class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
@@ -256,6 +328,12 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    // Make room in vRecv for up to nBytes (lowered to what fits) more of the payload, and return where they go
+    char* ReserveData(unsigned int& nBytes);
+
+    // Give the payload buffer back to the pool once the message has been processed
+    void ReleaseBuffer();
 };
 
 /** Information about a peer */
@@ -269,8 +347,10 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedMessage> vSendMsg;
     CCriticalSection cs_vSend;
+    bool fPollSend; // whether the socket is watched for writability (guarded by cs_vSend)
+    bool fPollRecv; // whether the socket may have unread data (socket handler thread only)
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
@@ -309,6 +389,7 @@ public:
     CBloomFilter* pfilter;
     int nRefCount;
     NodeId id;
+    bool fProcessing; // whether a message handler thread is working on this node (guarded by mutexMsgProc in net.cpp)
 protected:
 
     // Denial-of-service detection/prevention
@@ -332,8 +413,10 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    CCriticalSection cs_vAddrToSend; // guards vAddrToSend and addrKnown
     bool fGetAddr;
-    std::set<uint256> setKnown;
+    int64_t nLastAddrRebroadcast; // guarded by cs_main
+    std::set<uint256> setKnown; // guarded by cs_mapAlerts
 
     // inventory based relay
     mruset<CInv> setInventoryKnown;
@@ -354,6 +437,10 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
+    // Time spent processing each command received from this node.
+    mapMsgCmdTime mapProcessTimePerMsgCmd;
+    CCriticalSection cs_mapProcessTimePerMsgCmd;
+
     CNode(SOCKET hSocketIn, const CAddress &addrIn, const std::string &addrNameIn = "", bool fInboundIn = false);
     ~CNode();
 
@@ -391,6 +478,15 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    // Where the socket can be read straight into the payload of the message
+    // being received, with room for nSpace bytes, or NULL if it cannot
+    char* GetRecvPayloadSpace(unsigned int& nSpace);
+
+    // requires LOCK(cs_vRecvMsg)
+    // Account for nBytes read into the space returned by GetRecvPayloadSpace
+    void ReceivedPayloadBytes(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -414,6 +510,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -422,6 +519,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -462,6 +560,9 @@ public:
 
     void PushVersion();
 
+    // Queue a message that may also be queued for other peers
+    void PushSharedMessage(const CSharedMessage& msg);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -656,6 +757,9 @@ public:
 
     void copyStats(CNodeStats &stats);
 
+    // Record how long a message took to process; commands we do not know are counted together
+    void RecordProcessTime(const std::string& strCommand, int64_t nMicros);
+
     static bool IsWhitelistedRange(const CNetAddr &ip);
     static void AddWhitelistedRange(const CSubNet &subnet);
 
@@ -9,6 +9,9 @@
 
 #include <boost/filesystem.hpp>
 
+#include <leveldb/cache.h>
+#include <leveldb/filter_policy.h>
+
 using namespace std;
 
 static boost::filesystem::path emptyPath;
@@ -36,16 +39,34 @@ PaymentDisclosureDB::PaymentDisclosureDB(const boost::filesystem::path& dbPath)
     }
 
     TryCreateDirectory(path);
+    // A 16 MiB budget with this database's default profile matches LevelDB's
+    // own defaults (8 MiB block cache, 4 MiB write buffer, no Bloom filter)
+    CLevelDBProfile profile = GetLevelDBProfile("paymentdisclosure");
+    const size_t nCacheSize = 1 << 24;
+    options = GetLevelDBOptions(profile, nCacheSize);
+    options.paranoid_checks = false;
     options.create_if_missing = true;
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &db);
     HandleError(status); // throws exception
     LogPrintf("PaymentDisclosure: Opened LevelDB successfully\n");
+
+    CLevelDBInfo info;
+    info.strName = "paymentdisclosure";
+    info.strPath = path.string();
+    info.profile = profile;
+    info.nCacheSize = nCacheSize;
+    info.pdb = db;
+    info.pcounters = &counters;
+    RegisterLevelDB(info);
 }
 
 PaymentDisclosureDB::~PaymentDisclosureDB() {
     if (db != nullptr) {
+        UnregisterLevelDB(db);
         delete db;
     }
+    delete options.filter_policy;
+    delete options.block_cache;
 }
 
 bool PaymentDisclosureDB::Put(const PaymentDisclosureKey& key, const PaymentDisclosureInfo& info)
@@ -63,6 +84,8 @@ bool PaymentDisclosureDB::Put(const PaymentDisclosureKey& key, const PaymentDisc
 
     leveldb::Status status = db->Put(writeOptions, key.ToString(), slice);
     HandleError(status);
+    counters.nBatches++;
+    counters.nBytesWritten += key.ToString().size() + slice.size();
     return true;
 }
 
@@ -75,6 +98,7 @@ bool PaymentDisclosureDB::Get(const PaymentDisclosureKey& key, PaymentDisclosure
     std::lock_guard<std::mutex> guard(lock_);
 
     std::string strValue;
+    counters.nReads++;
     leveldb::Status status = db->Get(readOptions, key.ToString(), &strValue);
     if (!status.ok()) {
         if (status.IsNotFound())
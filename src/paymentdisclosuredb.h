@@ -5,6 +5,7 @@
 #ifndef ZCASH_PAYMENTDISCLOSUREDB_H
 #define ZCASH_PAYMENTDISCLOSUREDB_H
 
+#include "leveldbwrapper.h"
 #include "paymentdisclosure.h"
 
 #include <cstdint>
@@ -26,6 +27,7 @@ protected:
     leveldb::ReadOptions readOptions;
     leveldb::WriteOptions writeOptions;
     mutable std::mutex lock_;
+    CLevelDBCounters counters;
 
 public:
     static std::shared_ptr<PaymentDisclosureDB> sharedInstance();
@@ -87,6 +87,10 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    // Set when hashMerkleRoot has been verified against vtx (and the tree
+    // found free of duplicate-transaction mutation), so CheckBlock need not
+    // rebuild the tree again. Must be cleared if vtx is modified.
+    mutable bool fMerkleChecked;
 
     CBlock()
     {
@@ -112,6 +116,7 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         vMerkleTree.clear();
+        fMerkleChecked = false;
     }
 
     CBlockHeader GetBlockHeader() const
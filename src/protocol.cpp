@@ -18,9 +18,40 @@ static const char* ppszTypeName[] =
     "ERROR",
     "tx",
     "block",
-    "filtered block"
+    "filtered block",
+    "cmpctblock"
 };
 
+static const char* allNetMessageTypes[] =
+{
+    "version",
+    "verack",
+    "addr",
+    "inv",
+    "getdata",
+    "merkleblock",
+    "getblocks",
+    "getheaders",
+    "tx",
+    "headers",
+    "block",
+    "getaddr",
+    "mempool",
+    "ping",
+    "pong",
+    "alert",
+    "notfound",
+    "filterload",
+    "filteradd",
+    "filterclear",
+    "reject",
+    "sendcmpct",
+    "cmpctblock",
+    "getblocktxn",
+    "blocktxn"
+};
+static const std::vector<std::string> allNetMessageTypesVec(allNetMessageTypes, allNetMessageTypes + ARRAYLEN(allNetMessageTypes));
+
 CMessageHeader::CMessageHeader(const MessageStartChars& pchMessageStartIn)
 {
     memcpy(pchMessageStart, pchMessageStartIn, MESSAGE_START_SIZE);
@@ -141,3 +172,8 @@ std::string CInv::ToString() const
 {
     return strprintf("%s %s", GetCommand(), hash.ToString());
 }
+
+const std::vector<std::string>& getAllNetMessageTypes()
+{
+    return allNetMessageTypesVec;
+}
@@ -0,0 +1,482 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "reindex.h"
+
+#include "blockencoding.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "consensus/consensus.h"
+#include "crypto/common.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "uint256.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+/** Number of block files the reader may load ahead of the one being validated */
+static const size_t REINDEX_PREFETCH_FILES = 2;
+/** Number of parsed blocks per parsing thread that may wait for validation */
+static const size_t REINDEX_BLOCKS_AHEAD_PER_THREAD = 16;
+
+bool FindBlockFileRecord(const std::vector<char>& vData, size_t nOffset, CBlockFileRecord& rec)
+{
+    const unsigned char* pchMessageStart = (const unsigned char*)Params().MessageStart();
+    const size_t nHeaderSize = MESSAGE_START_SIZE + sizeof(uint32_t);
+    const size_t nLen = vData.size();
+    while (nOffset + nHeaderSize <= nLen) {
+        const char* pbegin = &vData[0];
+        const char* pfound = (const char*)memchr(pbegin + nOffset, pchMessageStart[0], nLen - nOffset);
+        if (pfound == NULL)
+            return false;
+        nOffset = pfound - pbegin;
+        if (nOffset + nHeaderSize > nLen)
+            return false;
+        if (memcmp(pfound, pchMessageStart, MESSAGE_START_SIZE) == 0) {
+            unsigned int nSize = ReadLE32((const unsigned char*)pfound + MESSAGE_START_SIZE);
+            size_t nPos = nOffset + nHeaderSize;
+            if (nSize >= 80 && nSize <= MAX_BLOCK_SIZE && nPos + nSize <= nLen) {
+                rec.nStart = nOffset;
+                rec.nPos = nPos;
+                rec.nSize = nSize;
+                return true;
+            }
+        }
+        // start one byte further, as the next record may overlap this candidate
+        nOffset++;
+    }
+    return false;
+}
+
+bool ReadBlockFileRecord(const std::vector<char>& vData, const CBlockFileRecord& rec, CBlock& block, uint256& hash)
+{
+    try {
+        const char* pbegin = &vData[rec.nPos];
+        const char* pend = pbegin + rec.nSize;
+        std::vector<char> vDecoded;
+        if (IsCompressedRecord(pbegin, rec.nSize)) {
+            if (!DecompressRecord(pbegin, rec.nSize, vDecoded)) {
+                LogPrintf("%s: invalid compressed block\n", __func__);
+                return false;
+            }
+            pbegin = vDecoded.data();
+            pend = pbegin + vDecoded.size();
+        }
+        CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+        reader >> block;
+    } catch (const std::exception& e) {
+        LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+        return false;
+    }
+    hash = block.GetHash();
+    bool fMutated;
+    block.fMerkleChecked = block.BuildMerkleTree(&fMutated) == block.hashMerkleRoot && !fMutated;
+    return true;
+}
+
+namespace {
+
+/** A block file loaded into memory, and the blocks parsed from it */
+struct CReindexFile
+{
+    enum RecordState { PENDING, PARSED, FAILED };
+
+    int nFile;
+    std::vector<char> vData;
+    std::vector<CBlockFileRecord> vRecords;
+
+    // Indexed like vRecords. An entry belongs to the parsing thread that
+    // claimed it until its state leaves PENDING, and to the validation thread
+    // after that.
+    std::vector<CBlock> vBlocks;
+    std::vector<uint256> vHashes;
+
+    // Guarded by CReindexPipeline::mutex
+    std::vector<RecordState> vState;
+    size_t nClaimed;
+
+    CReindexFile(int nFileIn) : nFile(nFileIn), nClaimed(0) {}
+};
+
+/** Totals for each pipeline stage, guarded by CReindexPipeline::mutex */
+struct CReindexStats
+{
+    unsigned int nFiles;
+    uint64_t nBytesRead;
+    int64_t nReadTime;
+    int64_t nReadStallTime;
+
+    unsigned int nParsed;
+    uint64_t nBytesParsed;
+    int64_t nParseTime;
+
+    unsigned int nValidated;
+    int64_t nValidateTime;
+    int64_t nValidateWaitTime;
+
+    CReindexStats() : nFiles(0), nBytesRead(0), nReadTime(0), nReadStallTime(0),
+                      nParsed(0), nBytesParsed(0), nParseTime(0),
+                      nValidated(0), nValidateTime(0), nValidateWaitTime(0) {}
+};
+
+class CReindexPipeline
+{
+private:
+    boost::mutex mutex;
+    //! The reader blocks on this while enough files are queued
+    boost::condition_variable condReader;
+    //! Parsing threads block on this when out of work
+    boost::condition_variable condParser;
+    //! The validation thread blocks on this while the next block is not parsed yet
+    boost::condition_variable condValidator;
+
+    //! Files loaded by the reader and not fully validated yet, in file order
+    std::deque<std::shared_ptr<CReindexFile> > queueFiles;
+    //! Whether the reader has run out of block files
+    bool fReaderDone;
+    //! Whether the helper threads have to stop
+    bool fQuit;
+    //! Number of records claimed by parsing threads and not validated yet
+    size_t nAhead;
+    size_t nMaxAhead;
+    int nParseThreads;
+
+    CReindexStats stats;
+    int64_t nTimeStart;
+
+    boost::thread_group threads;
+
+    std::shared_ptr<CReindexFile> ReadFile(int nFile);
+    bool HaveUnclaimedRecords() const;
+    bool ClaimRecord(std::shared_ptr<CReindexFile>& file, size_t& nRecord);
+    bool ValidateBlock(const CBlock& block, const uint256& hash, int nFile, const CBlockFileRecord& rec, int& nLoaded);
+    size_t RescanRecords(const CReindexFile& file, size_t nOffset, size_t nLimit, int& nLoaded, bool& fError);
+    void WaitForRecord(const CReindexFile& file, size_t nRecord);
+    void LogStats(const char* category);
+
+public:
+    CReindexPipeline(int nParseThreadsIn);
+    ~CReindexPipeline();
+
+    void ThreadRead();
+    void ThreadParse();
+    //! Feed the blocks to validation, on the calling thread
+    bool Validate();
+    void Stop();
+};
+
+CReindexPipeline::CReindexPipeline(int nParseThreadsIn) :
+    fReaderDone(false), fQuit(false), nAhead(0),
+    nMaxAhead(nParseThreadsIn * REINDEX_BLOCKS_AHEAD_PER_THREAD), nParseThreads(nParseThreadsIn),
+    nTimeStart(GetTimeMicros())
+{
+    threads.create_thread(boost::bind(&CReindexPipeline::ThreadRead, this));
+    for (int i = 0; i < nParseThreads; i++)
+        threads.create_thread(boost::bind(&CReindexPipeline::ThreadParse, this));
+}
+
+CReindexPipeline::~CReindexPipeline()
+{
+    Stop();
+}
+
+void CReindexPipeline::Stop()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+    }
+    condReader.notify_all();
+    condParser.notify_all();
+    threads.join_all();
+}
+
+std::shared_ptr<CReindexFile> CReindexPipeline::ReadFile(int nFile)
+{
+    CDiskBlockPos pos(nFile, 0);
+    if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
+        return std::shared_ptr<CReindexFile>(); // No block files left to reindex
+    FILE *filein = OpenBlockFile(pos, true);
+    if (!filein)
+        return std::shared_ptr<CReindexFile>(); // This error is logged in OpenBlockFile
+
+    std::shared_ptr<CReindexFile> file(new CReindexFile(nFile));
+    if (fseek(filein, 0, SEEK_END) == 0) {
+        long nLen = ftell(filein);
+        if (nLen > 0 && fseek(filein, 0, SEEK_SET) == 0) {
+            file->vData.resize(nLen);
+            file->vData.resize(fread(&file->vData[0], 1, nLen, filein));
+        }
+    }
+    if (ferror(filein))
+        LogPrintf("%s: I/O error reading blk%05u.dat, using the first %u bytes\n", __func__, (unsigned int)nFile, file->vData.size());
+    fclose(filein);
+
+    CBlockFileRecord rec;
+    size_t nOffset = 0;
+    while (FindBlockFileRecord(file->vData, nOffset, rec)) {
+        file->vRecords.push_back(rec);
+        nOffset = rec.nPos + rec.nSize;
+    }
+    file->vBlocks.resize(file->vRecords.size());
+    file->vHashes.resize(file->vRecords.size());
+    file->vState.resize(file->vRecords.size(), CReindexFile::PENDING);
+    return file;
+}
+
+void CReindexPipeline::ThreadRead()
+{
+    RenameThread("litecoinz-blkread");
+    for (int nFile = 0; ; nFile++) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            int64_t nWaitStart = GetTimeMicros();
+            while (!fQuit && queueFiles.size() >= REINDEX_PREFETCH_FILES)
+                condReader.wait(lock);
+            stats.nReadStallTime += GetTimeMicros() - nWaitStart;
+            if (fQuit)
+                return;
+        }
+
+        int64_t nReadStart = GetTimeMicros();
+        std::shared_ptr<CReindexFile> file = ReadFile(nFile);
+        if (!file)
+            break;
+        int64_t nReadTime = GetTimeMicros() - nReadStart;
+        LogPrint("reindex", "%s: read blk%05u.dat (%u bytes, %u blocks) in %dms\n", __func__,
+            (unsigned int)nFile, file->vData.size(), file->vRecords.size(), nReadTime / 1000);
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            queueFiles.push_back(file);
+            stats.nFiles++;
+            stats.nBytesRead += file->vData.size();
+            stats.nReadTime += nReadTime;
+        }
+        condParser.notify_all();
+        condValidator.notify_one();
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReaderDone = true;
+    }
+    condParser.notify_all();
+    condValidator.notify_one();
+}
+
+bool CReindexPipeline::HaveUnclaimedRecords() const
+{
+    BOOST_FOREACH(const std::shared_ptr<CReindexFile>& queued, queueFiles) {
+        if (queued->nClaimed < queued->vRecords.size())
+            return true;
+    }
+    return false;
+}
+
+bool CReindexPipeline::ClaimRecord(std::shared_ptr<CReindexFile>& file, size_t& nRecord)
+{
+    BOOST_FOREACH(std::shared_ptr<CReindexFile>& queued, queueFiles) {
+        if (queued->nClaimed < queued->vRecords.size()) {
+            file = queued;
+            nRecord = queued->nClaimed++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CReindexPipeline::ThreadParse()
+{
+    RenameThread("litecoinz-blkparse");
+    while (true) {
+        std::shared_ptr<CReindexFile> file;
+        size_t nRecord;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (true) {
+                if (fQuit)
+                    return;
+                if (nAhead < nMaxAhead && ClaimRecord(file, nRecord))
+                    break;
+                if (fReaderDone && !HaveUnclaimedRecords())
+                    return;
+                condParser.wait(lock);
+            }
+            nAhead++;
+        }
+
+        int64_t nParseStart = GetTimeMicros();
+        const CBlockFileRecord& rec = file->vRecords[nRecord];
+        bool fOk = ReadBlockFileRecord(file->vData, rec, file->vBlocks[nRecord], file->vHashes[nRecord]);
+        int64_t nParseTime = GetTimeMicros() - nParseStart;
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            file->vState[nRecord] = fOk ? CReindexFile::PARSED : CReindexFile::FAILED;
+            stats.nParsed++;
+            stats.nBytesParsed += rec.nSize;
+            stats.nParseTime += nParseTime;
+        }
+        condValidator.notify_one();
+    }
+}
+
+void CReindexPipeline::WaitForRecord(const CReindexFile& file, size_t nRecord)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    int64_t nWaitStart = GetTimeMicros();
+    while (file.vState[nRecord] == CReindexFile::PENDING)
+        condValidator.wait(lock);
+    stats.nValidateWaitTime += GetTimeMicros() - nWaitStart;
+}
+
+bool CReindexPipeline::ValidateBlock(const CBlock& block, const uint256& hash, int nFile, const CBlockFileRecord& rec, int& nLoaded)
+{
+    int64_t nValidateStart = GetTimeMicros();
+    bool fOk = true;
+    try {
+        CDiskBlockPos pos(nFile, rec.nPos);
+        fOk = ProcessExternalBlock(block, hash, &pos, rec.nSize, nLoaded);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+    }
+    int64_t nValidateTime = GetTimeMicros() - nValidateStart;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    stats.nValidated++;
+    stats.nValidateTime += nValidateTime;
+    return fOk;
+}
+
+/**
+ * Look for blocks between the start of a record that failed to parse and the
+ * next record, one byte at a time, like LoadExternalBlockFile does. Returns
+ * the offset that scanning would continue at.
+ */
+size_t CReindexPipeline::RescanRecords(const CReindexFile& file, size_t nOffset, size_t nLimit, int& nLoaded, bool& fError)
+{
+    CBlockFileRecord rec;
+    while (nOffset < nLimit && FindBlockFileRecord(file.vData, nOffset, rec) && rec.nStart < nLimit) {
+        CBlock block;
+        uint256 hash;
+        if (!ReadBlockFileRecord(file.vData, rec, block, hash)) {
+            nOffset = rec.nStart + 1;
+            continue;
+        }
+        nOffset = rec.nPos + rec.nSize;
+        if (!ValidateBlock(block, hash, file.nFile, rec, nLoaded)) {
+            fError = true;
+            break;
+        }
+    }
+    return nOffset;
+}
+
+bool CReindexPipeline::Validate()
+{
+    bool fRet = true;
+    while (true) {
+        std::shared_ptr<CReindexFile> file;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            int64_t nWaitStart = GetTimeMicros();
+            while (queueFiles.empty() && !fReaderDone)
+                condValidator.wait(lock);
+            stats.nValidateWaitTime += GetTimeMicros() - nWaitStart;
+            if (queueFiles.empty())
+                break;
+            file = queueFiles.front();
+        }
+
+        LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)file->nFile);
+        int64_t nStart = GetTimeMillis();
+        int nLoaded = 0;
+        bool fError = false;
+        size_t nResume = 0;
+        for (size_t i = 0; i < file->vRecords.size(); i++) {
+            boost::this_thread::interruption_point();
+            WaitForRecord(*file, i);
+
+            // Records that a rescan already went past, and everything after a
+            // system error, are only taken off the queue.
+            const CBlockFileRecord& rec = file->vRecords[i];
+            if (!fError && rec.nStart >= nResume) {
+                if (file->vState[i] == CReindexFile::PARSED) {
+                    nResume = rec.nPos + rec.nSize;
+                    if (!ValidateBlock(file->vBlocks[i], file->vHashes[i], file->nFile, rec, nLoaded))
+                        fError = true;
+                } else {
+                    size_t nLimit = i + 1 < file->vRecords.size() ? file->vRecords[i + 1].nStart : file->vData.size();
+                    nResume = RescanRecords(*file, rec.nStart + 1, nLimit, nLoaded, fError);
+                }
+            }
+            file->vBlocks[i] = CBlock();
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nAhead--;
+            }
+            condParser.notify_all();
+        }
+        if (fError)
+            fRet = false;
+        if (nLoaded > 0)
+            LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            queueFiles.pop_front();
+        }
+        condReader.notify_one();
+        LogStats("reindex");
+    }
+    LogStats(NULL);
+    return fRet;
+}
+
+void CReindexPipeline::LogStats(const char* category)
+{
+    CReindexStats s;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        s = stats;
+    }
+    double dElapsed = std::max(GetTimeMicros() - nTimeStart, (int64_t)1) * 0.000001;
+    double dMB = 1.0 / (1024 * 1024);
+    LogPrint(category, "Reindex read: %u files, %.1fMB in %.2fs (%.1fMB/s), stalled %.2fs on a full queue\n",
+        s.nFiles, s.nBytesRead * dMB, s.nReadTime * 0.000001,
+        s.nBytesRead * dMB / std::max(s.nReadTime * 0.000001, 0.000001), s.nReadStallTime * 0.000001);
+    LogPrint(category, "Reindex parse: %u blocks, %.1fMB on %d threads in %.2fs of thread time (%.1f blocks/s, %.1fMB/s per thread)\n",
+        s.nParsed, s.nBytesParsed * dMB, nParseThreads, s.nParseTime * 0.000001,
+        s.nParsed / std::max(s.nParseTime * 0.000001, 0.000001), s.nBytesParsed * dMB / std::max(s.nParseTime * 0.000001, 0.000001));
+    LogPrint(category, "Reindex validate: %u blocks in %.2fs (%.1f blocks/s), waited %.2fs for parsed blocks, %.2fs elapsed\n",
+        s.nValidated, s.nValidateTime * 0.000001, s.nValidated / std::max(s.nValidateTime * 0.000001, 0.000001),
+        s.nValidateWaitTime * 0.000001, dElapsed);
+}
+
+} // namespace
+
+bool ReindexBlockFiles()
+{
+    // -reindexthreads=0 means one parsing thread per core, less the two
+    // used by the reader and by validation
+    int nThreads = GetArg("-reindexthreads", DEFAULT_REINDEX_THREADS);
+    if (nThreads <= 0)
+        nThreads += GetNumCores() - 2;
+    nThreads = std::max(1, std::min(nThreads, MAX_REINDEX_THREADS));
+    LogPrintf("Reindexing with %d block parsing threads\n", nThreads);
+
+    CReindexPipeline pipeline(nThreads);
+    return pipeline.Validate();
+}
@@ -0,0 +1,48 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_REINDEX_H
+#define BITCOIN_REINDEX_H
+
+#include <stddef.h>
+#include <vector>
+
+class CBlock;
+class uint256;
+
+/** Where a block was found in the image of a blk?????.dat file */
+struct CBlockFileRecord
+{
+    //! Offset of the message start in front of the block
+    unsigned int nStart;
+    //! Offset of the serialized block
+    unsigned int nPos;
+    //! Size of the serialized block, as recorded in the file
+    unsigned int nSize;
+};
+
+/**
+ * Find the first record at or after nOffset that starts with the network's
+ * message start and has a plausible block size that fits in the file.
+ */
+bool FindBlockFileRecord(const std::vector<char>& vData, size_t nOffset, CBlockFileRecord& rec);
+
+/**
+ * Deserialize the block of a record and compute its hash and Merkle root.
+ * The block is flagged as having a checked Merkle root if that matches.
+ */
+bool ReadBlockFileRecord(const std::vector<char>& vData, const CBlockFileRecord& rec, CBlock& block, uint256& hash);
+
+/**
+ * Rebuild the block index from the blk?????.dat files (-reindex).
+ *
+ * The work is pipelined: a reader thread loads whole block files ahead of
+ * time and finds the blocks in them, a pool of threads deserializes the
+ * blocks and computes their hashes and Merkle roots, and the calling thread
+ * feeds the parsed blocks to validation in file order. Throughput of each
+ * stage is logged, so it is visible which one limits the reindex.
+ */
+bool ReindexBlockFiles();
+
+#endif // BITCOIN_REINDEX_H
@@ -5,14 +5,17 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "amount.h"
+#include "blockstore.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "consensus/validation.h"
+#include "joinsplitcache.h"
 #include "main.h"
 #include "primitives/transaction.h"
 #include "rpc/server.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 
 #include <stdint.h>
@@ -228,10 +231,9 @@ UniValue mempoolToJSON(bool fVerbose = false)
     {
         LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
         {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+            const uint256& hash = e.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
@@ -239,6 +241,12 @@ UniValue mempoolToJSON(bool fVerbose = false)
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", e.GetModFeesWithDescendants()));
+            info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
@@ -293,6 +301,12 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions (including this one)\n"
+            "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants (including this one)\n"
+            "    \"descendantfees\" : n,   (numeric) fees, including prioritisation, of in-mempool descendants (including this one)\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,     (numeric) fees, including prioritisation, of in-mempool ancestors (including this one)\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -333,8 +347,7 @@ UniValue getblockhash(const UniValue& params, bool fHelp)
     if (nHeight < 0 || nHeight > chainActive.Height())
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
 
-    CBlockIndex* pblockindex = chainActive[nHeight];
-    return pblockindex->GetBlockHash().GetHex();
+    return chainActive.GetBlockHash(nHeight).GetHex();
 }
 
 UniValue getblockheader(const UniValue& params, bool fHelp)
@@ -466,61 +479,106 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if (mapBlockIndex.count(hash) == 0)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlock block;
+    CBlockView view;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
     if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
 
-    if(!ReadBlockFromDisk(block, pblockindex))
+    if(!view.Read(pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
     if (!fVerbose)
     {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-        ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
+        // The serialized block is returned as stored
+        std::string strHex = HexStr(view.GetBytes().begin(), view.GetBytes().end());
         return strHex;
     }
 
-    return blockToJSON(block, pblockindex);
+    const CBlock* pblock = view.GetBlock();
+    if (!pblock)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    return blockToJSON(*pblock, pblockindex);
 }
 
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( \"hash_type\" )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "Note this call may take some time with hash_type \"hash_serialized\".\n"
+            "\nArguments:\n"
+            "1. \"hash_type\"  (string, optional, default=\"hash_serialized\") Which UTXO set hash should be calculated:\n"
+            "                 \"hash_serialized\" computes the serialized hash in a single pass,\n"
+            "                 \"muhash\" reads the MuHash commitment kept up to date as blocks are connected, and\n"
+            "                 \"muhash_scan\" computes the MuHash commitment by scanning the database in parallel.\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
-            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"transactions\": n,      (numeric) The number of transactions (only with hash_serialized)\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (only with hash_serialized)\n"
+            "  \"muhash\": \"hash\",    (string) The MuHash3072 of the set (only with muhash and muhash_scan)\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "\"muhash\"")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    std::string strHashType = params.size() > 0 ? params[0].get_str() : "hash_serialized";
+    if (strHashType != "muhash" && strHashType != "muhash_scan" && strHashType != "hash_serialized")
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown hash_type " + strHashType);
+
     UniValue ret(UniValue::VOBJ);
 
-    CCoinsStats stats;
-    FlushStateToDisk();
-    if (pcoinsTip->GetStats(stats)) {
-        ret.push_back(Pair("height", (int64_t)stats.nHeight));
-        ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
-        ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
-        ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
-        ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
-        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    if (strHashType == "hash_serialized") {
+        CCoinsStats stats;
+        FlushStateToDisk();
+        if (pcoinsTip->GetStats(stats)) {
+            ret.push_back(Pair("height", (int64_t)stats.nHeight));
+            ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+            ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
+            ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+            ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
+            ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+            ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+        }
+        return ret;
     }
+
+    CCoinsSetCommitment commitment;
+    uint256 hashBlock;
+    if (strHashType == "muhash") {
+        LOCK(cs_main);
+        if (!pcoinsTip->GetSetCommitment(commitment))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "UTXO set commitment is not available");
+        hashBlock = pcoinsTip->GetBestBlock();
+    } else {
+        FlushStateToDisk();
+        if (!pcoinsdbview->ComputeSetCommitment(commitment, hashBlock))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+    }
+
+    int nHeight = -1;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi != mapBlockIndex.end())
+            nHeight = mi->second->nHeight;
+    }
+    uint256 hashMuHash;
+    commitment.muhash.Finalize(hashMuHash);
+    ret.push_back(Pair("height", (int64_t)nHeight));
+    ret.push_back(Pair("bestblock", hashBlock.GetHex()));
+    ret.push_back(Pair("txouts", (int64_t)commitment.nTransactionOutputs));
+    ret.push_back(Pair("bytes_serialized", (int64_t)commitment.nSerializedSize));
+    ret.push_back(Pair("muhash", hashMuHash.GetHex()));
+    ret.push_back(Pair("total_amount", ValueFromAmount(commitment.nTotalAmount)));
     return ret;
 }
 
@@ -549,7 +607,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,              (numeric) The version\n"
             "  \"coinbase\" : true|false     (boolean) Coinbase or not\n"
             "}\n"
 
@@ -573,33 +630,30 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    COutPoint out(hash, n);
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) // TODO: filtering spent coins should be done by the CCoinsViewMemPool
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
 
     return ret;
 }
@@ -690,7 +744,17 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "        },\n"
             "        \"reject\": { ... }      (object) progress toward rejecting pre-softfork blocks (same fields as \"enforce\")\n"
             "     }, ...\n"
-            "  ]\n"
+            "  ],\n"
+            "  \"coinsflush\": {           (object) timings of coin database cache flushes\n"
+            "     \"flushes\": xx,          (numeric) number of flushes written to disk\n"
+            "     \"pending\": xx,          (boolean) whether a flush is being written in the background\n"
+            "     \"writebehind\": xx,      (boolean) whether flushes are written in the background\n"
+            "     \"last_write_ms\": xx,    (numeric) time spent writing the last flush\n"
+            "     \"total_write_ms\": xx,   (numeric) time spent writing all flushes\n"
+            "     \"last_stall_ms\": xx,    (numeric) time block processing waited on the last flush\n"
+            "     \"total_stall_ms\": xx,   (numeric) time block processing waited on all flushes\n"
+            "     \"max_stall_ms\": xx      (numeric) longest time block processing waited on a flush\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getblockchaininfo", "")
@@ -733,6 +797,21 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
 
         obj.push_back(Pair("pruneheight",        block->nHeight));
     }
+
+    if (pcoinsdbview)
+    {
+        CCoinsFlushStats flushStats = pcoinsdbview->GetFlushStats();
+        UniValue coinsflush(UniValue::VOBJ);
+        coinsflush.push_back(Pair("flushes",        flushStats.nFlushes));
+        coinsflush.push_back(Pair("pending",        flushStats.fPending));
+        coinsflush.push_back(Pair("writebehind",    pcoinsdbview->IsWriteBehind()));
+        coinsflush.push_back(Pair("last_write_ms",  flushStats.nLastWriteMicros * 0.001));
+        coinsflush.push_back(Pair("total_write_ms", flushStats.nTotalWriteMicros * 0.001));
+        coinsflush.push_back(Pair("last_stall_ms",  flushStats.nLastStallMicros * 0.001));
+        coinsflush.push_back(Pair("total_stall_ms", flushStats.nTotalStallMicros * 0.001));
+        coinsflush.push_back(Pair("max_stall_ms",   flushStats.nMaxStallMicros * 0.001));
+        obj.push_back(Pair("coinsflush",            coinsflush));
+    }
     return obj;
 }
 
@@ -847,6 +926,9 @@ UniValue mempoolInfoToJSON()
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
     ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
 
     return ret;
 }
@@ -862,6 +944,8 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
             "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -871,6 +955,131 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue getjoinsplitcacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getjoinsplitcacheinfo\n"
+            "\nReturns details on the cache of JoinSplit proofs and signatures verified in the memory pool.\n"
+            "Entries may be evicted once their transaction is connected in a block.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"proofs\": {                 (object) Cached JoinSplit proofs\n"
+            "    \"capacity\": xxxxx          (numeric) Number of proofs the cache can hold\n"
+            "    \"hits\": xxxxx              (numeric) Lookups that skipped proof verification\n"
+            "    \"misses\": xxxxx            (numeric) Lookups that required proof verification\n"
+            "  },\n"
+            "  \"signatures\": {             (object) Cached joinSplitSigs, with the same fields\n"
+            "    ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getjoinsplitcacheinfo", "")
+            + HelpExampleRpc("getjoinsplitcacheinfo", "")
+        );
+
+    CJoinSplitCacheStats stats = JoinSplitCacheGetStats();
+
+    UniValue proofs(UniValue::VOBJ);
+    proofs.push_back(Pair("capacity", (uint64_t) stats.nProofCapacity));
+    proofs.push_back(Pair("hits", stats.nProofHits));
+    proofs.push_back(Pair("misses", stats.nProofMisses));
+
+    UniValue sigs(UniValue::VOBJ);
+    sigs.push_back(Pair("capacity", (uint64_t) stats.nSigCapacity));
+    sigs.push_back(Pair("hits", stats.nSigHits));
+    sigs.push_back(Pair("misses", stats.nSigMisses));
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("proofs", proofs));
+    ret.push_back(Pair("signatures", sigs));
+    return ret;
+}
+
+UniValue getdbstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns the tuning and internal statistics of each open LevelDB database.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"name\": \"xxxx\",                (string) The database (chainstate, index, ...)\n"
+            "    \"path\": \"xxxx\",                (string) Its directory, empty if held in memory\n"
+            "    \"profile\": {                   (object) Settings it was opened with, see -dbtune\n"
+            "      \"maxopenfiles\": n,\n"
+            "      \"bloombits\": n,\n"
+            "      \"blockcache\": n,             (numeric) Block cache size in bytes\n"
+            "      \"writebuffer\": n,            (numeric) Write buffer size in bytes\n"
+            "      \"blocksize\": n,\n"
+            "      \"restartinterval\": n\n"
+            "    },\n"
+            "    \"approximatesize\": n,          (numeric) Approximate size on disk in bytes\n"
+            "    \"prefixsizes\": {               (object) Approximate size on disk of the keys with each first byte\n"
+            "      \"xx\": n,                     (numeric) Size in bytes for the hex prefix xx\n"
+            "      ...\n"
+            "    },\n"
+            "    \"filesatlevel\": [ n, ... ],    (array) Number of table files at each level\n"
+            "    \"readamplification\": n,        (numeric) Most table files a read may have to look in\n"
+            "    \"compaction\": {                (object) Totals over all compactions since the database was opened\n"
+            "      \"seconds\": x.xxx,\n"
+            "      \"bytesread\": n,\n"
+            "      \"byteswritten\": n\n"
+            "    },\n"
+            "    \"reads\": n,                    (numeric) Reads since the database was opened\n"
+            "    \"batches\": n,                  (numeric) Write batches since the database was opened\n"
+            "    \"byteswritten\": n,             (numeric) Bytes in those batches\n"
+            "    \"leveldbstats\": \"xxxx\"         (string) The leveldb.stats property\n"
+            "  },\n"
+            "  ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    UniValue ret(UniValue::VARR);
+    BOOST_FOREACH(const CLevelDBStats& stats, GetLevelDBStats()) {
+        UniValue profile(UniValue::VOBJ);
+        profile.push_back(Pair("maxopenfiles", stats.profile.nMaxOpenFiles));
+        profile.push_back(Pair("bloombits", stats.profile.nBloomBits));
+        profile.push_back(Pair("blockcache", (uint64_t) stats.nBlockCacheSize));
+        profile.push_back(Pair("writebuffer", (uint64_t) stats.nWriteBufferSize));
+        profile.push_back(Pair("blocksize", stats.profile.nBlockSize));
+        profile.push_back(Pair("restartinterval", stats.profile.nBlockRestartInterval));
+
+        UniValue prefixes(UniValue::VOBJ);
+        for (std::map<unsigned char, uint64_t>::const_iterator it = stats.mapPrefixSizes.begin(); it != stats.mapPrefixSizes.end(); ++it)
+            prefixes.push_back(Pair(HexStr(&it->first, &it->first + 1), it->second));
+
+        UniValue levels(UniValue::VARR);
+        BOOST_FOREACH(int nFiles, stats.vFilesAtLevel)
+            levels.push_back(nFiles);
+
+        UniValue compaction(UniValue::VOBJ);
+        compaction.push_back(Pair("seconds", stats.dCompactionTime));
+        compaction.push_back(Pair("bytesread", stats.nCompactionRead));
+        compaction.push_back(Pair("byteswritten", stats.nCompactionWritten));
+
+        UniValue db(UniValue::VOBJ);
+        db.push_back(Pair("name", stats.strName));
+        db.push_back(Pair("path", stats.strPath));
+        db.push_back(Pair("profile", profile));
+        db.push_back(Pair("approximatesize", stats.nApproximateSize));
+        db.push_back(Pair("prefixsizes", prefixes));
+        db.push_back(Pair("filesatlevel", levels));
+        db.push_back(Pair("readamplification", stats.nReadAmplification));
+        db.push_back(Pair("compaction", compaction));
+        db.push_back(Pair("reads", stats.nReads));
+        db.push_back(Pair("batches", stats.nBatches));
+        db.push_back(Pair("byteswritten", stats.nBytesWritten));
+        db.push_back(Pair("leveldbstats", stats.strStats));
+        ret.push_back(db);
+    }
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
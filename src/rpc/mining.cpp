@@ -33,18 +33,21 @@
 
 using namespace std;
 
+/** The template served by getblocktemplate, kept up to date between calls. Guarded by cs_main. */
+static CBlockTemplateBuilder templateBuilder;
+
 /**
  * Return average network hashes per second based on the last 'lookup' blocks,
  * or over the difficulty averaging window if 'lookup' is nonpositive.
  * If 'height' is nonnegative, compute the estimate at the time when a given block was found.
  */
 int64_t GetNetworkHashPS(int lookup, int height) {
-    CBlockIndex *pb = chainActive.Tip();
+    int nHeight = chainActive.Height();
 
     if (height >= 0 && height < chainActive.Height())
-        pb = chainActive[height];
+        nHeight = height;
 
-    if (pb == NULL || !pb->nHeight)
+    if (nHeight <= 0)
         return 0;
 
     // If lookup is nonpositive, then use difficulty averaging window.
@@ -52,15 +55,13 @@ int64_t GetNetworkHashPS(int lookup, int height) {
         lookup = Params().GetConsensus().nPowAveragingWindow;
 
     // If lookup is larger than chain, then set it to chain length.
-    if (lookup > pb->nHeight)
-        lookup = pb->nHeight;
+    if (lookup > nHeight)
+        lookup = nHeight;
 
-    CBlockIndex *pb0 = pb;
-    int64_t minTime = pb0->GetBlockTime();
+    int64_t minTime = chainActive.GetBlockTime(nHeight);
     int64_t maxTime = minTime;
-    for (int i = 0; i < lookup; i++) {
-        pb0 = pb0->pprev;
-        int64_t time = pb0->GetBlockTime();
+    for (int i = nHeight - lookup; i < nHeight; i++) {
+        int64_t time = chainActive.GetBlockTime(i);
         minTime = std::min(time, minTime);
         maxTime = std::max(time, maxTime);
     }
@@ -69,7 +70,7 @@ int64_t GetNetworkHashPS(int lookup, int height) {
     if (minTime == maxTime)
         return 0;
 
-    arith_uint256 workDiff = pb->nChainWork - pb0->nChainWork;
+    arith_uint256 workDiff = chainActive.GetChainWork(nHeight) - chainActive.GetChainWork(nHeight - lookup);
     int64_t timeDiff = maxTime - minTime;
 
     return (int64_t)(workDiff.getdouble() / timeDiff);
@@ -344,6 +345,10 @@ UniValue getmininginfo(const UniValue& params, bool fHelp)
             "  \"localsolps\": xxx.xxxxx    (numeric) The average local solution rate in Sol/s since this node was started\n"
             "  \"networksolps\": x          (numeric) The estimated network solution rate in Sol/s\n"
             "  \"pooledtx\": n              (numeric) The size of the mem pool\n"
+            "  \"templaterebuilds\": n      (numeric) The number of times getblocktemplate built a new template\n"
+            "  \"templaterebuildtime\": n   (numeric) The time taken by the last template rebuild, in microseconds\n"
+            "  \"templateupdates\": n       (numeric) The number of times getblocktemplate added new mempool transactions to its template\n"
+            "  \"templateupdatetime\": n    (numeric) The time taken by the last template update, in microseconds\n"
             "  \"testnet\": true|false      (boolean) If using testnet or not\n"
             "  \"chain\": \"xxxx\",         (string) current network name as defined in BIP70 (main, test, regtest)\n"
             "}\n"
@@ -366,6 +371,10 @@ UniValue getmininginfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("networksolps",     getnetworksolps(params, false)));
     obj.push_back(Pair("networkhashps",    getnetworksolps(params, false)));
     obj.push_back(Pair("pooledtx",         (uint64_t)mempool.size()));
+    obj.push_back(Pair("templaterebuilds",    templateBuilder.GetRebuildCount()));
+    obj.push_back(Pair("templaterebuildtime", templateBuilder.GetLastRebuildTime()));
+    obj.push_back(Pair("templateupdates",     templateBuilder.GetUpdateCount()));
+    obj.push_back(Pair("templateupdatetime",  templateBuilder.GetLastUpdateTime()));
     obj.push_back(Pair("testnet",          Params().TestnetToBeDeprecatedFieldRPC()));
     obj.push_back(Pair("chain",            Params().NetworkIDString()));
 #ifdef ENABLE_MINING
@@ -559,7 +568,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "LitecoinZ is downloading blocks...");
 
-    static unsigned int nTransactionsUpdatedLast;
+    unsigned int nTransactionsUpdatedLast = templateBuilder.GetTransactionsUpdated();
 
     if (!lpval.isNull())
     {
@@ -608,38 +617,30 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     }
 
     // Update block
-    static CBlockIndex* pindexPrev;
     static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+    if (templateBuilder.NeedsRebuild())
     {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlockWithKey, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
 #ifdef ENABLE_WALLET
         CReserveKey reservekey(pwalletMain);
-        pblocktemplate = CreateNewBlockWithKey(reservekey);
+        boost::optional<CScript> scriptPubKey = GetMinerScriptPubKey(reservekey);
 #else
-        pblocktemplate = CreateNewBlockWithKey();
+        boost::optional<CScript> scriptPubKey = GetMinerScriptPubKey();
 #endif
-        if (!pblocktemplate)
+        if (!scriptPubKey || !templateBuilder.Rebuild(*scriptPubKey))
+            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+        nStart = GetTime();
+    }
+    else if (mempool.GetTransactionsUpdated() != templateBuilder.GetTransactionsUpdated() && GetTime() - nStart > 5)
+    {
+        // Same tip, so new mempool transactions can go into the template we have
+        nStart = GetTime();
+        templateBuilder.Update();
+        if (!templateBuilder.GetTemplate())
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlockWithKey succeeded
-        pindexPrev = pindexPrevNew;
     }
+    nTransactionsUpdatedLast = templateBuilder.GetTransactionsUpdated();
+    CBlockTemplate* pblocktemplate = templateBuilder.GetTemplate();
+    const CBlockIndex* pindexPrev = templateBuilder.GetPrevBlock();
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
     // Update nTime
@@ -713,7 +714,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     }
     result.push_back(Pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
     result.push_back(Pair("target", hashTarget.GetHex()));
-    result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
+    result.push_back(Pair("mintime", chainActive.GetMedianTimePast(pindexPrev)+1));
     result.push_back(Pair("mutable", aMutable));
     result.push_back(Pair("noncerange", "00000000ffffffff"));
     result.push_back(Pair("sigoplimit", (int64_t)MAX_BLOCK_SIGOPS));
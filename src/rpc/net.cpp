@@ -107,7 +107,23 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"blockdownload\": {        (json object) The state of block download from this peer\n"
+            "      \"rate\": n,              (numeric) The average rate at which requested blocks arrive, in bytes per second\n"
+            "      \"latency\": n,           (numeric) The average time from requesting a block to receiving it, in seconds\n"
+            "      \"window\": n,            (numeric) The number of blocks we allow in flight from this peer\n"
+            "      \"rerequested\": n,       (numeric) The number of blocks asked from other peers because this one was late with them\n"
+            "      \"stalling\": true|false  (boolean) Whether this peer holds back the block download window\n"
+            "    },\n"
+            "    \"msgproctime\": {          (json object) Time spent processing the messages of each command from this peer\n"
+            "      \"command\": {\n"
+            "        \"count\": n,            (numeric) The number of messages processed\n"
+            "        \"totaltime\": n,        (numeric) The total time taken, in seconds\n"
+            "        \"maxtime\": n,          (numeric) The longest time a message took, in seconds\n"
+            "        \"histogram\": [n,...]   (json array) The number of messages that took under 10us, 100us, 1ms, 10ms, 100ms, 1s, and longer\n"
+            "      },\n"
+            "      ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -157,9 +173,31 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            UniValue blockdownload(UniValue::VOBJ);
+            blockdownload.push_back(Pair("rate", statestats.dDownloadRate));
+            blockdownload.push_back(Pair("latency", statestats.dDownloadLatency));
+            blockdownload.push_back(Pair("window", statestats.nDownloadWindow));
+            blockdownload.push_back(Pair("rerequested", statestats.nBlocksRerequested));
+            blockdownload.push_back(Pair("stalling", statestats.fStalling));
+            obj.push_back(Pair("blockdownload", blockdownload));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
+        UniValue msgproctime(UniValue::VOBJ);
+        BOOST_FOREACH(const mapMsgCmdTime::value_type& item, stats.mapProcessTimePerMsgCmd) {
+            const CMessageTimeStats& timestats = item.second;
+            UniValue cmd(UniValue::VOBJ);
+            cmd.push_back(Pair("count", timestats.nCount));
+            cmd.push_back(Pair("totaltime", timestats.nTotalMicros / 1e6));
+            cmd.push_back(Pair("maxtime", timestats.nMaxMicros / 1e6));
+            UniValue histogram(UniValue::VARR);
+            for (int i = 0; i < CMessageTimeStats::HISTOGRAM_BUCKETS; i++)
+                histogram.push_back(timestats.vHistogram[i]);
+            cmd.push_back(Pair("histogram", histogram));
+            msgproctime.push_back(Pair(item.first, cmd));
+        }
+        obj.push_back(Pair("msgproctime", msgproctime));
+
         ret.push_back(obj);
     }
 
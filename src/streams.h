@@ -300,6 +300,12 @@ public:
         d.insert(d.end(), begin(), end());
         clear();
     }
+
+    //! Exchange the storage of the stream with d, without copying, and read from the start
+    void Swap(vector_type &d) {
+        vch.swap(d);
+        nReadPos = 0;
+    }
 };
 
 class CDataStream : public CBaseDataStream<CSerializeData>
@@ -335,6 +341,54 @@ public:
 
 
 
+/** Read-only stream over memory owned by someone else, such as a mapped file.
+ *
+ * Unlike CDataStream, the bytes are not copied; the caller keeps them alive
+ * for as long as the stream is used.
+ */
+class CMemoryReader
+{
+private:
+    const int nType;
+    const int nVersion;
+    const char* pcur;
+    const char* pend;
+
+public:
+    CMemoryReader(const char* pbegin, const char* pendIn, int nTypeIn, int nVersionIn) :
+        nType(nTypeIn), nVersion(nVersionIn), pcur(pbegin), pend(pendIn) {}
+
+    int GetType() const          { return nType; }
+    int GetVersion() const       { return nVersion; }
+    size_t size() const          { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+
+    CMemoryReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read(): end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CMemoryReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::ignore(): end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 /** Non-refcounted RAII wrapper for FILE*
  *
  * Will automatically close the file when it goes out of scope if not null.
@@ -0,0 +1,176 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencoding.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "lz4.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockencoding_tests, BasicTestingSetup)
+
+static void CheckLZ4RoundTrip(const std::vector<unsigned char>& vData)
+{
+    std::vector<unsigned char> vCompressed;
+    LZ4Compress(vData.data(), vData.size(), vCompressed);
+
+    std::vector<unsigned char> vOut(vData.size());
+    BOOST_CHECK(LZ4Decompress(vCompressed.data(), vCompressed.size(), vOut.data(), vOut.size()));
+    BOOST_CHECK(vOut == vData);
+
+    // The decompressed size has to be exact
+    std::vector<unsigned char> vLarger(vData.size() + 1);
+    BOOST_CHECK(!LZ4Decompress(vCompressed.data(), vCompressed.size(), vLarger.data(), vLarger.size()));
+    if (!vData.empty())
+        BOOST_CHECK(!LZ4Decompress(vCompressed.data(), vCompressed.size(), vOut.data(), vOut.size() - 1));
+}
+
+BOOST_AUTO_TEST_CASE(lz4_roundtrip)
+{
+    CheckLZ4RoundTrip(std::vector<unsigned char>());
+    CheckLZ4RoundTrip(std::vector<unsigned char>(1, 7));
+    CheckLZ4RoundTrip(std::vector<unsigned char>(13, 0));
+    CheckLZ4RoundTrip(std::vector<unsigned char>(100000, 0));
+
+    // Repeats of a short pattern make matches that overlap their own output
+    std::vector<unsigned char> vPattern;
+    for (int i = 0; i < 5000; i++)
+        vPattern.push_back("abc"[i % 3]);
+    CheckLZ4RoundTrip(vPattern);
+
+    // Random data does not compress, and repeats of it lie too far back to match
+    std::vector<unsigned char> vRandom(70000);
+    GetRandBytes(vRandom.data(), vRandom.size());
+    CheckLZ4RoundTrip(vRandom);
+    vRandom.insert(vRandom.end(), vRandom.begin(), vRandom.begin() + 1000);
+    CheckLZ4RoundTrip(vRandom);
+
+    std::vector<unsigned char> vCompressed;
+    LZ4Compress(vPattern.data(), vPattern.size(), vCompressed);
+    BOOST_CHECK(vCompressed.size() < vPattern.size() / 50);
+}
+
+BOOST_AUTO_TEST_CASE(lz4_format)
+{
+    // One literal, a match of eight bytes at offset one, then five literals
+    const unsigned char stream[] = {0x14, 'a', 0x01, 0x00, 0x50, 'b', 'c', 'd', 'e', 'f'};
+    std::vector<unsigned char> vOut(14);
+    BOOST_CHECK(LZ4Decompress(stream, sizeof(stream), vOut.data(), vOut.size()));
+    BOOST_CHECK(std::string(vOut.begin(), vOut.end()) == "aaaaaaaaabcdef");
+
+    // Offsets of zero or before the start of the output are rejected
+    unsigned char badOffset[sizeof(stream)];
+    memcpy(badOffset, stream, sizeof(stream));
+    badOffset[2] = 0;
+    BOOST_CHECK(!LZ4Decompress(badOffset, sizeof(badOffset), vOut.data(), vOut.size()));
+    badOffset[2] = 2;
+    BOOST_CHECK(!LZ4Decompress(badOffset, sizeof(badOffset), vOut.data(), vOut.size()));
+
+    // So is a stream that ends in the middle of a sequence
+    for (size_t n = 1; n < 5; n++)
+        BOOST_CHECK(!LZ4Decompress(stream, n, vOut.data(), vOut.size()));
+}
+
+static CBlock MakeBlock()
+{
+    CBlock block(Params().GenesisBlock());
+    for (int i = 0; i < 50; i++) {
+        CMutableTransaction mtx;
+        mtx.nVersion = 1 + i % 2;
+        mtx.vin.resize(2);
+        for (size_t j = 0; j < mtx.vin.size(); j++) {
+            mtx.vin[j].prevout = COutPoint(GetRandHash(), j);
+            mtx.vin[j].scriptSig = CScript() << std::vector<unsigned char>(72, i) << std::vector<unsigned char>(33, 2);
+        }
+        mtx.vout.resize(2);
+        for (size_t j = 0; j < mtx.vout.size(); j++) {
+            mtx.vout[j].nValue = i * 1000 + j;
+            mtx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        if (mtx.nVersion >= 2) {
+            mtx.vjoinsplit.resize(1);
+            mtx.vjoinsplit[0].vpub_old = i;
+            mtx.vjoinsplit[0].anchor = GetRandHash();
+            mtx.vjoinsplit[0].randomSeed = GetRandHash();
+            mtx.joinSplitPubKey = GetRandHash();
+        }
+        block.vtx.push_back(mtx);
+    }
+    return block;
+}
+
+static std::vector<char> SerializeBlock(const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    return std::vector<char>(ss.begin(), ss.end());
+}
+
+BOOST_AUTO_TEST_CASE(block_record_roundtrip)
+{
+    CBlock block = MakeBlock();
+    std::vector<char> vRaw = SerializeBlock(block);
+    BOOST_CHECK(!IsCompressedRecord(vRaw.data(), vRaw.size()));
+
+    std::vector<char> vFrame;
+    BOOST_CHECK(CompressBlockRecord(vRaw.data(), vRaw.size(), vFrame));
+    BOOST_CHECK(IsCompressedRecord(vFrame.data(), vFrame.size()));
+    BOOST_CHECK(vFrame.size() < vRaw.size());
+
+    std::vector<char> vRecord;
+    BOOST_CHECK(DecompressRecord(vFrame.data(), vFrame.size(), vRecord));
+    BOOST_CHECK(vRecord == vRaw);
+
+    CBlock blockRead;
+    CMemoryReader reader(vRecord.data(), vRecord.data() + vRecord.size(), SER_DISK, CLIENT_VERSION);
+    reader >> blockRead;
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+    BOOST_CHECK(blockRead.BuildMerkleTree() == block.BuildMerkleTree());
+
+    // A frame that is cut short, or followed by anything, does not decode
+    for (size_t n = 0; n < vFrame.size(); n += 7) {
+        BOOST_CHECK(!DecompressRecord(vFrame.data(), n, vRecord));
+        BOOST_CHECK(vRecord.empty());
+    }
+    vFrame.push_back(0);
+    BOOST_CHECK(!DecompressRecord(vFrame.data(), vFrame.size(), vRecord));
+}
+
+BOOST_AUTO_TEST_CASE(plain_record_roundtrip)
+{
+    // Anything that does not parse as a block is compressed as a whole
+    std::vector<char> vData(1000, 0);
+    for (size_t i = 0; i < vData.size(); i += 10)
+        vData[i] = i / 10;
+    std::vector<char> vFrame;
+    BOOST_CHECK(CompressBlockRecord(vData.data(), vData.size(), vFrame));
+    std::vector<char> vRecord;
+    BOOST_CHECK(DecompressRecord(vFrame.data(), vFrame.size(), vRecord));
+    BOOST_CHECK(vRecord == vData);
+
+    BOOST_CHECK(CompressRecord(vData.data(), vData.size(), vFrame));
+    BOOST_CHECK(DecompressRecord(vFrame.data(), vFrame.size(), vRecord));
+    BOOST_CHECK(vRecord == vData);
+
+    // Data that does not get smaller is left as it is
+    std::vector<char> vRandom(1000);
+    GetRandBytes((unsigned char*)vRandom.data(), vRandom.size());
+    BOOST_CHECK(!CompressRecord(vRandom.data(), vRandom.size(), vFrame));
+    BOOST_CHECK(vFrame.empty());
+    BOOST_CHECK(!CompressBlockRecord(vRandom.data(), vRandom.size(), vFrame));
+    BOOST_CHECK(vFrame.empty());
+
+    // Only frames decode
+    BOOST_CHECK(!DecompressRecord(vData.data(), vData.size(), vRecord));
+    const char unknownFormat[] = {'\xff', '\xff', '\xff', '\xff', 2, 0, 0};
+    BOOST_CHECK(IsCompressedRecord(unknownFormat, sizeof(unknownFormat)));
+    BOOST_CHECK(!DecompressRecord(unknownFormat, sizeof(unknownFormat), vRecord));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,132 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+#include "pow.h"
+#include "txdb.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockindex_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockindex_pool)
+{
+    CBlockIndexPool pool;
+    BOOST_CHECK_EQUAL(pool.Size(), 0);
+    std::set<CBlockIndex*> setEntries;
+    for (int i = 0; i < 10000; i++) {
+        CBlockIndex* pindex = pool.Allocate();
+        BOOST_CHECK(pindex->phashBlock == NULL && pindex->pprev == NULL);
+        pindex->nSolution.resize(i % 100);
+        setEntries.insert(pindex);
+    }
+    CBlockHeader header;
+    header.nTime = 7;
+    BOOST_CHECK_EQUAL(pool.Allocate(header)->nTime, 7);
+    BOOST_CHECK_EQUAL(setEntries.size(), 10000);
+    BOOST_CHECK_EQUAL(pool.Size(), 10001);
+    pool.Clear();
+    BOOST_CHECK_EQUAL(pool.Size(), 0);
+    pool.Allocate();
+    BOOST_CHECK_EQUAL(pool.Size(), 1);
+}
+
+/** Headers that meet the proof of work limit, kept alive with their index entries */
+struct CTestChain
+{
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex> vIndex;
+
+    CTestChain(size_t nSize) : vHashes(nSize), vIndex(nSize) {}
+
+    void Add(size_t i, CBlockIndex* pindexPrev)
+    {
+        CBlockHeader header;
+        header.nVersion = 4;
+        header.hashPrevBlock = pindexPrev ? pindexPrev->GetBlockHash() : uint256();
+        header.nTime = 1500000000 + i;
+        header.nBits = UintToArith256(Params().GetConsensus().powLimit).GetCompact();
+        for (uint64_t n = 0; ; n++) {
+            header.nNonce = ArithToUint256(arith_uint256(n));
+            vHashes[i] = header.GetHash();
+            if (CheckProofOfWork(vHashes[i], header.nBits, Params().GetConsensus()))
+                break;
+        }
+        vIndex[i] = CBlockIndex(header);
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].pprev = pindexPrev;
+        vIndex[i].nHeight = pindexPrev ? pindexPrev->nHeight + 1 : 0;
+        vIndex[i].nTx = 1;
+        vIndex[i].nStatus = BLOCK_VALID_TRANSACTIONS;
+    }
+};
+
+static void RecordLoaded(std::vector<CBlockIndex*>* pvLoaded, CBlockIndex* pindex)
+{
+    pvLoaded->push_back(pindex);
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_upgrade_and_load)
+{
+    // A chain of 30 blocks with a fork of 5 from height 10
+    CTestChain chain(35);
+    for (size_t i = 0; i < 30; i++)
+        chain.Add(i, i ? &chain.vIndex[i - 1] : NULL);
+    for (size_t i = 30; i < 35; i++)
+        chain.Add(i, &chain.vIndex[i == 30 ? 10 : i - 1]);
+
+    // Half of the entries are stored as older versions did, by hash
+    std::vector<const CBlockIndex*> vNew;
+    for (size_t i = 0; i < chain.vIndex.size(); i++) {
+        if (i % 2)
+            pblocktree->Write(std::make_pair('b', chain.vHashes[i]), CDiskBlockIndex(&chain.vIndex[i]));
+        else
+            vNew.push_back(&chain.vIndex[i]);
+    }
+    BOOST_CHECK(pblocktree->WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), 0, vNew));
+
+    BOOST_CHECK(pblocktree->Upgrade());
+    for (size_t i = 0; i < chain.vIndex.size(); i++)
+        BOOST_CHECK(!pblocktree->Exists(std::make_pair('b', chain.vHashes[i])));
+    BOOST_CHECK(pblocktree->Upgrade());
+
+    UnloadBlockIndex();
+    std::vector<CBlockIndex*> vLoaded;
+    BOOST_CHECK(pblocktree->LoadBlockIndexGuts(boost::bind(RecordLoaded, &vLoaded, _1)));
+
+    // Everything is loaded, parents before their children
+    BOOST_CHECK_EQUAL(vLoaded.size(), chain.vIndex.size());
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), chain.vIndex.size());
+    std::set<const CBlockIndex*> setSeen;
+    for (size_t i = 0; i < vLoaded.size(); i++) {
+        const CBlockIndex* pindex = vLoaded[i];
+        BOOST_CHECK(pindex->pprev == NULL || setSeen.count(pindex->pprev));
+        BOOST_CHECK_EQUAL(pindex->nHeight, pindex->pprev ? pindex->pprev->nHeight + 1 : 0);
+        setSeen.insert(pindex);
+    }
+    for (size_t i = 0; i < chain.vIndex.size(); i++) {
+        BlockMap::const_iterator it = mapBlockIndex.find(chain.vHashes[i]);
+        BOOST_REQUIRE(it != mapBlockIndex.end());
+        BOOST_CHECK(it->second->GetBlockHeader().GetHash() == chain.vHashes[i]);
+        BOOST_CHECK_EQUAL(it->second->nHeight, chain.vIndex[i].nHeight);
+        BOOST_CHECK_EQUAL(it->second->nTx, 1);
+    }
+
+    // An entry stored under the wrong hash is rejected
+    CBlockIndex indexWrong(chain.vIndex[6]);
+    indexWrong.phashBlock = &chain.vHashes[5];
+    std::vector<const CBlockIndex*> vWrong(1, &indexWrong);
+    BOOST_CHECK(pblocktree->WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), 0, vWrong));
+    UnloadBlockIndex();
+    vLoaded.clear();
+    BOOST_CHECK(!pblocktree->LoadBlockIndexGuts(boost::bind(RecordLoaded, &vLoaded, _1)));
+    UnloadBlockIndex();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,118 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencoding.h"
+#include "blockstore.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockstore_tests, TestingSetup)
+
+static void CheckGenesisView(const CBlockIndex* pindex)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << genesis;
+
+    CBlockView view;
+    BOOST_CHECK(view.Read(pindex));
+    BOOST_CHECK(view.GetHeader().GetHash() == genesis.GetHash());
+
+    // The bytes are exactly what was written
+    const CBlockBytes& bytes = view.GetBytes();
+    BOOST_CHECK_EQUAL(bytes.size(), ss.size());
+    BOOST_CHECK(std::equal(bytes.begin(), bytes.end(), ss.begin()));
+
+    // and serialize as they are
+    CDataStream ssCopy(SER_NETWORK, PROTOCOL_VERSION);
+    ssCopy << bytes;
+    BOOST_CHECK(ssCopy.str() == ss.str());
+
+    const CBlock* pblock = view.GetBlock();
+    BOOST_CHECK(pblock != NULL);
+    BOOST_CHECK(pblock->GetHash() == genesis.GetHash());
+    BOOST_CHECK_EQUAL(pblock->vtx.size(), genesis.vtx.size());
+    BOOST_CHECK(pblock == view.GetBlock());
+
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex));
+    BOOST_CHECK(block.GetHash() == genesis.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(blockstore_read)
+{
+    const CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex != NULL);
+    BOOST_REQUIRE(pindex->nStatus & BLOCK_HAVE_DATA);
+
+    CheckGenesisView(pindex);
+
+    // Bytes handed out stay valid after the file stops being mapped
+    CBlockBytes bytes;
+    BOOST_CHECK(ReadRawBlockFromDisk(bytes, pindex->GetBlockPos()));
+    ReleaseBlockFile(pindex->GetBlockPos().nFile);
+    CBlock block;
+    CMemoryReader reader(bytes.begin(), bytes.end(), SER_DISK, CLIENT_VERSION);
+    reader >> block;
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK(block.GetHash() == pindex->GetBlockHash());
+
+    // Without mappings the file is read into a buffer
+    SetBlockFileMapping(false);
+    CheckGenesisView(pindex);
+    SetBlockFileMapping(DEFAULT_BLOCK_MMAP);
+
+    // A position that does not hold a block is rejected
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    pos.nPos += 1;
+    BOOST_CHECK(!ReadRawBlockFromDisk(bytes, pos));
+    BOOST_CHECK(bytes.empty());
+    BOOST_CHECK(!ReadRawBlockFromDisk(bytes, CDiskBlockPos(pos.nFile + 1, 8)));
+}
+
+BOOST_AUTO_TEST_CASE(blockstore_compressed)
+{
+    // The genesis block, padded with copies of its coinbase so it compresses
+    CBlock block(Params().GenesisBlock());
+    block.vtx.resize(50, block.vtx[0]);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+
+    std::vector<char> vRecord;
+    EncodeBlockRecord(block, vRecord);
+    BOOST_CHECK(!IsCompressedRecord(vRecord.data(), vRecord.size()));
+    SetBlockCompression(true);
+    EncodeBlockRecord(block, vRecord);
+    SetBlockCompression(DEFAULT_COMPRESS_BLOCKS);
+    BOOST_CHECK(IsCompressedRecord(vRecord.data(), vRecord.size()));
+    BOOST_CHECK(vRecord.size() < ss.size());
+
+    CDiskBlockPos pos(chainActive.Genesis()->GetBlockPos().nFile + 1, 0);
+    BOOST_CHECK(WriteBlockToDisk(vRecord, pos, Params().MessageStart()));
+    BOOST_CHECK_EQUAL(pos.nPos, BLOCK_RECORD_HEADER_SIZE);
+
+    // Readers get the block as it would have been stored without compression
+    for (int i = 0; i < 2; i++) {
+        SetBlockFileMapping(i == 0);
+        CBlockBytes bytes;
+        BOOST_CHECK(ReadRawBlockFromDisk(bytes, pos));
+        BOOST_CHECK_EQUAL(bytes.size(), ss.size());
+        BOOST_CHECK(std::equal(bytes.begin(), bytes.end(), ss.begin()));
+
+        CBlock blockRead;
+        BOOST_CHECK(ReadBlockFromDisk(blockRead, pos));
+        BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+        BOOST_CHECK_EQUAL(blockRead.vtx.size(), block.vtx.size());
+    }
+    SetBlockFileMapping(DEFAULT_BLOCK_MMAP);
+    ReleaseBlockFile(pos.nFile);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
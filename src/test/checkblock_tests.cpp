@@ -3,6 +3,8 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
+#include "chainparams.h"
 #include "clientversion.h"
 #include "consensus/validation.h"
 #include "main.h"
@@ -15,6 +17,7 @@
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 
 BOOST_FIXTURE_TEST_SUITE(CheckBlock_tests, BasicTestingSetup)
@@ -65,4 +68,66 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(check_block_headers)
+{
+    CBlockHeader genesis = Params().GenesisBlock().GetBlockHeader();
+    std::vector<CBlockHeader> headers(20, genesis);
+    std::vector<unsigned char> vValid;
+
+    // Without header checking threads, every header is left to AcceptBlockHeader
+    CheckBlockHeaders(headers, vValid);
+    BOOST_CHECK(vValid == std::vector<unsigned char>(headers.size(), 0));
+
+    boost::thread_group threadGroup;
+    nHeaderCheckThreads = 3;
+    for (int i = 0; i < nHeaderCheckThreads - 1; i++)
+        threadGroup.create_thread(&ThreadHeaderCheck);
+
+    // The parent of the first header is unknown, so none are checked
+    CheckBlockHeaders(headers, vValid);
+    BOOST_CHECK(vValid == std::vector<unsigned char>(headers.size(), 0));
+
+    // Once it is known only the first header connects; the copies of it
+    // that follow do not continue from it
+    CBlockIndex indexParent;
+    {
+        LOCK(cs_main);
+        mapBlockIndex[genesis.hashPrevBlock] = &indexParent;
+    }
+    std::vector<unsigned char> vExpected(headers.size(), 0);
+    vExpected[0] = 1;
+    CheckBlockHeaders(headers, vValid);
+    BOOST_CHECK(vValid == vExpected);
+
+    // An invalid solution is not marked
+    headers[0].nNonce = ArithToUint256(UintToArith256(genesis.nNonce) + 1);
+    CheckBlockHeaders(headers, vValid);
+    BOOST_CHECK(!vValid[0]);
+    headers[0] = genesis;
+
+    // Nor is anything after a parent that failed
+    indexParent.nStatus |= BLOCK_FAILED_VALID;
+    CheckBlockHeaders(headers, vValid);
+    BOOST_CHECK(vValid == std::vector<unsigned char>(headers.size(), 0));
+    indexParent.nStatus = 0;
+
+    // Headers that are already known are not checked again
+    CBlockIndex index(genesis);
+    {
+        LOCK(cs_main);
+        mapBlockIndex[genesis.GetHash()] = &index;
+    }
+    CheckBlockHeaders(headers, vValid);
+    BOOST_CHECK(vValid == std::vector<unsigned char>(headers.size(), 0));
+    {
+        LOCK(cs_main);
+        mapBlockIndex.erase(genesis.GetHash());
+        mapBlockIndex.erase(genesis.hashPrevBlock);
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    nHeaderCheckThreads = 0;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -11,6 +11,7 @@
 #include "test/test_bitcoin.h"
 #include "consensus/validation.h"
 #include "main.h"
+#include "txdb.h"
 #include "undo.h"
 #include "pubkey.h"
 
@@ -26,7 +27,7 @@ class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
     uint256 hashBestAnchor_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
     std::map<uint256, ZCIncrementalMerkleTree> mapAnchors_;
     std::map<uint256, bool> mapNullifiers_;
 
@@ -66,39 +67,37 @@ public:
 
     uint256 GetBestAnchor() const { return hashBestAnchor_; }
 
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
-    {
-        CCoins coins;
-        return GetCoins(txid, coins);
-    }
-
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
     bool BatchWrite(CCoinsMap& mapCoins,
                     const uint256& hashBlock,
                     const uint256& hashAnchor,
                     CAnchorsMap& mapAnchors,
-                    CNullifiersMap& mapNullifiers)
+                    CNullifiersMap& mapNullifiers,
+                    const CCoinsSetCommitment* pcommitment)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
-            map_[it->first] = it->second.coins;
-            if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
-                // Randomly delete empty entries on write.
-                map_.erase(it->first);
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                // Same optimization used in CCoinsViewDB is to only write dirty entries.
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
+                    // Randomly delete empty entries on write.
+                    map_.erase(it->first);
+                }
             }
             mapCoins.erase(it++);
         }
@@ -144,7 +143,7 @@ public:
                      memusage::DynamicUsage(cacheAnchors) +
                      memusage::DynamicUsage(cacheNullifiers);
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.DynamicMemoryUsage();
+            ret += it->second.coin.DynamicMemoryUsage();
         }
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
@@ -616,7 +615,7 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
+// It will randomly create/update/delete Coin entries to a tip of caches, with
 // txids picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
@@ -628,13 +627,15 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool removed_all_caches = false;
     bool reached_4_caches = false;
     bool added_an_entry = false;
+    bool added_an_unspendable_entry = false;
     bool removed_an_entry = false;
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool uncached_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -652,36 +653,51 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         // Do a random modification.
         {
             uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
-                    added_an_entry = true;
+            Coin& coin = result[COutPoint(txid, 0)];
+            const Coin& entry = (insecure_rand() % 500 == 0) ? AccessByTxid(*stack.back(), txid) : stack.back()->AccessCoin(COutPoint(txid, 0));
+            BOOST_CHECK(coin == entry);
+
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.nHeight = 1;
+                if (insecure_rand() % 16 == 0 && coin.IsSpent()) {
+                    newcoin.out.scriptPubKey.assign(1 + (insecure_rand() & 0x3f), OP_RETURN);
+                    BOOST_CHECK(newcoin.out.scriptPubKey.IsUnspendable());
+                    added_an_unspendable_entry = true;
                 } else {
-                    updated_an_entry = true;
+                    newcoin.out.scriptPubKey.assign(insecure_rand() & 0x3f, 0); // Random sizes so we can test memory usage accounting
+                    (coin.IsSpent() ? added_an_entry : updated_an_entry) = true;
+                    coin = newcoin;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                stack.back()->AddCoin(COutPoint(txid, 0), std::move(newcoin), !coin.IsSpent() || insecure_rand() & 1);
             } else {
-                coins.Clear();
-                entry->Clear();
                 removed_an_entry = true;
+                coin.Clear();
+                stack.back()->SpendCoin(COutPoint(txid, 0));
             }
         }
 
+        // Once every 10 iterations, remove a random entry from the cache
+        if (insecure_rand() % 10 == 0) {
+            COutPoint out(txids[insecure_rand() % txids.size()], 0);
+            int cacheid = insecure_rand() % stack.size();
+            stack[cacheid]->Uncache(out);
+            uncached_an_entry |= !stack[cacheid]->HaveCoinInCache(out);
+        }
+
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
             BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
@@ -721,10 +737,12 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(removed_all_caches);
     BOOST_CHECK(reached_4_caches);
     BOOST_CHECK(added_an_entry);
+    BOOST_CHECK(added_an_unspendable_entry);
     BOOST_CHECK(removed_an_entry);
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(uncached_an_entry);
 }
 
 BOOST_AUTO_TEST_CASE(coins_coinbase_spends)
@@ -774,53 +792,36 @@ BOOST_AUTO_TEST_CASE(coins_coinbase_spends)
 BOOST_AUTO_TEST_CASE(ccoins_serialization)
 {
     // Good example
-    CDataStream ss1(ParseHex("0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e"), SER_DISK, CLIENT_VERSION);
-    CCoins cc1;
+    CDataStream ss1(ParseHex("97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    Coin cc1;
     ss1 >> cc1;
-    BOOST_CHECK_EQUAL(cc1.nVersion, 1);
     BOOST_CHECK_EQUAL(cc1.fCoinBase, false);
     BOOST_CHECK_EQUAL(cc1.nHeight, 203998);
-    BOOST_CHECK_EQUAL(cc1.vout.size(), 2);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(0), false);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(1), true);
-    BOOST_CHECK_EQUAL(cc1.vout[1].nValue, 60000000000ULL);
-    BOOST_CHECK_EQUAL(HexStr(cc1.vout[1].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
+    BOOST_CHECK_EQUAL(cc1.out.nValue, 60000000000ULL);
+    BOOST_CHECK_EQUAL(HexStr(cc1.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
 
     // Good example
-    CDataStream ss2(ParseHex("0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b"), SER_DISK, CLIENT_VERSION);
-    CCoins cc2;
+    CDataStream ss2(ParseHex("8ddf77bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4"), SER_DISK, CLIENT_VERSION);
+    Coin cc2;
     ss2 >> cc2;
-    BOOST_CHECK_EQUAL(cc2.nVersion, 1);
     BOOST_CHECK_EQUAL(cc2.fCoinBase, true);
     BOOST_CHECK_EQUAL(cc2.nHeight, 120891);
-    BOOST_CHECK_EQUAL(cc2.vout.size(), 17);
-    for (int i = 0; i < 17; i++) {
-        BOOST_CHECK_EQUAL(cc2.IsAvailable(i), i == 4 || i == 16);
-    }
-    BOOST_CHECK_EQUAL(cc2.vout[4].nValue, 234925952);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[4].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("61b01caab50f1b8e9c50a5057eb43c2d9563a4ee"))))));
-    BOOST_CHECK_EQUAL(cc2.vout[16].nValue, 110397);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[16].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
+    BOOST_CHECK_EQUAL(cc2.out.nValue, 110397);
+    BOOST_CHECK_EQUAL(HexStr(cc2.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
 
     // Smallest possible example
-    CDataStream ssx(SER_DISK, CLIENT_VERSION);
-    BOOST_CHECK_EQUAL(HexStr(ssx.begin(), ssx.end()), "");
-
-    CDataStream ss3(ParseHex("0002000600"), SER_DISK, CLIENT_VERSION);
-    CCoins cc3;
+    CDataStream ss3(ParseHex("000006"), SER_DISK, CLIENT_VERSION);
+    Coin cc3;
     ss3 >> cc3;
-    BOOST_CHECK_EQUAL(cc3.nVersion, 0);
     BOOST_CHECK_EQUAL(cc3.fCoinBase, false);
     BOOST_CHECK_EQUAL(cc3.nHeight, 0);
-    BOOST_CHECK_EQUAL(cc3.vout.size(), 1);
-    BOOST_CHECK_EQUAL(cc3.IsAvailable(0), true);
-    BOOST_CHECK_EQUAL(cc3.vout[0].nValue, 0);
-    BOOST_CHECK_EQUAL(cc3.vout[0].scriptPubKey.size(), 0);
+    BOOST_CHECK_EQUAL(cc3.out.nValue, 0);
+    BOOST_CHECK_EQUAL(cc3.out.scriptPubKey.size(), 0);
 
     // scriptPubKey that ends beyond the end of the stream
-    CDataStream ss4(ParseHex("0002000800"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss4(ParseHex("000007"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc4;
+        Coin cc4;
         ss4 >> cc4;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
@@ -831,13 +832,177 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     uint64_t x = 3000000000ULL;
     tmp << VARINT(x);
     BOOST_CHECK_EQUAL(HexStr(tmp.begin(), tmp.end()), "8a95c0bb00");
-    CDataStream ss5(ParseHex("0002008a95c0bb0000"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss5(ParseHex("00008a95c0bb00"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc5;
+        Coin cc5;
         ss5 >> cc5;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(txundo_serialization)
+{
+    // Undo records keep the layout written by the per-transaction coins
+    // format: a dummy version byte follows the height of spent outputs.
+    CTxUndo txundo;
+    txundo.vprevout.push_back(Coin(CTxOut(0, CScript()), 5, true));
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txundo;
+    BOOST_CHECK_EQUAL(HexStr(ss.begin(), ss.end()), "010b000006");
+
+    CTxUndo txundo2;
+    ss >> txundo2;
+    BOOST_CHECK_EQUAL(txundo2.vprevout.size(), 1);
+    BOOST_CHECK(txundo2.vprevout[0] == txundo.vprevout[0]);
+    BOOST_CHECK_EQUAL(txundo2.vprevout[0].nHeight, 5);
+    BOOST_CHECK_EQUAL(txundo2.vprevout[0].fCoinBase, true);
+
+    // Inputs that were not the last spend of their transaction carry no metadata.
+    CDataStream ss2(ParseHex("01000006"), SER_DISK, CLIENT_VERSION);
+    CTxUndo txundo3;
+    ss2 >> txundo3;
+    BOOST_CHECK_EQUAL(txundo3.vprevout.size(), 1);
+    BOOST_CHECK_EQUAL(txundo3.vprevout[0].nHeight, 0);
+}
+
+static void CheckCoinsDBFlush(CCoinsViewDB& db)
+{
+    CCoinsViewCache cache(&db);
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 100; i++) {
+        Coin coin;
+        coin.out.nValue = insecure_rand() + 1;
+        coin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+        coin.nHeight = 1;
+        outpoints.push_back(COutPoint(GetRandHash(), 0));
+        cache.AddCoin(outpoints.back(), std::move(coin), false);
+    }
+    uint256 hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Flush());
+
+    // Whether or not the flush is still being written, the view must
+    // already reflect it.
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+    for (size_t i = 0; i < outpoints.size(); i++) {
+        BOOST_CHECK(db.HaveCoin(outpoints[i]));
+    }
+
+    // Spend half of the coins in a second flush.
+    for (size_t i = 0; i < outpoints.size(); i += 2) {
+        BOOST_CHECK(cache.SpendCoin(outpoints[i]));
+    }
+    uint256 hashBlock2 = GetRandHash();
+    cache.SetBestBlock(hashBlock2);
+    BOOST_CHECK(cache.Flush());
+    for (size_t i = 0; i < outpoints.size(); i++) {
+        BOOST_CHECK_EQUAL(db.HaveCoin(outpoints[i]), i % 2 == 1);
+    }
+
+    BOOST_CHECK(db.Sync());
+    BOOST_CHECK(!db.HasWriteFailed());
+    BOOST_CHECK(db.GetBestBlock() == hashBlock2);
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+    for (size_t i = 0; i < outpoints.size(); i++) {
+        Coin coin;
+        BOOST_CHECK_EQUAL(db.GetCoin(outpoints[i], coin), i % 2 == 1);
+    }
+    BOOST_CHECK_EQUAL(db.GetFlushStats().nFlushes, 2U);
+    BOOST_CHECK(!db.GetFlushStats().fPending);
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_write_behind, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true, false, true);
+    BOOST_CHECK(db.IsWriteBehind());
+    CheckCoinsDBFlush(db);
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_partial_batches, TestingSetup)
+{
+    // Force every coin into its own batch, so the head blocks marker is
+    // written and cleared again.
+    mapArgs["-dbbatchsize"] = "1";
+    CCoinsViewDB db(1 << 20, true, false, false);
+    mapArgs.erase("-dbbatchsize");
+    CheckCoinsDBFlush(db);
+}
+
+static void CheckSetCommitment(const CCoinsSetCommitment& a, const CCoinsSetCommitment& b)
+{
+    BOOST_CHECK_EQUAL(a.nTransactionOutputs, b.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(a.nSerializedSize, b.nSerializedSize);
+    BOOST_CHECK_EQUAL(a.nTotalAmount, b.nTotalAmount);
+    uint256 hashA, hashB;
+    CCoinsSetCommitment(a).muhash.Finalize(hashA);
+    CCoinsSetCommitment(b).muhash.Finalize(hashB);
+    BOOST_CHECK(hashA == hashB);
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_set_commitment, TestingSetup)
+{
+    for (int fWriteBehind = 0; fWriteBehind <= 1; fWriteBehind++) {
+        CCoinsViewDB db(1 << 20, true, false, fWriteBehind);
+        CCoinsSetCommitment stored, scanned;
+        uint256 hashBlock;
+        BOOST_CHECK(!db.GetSetCommitment(stored));
+        BOOST_CHECK(db.RebuildSetCommitment());
+        BOOST_CHECK(db.GetSetCommitment(stored));
+        BOOST_CHECK_EQUAL(stored.nTransactionOutputs, 0);
+
+        // Add coins spread over all shards, recording them in the commitment
+        // as ConnectBlock does.
+        CCoinsViewCache cache(&db);
+        BOOST_CHECK(cache.HaveSetCommitment());
+        std::vector<COutPoint> outpoints;
+        CCoinsSetCommitment delta;
+        for (int i = 0; i < 1000; i++) {
+            Coin coin;
+            coin.out.nValue = insecure_rand() % 100000 + 1;
+            coin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+            coin.nHeight = insecure_rand() % 1000 + 1;
+            coin.fCoinBase = insecure_rand() & 1;
+            outpoints.push_back(COutPoint(GetRandHash(), insecure_rand() % 300));
+            delta.Add(outpoints.back(), coin);
+            cache.AddCoin(outpoints.back(), std::move(coin), false);
+        }
+        cache.UpdateSetCommitment(delta);
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+
+        BOOST_CHECK(db.GetSetCommitment(stored));
+        BOOST_CHECK(db.ComputeSetCommitment(scanned, hashBlock));
+        BOOST_CHECK(hashBlock == db.GetBestBlock());
+        BOOST_CHECK_EQUAL(scanned.nTransactionOutputs, 1000);
+        CheckSetCommitment(stored, scanned);
+
+        // Spend some of them again.
+        delta = CCoinsSetCommitment();
+        for (size_t i = 0; i < outpoints.size(); i += 3) {
+            Coin coin;
+            BOOST_CHECK(cache.SpendCoin(outpoints[i], &coin));
+            delta.Remove(outpoints[i], coin);
+        }
+        cache.UpdateSetCommitment(delta);
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+
+        BOOST_CHECK(db.GetSetCommitment(stored));
+        BOOST_CHECK(db.ComputeSetCommitment(scanned, hashBlock));
+        CheckSetCommitment(stored, scanned);
+
+        // A flush that changes coins without a commitment drops the stored one.
+        CCoinsMap mapCoins;
+        CAnchorsMap mapAnchors;
+        CNullifiersMap mapNullifiers;
+        CCoinsCacheEntry& entry = mapCoins[outpoints[1]];
+        entry.flags = CCoinsCacheEntry::DIRTY;
+        BOOST_CHECK(db.BatchWrite(mapCoins, GetRandHash(), uint256(), mapAnchors, mapNullifiers, NULL));
+        BOOST_CHECK(!db.GetSetCommitment(stored));
+        BOOST_CHECK(db.Sync());
+        BOOST_CHECK(!db.GetSetCommitment(stored));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
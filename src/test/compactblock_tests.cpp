@@ -0,0 +1,179 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "compactblock.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(compactblock_tests, BasicTestingSetup)
+
+static CBlock BuildBlockTestCase(size_t nTx)
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.push_back(tx);
+    block.nVersion = 4;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    for (size_t i = 1; i < nTx; i++) {
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = 0;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// The message is serialized and read back, as a peer would
+static CBlockHeaderAndShortTxIDs SendCompactBlock(const CBlock& block)
+{
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+
+    CBlockHeaderAndShortTxIDs cmpctblockReceived;
+    stream >> cmpctblockReceived;
+    BOOST_CHECK(stream.empty());
+    return cmpctblockReceived;
+}
+
+BOOST_AUTO_TEST_CASE(rebuild_from_mempool)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block = BuildBlockTestCase(4);
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs cmpctblock = SendCompactBlock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock), READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.GetMissingIndexes().empty());
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1U);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 3U);
+
+    CBlock blockRebuilt;
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockRebuilt, std::vector<CTransaction>()), READ_STATUS_OK);
+    BOOST_CHECK(blockRebuilt.GetHash() == block.GetHash());
+    BOOST_CHECK(blockRebuilt.BuildMerkleTree() == block.hashMerkleRoot);
+    BOOST_CHECK(blockRebuilt.fMerkleChecked);
+}
+
+BOOST_AUTO_TEST_CASE(rebuild_with_missing_transactions)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block = BuildBlockTestCase(6);
+    // The mempool has all but the second and fifth transactions
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        if (i != 2 && i != 5)
+            pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 0, 0, 0.0, 1));
+    }
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK_EQUAL(partialBlock.InitData(SendCompactBlock(block)), READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(2));
+
+    BlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    req.indexes = partialBlock.GetMissingIndexes();
+    BOOST_REQUIRE_EQUAL(req.indexes.size(), 2U);
+    BOOST_CHECK_EQUAL(req.indexes[0], 2);
+    BOOST_CHECK_EQUAL(req.indexes[1], 5);
+
+    // The request goes out and the answer comes back over the wire
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req;
+    BlockTransactionsRequest reqReceived;
+    stream >> reqReceived;
+    BOOST_CHECK(reqReceived.indexes == req.indexes);
+
+    BlockTransactions resp(reqReceived);
+    for (size_t i = 0; i < reqReceived.indexes.size(); i++)
+        resp.txn[i] = block.vtx[reqReceived.indexes[i]];
+    stream << resp;
+    BlockTransactions respReceived;
+    stream >> respReceived;
+
+    // Too few or the wrong transactions are caught
+    CBlock blockRebuilt;
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockRebuilt, std::vector<CTransaction>(1, respReceived.txn[0])), READ_STATUS_INVALID);
+    std::vector<CTransaction> vtxWrong(respReceived.txn);
+    std::swap(vtxWrong[0], vtxWrong[1]);
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockRebuilt, vtxWrong), READ_STATUS_FAILED);
+
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockRebuilt, respReceived.txn), READ_STATUS_OK);
+    BOOST_CHECK(blockRebuilt.GetHash() == block.GetHash());
+    BOOST_CHECK(blockRebuilt.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_size)
+{
+    // Each transaction but the coinbase takes six bytes
+    CBlock block = BuildBlockTestCase(100);
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    size_t nFullSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    size_t nCompactSize = ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION);
+    size_t nHeaderSize = ::GetSerializeSize(block.GetBlockHeader(), SER_NETWORK, PROTOCOL_VERSION);
+    size_t nCoinbaseSize = ::GetSerializeSize(block.vtx[0], SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(nCompactSize, nHeaderSize + 8 + 1 + 99 * 6 + 1 + 1 + nCoinbaseSize);
+    BOOST_CHECK(nCompactSize < nFullSize);
+}
+
+BOOST_AUTO_TEST_CASE(invalid_compact_blocks)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A prefilled index beyond the transactions of the block
+    CBlock block = BuildBlockTestCase(3);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    uint64_t nShortIDs = 2;
+    uint64_t nPrefilled = 1;
+    uint64_t nIndex = 3;
+    uint32_t nShortIDLow = 0;
+    uint16_t nShortIDHigh = 0;
+    stream << block.GetBlockHeader() << (uint64_t)0 << COMPACTSIZE(nShortIDs);
+    stream << nShortIDLow << nShortIDHigh << nShortIDLow << nShortIDHigh;
+    stream << COMPACTSIZE(nPrefilled) << COMPACTSIZE(nIndex) << block.vtx[0];
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    stream >> cmpctblock;
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock), READ_STATUS_INVALID);
+
+    // Two transactions with the same short id cannot be told apart
+    stream.clear();
+    nIndex = 0;
+    stream << block.GetBlockHeader() << (uint64_t)0 << COMPACTSIZE(nShortIDs);
+    stream << nShortIDLow << nShortIDHigh << nShortIDLow << nShortIDHigh;
+    stream << COMPACTSIZE(nPrefilled) << COMPACTSIZE(nIndex) << block.vtx[0];
+    CBlockHeaderAndShortTxIDs cmpctblockCollision;
+    stream >> cmpctblockCollision;
+    PartiallyDownloadedBlock partialBlockCollision(&pool);
+    BOOST_CHECK_EQUAL(partialBlockCollision.InitData(cmpctblockCollision), READ_STATUS_FAILED);
+
+    // Indexes of a getblocktxn may not overflow 16 bits
+    stream.clear();
+    uint64_t nIndexes = 2;
+    uint64_t nFirst = 0xfffe;
+    uint64_t nSecond = 1;
+    stream << uint256() << COMPACTSIZE(nIndexes) << COMPACTSIZE(nFirst) << COMPACTSIZE(nSecond);
+    BlockTransactionsRequest req;
+    BOOST_CHECK_THROW(stream >> req, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,12 +3,14 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "crypto/muhash.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "hash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
@@ -132,6 +134,46 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256_multilane) {
+    // Enough blocks to exercise the 8-way, 4-way and single lane paths
+    const size_t blocks = 8 + 4 + 3;
+    std::vector<unsigned char> in(64 * blocks);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = insecure_rand();
+
+    std::vector<unsigned char> d64(32 * blocks), c64(32 * blocks);
+    for (size_t i = 0; i < blocks; i++) {
+        uint256 hash = Hash(in.begin() + 64 * i, in.begin() + 64 * (i + 1));
+        std::copy(hash.begin(), hash.end(), d64.begin() + 32 * i);
+        CSHA256().Write(&in[64 * i], 64).FinalizeNoPadding(&c64[32 * i]);
+    }
+
+    // Every combination of back ends must agree with the reference
+    for (int mask = 0; mask <= sha256_implementation::USE_ALL; mask++) {
+        SHA256AutoDetect(sha256_implementation::UseImplementation(mask));
+        BOOST_CHECK(SHA256SelfTest());
+
+        std::vector<unsigned char> out(32 * blocks);
+        SHA256D64(out.data(), in.data(), blocks);
+        BOOST_CHECK(out == d64);
+        SHA256Compress64(out.data(), in.data(), blocks);
+        BOOST_CHECK(out == c64);
+
+        TestSHA256(std::string(1000000, 'a'),
+                   "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+    }
+    SHA256AutoDetect();
+
+    // The same, naming the back ends on each call instead of switching
+    for (int mask = 0; mask <= sha256_implementation::USE_ALL; mask++) {
+        std::vector<unsigned char> out(32 * blocks);
+        SHA256D64(out.data(), in.data(), blocks, sha256_implementation::UseImplementation(mask));
+        BOOST_CHECK(out == d64);
+        SHA256Compress64(out.data(), in.data(), blocks, sha256_implementation::UseImplementation(mask));
+        BOOST_CHECK(out == c64);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
@@ -249,4 +291,84 @@ BOOST_AUTO_TEST_CASE(hmac_sha512_testvectors) {
                    "b6022cac3c4982b10d5eeb55c3e4de15134676fb6de0446065c97440fa8c6a58");
 }
 
+static MuHash3072 FromInt(unsigned char i) {
+    unsigned char tmp[32] = {i, 0};
+    return MuHash3072(tmp, sizeof(tmp));
+}
+
+BOOST_AUTO_TEST_CASE(muhash_tests)
+{
+    uint256 out;
+
+    for (int iter = 0; iter < 10; ++iter) {
+        // The result does not depend on the order of insertions and removals
+        uint256 res;
+        int table[4];
+        for (int i = 0; i < 4; ++i) {
+            table[i] = insecure_rand() & 7;
+        }
+        for (int order = 0; order < 4; ++order) {
+            MuHash3072 acc;
+            for (int i = 0; i < 4; ++i) {
+                int t = table[i ^ order];
+                if (t & 4) {
+                    acc /= FromInt(t & 3);
+                } else {
+                    acc *= FromInt(t & 3);
+                }
+            }
+            acc.Finalize(out);
+            if (order == 0) {
+                res = out;
+            } else {
+                BOOST_CHECK(res == out);
+            }
+        }
+
+        // Removing what was added gives the hash of the empty set
+        MuHash3072 x = FromInt(insecure_rand() & 15);
+        MuHash3072 y = FromInt(insecure_rand() & 15);
+        MuHash3072 z;
+        z *= x;
+        z *= y;
+        y *= x;
+        z /= y;
+        z.Finalize(out);
+
+        uint256 out2;
+        MuHash3072 a;
+        a.Finalize(out2);
+        BOOST_CHECK(out == out2);
+    }
+
+    // Test vector shared with Bitcoin Core
+    MuHash3072 acc = FromInt(0);
+    acc *= FromInt(1);
+    acc /= FromInt(2);
+    acc.Finalize(out);
+    BOOST_CHECK_EQUAL(out.GetHex(), "10d312b100cbd32ada024a6646e40d3482fcff103668d2625f10002a607d5863");
+
+    // Insert/Remove of raw data match multiplication/division by single-element sets
+    unsigned char tmp[32] = {0};
+    MuHash3072 muhash;
+    tmp[0] = 0; muhash.Insert(tmp, sizeof(tmp));
+    tmp[0] = 1; muhash.Insert(tmp, sizeof(tmp));
+    tmp[0] = 2; muhash.Remove(tmp, sizeof(tmp));
+    uint256 out3;
+    muhash.Finalize(out3);
+    BOOST_CHECK(out == out3);
+
+    // Serialization keeps numerator and denominator apart
+    MuHash3072 serchk = FromInt(1);
+    serchk /= FromInt(2);
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << serchk;
+    BOOST_CHECK_EQUAL(ss.size(), 2 * Num3072::BYTE_SIZE);
+    MuHash3072 deser;
+    ss >> deser;
+    deser *= FromInt(0);
+    deser.Finalize(out3);
+    BOOST_CHECK(out == out3);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
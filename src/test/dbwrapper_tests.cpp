@@ -0,0 +1,90 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "leveldbwrapper.h"
+#include "uint256.h"
+#include "util.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include <leveldb/cache.h>
+#include <leveldb/filter_policy.h>
+
+BOOST_FIXTURE_TEST_SUITE(dbwrapper_tests, BasicTestingSetup)
+
+static bool CheckDbTune(const std::string& strTune)
+{
+    mapMultiArgs["-dbtune"].assign(1, strTune);
+    std::string strError;
+    bool fValid = CheckLevelDBProfiles(strError);
+    BOOST_CHECK(fValid == strError.empty());
+    mapMultiArgs.erase("-dbtune");
+    return fValid;
+}
+
+BOOST_AUTO_TEST_CASE(dbwrapper_profiles)
+{
+    BOOST_CHECK(CheckDbTune("chainstate.bloombits=0"));
+    BOOST_CHECK(CheckDbTune("index.maxopenfiles=1000"));
+    BOOST_CHECK(CheckDbTune("paymentdisclosure.blocksize=65536"));
+    BOOST_CHECK(CheckDbTune("chainstate.blockcache=45"));
+
+    BOOST_CHECK(!CheckDbTune("chainstate"));
+    BOOST_CHECK(!CheckDbTune("chainstate.bloombits"));
+    BOOST_CHECK(!CheckDbTune("chainstate.bloombits=ten"));
+    BOOST_CHECK(!CheckDbTune("wallet.bloombits=10"));
+    BOOST_CHECK(!CheckDbTune("chainstate.compression=1"));
+    BOOST_CHECK(!CheckDbTune("chainstate.maxopenfiles=10"));
+    BOOST_CHECK(!CheckDbTune("chainstate.writebuffer=0"));
+    // Block cache and both write buffers have to fit in the cache
+    BOOST_CHECK(!CheckDbTune("chainstate.blockcache=90"));
+
+    mapMultiArgs["-dbtune"].push_back("index.bloombits=16");
+    mapMultiArgs["-dbtune"].push_back("chainstate.bloombits=0");
+    mapMultiArgs["-dbtune"].push_back("index.writebuffer=10");
+    CLevelDBProfile profile = GetLevelDBProfile("index");
+    mapMultiArgs.erase("-dbtune");
+    BOOST_CHECK_EQUAL(profile.nBloomBits, 16);
+    BOOST_CHECK_EQUAL(profile.nWriteBufferPercent, 10);
+    BOOST_CHECK_EQUAL(profile.nBlockCachePercent, CLevelDBProfile().nBlockCachePercent);
+
+    // The payment disclosure database keeps LevelDB's own defaults
+    CLevelDBProfile pdprofile = GetLevelDBProfile("paymentdisclosure");
+    BOOST_CHECK_EQUAL(pdprofile.nMaxOpenFiles, 1000);
+    BOOST_CHECK_EQUAL(pdprofile.nBloomBits, 0);
+
+    leveldb::Options options = GetLevelDBOptions(profile, 1 << 20);
+    BOOST_CHECK_EQUAL(options.write_buffer_size, (1 << 20) / 10);
+    BOOST_CHECK(options.filter_policy != NULL);
+    delete options.filter_policy;
+    delete options.block_cache;
+}
+
+BOOST_AUTO_TEST_CASE(dbwrapper_stats)
+{
+    BOOST_CHECK(GetLevelDBStats().empty());
+    {
+        CLevelDBWrapper db("index", 1 << 20, true);
+        for (int i = 0; i < 100; i++)
+            BOOST_CHECK(db.Write(std::make_pair('b', i), uint256()));
+        BOOST_CHECK(db.Exists(std::make_pair('b', 1)));
+        uint256 hash;
+        BOOST_CHECK(db.Read(std::make_pair('b', 2), hash));
+
+        std::vector<CLevelDBStats> vStats = GetLevelDBStats();
+        BOOST_CHECK_EQUAL(vStats.size(), 1);
+        const CLevelDBStats& stats = vStats[0];
+        BOOST_CHECK_EQUAL(stats.strName, "index");
+        BOOST_CHECK_EQUAL(stats.nReads, 2);
+        BOOST_CHECK_EQUAL(stats.nBatches, 100);
+        BOOST_CHECK(stats.nBytesWritten > 100 * 32);
+        BOOST_CHECK_EQUAL(stats.nWriteBufferSize, (1 << 20) / 4);
+        BOOST_CHECK(!stats.strStats.empty());
+        BOOST_CHECK(!stats.vFilesAtLevel.empty());
+    }
+    BOOST_CHECK(GetLevelDBStats().empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
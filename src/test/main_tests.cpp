@@ -4,7 +4,11 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chainparams.h"
+#include "compactblock.h"
 #include "main.h"
+#include "net.h"
+#include "pow.h"
+#include "random.h"
 
 #include "test/test_bitcoin.h"
 
@@ -74,4 +78,93 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(block_download_window)
+{
+    // Until both the block interval and the ping time are known
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(0, 50000), DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(100000, std::numeric_limits<int64_t>::max()), DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A peer on a short link needs little more than the block being sent
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(100000, 0), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    // A link limited by its bandwidth: one 2 MB block every two seconds
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(2000000, 100000), 3);
+    // A window of 8 over a 200 ms round trip keeps the link idle most of the
+    // time, so the window more than doubles
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(200000 / 8, 200000), 18);
+    BOOST_CHECK_EQUAL(GetBlockDownloadWindow(1000, 1000000), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+// Feed node a cmpctblock message for block, as if it came off the wire
+static void ReceiveCompactBlock(CNode& node, const CBlock& block)
+{
+    CSharedMessage msg = MakeSharedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+    {
+        LOCK(node.cs_vRecvMsg);
+        BOOST_CHECK(node.ReceiveMsgBytes(&(*msg)[0], msg->size()));
+        ProcessMessages(&node);
+    }
+    // Replies can't be sent over the dummy socket; that is no reason to
+    // stop listening to the peer here
+    node.fDisconnect = false;
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_in_flight)
+{
+    // A block on top of the tip; once its header is in mapBlockIndex it is
+    // not checked again, so it does not need a valid proof of work
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+    block.vtx.push_back(tx);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    block.vtx.push_back(tx);
+    block.nVersion = 4;
+    block.hashPrevBlock = chainActive.Tip()->GetBlockHash();
+    block.nTime = chainActive.Tip()->nTime + 1;
+    block.nBits = chainActive.Tip()->nBits;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    uint256 hash = block.GetHash();
+
+    CBlockIndex* pindex = new CBlockIndex(block);
+    {
+        LOCK(cs_main);
+        pindex->phashBlock = &mapBlockIndex.insert(std::make_pair(hash, pindex)).first->first;
+        pindex->pprev = chainActive.Tip();
+        pindex->nHeight = pindex->pprev->nHeight + 1;
+        pindex->nChainWork = pindex->pprev->nChainWork + GetBlockProof(*pindex);
+        pindex->RaiseValidity(BLOCK_VALID_TREE);
+    }
+
+    {
+        CNode dummyNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", Params().GetDefaultPort())), "", true);
+        dummyNode.nVersion = PROTOCOL_VERSION;
+        CNodeStateStats stats;
+
+        // The mempool lacks the second transaction, so it is asked for and
+        // the block is in flight from the peer
+        ReceiveCompactBlock(dummyNode, block);
+        BOOST_CHECK(GetNodeStateStats(dummyNode.GetId(), stats));
+        BOOST_CHECK_EQUAL(stats.vHeightInFlight.size(), 1);
+
+        // The transactions arrive some other way; announcing the block again
+        // must free the download slot rather than leave it in flight
+        {
+            LOCK(cs_main);
+            pindex->nTx = block.vtx.size();
+        }
+        ReceiveCompactBlock(dummyNode, block);
+        stats = CNodeStateStats();
+        BOOST_CHECK(GetNodeStateStats(dummyNode.GetId(), stats));
+        BOOST_CHECK(stats.vHeightInFlight.empty());
+        BOOST_CHECK_EQUAL(stats.nMisbehavior, 0);
+    }
+
+    LOCK(cs_main);
+    mapBlockIndex.erase(hash);
+    delete pindex;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
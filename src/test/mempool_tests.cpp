@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -102,4 +103,211 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // Three unrelated transactions of the same size, entered in an order
+    // that differs from their fee rate order
+    CMutableTransaction tx[3];
+    CAmount fees[3] = { 20000LL, 10000LL, 30000LL };
+    for (int i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.hash = GetRandHash();
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], fees[i], 100 + i, 0.0, 1));
+    }
+
+    // Fee rate index is lowest first
+    CTxMemPool::indexed_transaction_set::index<fee_rate>::type::iterator it = pool.mapTx.get<fee_rate>().begin();
+    BOOST_CHECK(it->GetTx().GetHash() == tx[1].GetHash()); it++;
+    BOOST_CHECK(it->GetTx().GetHash() == tx[0].GetHash()); it++;
+    BOOST_CHECK(it->GetTx().GetHash() == tx[2].GetHash()); it++;
+    BOOST_CHECK(it == pool.mapTx.get<fee_rate>().end());
+
+    // Entry time index follows arrival
+    CTxMemPool::indexed_transaction_set::index<entry_time>::type::iterator it2 = pool.mapTx.get<entry_time>().begin();
+    for (int i = 0; i < 3; i++, it2++)
+        BOOST_CHECK(it2->GetTx().GetHash() == tx[i].GetHash());
+
+    // Prioritising the cheapest transaction moves it to the top
+    pool.PrioritiseTransaction(tx[1].GetHash(), tx[1].GetHash().ToString(), 0.0, 25000LL);
+    BOOST_CHECK(pool.mapTx.get<fee_rate>().rbegin()->GetTx().GetHash() == tx[1].GetHash());
+    BOOST_CHECK(pool.mapTx.get<fee_rate>().begin()->GetTx().GetHash() == tx[0].GetHash());
+    pool.ClearPrioritisation(tx[1].GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A chain of three transactions: tx[0] <- tx[1] <- tx[2]
+    CMutableTransaction tx[3];
+    CAmount fees[3] = { 1000LL, 2000LL, 30000LL };
+    unsigned int sizes[3];
+    for (int i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout = i == 0 ? COutPoint(GetRandHash(), 0) : COutPoint(tx[i-1].GetHash(), 0);
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+        sizes[i] = CTransaction(tx[i]).GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION);
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], fees[i], 0, 0.0, 1));
+    }
+
+    // An unrelated transaction paying a better rate than tx[0] alone,
+    // but a worse one than the whole chain
+    CMutableTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_11;
+    txOther.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txOther.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 5000LL, 0, 0.0, 1));
+
+    CTxMemPool::txiter it0 = pool.mapTx.find(tx[0].GetHash());
+    CTxMemPool::txiter it2 = pool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it0->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it0->GetSizeWithDescendants(), sizes[0] + sizes[1] + sizes[2]);
+    BOOST_CHECK_EQUAL(it0->GetModFeesWithDescendants(), fees[0] + fees[1] + fees[2]);
+    BOOST_CHECK_EQUAL(it2->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it2->GetSizeWithAncestors(), sizes[0] + sizes[1] + sizes[2]);
+    BOOST_CHECK_EQUAL(it2->GetModFeesWithAncestors(), fees[0] + fees[1] + fees[2]);
+
+    // The ancestor score index puts the whole chain, found through its
+    // last transaction, ahead of txOther
+    BOOST_CHECK(pool.mapTx.get<ancestor_score>().begin()->GetTx().GetHash() == tx[2].GetHash());
+
+    // Package limits are enforced against the existing ancestors
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout = COutPoint(tx[2].GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 10 * COIN;
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(CTxMemPoolEntry(txChild, 0, 0, 0.0, 1), setAncestors, 4, 1000000, 1000, 1000000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(CTxMemPoolEntry(txChild, 0, 0, 0.0, 1), setAncestors, 3, 1000000, 1000, 1000000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(CTxMemPoolEntry(txChild, 0, 0, 0.0, 1), setAncestors, 1000, 1000000, 3, 1000000, errString));
+
+    // Prioritising the middle transaction shows up in both directions
+    pool.PrioritiseTransaction(tx[1].GetHash(), tx[1].GetHash().ToString(), 0.0, 4000LL);
+    BOOST_CHECK_EQUAL(it0->GetModFeesWithDescendants(), fees[0] + fees[1] + fees[2] + 4000LL);
+    BOOST_CHECK_EQUAL(it2->GetModFeesWithAncestors(), fees[0] + fees[1] + fees[2] + 4000LL);
+    pool.PrioritiseTransaction(tx[1].GetHash(), tx[1].GetHash().ToString(), 0.0, -4000LL);
+    BOOST_CHECK_EQUAL(it2->GetModFeesWithAncestors(), fees[0] + fees[1] + fees[2]);
+
+    // Mining tx[0] leaves the rest of the chain with updated ancestor state
+    std::vector<CTransaction> vtx;
+    vtx.push_back(tx[0]);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK_EQUAL(it2->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it2->GetSizeWithAncestors(), sizes[1] + sizes[2]);
+    BOOST_CHECK_EQUAL(it2->GetModFeesWithAncestors(), fees[1] + fees[2]);
+    CTxMemPool::txiter it1 = pool.mapTx.find(tx[1].GetHash());
+    BOOST_CHECK_EQUAL(it1->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it1->GetCountWithDescendants(), 2);
+
+    // Removing the tip leaves tx[1] without descendants
+    std::list<CTransaction> removed;
+    pool.remove(tx[2], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(it1->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(it1->GetSizeWithDescendants(), sizes[1]);
+    BOOST_CHECK_EQUAL(it1->GetModFeesWithDescendants(), fees[1]);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vin[0].prevout.hash = GetRandHash();
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 0.0, 1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vin.resize(1);
+    tx2.vin[0].scriptSig = CScript() << OP_2;
+    tx2.vin[0].prevout.hash = GetRandHash();
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 0.0, 1));
+
+    // Trimming to the current size is a no-op
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    // Dropping the limit by a byte evicts the lower fee rate transaction
+    std::list<CTransaction> removed;
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1, &removed);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    removed.clear();
+
+    // A child of tx1 pays a high fee, but is evicted along with its parent
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx3.vin[0].scriptSig = CScript() << OP_1;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    tx3.vout[0].nValue = 9 * COIN;
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 1 * COIN, 0, 0.0, 1));
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 0.0, 1));
+
+    // Shrink until only tx3's family would fit; tx2 goes first
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1, &removed);
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+    removed.clear();
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1, &removed);
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+
+    // The rolling minimum fee is the evicted package's fee rate plus the relay fee...
+    CFeeRate maxFeeRateRemoved(10000LL + 1 * COIN,
+        CTransaction(tx1).GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION) +
+        CTransaction(tx3).GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), maxFeeRateRemoved.GetFeePerK() + 1000);
+
+    // ... and only starts to decay once a block has been connected
+    std::vector<CTransaction> vtx;
+    std::list<CTransaction> conflicts;
+    SetMockTime(42);
+    pool.removeForBlock(vtx, 1, conflicts);
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), (maxFeeRateRemoved.GetFeePerK() + 1000) / 2);
+
+    // Once it drops below half the relay fee it resets to zero
+    SetMockTime(42 + 20 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -270,6 +270,80 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
     delete pblocktemplate;
 
+    // A template builder appends new mempool transactions to its template
+    {
+        CBlockTemplateBuilder builder;
+        BOOST_CHECK(builder.NeedsRebuild());
+        BOOST_CHECK(builder.Rebuild(scriptPubKey));
+        BOOST_CHECK(!builder.NeedsRebuild());
+        BOOST_CHECK_EQUAL(builder.GetTemplate()->block.vtx.size(), 1);
+        CAmount nCoinbaseValue = builder.GetTemplate()->block.vtx[0].vout[0].nValue;
+
+        const CAmount nFee = 1000000LL;
+        CMutableTransaction txParent;
+        txParent.vin.resize(1);
+        txParent.vin[0].scriptSig = CScript() << OP_1;
+        txParent.vin[0].prevout = COutPoint(txFirst[0]->GetHash(), 0);
+        txParent.vout.resize(1);
+        txParent.vout[0].scriptPubKey = CScript() << OP_1;
+        txParent.vout[0].nValue = txFirst[0]->vout[0].nValue - nFee;
+        CMutableTransaction txChild;
+        txChild.vin.resize(1);
+        txChild.vin[0].scriptSig = CScript() << OP_1;
+        txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+        txChild.vout.resize(1);
+        txChild.vout[0].scriptPubKey = CScript() << OP_1;
+        txChild.vout[0].nValue = txParent.vout[0].nValue - nFee;
+        mempool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, nFee, GetTime(), 111.0, 11));
+        mempool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, nFee, GetTime(), 111.0, 11));
+
+        BOOST_CHECK_EQUAL(builder.Update(), 2);
+        BOOST_CHECK(!builder.NeedsRebuild());
+        CBlock& block = builder.GetTemplate()->block;
+        BOOST_CHECK_EQUAL(block.vtx.size(), 3);
+        BOOST_CHECK(block.vtx[1].GetHash() == txParent.GetHash());
+        BOOST_CHECK(block.vtx[2].GetHash() == txChild.GetHash());
+        BOOST_CHECK_EQUAL(block.vtx[0].vout[0].nValue, nCoinbaseValue + 2 * nFee);
+        BOOST_CHECK_EQUAL(builder.GetTemplate()->vTxFees[0], -2 * nFee);
+        CValidationState state;
+        BOOST_CHECK(TestBlockValidity(state, block, chainActive.Tip(), false, false));
+
+        // Nothing new arrived
+        BOOST_CHECK_EQUAL(builder.Update(), 0);
+        BOOST_CHECK_EQUAL(builder.GetTemplate()->block.vtx.size(), 3);
+
+        // Changing a transaction's priority forces a full rebuild
+        mempool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 0.0, nFee);
+        BOOST_CHECK(builder.NeedsRebuild());
+        BOOST_CHECK(builder.Rebuild(scriptPubKey));
+        BOOST_CHECK(!builder.NeedsRebuild());
+        BOOST_CHECK_EQUAL(builder.GetTemplate()->block.vtx.size(), 3);
+        mempool.ClearPrioritisation(txChild.GetHash());
+        BOOST_CHECK(builder.NeedsRebuild());
+
+        // A JoinSplit whose anchor is unknown is left out of the template,
+        // rather than making the updated template invalid
+        BOOST_CHECK(builder.Rebuild(scriptPubKey));
+        uint64_t nRebuilds = builder.GetRebuildCount();
+        CMutableTransaction txJoinSplit;
+        txJoinSplit.nVersion = 2;
+        txJoinSplit.vin.resize(1);
+        txJoinSplit.vin[0].scriptSig = CScript() << OP_1;
+        txJoinSplit.vin[0].prevout = COutPoint(txFirst[1]->GetHash(), 0);
+        txJoinSplit.vout.resize(1);
+        txJoinSplit.vout[0].scriptPubKey = CScript() << OP_1;
+        txJoinSplit.vout[0].nValue = txFirst[1]->vout[0].nValue - nFee;
+        txJoinSplit.vjoinsplit.resize(1);
+        txJoinSplit.vjoinsplit[0].anchor = GetRandHash();
+        txJoinSplit.vjoinsplit[0].nullifiers.at(0) = GetRandHash();
+        txJoinSplit.vjoinsplit[0].nullifiers.at(1) = GetRandHash();
+        mempool.addUnchecked(txJoinSplit.GetHash(), CTxMemPoolEntry(txJoinSplit, nFee, GetTime(), 111.0, 11));
+        BOOST_CHECK_EQUAL(builder.Update(), 0);
+        BOOST_CHECK_EQUAL(builder.GetRebuildCount(), nRebuilds);
+        BOOST_CHECK_EQUAL(builder.GetTemplate()->block.vtx.size(), 3);
+        mempool.clear();
+    }
+
     // block sigops > limit: 1000 CHECKMULTISIG + 1
     tx.vin.resize(1);
     // NOTE: OP_NOP is used to force 20 SigOps for the CHECKMULTISIG
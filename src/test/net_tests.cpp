@@ -0,0 +1,139 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "hash.h"
+#include "net.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(message_time_histogram)
+{
+    CMessageTimeStats stats;
+    stats.Add(0);
+    stats.Add(9);
+    stats.Add(10);
+    stats.Add(999);
+    stats.Add(1000);
+    stats.Add(999999);
+    stats.Add(1000000);
+    stats.Add(60000000);
+
+    BOOST_CHECK_EQUAL(stats.nCount, 8U);
+    BOOST_CHECK_EQUAL(stats.nTotalMicros, 0 + 9 + 10 + 999 + 1000 + 999999 + 1000000 + 60000000);
+    BOOST_CHECK_EQUAL(stats.nMaxMicros, 60000000);
+    const uint64_t vExpected[CMessageTimeStats::HISTOGRAM_BUCKETS] = {2, 1, 1, 1, 0, 1, 2};
+    for (int i = 0; i < CMessageTimeStats::HISTOGRAM_BUCKETS; i++)
+        BOOST_CHECK_EQUAL(stats.vHistogram[i], vExpected[i]);
+}
+
+BOOST_AUTO_TEST_CASE(message_time_per_command)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0)));
+    node.RecordProcessTime("ping", 5);
+    node.RecordProcessTime("ping", 50);
+    node.RecordProcessTime("tx", 500);
+    // Commands we do not know cannot grow the map
+    node.RecordProcessTime("foo", 5000);
+    node.RecordProcessTime("bar", 5000);
+
+    CNodeStats stats;
+    node.copyStats(stats);
+    BOOST_CHECK_EQUAL(stats.mapProcessTimePerMsgCmd.size(), 3U);
+    BOOST_CHECK_EQUAL(stats.mapProcessTimePerMsgCmd["ping"].nCount, 2U);
+    BOOST_CHECK_EQUAL(stats.mapProcessTimePerMsgCmd["ping"].nTotalMicros, 55);
+    BOOST_CHECK_EQUAL(stats.mapProcessTimePerMsgCmd["tx"].vHistogram[2], 1U);
+    BOOST_CHECK_EQUAL(stats.mapProcessTimePerMsgCmd[NET_MESSAGE_COMMAND_OTHER].nCount, 2U);
+}
+
+BOOST_AUTO_TEST_CASE(shared_message_framing)
+{
+    std::vector<unsigned char> vPayload(100000);
+    for (size_t i = 0; i < vPayload.size(); i++)
+        vPayload[i] = i * 7;
+
+    // Both the small path (copied out of the stream) and the large one (moved)
+    CSharedMessage msgSmall = MakeSharedMessage("ping", (uint64_t)12345);
+    CSharedMessage msgLarge = MakeSharedMessage("block", vPayload);
+    BOOST_CHECK_EQUAL(msgSmall->size(), CMessageHeader::HEADER_SIZE + 8);
+
+    CDataStream ssExpected(SER_NETWORK, PROTOCOL_VERSION);
+    ssExpected << vPayload;
+    BOOST_CHECK_EQUAL(msgLarge->size(), CMessageHeader::HEADER_SIZE + ssExpected.size());
+    BOOST_CHECK(std::equal(ssExpected.begin(), ssExpected.end(), msgLarge->begin() + CMessageHeader::HEADER_SIZE));
+
+    CMessageHeader hdr(Params().MessageStart());
+    CDataStream(msgLarge->begin(), msgLarge->begin() + CMessageHeader::HEADER_SIZE, SER_NETWORK, PROTOCOL_VERSION) >> hdr;
+    BOOST_CHECK(hdr.IsValid(Params().MessageStart()));
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "block");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ssExpected.size());
+    uint256 hash = Hash(ssExpected.begin(), ssExpected.end());
+    BOOST_CHECK_EQUAL(hdr.nChecksum, ReadLE32(hash.begin()));
+}
+
+BOOST_AUTO_TEST_CASE(message_buffer_pool)
+{
+    CSerializeData data;
+    data.reserve(300000);
+    data.resize(1000);
+    GiveMessageBuffer(data);
+    BOOST_CHECK_EQUAL(data.capacity(), 0U);
+
+    // A buffer is only handed out for sizes it certainly has room for
+    BOOST_CHECK(!TakeMessageBuffer(data, 300000));
+    BOOST_CHECK(TakeMessageBuffer(data, 200000));
+    BOOST_CHECK(data.empty());
+    BOOST_CHECK(data.capacity() >= 300000);
+    CSerializeData other;
+    BOOST_CHECK(!TakeMessageBuffer(other, 200000));
+
+    // Oversized buffers are freed instead of kept
+    BOOST_CHECK(!TakeMessageBuffer(other, MAX_SIZE));
+    other.reserve(64 * 1024 * 1024);
+    GiveMessageBuffer(other);
+    BOOST_CHECK_EQUAL(other.capacity(), 0U);
+    BOOST_CHECK(!TakeMessageBuffer(other, 32 * 1024 * 1024));
+}
+
+BOOST_AUTO_TEST_CASE(payload_received_in_place)
+{
+    std::vector<unsigned char> vPayload(200000);
+    for (size_t i = 0; i < vPayload.size(); i++)
+        vPayload[i] = i * 13;
+    CSharedMessage msg = MakeSharedMessage("block", vPayload);
+    const char* pch = (const char*)&(*msg)[0];
+
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0)));
+    LOCK(node.cs_vRecvMsg);
+    unsigned int nSpace = 0x10000;
+    BOOST_CHECK(node.GetRecvPayloadSpace(nSpace) == NULL);
+
+    // The header and the start of the payload arrive together
+    size_t nPos = CMessageHeader::HEADER_SIZE + 100;
+    BOOST_CHECK(node.ReceiveMsgBytes(pch, nPos));
+    char* pchSpace;
+    while ((pchSpace = node.GetRecvPayloadSpace(nSpace = 0x10000)) != NULL) {
+        BOOST_CHECK(nSpace > 0 && nSpace <= 0x10000);
+        memcpy(pchSpace, pch + nPos, nSpace);
+        node.ReceivedPayloadBytes(nSpace);
+        nPos += nSpace;
+    }
+    BOOST_CHECK(nPos < msg->size());
+    BOOST_CHECK(!node.vRecvMsg.back().complete());
+    BOOST_CHECK(node.ReceiveMsgBytes(pch + nPos, msg->size() - nPos));
+
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 1U);
+    CNetMessage& netmsg = node.vRecvMsg.front();
+    BOOST_CHECK(netmsg.complete());
+    std::vector<unsigned char> vReceived;
+    netmsg.vRecv >> vReceived;
+    BOOST_CHECK(vReceived == vPayload);
+    netmsg.ReleaseBuffer();
+    BOOST_CHECK(netmsg.vRecv.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
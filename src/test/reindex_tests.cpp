@@ -0,0 +1,113 @@
+// Copyright (c) 2017-2018 The LitecoinZ developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencoding.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "crypto/common.h"
+#include "primitives/block.h"
+#include "reindex.h"
+#include "streams.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(reindex_tests, BasicTestingSetup)
+
+static void AppendRecord(std::vector<char>& vData, unsigned int nSize, const std::vector<char>& vBlock)
+{
+    const char* pchMessageStart = (const char*)Params().MessageStart();
+    vData.insert(vData.end(), pchMessageStart, pchMessageStart + MESSAGE_START_SIZE);
+    unsigned char size[4];
+    WriteLE32(size, nSize);
+    vData.insert(vData.end(), size, size + sizeof(size));
+    vData.insert(vData.end(), vBlock.begin(), vBlock.end());
+}
+
+static std::vector<char> SerializeBlock(const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    return std::vector<char>(ss.begin(), ss.end());
+}
+
+BOOST_AUTO_TEST_CASE(reindex_find_records)
+{
+    std::vector<char> vData(7, 0);
+    // A record, following some padding
+    AppendRecord(vData, 100, std::vector<char>(100, 1));
+    // A size that is too small for a block is skipped
+    AppendRecord(vData, 79, std::vector<char>(79, 2));
+    // So is a lone first byte of the message start
+    vData.push_back(Params().MessageStart()[0]);
+    size_t nSecond = vData.size();
+    AppendRecord(vData, 80, std::vector<char>(80, 3));
+    // A record that runs past the end of the file is not returned
+    AppendRecord(vData, 1000, std::vector<char>(10, 4));
+
+    CBlockFileRecord rec;
+    BOOST_CHECK(FindBlockFileRecord(vData, 0, rec));
+    BOOST_CHECK_EQUAL(rec.nStart, 7U);
+    BOOST_CHECK_EQUAL(rec.nPos, 15U);
+    BOOST_CHECK_EQUAL(rec.nSize, 100U);
+
+    BOOST_CHECK(FindBlockFileRecord(vData, rec.nPos + rec.nSize, rec));
+    BOOST_CHECK_EQUAL(rec.nStart, nSecond);
+    BOOST_CHECK_EQUAL(rec.nSize, 80U);
+
+    BOOST_CHECK(!FindBlockFileRecord(vData, rec.nPos + rec.nSize, rec));
+    BOOST_CHECK(!FindBlockFileRecord(std::vector<char>(), 0, rec));
+}
+
+BOOST_AUTO_TEST_CASE(reindex_read_record)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    std::vector<char> vBlock = SerializeBlock(genesis);
+
+    std::vector<char> vData;
+    AppendRecord(vData, vBlock.size(), vBlock);
+    CBlockFileRecord rec;
+    BOOST_CHECK(FindBlockFileRecord(vData, 0, rec));
+
+    CBlock block;
+    uint256 hash;
+    BOOST_CHECK(ReadBlockFileRecord(vData, rec, block, hash));
+    BOOST_CHECK(hash == genesis.GetHash());
+    BOOST_CHECK(block.fMerkleChecked);
+
+    // A block with the wrong Merkle root is parsed, but not flagged as checked
+    CBlock bad(genesis);
+    bad.hashMerkleRoot = uint256();
+    vData.clear();
+    vBlock = SerializeBlock(bad);
+    AppendRecord(vData, vBlock.size(), vBlock);
+    BOOST_CHECK(FindBlockFileRecord(vData, 0, rec));
+    CBlock block2;
+    BOOST_CHECK(ReadBlockFileRecord(vData, rec, block2, hash));
+    BOOST_CHECK(hash == bad.GetHash());
+    BOOST_CHECK(!block2.fMerkleChecked);
+
+    // A compressed record is decompressed first
+    CBlock padded(genesis);
+    padded.vtx.resize(50, padded.vtx[0]);
+    vBlock = SerializeBlock(padded);
+    std::vector<char> vFrame;
+    BOOST_CHECK(CompressBlockRecord(vBlock.data(), vBlock.size(), vFrame));
+    vData.clear();
+    AppendRecord(vData, vFrame.size(), vFrame);
+    BOOST_CHECK(FindBlockFileRecord(vData, 0, rec));
+    CBlock block4;
+    BOOST_CHECK(ReadBlockFileRecord(vData, rec, block4, hash));
+    BOOST_CHECK(hash == padded.GetHash());
+    BOOST_CHECK_EQUAL(block4.vtx.size(), padded.vtx.size());
+
+    // A record that does not hold a block fails to parse
+    vData.clear();
+    AppendRecord(vData, 200, std::vector<char>(200, 0xff));
+    BOOST_CHECK(FindBlockFileRecord(vData, 0, rec));
+    CBlock block3;
+    BOOST_CHECK(!ReadBlockFileRecord(vData, rec, block3, hash));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
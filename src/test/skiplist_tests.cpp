@@ -101,4 +101,59 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(chain_arrays_test)
+{
+    // A main chain and a branch off it, as in getlocator_test
+    std::vector<uint256> vHashMain(20000);
+    std::vector<CBlockIndex> vBlocksMain(20000);
+    for (unsigned int i=0; i<vBlocksMain.size(); i++) {
+        vHashMain[i] = ArithToUint256(i);
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].nTime = 1000000 + i * 150 + insecure_rand() % 1000;
+        vBlocksMain[i].nBits = insecure_rand();
+        vBlocksMain[i].nChainWork = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].phashBlock = &vHashMain[i];
+        vBlocksMain[i].BuildSkip();
+    }
+    std::vector<uint256> vHashSide(10000);
+    std::vector<CBlockIndex> vBlocksSide(10000);
+    for (unsigned int i=0; i<vBlocksSide.size(); i++) {
+        vHashSide[i] = ArithToUint256(i + 10000 + (arith_uint256(1) << 128));
+        vBlocksSide[i].nHeight = i + 10000;
+        vBlocksSide[i].nTime = 1000000 + i * 150 + insecure_rand() % 1000;
+        vBlocksSide[i].pprev = i ? &vBlocksSide[i - 1] : &vBlocksMain[9999];
+        vBlocksSide[i].phashBlock = &vHashSide[i];
+        vBlocksSide[i].BuildSkip();
+    }
+
+    CChain chain;
+    chain.SetTip(&vBlocksSide.back());
+    // Moving the tip back to the main branch rewrites the fields above the fork
+    chain.SetTip(&vBlocksMain.back());
+    for (unsigned int i=0; i<vBlocksMain.size(); i++) {
+        BOOST_CHECK(chain.GetBlockHash(i) == vBlocksMain[i].GetBlockHash());
+        BOOST_CHECK_EQUAL(chain.GetBlockTime(i), vBlocksMain[i].GetBlockTime());
+        BOOST_CHECK_EQUAL(chain.GetBits(i), vBlocksMain[i].nBits);
+        BOOST_CHECK(chain.GetChainWork(i) == vBlocksMain[i].nChainWork);
+        BOOST_CHECK_EQUAL(chain.GetMedianTimePast(i), vBlocksMain[i].GetMedianTimePast());
+    }
+    for (unsigned int i=0; i<vBlocksSide.size(); i++)
+        BOOST_CHECK_EQUAL(chain.GetMedianTimePast(&vBlocksSide[i]), vBlocksSide[i].GetMedianTimePast());
+
+    // Ancestors agree with the skiplist, on and off the chain
+    for (int n=0; n<10000; n++) {
+        int r = insecure_rand() % 30000;
+        CBlockIndex* pindex = (r < 20000) ? &vBlocksMain[r] : &vBlocksSide[r - 20000];
+        int nHeight = insecure_rand() % (pindex->nHeight + 1);
+        BOOST_CHECK(chain.GetAncestor(pindex, nHeight) == pindex->GetAncestor(nHeight));
+    }
+    BOOST_CHECK(chain.GetAncestor(&vBlocksMain[5], 6) == NULL);
+    BOOST_CHECK(chain.GetAncestor(&vBlocksMain[5], -1) == NULL);
+
+    chain.SetTip(NULL);
+    BOOST_CHECK_EQUAL(chain.Height(), -1);
+    BOOST_CHECK_EQUAL(chain.GetMedianTimePast(&vBlocksMain[100]), vBlocksMain[100].GetMedianTimePast());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
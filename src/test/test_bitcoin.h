@@ -29,7 +29,6 @@ struct JoinSplitTestingSetup: public BasicTestingSetup {
  */
 class CConnman;
 struct TestingSetup: public JoinSplitTestingSetup {
-    CCoinsViewDB *pcoinsdbview;
     boost::filesystem::path pathTemp;
     boost::thread_group threadGroup;
     CConnman* connman;
@@ -7,9 +7,13 @@
 #include "txdb.h"
 
 #include "chainparams.h"
+#include "checkqueue.h"
+#include "crypto/common.h"
 #include "hash.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
 #include <stdint.h>
@@ -20,13 +24,17 @@ using namespace std;
 
 static const char DB_ANCHOR = 'A';
 static const char DB_NULLIFIER = 's';
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_BLOCK_INDEX_BY_HEIGHT = 'h';
 
 static const char DB_BEST_BLOCK = 'B';
+static const char DB_HEAD_BLOCKS = 'H';
 static const char DB_BEST_ANCHOR = 'a';
+static const char DB_COINS_COMMITMENT = 'M';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
@@ -51,11 +59,172 @@ void static BatchWriteNullifier(CLevelDBBatch &batch, const uint256 &nf, const b
         batch.Write(make_pair(DB_NULLIFIER, nf), true);
 }
 
-void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
-    if (coins.IsPruned())
-        batch.Erase(make_pair(DB_COINS, hash));
+namespace {
+
+/** Key of a coin in the database: DB_COIN, then the outpoint's txid and VARINT(n) */
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(key);
+        READWRITE(outpoint->hash);
+        READWRITE(VARINT(outpoint->n));
+    }
+};
+
+/**
+ * Key of a block index entry: DB_BLOCK_INDEX_BY_HEIGHT, the height as 4 big
+ * endian bytes so that entries sort by it, then the block hash
+ */
+struct BlockIndexEntry {
+    int nHeight;
+    uint256 hash;
+
+    BlockIndexEntry() : nHeight(0) {}
+    BlockIndexEntry(int nHeightIn, const uint256& hashIn) : nHeight(nHeightIn), hash(hashIn) {}
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        unsigned char buf[4];
+        WriteBE32(buf, nHeight);
+        ::Serialize(s, DB_BLOCK_INDEX_BY_HEIGHT, nType, nVersion);
+        s.write((const char*)buf, sizeof(buf));
+        ::Serialize(s, hash, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        char chType;
+        unsigned char buf[4];
+        ::Unserialize(s, chType, nType, nVersion);
+        s.read((char*)buf, sizeof(buf));
+        nHeight = ReadBE32(buf);
+        ::Unserialize(s, hash, nType, nVersion);
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 1 + 4 + hash.size();
+    }
+};
+
+/**
+ * Deserialization and proof of work check of a block index entry, run by
+ * the threads that load the block index
+ */
+class CBlockIndexLoadCheck
+{
+private:
+    const std::string* pstrValue;
+    const uint256* phash;
+    CDiskBlockIndex* pdiskindex;
+
+public:
+    CBlockIndexLoadCheck() : pstrValue(NULL), phash(NULL), pdiskindex(NULL) {}
+    CBlockIndexLoadCheck(const std::string* pstrValueIn, const uint256* phashIn, CDiskBlockIndex* pdiskindexIn) :
+        pstrValue(pstrValueIn), phash(phashIn), pdiskindex(pdiskindexIn) {}
+
+    bool operator()() {
+        try {
+            CDataStream ssValue(pstrValue->data(), pstrValue->data() + pstrValue->size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> *pdiskindex;
+        } catch (const std::exception& e) {
+            return error("LoadBlockIndex(): Deserialize or I/O error - %s", e.what());
+        }
+        uint256 hash = pdiskindex->GetBlockHash();
+        if (hash != *phash)
+            return error("LoadBlockIndex(): entry stored under %s has hash %s", phash->ToString(), hash.ToString());
+        pdiskindex->phashBlock = phash;
+        if (!CheckProofOfWork(hash, pdiskindex->nBits, Params().GetConsensus()))
+            return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pdiskindex->ToString());
+        return true;
+    }
+
+    void swap(CBlockIndexLoadCheck& check) {
+        std::swap(pstrValue, check.pstrValue);
+        std::swap(phash, check.phash);
+        std::swap(pdiskindex, check.pdiskindex);
+    }
+};
+
+/** Number of block index entries read from the database per batch */
+const size_t BLOCK_INDEX_LOAD_BATCH = 4096;
+
+/**
+ * Legacy per-transaction record, as stored under DB_COINS before coins were
+ * kept per output. Only read, to upgrade old databases.
+ *
+ * Serialized format:
+ * - VARINT(nVersion)
+ * - VARINT(nCode)
+ * - unspentness bitvector, for vout[2] and further; least significant byte first
+ * - the non-spent CTxOuts (via CTxOutCompressor)
+ * - VARINT(nHeight)
+ *
+ * The nCode value consists of:
+ * - bit 1: IsCoinBase()
+ * - bit 2: vout[0] is not spent
+ * - bit 4: vout[1] is not spent
+ * - The higher bits encode N, the number of non-zero bytes in the following bitvector.
+ *   - In case both bit 2 and bit 4 are unset, they encode N-1, as there must be at
+ *     least one non-spent output).
+ */
+class CLegacyCoins
+{
+public:
+    bool fCoinBase;
+    std::vector<CTxOut> vout;
+    int nHeight;
+    int nVersion;
+
+    CLegacyCoins() : fCoinBase(false), vout(0), nHeight(0), nVersion(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned int nCode = 0;
+        // version
+        ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
+        // header code
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
+
+} // namespace
+
+void static BatchWriteCoin(CLevelDBBatch &batch, const COutPoint &outpoint, const Coin &coin) {
+    CoinEntry entry(&outpoint);
+    if (coin.IsSpent())
+        batch.Erase(entry);
     else
-        batch.Write(make_pair(DB_COINS, hash), coins);
+        batch.Write(entry, coin);
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
@@ -66,12 +235,42 @@ void static BatchWriteHashBestAnchor(CLevelDBBatch &batch, const uint256 &hash)
     batch.Write(DB_BEST_ANCHOR, hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) :
+    db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe), fWriteBehind(false),
+    nBatchSize(GetArg("-dbbatchsize", nDefaultDbBatchSize)), fWriteFailed(false), fStopWriter(false)
+{
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, bool fWriteBehindIn) :
+    db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), fWriteBehind(fWriteBehindIn),
+    nBatchSize(GetArg("-dbbatchsize", nDefaultDbBatchSize)), fWriteFailed(false), fStopWriter(false)
+{
+    if (fWriteBehind)
+        writerThread = boost::thread(boost::bind(&CCoinsViewDB::ThreadWriteBehind, this));
 }
 
+CCoinsViewDB::~CCoinsViewDB()
+{
+    if (writerThread.joinable()) {
+        {
+            boost::unique_lock<boost::mutex> lock(cs_writer);
+            fStopWriter = true;
+        }
+        condWriter.notify_all();
+        writerThread.join();
+    }
+}
+
+bool CCoinsViewDB::GetPendingCoin(const COutPoint &outpoint, Coin &coin) const {
+    boost::unique_lock<boost::mutex> lock(cs_writer);
+    if (!pending)
+        return false;
+    CCoinsMap::const_iterator it = pending->mapCoins.find(outpoint);
+    if (it == pending->mapCoins.end())
+        return false;
+    coin = it->second.coin;
+    return true;
+}
 
 bool CCoinsViewDB::GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree) const {
     if (rt == ZCIncrementalMerkleTree::empty_root()) {
@@ -80,27 +279,58 @@ bool CCoinsViewDB::GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree)
         return true;
     }
 
+    {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        if (pending) {
+            CAnchorsMap::const_iterator it = pending->mapAnchors.find(rt);
+            if (it != pending->mapAnchors.end()) {
+                if (it->second.entered)
+                    tree = it->second.tree;
+                return it->second.entered;
+            }
+        }
+    }
+
     bool read = db.Read(make_pair(DB_ANCHOR, rt), tree);
 
     return read;
 }
 
 bool CCoinsViewDB::GetNullifier(const uint256 &nf) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        if (pending) {
+            CNullifiersMap::const_iterator it = pending->mapNullifiers.find(nf);
+            if (it != pending->mapNullifiers.end())
+                return it->second.entered;
+        }
+    }
+
     bool spent = false;
     bool read = db.Read(make_pair(DB_NULLIFIER, nf), spent);
 
     return read;
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    if (GetPendingCoin(outpoint, coin))
+        return !coin.IsSpent();
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    Coin coin;
+    if (GetPendingCoin(outpoint, coin))
+        return !coin.IsSpent();
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        if (pending && !pending->hashBlock.IsNull())
+            return pending->hashBlock;
+    }
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
@@ -108,57 +338,298 @@ uint256 CCoinsViewDB::GetBestBlock() const {
 }
 
 uint256 CCoinsViewDB::GetBestAnchor() const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        if (pending && !pending->hashAnchor.IsNull())
+            return pending->hashAnchor;
+    }
     uint256 hashBestAnchor;
     if (!db.Read(DB_BEST_ANCHOR, hashBestAnchor))
         return ZCIncrementalMerkleTree::empty_root();
     return hashBestAnchor;
 }
 
+bool CCoinsViewDB::GetSetCommitment(CCoinsSetCommitment &commitment) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        if (pending) {
+            if (pending->fHaveCommitment) {
+                commitment = pending->commitment;
+                return true;
+            }
+            // The stored commitment is dropped by a flush that changes coins without one.
+            if (!pending->mapCoins.empty())
+                return false;
+        }
+    }
+    return db.Read(DB_COINS_COMMITMENT, commitment);
+}
+
+std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const {
+    std::vector<uint256> vhashHeadBlocks;
+    if (!db.Read(DB_HEAD_BLOCKS, vhashHeadBlocks)) {
+        return std::vector<uint256>();
+    }
+    return vhashHeadBlocks;
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
                               const uint256 &hashBlock,
                               const uint256 &hashAnchor,
                               CAnchorsMap &mapAnchors,
-                              CNullifiersMap &mapNullifiers) {
+                              CNullifiersMap &mapNullifiers,
+                              const CCoinsSetCommitment *pcommitment) {
+    // Only one flush is in flight at a time; wait for the previous one.
+    if (!Sync())
+        return false;
+
+    std::unique_ptr<Snapshot> snapshot(new Snapshot());
+    snapshot->mapCoins.swap(mapCoins);
+    snapshot->mapAnchors.swap(mapAnchors);
+    snapshot->mapNullifiers.swap(mapNullifiers);
+    snapshot->hashBlock = hashBlock;
+    snapshot->hashAnchor = hashAnchor;
+    snapshot->fHaveCommitment = pcommitment != NULL;
+    if (pcommitment)
+        snapshot->commitment = *pcommitment;
+
+    if (fWriteBehind) {
+        {
+            boost::unique_lock<boost::mutex> lock(cs_writer);
+            pending = std::move(snapshot);
+            flushStats.fPending = true;
+        }
+        condWriter.notify_all();
+        return true;
+    }
+
+    int64_t nStart = GetTimeMicros();
+    bool fOk = WriteSnapshot(*snapshot);
+    int64_t nWrite = GetTimeMicros() - nStart;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_writer);
+        flushStats.nFlushes++;
+        flushStats.nLastWriteMicros = nWrite;
+        flushStats.nTotalWriteMicros += nWrite;
+    }
+    return fOk;
+}
+
+bool CCoinsViewDB::WriteSnapshot(const Snapshot &snapshot) {
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+
+    // Coins are written in several batches when there are many of them. In
+    // the first one, replace the best block by the pair (new, old), so an
+    // interrupted flush can be detected and completed by replaying blocks.
+    // The anchors, nullifiers, best anchor and set commitment all go into the
+    // last batch, so that they always describe the old tip until the flush is
+    // complete. The commitment is erased first: unlike the anchors it can't be
+    // brought back in line by replaying blocks, so it is recomputed instead.
+    bool fMarkHeads = !snapshot.hashBlock.IsNull();
+    if (fMarkHeads) {
+        uint256 hashOldTip;
+        if (!db.Read(DB_BEST_BLOCK, hashOldTip)) {
+            // We may be in the middle of replaying.
+            std::vector<uint256> vhashOldHeads = GetHeadBlocks();
+            if (vhashOldHeads.size() == 2) {
+                assert(vhashOldHeads[0] == snapshot.hashBlock);
+                hashOldTip = vhashOldHeads[1];
+            }
+        }
+        std::vector<uint256> vhashHeads;
+        vhashHeads.push_back(snapshot.hashBlock);
+        vhashHeads.push_back(hashOldTip);
+        batch.Erase(DB_BEST_BLOCK);
+        batch.Erase(DB_COINS_COMMITMENT);
+        batch.Write(DB_HEAD_BLOCKS, vhashHeads);
+    }
+
+    for (CCoinsMap::const_iterator it = snapshot.mapCoins.begin(); it != snapshot.mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            BatchWriteCoin(batch, it->first, it->second.coin);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fMarkHeads && batch.SizeEstimate() > nBatchSize) {
+            LogPrint("coindb", "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+        }
     }
 
-    for (CAnchorsMap::iterator it = mapAnchors.begin(); it != mapAnchors.end();) {
+    for (CAnchorsMap::const_iterator it = snapshot.mapAnchors.begin(); it != snapshot.mapAnchors.end(); it++) {
         if (it->second.flags & CAnchorsCacheEntry::DIRTY) {
             BatchWriteAnchor(batch, it->first, it->second.tree, it->second.entered);
             // TODO: changed++?
         }
-        CAnchorsMap::iterator itOld = it++;
-        mapAnchors.erase(itOld);
     }
 
-    for (CNullifiersMap::iterator it = mapNullifiers.begin(); it != mapNullifiers.end();) {
+    for (CNullifiersMap::const_iterator it = snapshot.mapNullifiers.begin(); it != snapshot.mapNullifiers.end(); it++) {
         if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
             BatchWriteNullifier(batch, it->first, it->second.entered);
             // TODO: changed++?
         }
-        CNullifiersMap::iterator itOld = it++;
-        mapNullifiers.erase(itOld);
     }
 
-    if (!hashBlock.IsNull())
-        BatchWriteHashBestChain(batch, hashBlock);
-    if (!hashAnchor.IsNull())
-        BatchWriteHashBestAnchor(batch, hashAnchor);
-
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    // In the last batch, mark the database as consistent with hashBlock again.
+    if (fMarkHeads) {
+        batch.Erase(DB_HEAD_BLOCKS);
+        BatchWriteHashBestChain(batch, snapshot.hashBlock);
+    }
+    if (!snapshot.hashAnchor.IsNull())
+        BatchWriteHashBestAnchor(batch, snapshot.hashAnchor);
+    if (snapshot.fHaveCommitment)
+        batch.Write(DB_COINS_COMMITMENT, snapshot.commitment);
+    else if (!snapshot.mapCoins.empty())
+        batch.Erase(DB_COINS_COMMITMENT);
+
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
+void CCoinsViewDB::ThreadWriteBehind()
+{
+    RenameThread("litecoinz-coindb");
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(cs_writer);
+            while (!pending && !fStopWriter)
+                condWriter.wait(lock);
+            if (!pending)
+                return;
+        }
+
+        // Nothing else modifies or releases the pending flush while it is
+        // being written, so it can be read without holding cs_writer.
+        int64_t nStart = GetTimeMicros();
+        bool fOk = false;
+        try {
+            fOk = WriteSnapshot(*pending);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: error writing coin database: %s\n", __func__, e.what());
+        }
+        int64_t nWrite = GetTimeMicros() - nStart;
+        LogPrint("coindb", "Background coin database flush took %.2fms\n", nWrite * 0.001);
+
+        std::unique_ptr<Snapshot> done;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_writer);
+            // Readers fall through to the database from here on.
+            done = std::move(pending);
+            if (!fOk)
+                fWriteFailed = true;
+            flushStats.fPending = false;
+            flushStats.nFlushes++;
+            flushStats.nLastWriteMicros = nWrite;
+            flushStats.nTotalWriteMicros += nWrite;
+        }
+        condWriter.notify_all();
+        // The snapshot can be large; free it without holding the lock.
+        done.reset();
+    }
+}
+
+bool CCoinsViewDB::Sync() const {
+    boost::unique_lock<boost::mutex> lock(cs_writer);
+    while (pending)
+        condWriter.wait(lock);
+    return !fWriteFailed;
+}
+
+bool CCoinsViewDB::HasWriteFailed() const {
+    boost::unique_lock<boost::mutex> lock(cs_writer);
+    return fWriteFailed;
+}
+
+void CCoinsViewDB::RecordFlushStall(int64_t nMicros) {
+    boost::unique_lock<boost::mutex> lock(cs_writer);
+    flushStats.nLastStallMicros = nMicros;
+    flushStats.nTotalStallMicros += nMicros;
+    flushStats.nMaxStallMicros = std::max(flushStats.nMaxStallMicros, nMicros);
+}
+
+CCoinsFlushStats CCoinsViewDB::GetFlushStats() const {
+    boost::unique_lock<boost::mutex> lock(cs_writer);
+    return flushStats;
+}
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-tx utxo model (0.14 and older) to per-txout.
+ */
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    pcursor->Seek(std::string(1, DB_COINS));
+    if (!pcursor->Valid() || pcursor->key()[0] != DB_COINS) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t batch_size = 1 << 24;
+    CLevelDBBatch batch;
+    int reportDone = 0;
+    std::pair<char, uint256> key = std::make_pair(DB_COINS, uint256());
+    std::pair<char, uint256> prev_key = key;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() == 0 || slKey[0] != DB_COINS) {
+                break;
+            }
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            ssKey >> key;
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CLegacyCoins old_coins;
+            ssValue >> old_coins;
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                }
+            }
+            batch.Erase(key);
+            if (batch.SizeEstimate() > batch_size) {
+                db.WriteBatch(batch);
+                batch.Clear();
+                db.CompactRange(prev_key, key);
+                prev_key = key;
+            }
+            pcursor->Next();
+        } catch (const std::exception& e) {
+            return error("%s: cannot parse legacy coins record - %s", __func__, e.what());
+        }
+    }
+    db.WriteBatch(batch);
+    db.CompactRange(std::make_pair(DB_COINS, uint256()), key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -183,52 +654,60 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 }
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    // Statistics are computed over the database itself; finish any pending flush first.
+    if (!Sync())
+        return false;
+
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
+    // Outputs of a transaction are adjacent in the database, so they are
+    // hashed as one record per transaction, ended by VARINT(0).
+    uint256 prevTxid;
+    bool fInTx = false;
+    pcursor->Seek(std::string(1, DB_COIN));
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == DB_COINS) {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
+            COutPoint outpoint;
+            CoinEntry entry(&outpoint);
+            ssKey >> entry;
+            if (entry.key != DB_COIN)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            Coin coin;
+            ssValue >> coin;
+            if (!fInTx || outpoint.hash != prevTxid) {
+                if (fInTx)
+                    ss << VARINT(0);
+                ss << outpoint.hash;
+                ss << (coin.fCoinBase ? 'c' : 'n');
+                ss << VARINT(coin.nHeight);
                 stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                prevTxid = outpoint.hash;
+                fInTx = true;
             }
+            stats.nTransactionOutputs++;
+            ss << VARINT(outpoint.n+1);
+            ss << coin.out;
+            nTotalAmount += coin.out.nValue;
+            stats.nSerializedSize += slKey.size() + slValue.size();
             pcursor->Next();
         } catch (const std::exception& e) {
             return error("%s: Deserialize or I/O error - %s", __func__, e.what());
         }
     }
+    if (fInTx)
+        ss << VARINT(0);
     {
         LOCK(cs_main);
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
@@ -238,6 +717,92 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     return true;
 }
 
+namespace {
+
+/**
+ * Add the coins whose txid starts with one of the bytes assigned to worker
+ * nWorker (of nWorkers) to a commitment. Each first byte is a shard of the
+ * key space; shards are dealt out round-robin so the workers finish together.
+ */
+void ScanCoinsShards(const CLevelDBWrapper &db, const leveldb::Snapshot *snapshot, int nWorker, int nWorkers,
+                     CCoinsSetCommitment *commitment, bool *pfOk)
+{
+    RenameThread("litecoinz-coinscan");
+    *pfOk = false;
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator(snapshot));
+    uint64_t nScanned = 0;
+    for (int nShard = nWorker; nShard < 256; nShard += nWorkers) {
+        char prefix[2] = {DB_COIN, (char)nShard};
+        pcursor->Seek(leveldb::Slice(prefix, sizeof(prefix)));
+        for (; pcursor->Valid(); pcursor->Next()) {
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() < 2 || slKey[0] != DB_COIN || (unsigned char)slKey[1] != nShard)
+                break;
+            if (++nScanned % 10000 == 0 && ShutdownRequested())
+                return;
+            try {
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                COutPoint outpoint;
+                CoinEntry entry(&outpoint);
+                ssKey >> entry;
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                Coin coin;
+                ssValue >> coin;
+                commitment->Add(outpoint, coin);
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+                return;
+            }
+        }
+    }
+    *pfOk = true;
+}
+
+}
+
+bool CCoinsViewDB::ComputeSetCommitment(CCoinsSetCommitment &commitment, uint256 &hashBlock) const {
+    if (!Sync())
+        return false;
+
+    // All workers read the same snapshot, so the result is consistent even
+    // if the database is written to in the meantime.
+    const leveldb::Snapshot *snapshot = db.GetSnapshot();
+    hashBlock.SetNull();
+    db.Read(DB_BEST_BLOCK, hashBlock, snapshot);
+
+    int nWorkers = std::max(1, std::min(GetNumCores(), 16));
+    std::vector<CCoinsSetCommitment> vParts(nWorkers);
+    std::unique_ptr<bool[]> vfOk(new bool[nWorkers]);
+    boost::thread_group workers;
+    for (int i = 0; i < nWorkers; i++) {
+        workers.create_thread(boost::bind(&ScanCoinsShards, boost::cref(db), snapshot, i, nWorkers, &vParts[i], &vfOk[i]));
+    }
+    workers.join_all();
+    db.ReleaseSnapshot(snapshot);
+
+    commitment = CCoinsSetCommitment();
+    for (int i = 0; i < nWorkers; i++) {
+        if (!vfOk[i])
+            return false;
+        commitment += vParts[i];
+    }
+    return true;
+}
+
+bool CCoinsViewDB::RebuildSetCommitment() {
+    LogPrintf("Computing commitment to the unspent output set...\n");
+    int64_t nStart = GetTimeMicros();
+    CCoinsSetCommitment commitment;
+    uint256 hashBlock;
+    if (!ComputeSetCommitment(commitment, hashBlock))
+        return false;
+    if (hashBlock != GetBestBlock())
+        return error("%s: coin database changed during the scan", __func__);
+    LogPrintf("Committed to %u unspent outputs in %.2fs\n", (unsigned int)commitment.nTransactionOutputs, (GetTimeMicros() - nStart) * 0.000001);
+    return db.Write(DB_COINS_COMMITMENT, commitment, true);
+}
+
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
     CLevelDBBatch batch;
     for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++) {
@@ -245,7 +810,7 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     }
     batch.Write(DB_LAST_BLOCK, nLastFile);
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
-        batch.Write(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
+        batch.Write(BlockIndexEntry((*it)->nHeight, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
     }
     return WriteBatch(batch, true);
 }
@@ -273,58 +838,159 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+bool CBlockTreeDB::Upgrade()
 {
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    pcursor->Seek(std::string(1, DB_BLOCK_INDEX));
+    if (!pcursor->Valid() || pcursor->key()[0] != DB_BLOCK_INDEX) {
+        return true;
+    }
 
-    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    ssKeySet << make_pair(DB_BLOCK_INDEX, uint256());
-    pcursor->Seek(ssKeySet.str());
-
-    // Load mapBlockIndex
+    // Each batch moves a set of entries, so every entry is in exactly one
+    // place whenever this is interrupted, and it resumes on the next start.
+    int64_t count = 0;
+    LogPrintf("Upgrading block index database...\n");
+    uiInterface.ShowProgress(_("Upgrading block index database"), 0);
+    size_t batch_size = 1 << 24;
+    CLevelDBBatch batch;
+    std::pair<char, uint256> key = std::make_pair(DB_BLOCK_INDEX, uint256());
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
         try {
             leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() == 0 || slKey[0] != DB_BLOCK_INDEX) {
+                break;
+            }
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == DB_BLOCK_INDEX) {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->hashAnchor     = diskindex.hashAnchor;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nArrivalTime   = diskindex.nArrivalTime;
-                pindexNew->nSolution      = diskindex.nSolution;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-                pindexNew->nSproutValue   = diskindex.nSproutValue;
-
-                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
+            ssKey >> key;
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                uiInterface.ShowProgress(_("Upgrading block index database"), (int)(high * 100.0 / 65536.0 + 0.5));
+            }
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+            batch.Write(BlockIndexEntry(diskindex.nHeight, key.second), diskindex);
+            batch.Erase(key);
+            if (batch.SizeEstimate() > batch_size) {
+                WriteBatch(batch);
+                batch.Clear();
+            }
+            pcursor->Next();
+        } catch (const std::exception& e) {
+            return error("%s: cannot parse block index entry - %s", __func__, e.what());
+        }
+    }
+    WriteBatch(batch);
+    CompactRange(std::make_pair(DB_BLOCK_INDEX, uint256()), key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("Upgrading block index database %s after %d entries\n", ShutdownRequested() ? "cancelled" : "done", count);
+    return !ShutdownRequested();
+}
 
+bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<void(CBlockIndex*)> fnLoaded)
+{
+    int64_t nStart = GetTimeMicros();
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    pcursor->Seek(std::string(1, DB_BLOCK_INDEX_BY_HEIGHT));
+
+    // The script verification threads are started before the block index
+    // is loaded, but they sit idle until blocks are connected, so as many
+    // threads again do the deserialization here, along with this one.
+    CCheckQueue<CBlockIndexLoadCheck> queue(64);
+    boost::thread_group threads;
+    for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CBlockIndexLoadCheck>::Thread, &queue));
+
+    // Stop the threads however this returns, before the queue goes away
+    struct CThreadsStopper {
+        boost::thread_group& threads;
+        CThreadsStopper(boost::thread_group& threadsIn) : threads(threadsIn) {}
+        ~CThreadsStopper() {
+            threads.interrupt_all();
+            threads.join_all();
+        }
+    } stopper(threads);
+
+    std::vector<BlockIndexEntry> vKeys;
+    std::vector<std::string> vValues;
+    std::vector<CDiskBlockIndex> vDiskIndex;
+    std::vector<CBlockIndexLoadCheck> vChecks;
+    vKeys.reserve(BLOCK_INDEX_LOAD_BATCH);
+    vValues.reserve(BLOCK_INDEX_LOAD_BATCH);
+    vChecks.reserve(BLOCK_INDEX_LOAD_BATCH);
+    size_t nLoaded = 0;
+    bool fOk = true;
+    while (fOk) {
+        boost::this_thread::interruption_point();
+        vKeys.clear();
+        vValues.clear();
+        try {
+            while (pcursor->Valid() && vKeys.size() < BLOCK_INDEX_LOAD_BATCH) {
+                leveldb::Slice slKey = pcursor->key();
+                if (slKey.size() == 0 || slKey[0] != DB_BLOCK_INDEX_BY_HEIGHT)
+                    break;
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                vKeys.push_back(BlockIndexEntry());
+                ssKey >> vKeys.back();
+                leveldb::Slice slValue = pcursor->value();
+                vValues.push_back(std::string(slValue.data(), slValue.size()));
                 pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
             }
         } catch (const std::exception& e) {
-            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+            fOk = error("%s: Deserialize or I/O error - %s", __func__, e.what());
+            break;
+        }
+        if (vKeys.empty())
+            break;
+
+        vDiskIndex.assign(vKeys.size(), CDiskBlockIndex());
+        for (size_t i = 0; i < vKeys.size(); i++)
+            vChecks.push_back(CBlockIndexLoadCheck(&vValues[i], &vKeys[i].hash, &vDiskIndex[i]));
+        {
+            CCheckQueueControl<CBlockIndexLoadCheck> control(&queue);
+            control.Add(vChecks);
+            fOk = control.Wait();
+        }
+        vChecks.clear();
+        if (!fOk)
+            break;
+
+        for (size_t i = 0; i < vDiskIndex.size(); i++) {
+            const CDiskBlockIndex& diskindex = vDiskIndex[i];
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(vKeys[i].hash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->hashAnchor     = diskindex.hashAnchor;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nArrivalTime   = diskindex.nArrivalTime;
+            pindexNew->nSolution      = diskindex.nSolution;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+            pindexNew->nSproutValue   = diskindex.nSproutValue;
+
+            fnLoaded(pindexNew);
         }
+        nLoaded += vDiskIndex.size();
     }
 
+    if (!fOk)
+        return false;
+
+    LogPrintf("%s: loaded %u block index entries in %.2fs with %d threads\n", __func__,
+        nLoaded, (GetTimeMicros() - nStart) * 0.000001, std::max(nScriptCheckThreads, 1));
     return true;
 }
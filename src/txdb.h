@@ -11,10 +11,16 @@
 #include "leveldbwrapper.h"
 
 #include <map>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
 class CBlockFileInfo;
 class CBlockIndex;
 struct CDiskTxPos;
@@ -26,28 +32,114 @@ static const int64_t nDefaultDbCache = 450;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -dbbatchsize default (bytes)
+static const int64_t nDefaultDbBatchSize = 16 << 20;
+//! -dbwritebehind default. Off, since it gives half of the in-memory UTXO set budget to pending writes.
+static const bool DEFAULT_DB_WRITE_BEHIND = false;
+
+/** Timings of coin database flushes, reported by getblockchaininfo */
+struct CCoinsFlushStats
+{
+    uint64_t nFlushes;          //!< Completed writes of the coin cache
+    int64_t nLastWriteMicros;   //!< Time spent writing the last flush to disk
+    int64_t nTotalWriteMicros;
+    int64_t nLastStallMicros;   //!< Time block processing was held up by the last flush
+    int64_t nTotalStallMicros;
+    int64_t nMaxStallMicros;
+    bool fPending;              //!< A flush is being written in the background
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+    CCoinsFlushStats() : nFlushes(0), nLastWriteMicros(0), nTotalWriteMicros(0),
+                         nLastStallMicros(0), nTotalStallMicros(0), nMaxStallMicros(0),
+                         fPending(false) {}
+};
+
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/)
+ *
+ * Large flushes are written in batches of -dbbatchsize bytes. While they are
+ * in progress the database records the old and new best block under
+ * DB_HEAD_BLOCKS instead of a best block, so an interrupted flush can be
+ * finished on startup by replaying blocks (see ReplayBlocks).
+ *
+ * In write-behind mode BatchWrite only takes ownership of the flushed entries
+ * and returns; a background thread writes them out. Until it is done, reads
+ * are answered from those entries first, so the view stays consistent with
+ * the cache that was flushed.
+ */
 class CCoinsViewDB : public CCoinsView
 {
+    /** Coin cache contents handed over by BatchWrite */
+    struct Snapshot {
+        CCoinsMap mapCoins;
+        CAnchorsMap mapAnchors;
+        CNullifiersMap mapNullifiers;
+        uint256 hashBlock;
+        uint256 hashAnchor;
+        bool fHaveCommitment;
+        CCoinsSetCommitment commitment;
+    };
+
 protected:
     CLevelDBWrapper db;
     CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool fWriteBehindIn = false);
+    ~CCoinsViewDB();
 
     bool GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree) const;
     bool GetNullifier(const uint256 &nf) const;
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     uint256 GetBestAnchor() const;
+    std::vector<uint256> GetHeadBlocks() const;
+    bool GetSetCommitment(CCoinsSetCommitment &commitment) const;
     bool BatchWrite(CCoinsMap &mapCoins,
                     const uint256 &hashBlock,
                     const uint256 &hashAnchor,
                     CAnchorsMap &mapAnchors,
-                    CNullifiersMap &mapNullifiers);
+                    CNullifiersMap &mapNullifiers,
+                    const CCoinsSetCommitment *pcommitment);
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Compute the commitment to the unspent output set by scanning the
+    //! database, in parallel over ranges of txids. hashBlock is set to the
+    //! best block the result belongs to.
+    bool ComputeSetCommitment(CCoinsSetCommitment &commitment, uint256 &hashBlock) const;
+    //! Compute and store the commitment, for databases that don't have one.
+    //! Must not run concurrently with BatchWrite.
+    bool RebuildSetCommitment();
+
+    //! Attempt to update from an older database format. Returns false on error or if interrupted.
+    bool Upgrade();
+
+    //! Wait until all flushes handed to BatchWrite are on disk. Returns false if writing any of them failed.
+    bool Sync() const;
+    //! Whether flushes are written in the background
+    bool IsWriteBehind() const { return fWriteBehind; }
+    //! Whether a background write has failed; the database must not be written to again
+    bool HasWriteFailed() const;
+    //! Account for time block processing spent waiting on a flush
+    void RecordFlushStall(int64_t nMicros);
+    CCoinsFlushStats GetFlushStats() const;
+
+private:
+    bool fWriteBehind;
+    size_t nBatchSize;
+
+    mutable boost::mutex cs_writer;
+    mutable boost::condition_variable condWriter;
+    //! Flush being written in the background; read-only until it is released
+    std::unique_ptr<Snapshot> pending;
+    bool fWriteFailed;
+    bool fStopWriter;
+    CCoinsFlushStats flushStats;
+    boost::thread writerThread;
+
+    bool WriteSnapshot(const Snapshot &snapshot);
+    void ThreadWriteBehind();
+    //! Look up an outpoint in the pending flush. Returns false if it is not part of it.
+    bool GetPendingCoin(const COutPoint &outpoint, Coin &coin) const;
 };
 
 /** Access to the block database (blocks/index/) */
@@ -68,7 +160,14 @@ public:
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
-    bool LoadBlockIndexGuts();
+    //! Move block index entries stored by hash to keys ordered by height.
+    //! Returns false on error or if interrupted.
+    bool Upgrade();
+    //! Load the block index into mapBlockIndex, in order of height. Entries
+    //! are deserialized and checked in parallel, in batches, and handed to
+    //! fnLoaded one at a time once complete, so that totals over the chain
+    //! can be computed in the same pass.
+    bool LoadBlockIndexGuts(boost::function<void(CBlockIndex*)> fnLoaded);
 };
 
 #endif // BITCOIN_TXDB_H
@@ -131,6 +131,7 @@ public:
      * @note This hash is not stable between little and big endian.
      */
     uint64_t GetHash(const uint256& salt) const;
+    uint64_t GetHash(const uint256& salt, uint32_t extra) const;
 };
 
 /* uint256 from const char *.
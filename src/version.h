@@ -10,7 +10,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 170002;
+static const int PROTOCOL_VERSION = 170003;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -22,4 +22,7 @@ static const int MIN_PEER_PROTO_VERSION = 170002;
 //! the older encoding that omits nTime is only used in "version" messages.
 static const int CADDR_TIME_VERSION = 31402;
 
+//! short-id-based block download starts with this version
+static const int SHORT_IDS_BLOCKS_VERSION = 170003;
+
 #endif // BITCOIN_VERSION_H
@@ -379,6 +379,35 @@ TEST(wallet_tests, FindMyNotes) {
     EXPECT_EQ(nd, noteMap[jsoutpt]);
 }
 
+TEST(wallet_tests, FindMyNotesWithThreads) {
+    CWallet wallet;
+
+    // Enough decryptors that trial decryption is split into chunks (with no
+    // worker threads running, this thread decrypts all of them)
+    for (size_t i = 0; i < 4 * MIN_NOTE_DECRYPTORS_PER_THREAD; i++) {
+        wallet.AddSpendingKey(libzcash::SpendingKey::random());
+    }
+
+    auto sk = libzcash::SpendingKey::random();
+    wallet.AddSpendingKey(sk);
+
+    auto wtx = GetValidReceive(sk, 10, true);
+    auto note = GetNote(sk, wtx, 0, 1);
+    auto nullifier = note.nullifier(sk);
+
+    int nPrevThreads = nNoteDecryptThreads;
+    nNoteDecryptThreads = 4;
+    auto noteMap = wallet.FindMyNotes(wtx);
+    nNoteDecryptThreads = nPrevThreads;
+
+    EXPECT_EQ(2, noteMap.size());
+
+    JSOutPoint jsoutpt {wtx.GetHash(), 0, 1};
+    CNoteData nd {sk.address(), nullifier};
+    EXPECT_EQ(1, noteMap.count(jsoutpt));
+    EXPECT_EQ(nd, noteMap[jsoutpt]);
+}
+
 TEST(wallet_tests, FindMyNotesInEncryptedWallet) {
     TestWallet wallet;
     uint256 r {GetRandHash()};
@@ -857,6 +886,48 @@ TEST(wallet_tests, ClearNoteWitnessCache) {
     EXPECT_EQ(0, wallet.nWitnessCacheSize);
 }
 
+TEST(wallet_tests, IncrementNoteWitnessesSkipsErasedNotes) {
+    TestWallet wallet;
+
+    auto sk = libzcash::SpendingKey::random();
+    wallet.AddSpendingKey(sk);
+
+    auto wtx = GetValidReceive(sk, 10, true);
+    auto note = GetNote(sk, wtx, 0, 0);
+    mapNoteData_t noteData;
+    JSOutPoint jsoutpt {wtx.GetHash(), 0, 0};
+    CNoteData nd {sk.address(), note.nullifier(sk)};
+    noteData[jsoutpt] = nd;
+    wtx.SetNoteData(noteData);
+    wallet.AddToWallet(wtx, true, NULL);
+
+    // The note is still indexed once its transaction has left the wallet
+    wallet.mapWallet.erase(wtx.GetHash());
+
+    auto wtx2 = GetValidReceive(sk, 10, true);
+    auto note2 = GetNote(sk, wtx2, 0, 0);
+    mapNoteData_t noteData2;
+    JSOutPoint jsoutpt2 {wtx2.GetHash(), 0, 0};
+    CNoteData nd2 {sk.address(), note2.nullifier(sk)};
+    noteData2[jsoutpt2] = nd2;
+    wtx2.SetNoteData(noteData2);
+    wallet.AddToWallet(wtx2, true, NULL);
+
+    CBlock block;
+    block.vtx.push_back(wtx2);
+    CBlockIndex index(block);
+    ZCIncrementalMerkleTree tree;
+    wallet.IncrementNoteWitnesses(&index, &block, tree);
+
+    std::vector<JSOutPoint> notes {jsoutpt, jsoutpt2};
+    std::vector<boost::optional<ZCIncrementalWitness>> witnesses;
+    uint256 anchor;
+    wallet.GetNoteWitnesses(notes, witnesses, anchor);
+    EXPECT_FALSE((bool) witnesses[0]);
+    EXPECT_TRUE((bool) witnesses[1]);
+    EXPECT_EQ(0, wallet.mapWallet[wtx2.GetHash()].mapNoteData[jsoutpt2].witnessHeight);
+}
+
 TEST(wallet_tests, WriteWitnessCache) {
     TestWallet wallet;
     MockWalletDB walletdb;
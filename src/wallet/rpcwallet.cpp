@@ -2746,6 +2746,46 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             "Runs a benchmark of the selected type samplecount times,\n"
             "returning the running times of each sample.\n"
             "\n"
+            "The verifyjoinsplitbatch benchmark takes a JoinSplit and a number\n"
+            "of proofs N, and returns two running times per sample: verifying\n"
+            "N proofs one at a time, then verifying them as a single batch.\n"
+            "\n"
+            "The trydecryptnotes benchmark takes a number of addresses and an\n"
+            "optional number of chunks to split them into, which run on the\n"
+            "-notedecryptthreads workers, and also returns the throughput of\n"
+            "each sample in trial decryptions per second.\n"
+            "\n"
+            "The verifyequihash benchmark takes an optional number of threads;\n"
+            "with it, it returns two running times per sample: checking the\n"
+            "solutions of a full headers message one at a time, then split\n"
+            "between that many threads.\n"
+            "\n"
+            "The sigcache benchmark takes a number of threads, and returns the\n"
+            "time each thread took for 1000000 signature cache operations.\n"
+            "\n"
+            "The sha256 benchmark takes a number of 64-byte blocks, and returns\n"
+            "two running times per sample: hashing them with the standard SHA256\n"
+            "implementation, then with the one selected for this CPU.\n"
+            "\n"
+            "The blockstorage benchmark takes a number of blocks from the tip of\n"
+            "the active chain, and returns four running times per sample: storing\n"
+            "them as they are, storing them compressed, then reading back each of\n"
+            "those. Each also has the total size of the stored blocks in bytes.\n"
+            "\n"
+            "The compactblock benchmark takes a number of blocks from the tip of\n"
+            "the active chain and an optional percentage of their transactions\n"
+            "to leave out of the mempool, and returns four running times per\n"
+            "sample: encoding the blocks in full, decoding them, encoding them\n"
+            "as compact blocks, then rebuilding them from the mempool. Each also\n"
+            "has the total size sent on the wire in bytes, including the round\n"
+            "trip for missing transactions.\n"
+            "\n"
+            "The chainindex benchmark takes a chain height, and returns four\n"
+            "running times per sample over a synthetic chain of that height:\n"
+            "the median time past of every block through the block index, then\n"
+            "through the active chain arrays, then 1000000 random ancestor\n"
+            "lookups through the skiplist, then through the active chain arrays.\n"
+            "\n"
             "Output: [\n"
             "  {\n"
             "    \"runningtime\": runningtime\n"
@@ -2768,10 +2808,13 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
     }
 
     std::vector<double> sample_times;
+    std::vector<double> sample_throughputs;
+    std::vector<double> sample_sizes;
+    std::vector<double> sample_wiresizes;
 
     JSDescription samplejoinsplit;
 
-    if (benchmarktype == "verifyjoinsplit") {
+    if (benchmarktype == "verifyjoinsplit" || benchmarktype == "verifyjoinsplitbatch") {
         CDataStream ss(ParseHexV(params[2].get_str(), "js"), SER_NETWORK, PROTOCOL_VERSION);
         ss >> samplejoinsplit;
     }
@@ -2793,6 +2836,13 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             }
         } else if (benchmarktype == "verifyjoinsplit") {
             sample_times.push_back(benchmark_verify_joinsplit(samplejoinsplit));
+        } else if (benchmarktype == "verifyjoinsplitbatch") {
+            int nProofs = params[3].get_int();
+            if (nProofs <= 0) {
+                throw JSONRPCError(RPC_TYPE_ERROR, "Invalid number of proofs");
+            }
+            std::vector<double> vals = benchmark_verify_joinsplit_batch(samplejoinsplit, nProofs);
+            sample_times.insert(sample_times.end(), vals.begin(), vals.end());
 #ifdef ENABLE_MINING
         } else if (benchmarktype == "solveequihash") {
             if (params.size() < 3) {
@@ -2803,13 +2853,75 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
                 sample_times.insert(sample_times.end(), vals.begin(), vals.end());
             }
 #endif
+        } else if (benchmarktype == "sigcache") {
+            int nThreads = params[2].get_int();
+            if (nThreads <= 0) {
+                throw JSONRPCError(RPC_TYPE_ERROR, "Invalid number of threads");
+            }
+            std::vector<double> vals = benchmark_sigcache_threaded(nThreads);
+            sample_times.insert(sample_times.end(), vals.begin(), vals.end());
         } else if (benchmarktype == "verifyequihash") {
-            sample_times.push_back(benchmark_verify_equihash());
+            if (params.size() < 3) {
+                sample_times.push_back(benchmark_verify_equihash());
+            } else {
+                int nThreads = params[2].get_int();
+                if (nThreads <= 0) {
+                    throw JSONRPCError(RPC_TYPE_ERROR, "Invalid number of threads");
+                }
+                std::vector<double> vals = benchmark_verify_equihash_threaded(nThreads);
+                sample_times.insert(sample_times.end(), vals.begin(), vals.end());
+            }
+        } else if (benchmarktype == "sha256") {
+            int nBlocks = params[2].get_int();
+            if (nBlocks <= 0) {
+                throw JSONRPCError(RPC_TYPE_ERROR, "Invalid number of blocks");
+            }
+            std::vector<double> vals = benchmark_sha256(nBlocks);
+            sample_times.insert(sample_times.end(), vals.begin(), vals.end());
+        } else if (benchmarktype == "blockstorage") {
+            int nBlocks = params[2].get_int();
+            if (nBlocks <= 0) {
+                throw JSONRPCError(RPC_TYPE_ERROR, "Invalid number of blocks");
+            }
+            std::vector<double> vals = benchmark_block_storage(nBlocks);
+            sample_times.insert(sample_times.end(), vals.begin(), vals.begin() + 4);
+            for (int j = 0; j < 2; j++) {
+                sample_sizes.push_back(vals[4]);
+                sample_sizes.push_back(vals[5]);
+            }
+        } else if (benchmarktype == "compactblock") {
+            int nBlocks = params[2].get_int();
+            if (nBlocks <= 0) {
+                throw JSONRPCError(RPC_TYPE_ERROR, "Invalid number of blocks");
+            }
+            int nMissingPercent = params.size() > 3 ? params[3].get_int() : 0;
+            if (nMissingPercent < 0 || nMissingPercent > 100) {
+                throw JSONRPCError(RPC_TYPE_ERROR, "Invalid percentage of missing transactions");
+            }
+            std::vector<double> vals = benchmark_compact_block(nBlocks, nMissingPercent);
+            sample_times.insert(sample_times.end(), vals.begin(), vals.begin() + 4);
+            for (int j = 0; j < 2; j++) {
+                sample_wiresizes.push_back(vals[4]);
+                sample_wiresizes.push_back(vals[5]);
+            }
+        } else if (benchmarktype == "chainindex") {
+            int nHeight = params[2].get_int();
+            if (nHeight <= 0) {
+                throw JSONRPCError(RPC_TYPE_ERROR, "Invalid chain height");
+            }
+            std::vector<double> vals = benchmark_chain_index(nHeight);
+            sample_times.insert(sample_times.end(), vals.begin(), vals.end());
         } else if (benchmarktype == "validatelargetx") {
             sample_times.push_back(benchmark_large_tx());
         } else if (benchmarktype == "trydecryptnotes") {
             int nAddrs = params[2].get_int();
-            sample_times.push_back(benchmark_try_decrypt_notes(nAddrs));
+            int nThreads = params.size() > 3 ? params[3].get_int() : 1;
+            if (nThreads <= 0) {
+                throw JSONRPCError(RPC_TYPE_ERROR, "Invalid number of threads");
+            }
+            std::vector<double> vals = benchmark_try_decrypt_notes(nAddrs, nThreads);
+            sample_times.push_back(vals[0]);
+            sample_throughputs.push_back(vals[1]);
         } else if (benchmarktype == "incnotewitnesses") {
             int nTxs = params[2].get_int();
             sample_times.push_back(benchmark_increment_note_witnesses(nTxs));
@@ -2837,9 +2949,18 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
     }
 
     UniValue results(UniValue::VARR);
-    for (auto time : sample_times) {
+    for (size_t i = 0; i < sample_times.size(); i++) {
         UniValue result(UniValue::VOBJ);
-        result.push_back(Pair("runningtime", time));
+        result.push_back(Pair("runningtime", sample_times[i]));
+        if (i < sample_throughputs.size()) {
+            result.push_back(Pair("throughput", sample_throughputs[i]));
+        }
+        if (i < sample_sizes.size()) {
+            result.push_back(Pair("storedsize", sample_sizes[i]));
+        }
+        if (i < sample_wiresizes.size()) {
+            result.push_back(Pair("wiresize", sample_wiresizes[i]));
+        }
         results.push_back(result);
     }
 
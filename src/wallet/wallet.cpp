@@ -7,7 +7,9 @@
 #include "wallet/wallet.h"
 
 #include "base58.h"
+#include "blockstore.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "coincontrol.h"
 #include "consensus/validation.h"
 #include "init.h"
@@ -35,6 +37,7 @@ CAmount maxTxFee = DEFAULT_TRANSACTION_MAXFEE;
 unsigned int nTxConfirmTarget = DEFAULT_TX_CONFIRM_TARGET;
 bool bSpendZeroConfChange = true;
 bool fSendFreeTransactions = false;
+int nNoteDecryptThreads = 1;
 bool fPayAtLeastCustomFee = true;
 
 /**
@@ -609,6 +612,25 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
  * Note is spent if any non-conflicted transaction
  * spends it:
  */
+/**
+ * Returns the depth in the main chain of the wallet transaction spending
+ * the given nullifier, or -1 if it is unspent.
+ */
+int CWallet::GetSpendDepth(const uint256& nullifier) const
+{
+    pair<TxNullifiers::const_iterator, TxNullifiers::const_iterator> range;
+    range = mapTxNullifiers.equal_range(nullifier);
+
+    int nDepth = -1;
+    for (TxNullifiers::const_iterator it = range.first; it != range.second; ++it) {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end()) {
+            nDepth = std::max(nDepth, mit->second.GetDepthInMainChain());
+        }
+    }
+    return nDepth;
+}
+
 bool CWallet::IsSpent(const uint256& nullifier) const
 {
     pair<TxNullifiers::const_iterator, TxNullifiers::const_iterator> range;
@@ -659,6 +681,24 @@ void CWallet::AddToSpends(const uint256& wtxid)
     }
 }
 
+void CWallet::AddToUnspentNotes(const CWalletTx& wtx)
+{
+    for (const mapNoteData_t::value_type& item : wtx.mapNoteData) {
+        setUnspentNotes.insert(item.first);
+    }
+}
+
+CNoteData* CWallet::GetUnspentNoteData(const JSOutPoint& jsop)
+{
+    std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(jsop.hash);
+    if (mi == mapWallet.end())
+        return NULL;
+    mapNoteData_t::iterator nit = mi->second.mapNoteData.find(jsop);
+    if (nit == mi->second.mapNoteData.end())
+        return NULL;
+    return &nit->second;
+}
+
 void CWallet::ClearNoteWitnessCache()
 {
     LOCK(cs_wallet);
@@ -676,31 +716,53 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
                                      ZCIncrementalMerkleTree& tree)
 {
     {
-        LOCK(cs_wallet);
-        for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-            for (mapNoteData_t::value_type& item : wtxItem.second.mapNoteData) {
-                CNoteData* nd = &(item.second);
-                // Only increment witnesses that are behind the current height
-                if (nd->witnessHeight < pindex->nHeight) {
-                    // Check the validity of the cache
-                    // The only time a note witnessed above the current height
-                    // would be invalid here is during a reindex when blocks
-                    // have been decremented, and we are incrementing the blocks
-                    // immediately after.
-                    assert(nWitnessCacheSize >= nd->witnesses.size());
-                    // Witnesses being incremented should always be either -1
-                    // (never incremented or decremented) or one below pindex
-                    assert((nd->witnessHeight == -1) ||
-                           (nd->witnessHeight == pindex->nHeight - 1));
-                    // Copy the witness for the previous block if we have one
-                    if (nd->witnesses.size() > 0) {
-                        nd->witnesses.push_front(nd->witnesses.front());
-                    }
-                    if (nd->witnesses.size() > WITNESS_CACHE_SIZE) {
-                        nd->witnesses.pop_back();
-                    }
+        // cs_main is needed for the depth of spends, see GetSpendDepth
+        LOCK2(cs_main, cs_wallet);
+        // Notes that are behind the current height, and the witnesses among
+        // them to increment. Only the unspent notes are walked, once per
+        // block; each commitment is then appended through the updater.
+        std::vector<CNoteData*> vBehind;
+        ZCIncrementalWitnessUpdater updater(tree);
+        for (std::set<JSOutPoint>::iterator it = setUnspentNotes.begin(); it != setUnspentNotes.end(); ) {
+            CNoteData* nd = GetUnspentNoteData(*it);
+            if (!nd) {
+                it = setUnspentNotes.erase(it);
+                continue;
+            }
+            // Only increment witnesses that are behind the current height
+            if (nd->witnessHeight < pindex->nHeight) {
+                // Check the validity of the cache
+                // The only time a note witnessed above the current height
+                // would be invalid here is during a reindex when blocks
+                // have been decremented, and we are incrementing the blocks
+                // immediately after.
+                assert(nWitnessCacheSize >= nd->witnesses.size());
+                // Witnesses being incremented should always be either -1
+                // (never incremented or decremented) or one below pindex
+                assert((nd->witnessHeight == -1) ||
+                       (nd->witnessHeight == pindex->nHeight - 1));
+                // A note spent deeper than the witness cache can never be
+                // spent again, so it leaves the index and its witnesses are
+                // no longer kept. Only notes with a known spend are looked
+                // up in the chain.
+                if (nd->nullifier && mapTxNullifiers.count(*nd->nullifier) &&
+                        GetSpendDepth(*nd->nullifier) >= (int)WITNESS_CACHE_SIZE) {
+                    nd->witnesses.clear();
+                    nd->witnessHeight = -1;
+                    it = setUnspentNotes.erase(it);
+                    continue;
+                }
+                vBehind.push_back(nd);
+                // Copy the witness for the previous block if we have one
+                if (nd->witnesses.size() > 0) {
+                    nd->witnesses.push_front(nd->witnesses.front());
+                    updater.add(&nd->witnesses.front());
+                }
+                if (nd->witnesses.size() > WITNESS_CACHE_SIZE) {
+                    nd->witnesses.pop_back();
                 }
             }
+            ++it;
         }
         if (nWitnessCacheSize < WITNESS_CACHE_SIZE) {
             nWitnessCacheSize += 1;
@@ -723,18 +785,7 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
                     tree.append(note_commitment);
 
                     // Increment existing witnesses
-                    for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-                        for (mapNoteData_t::value_type& item : wtxItem.second.mapNoteData) {
-                            CNoteData* nd = &(item.second);
-                            if (nd->witnessHeight < pindex->nHeight &&
-                                    nd->witnesses.size() > 0) {
-                                // Check the validity of the cache
-                                // See earlier comment about validity.
-                                assert(nWitnessCacheSize >= nd->witnesses.size());
-                                nd->witnesses.front().append(note_commitment);
-                            }
-                        }
-                    }
+                    updater.append(note_commitment);
 
                     // If this is our note, witness it
                     if (txIsOurs) {
@@ -751,15 +802,19 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
                                 // to be called again on previously-cached blocks. This
                                 // doesn't affect existing cached notes because of the
                                 // CNoteData::witnessHeight checks. See #1378 for details.
+                                updater.finish();
                                 LogPrintf("Inconsistent witness cache state found for %s\n- Cache size: %d\n- Top (height %d): %s\n- New (height %d): %s\n",
                                           jsoutpt.ToString(), nd->witnesses.size(),
                                           nd->witnessHeight,
                                           nd->witnesses.front().root().GetHex(),
                                           pindex->nHeight,
                                           tree.witness().root().GetHex());
+                                updater.remove(&nd->witnesses.front());
                                 nd->witnesses.clear();
                             }
                             nd->witnesses.push_front(tree.witness());
+                            updater.add(&nd->witnesses.front());
+                            setUnspentNotes.insert(jsoutpt);
                             // Set height to one less than pindex so it gets incremented
                             nd->witnessHeight = pindex->nHeight - 1;
                             // Check the validity of the cache
@@ -769,17 +824,15 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
                 }
             }
         }
+        updater.finish();
 
         // Update witness heights
-        for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-            for (mapNoteData_t::value_type& item : wtxItem.second.mapNoteData) {
-                CNoteData* nd = &(item.second);
-                if (nd->witnessHeight < pindex->nHeight) {
-                    nd->witnessHeight = pindex->nHeight;
-                    // Check the validity of the cache
-                    // See earlier comment about validity.
-                    assert(nWitnessCacheSize >= nd->witnesses.size());
-                }
+        for (CNoteData* nd : vBehind) {
+            if (nd->witnessHeight < pindex->nHeight) {
+                nd->witnessHeight = pindex->nHeight;
+                // Check the validity of the cache
+                // See earlier comment about validity.
+                assert(nWitnessCacheSize >= nd->witnesses.size());
             }
         }
 
@@ -793,45 +846,47 @@ void CWallet::DecrementNoteWitnesses(const CBlockIndex* pindex)
 {
     {
         LOCK(cs_wallet);
-        for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-            for (mapNoteData_t::value_type& item : wtxItem.second.mapNoteData) {
-                CNoteData* nd = &(item.second);
-                // Only increment witnesses that are not above the current height
-                if (nd->witnessHeight <= pindex->nHeight) {
-                    // Check the validity of the cache
-                    // See comment below (this would be invalid if there was a
-                    // prior decrement).
-                    assert(nWitnessCacheSize >= nd->witnesses.size());
-                    // Witnesses being decremented should always be either -1
-                    // (never incremented or decremented) or equal to pindex
-                    assert((nd->witnessHeight == -1) ||
-                           (nd->witnessHeight == pindex->nHeight));
-                    if (nd->witnesses.size() > 0) {
-                        nd->witnesses.pop_front();
-                    }
-                    // pindex is the block being removed, so the new witness cache
-                    // height is one below it.
-                    nd->witnessHeight = pindex->nHeight - 1;
+        // Notes spent deeper than any reorg have no witnesses to rewind
+        for (std::set<JSOutPoint>::iterator it = setUnspentNotes.begin(); it != setUnspentNotes.end(); ) {
+            CNoteData* nd = GetUnspentNoteData(*it);
+            if (!nd) {
+                it = setUnspentNotes.erase(it);
+                continue;
+            }
+            // Only increment witnesses that are not above the current height
+            if (nd->witnessHeight <= pindex->nHeight) {
+                // Check the validity of the cache
+                // See comment below (this would be invalid if there was a
+                // prior decrement).
+                assert(nWitnessCacheSize >= nd->witnesses.size());
+                // Witnesses being decremented should always be either -1
+                // (never incremented or decremented) or equal to pindex
+                assert((nd->witnessHeight == -1) ||
+                       (nd->witnessHeight == pindex->nHeight));
+                if (nd->witnesses.size() > 0) {
+                    nd->witnesses.pop_front();
                 }
+                // pindex is the block being removed, so the new witness cache
+                // height is one below it.
+                nd->witnessHeight = pindex->nHeight - 1;
             }
+            ++it;
         }
         nWitnessCacheSize -= 1;
-        for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-            for (mapNoteData_t::value_type& item : wtxItem.second.mapNoteData) {
-                CNoteData* nd = &(item.second);
-                // Check the validity of the cache
-                // Technically if there are notes witnessed above the current
-                // height, their cache will now be invalid (relative to the new
-                // value of nWitnessCacheSize). However, this would only occur
-                // during a reindex, and by the time the reindex reaches the tip
-                // of the chain again, the existing witness caches will be valid
-                // again.
-                // We don't set nWitnessCacheSize to zero at the start of the
-                // reindex because the on-disk blocks had already resulted in a
-                // chain that didn't trigger the assertion below.
-                if (nd->witnessHeight < pindex->nHeight) {
-                    assert(nWitnessCacheSize >= nd->witnesses.size());
-                }
+        for (const JSOutPoint& jsop : setUnspentNotes) {
+            CNoteData* nd = GetUnspentNoteData(jsop);
+            // Check the validity of the cache
+            // Technically if there are notes witnessed above the current
+            // height, their cache will now be invalid (relative to the new
+            // value of nWitnessCacheSize). However, this would only occur
+            // during a reindex, and by the time the reindex reaches the tip
+            // of the chain again, the existing witness caches will be valid
+            // again.
+            // We don't set nWitnessCacheSize to zero at the start of the
+            // reindex because the on-disk blocks had already resulted in a
+            // chain that didn't trigger the assertion below.
+            if (nd->witnessHeight < pindex->nHeight) {
+                assert(nWitnessCacheSize >= nd->witnesses.size());
             }
         }
         // TODO: If nWitnessCache is zero, we need to regenerate the caches (#1302)
@@ -1040,6 +1095,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         mapWallet[hash].BindWallet(this);
         UpdateNullifierNoteMapWithTx(mapWallet[hash]);
         AddToSpends(hash);
+        AddToUnspentNotes(mapWallet[hash]);
     }
     else
     {
@@ -1127,6 +1183,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
                 fUpdated = true;
             }
         }
+        AddToUnspentNotes(wtx);
 
         //// debug print
         LogPrintf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
@@ -1278,6 +1335,78 @@ boost::optional<uint256> CWallet::GetNoteNullifier(const JSDescription& jsdesc,
     return ret;
 }
 
+/**
+ * Closure that trial-decrypts every output of a transaction with the
+ * decryptors in [nBegin, nEnd), recording in *pvMatch the first decryptor
+ * that succeeds for each output (outputs are numbered
+ * i * ZC_NUM_JS_OUTPUTS + j, misses are vDecryptors.size()).
+ */
+class CNoteDecryptCheck
+{
+private:
+    const CTransaction* ptx;
+    const std::vector<uint256>* pvhSig;
+    const std::vector<const NoteDecryptorMap::value_type*>* pvDecryptors;
+    size_t nBegin;
+    size_t nEnd;
+    std::vector<size_t>* pvMatch;
+
+public:
+    CNoteDecryptCheck() : ptx(0), pvhSig(0), pvDecryptors(0), nBegin(0), nEnd(0), pvMatch(0) {}
+    CNoteDecryptCheck(const CTransaction& txIn, const std::vector<uint256>& vhSigIn,
+                      const std::vector<const NoteDecryptorMap::value_type*>& vDecryptorsIn,
+                      size_t nBeginIn, size_t nEndIn, std::vector<size_t>& vMatchIn) :
+        ptx(&txIn), pvhSig(&vhSigIn), pvDecryptors(&vDecryptorsIn),
+        nBegin(nBeginIn), nEnd(nEndIn), pvMatch(&vMatchIn) { }
+
+    bool operator()()
+    {
+        const std::vector<const NoteDecryptorMap::value_type*>& vDecryptors = *pvDecryptors;
+        pvMatch->assign(ptx->vjoinsplit.size() * ZC_NUM_JS_OUTPUTS, vDecryptors.size());
+        ZCNoteDecryption::Plaintext plaintext;
+        for (size_t d = nBegin; d < nEnd; d++) {
+            const ZCNoteDecryption& dec = vDecryptors[d]->second;
+            for (size_t i = 0; i < ptx->vjoinsplit.size(); i++) {
+                const JSDescription& jsdesc = ptx->vjoinsplit[i];
+                uint256 dhsecret;
+                if (!dec.get_dhsecret(dhsecret, jsdesc.ephemeralKey)) {
+                    continue;
+                }
+                for (size_t j = 0; j < ZC_NUM_JS_OUTPUTS; j++) {
+                    size_t nOutput = i * ZC_NUM_JS_OUTPUTS + j;
+                    if ((*pvMatch)[nOutput] == vDecryptors.size() &&
+                        dec.try_decrypt(plaintext, jsdesc.ciphertexts[j], dhsecret,
+                                        jsdesc.ephemeralKey, (*pvhSig)[i], (unsigned char) j)) {
+                        (*pvMatch)[nOutput] = d;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    void swap(CNoteDecryptCheck& check)
+    {
+        std::swap(ptx, check.ptx);
+        std::swap(pvhSig, check.pvhSig);
+        std::swap(pvDecryptors, check.pvDecryptors);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+        std::swap(pvMatch, check.pvMatch);
+    }
+};
+
+// Trial decryption of one chunk takes a while, so workers take them one at a time.
+static CCheckQueue<CNoteDecryptCheck> notedecryptqueue(1);
+//! Held by the FindMyNotes call that is using notedecryptqueue
+static CCriticalSection cs_notedecryptqueue;
+
+void ThreadNoteDecrypt()
+{
+    RenameThread("litecoinz-notedec");
+    notedecryptqueue.Thread();
+}
+
 /**
  * Finds all output notes in the given transaction that have been sent to
  * PaymentAddresses in this wallet.
@@ -1292,34 +1421,74 @@ mapNoteData_t CWallet::FindMyNotes(const CTransaction& tx) const
     uint256 hash = tx.GetHash();
 
     mapNoteData_t noteData;
-    for (size_t i = 0; i < tx.vjoinsplit.size(); i++) {
-        auto hSig = tx.vjoinsplit[i].h_sig(*pzcashParams, tx.joinSplitPubKey);
-        for (uint8_t j = 0; j < tx.vjoinsplit[i].ciphertexts.size(); j++) {
-            for (const NoteDecryptorMap::value_type& item : mapNoteDecryptors) {
-                try {
-                    auto address = item.first;
-                    JSOutPoint jsoutpt {hash, i, j};
-                    auto nullifier = GetNoteNullifier(
-                        tx.vjoinsplit[i],
-                        address,
-                        item.second,
-                        hSig, j);
-                    if (nullifier) {
-                        CNoteData nd {address, *nullifier};
-                        noteData.insert(std::make_pair(jsoutpt, nd));
-                    } else {
-                        CNoteData nd {address};
-                        noteData.insert(std::make_pair(jsoutpt, nd));
-                    }
-                    break;
-                } catch (const note_decryption_failed &err) {
-                    // Couldn't decrypt with this decryptor
-                } catch (const std::exception &exc) {
-                    // Unexpected failure
-                    LogPrintf("FindMyNotes(): Unexpected error while testing decrypt:\n");
-                    LogPrintf("%s\n", exc.what());
+    if (tx.vjoinsplit.empty() || mapNoteDecryptors.empty()) {
+        return noteData;
+    }
+
+    std::vector<uint256> vhSig;
+    for (const JSDescription& jsdesc : tx.vjoinsplit) {
+        vhSig.push_back(jsdesc.h_sig(*pzcashParams, tx.joinSplitPubKey));
+    }
+
+    std::vector<const NoteDecryptorMap::value_type*> vDecryptors;
+    for (const NoteDecryptorMap::value_type& item : mapNoteDecryptors) {
+        vDecryptors.push_back(&item);
+    }
+
+    // Large wallets spread the decryptors across the note decryption
+    // threads; each chunk is contiguous, so the earliest chunk with a match
+    // wins. If another call is using the threads, this one runs alone.
+    size_t nChunks = std::max(1, std::min<int>(nNoteDecryptThreads,
+        (vDecryptors.size() + MIN_NOTE_DECRYPTORS_PER_THREAD - 1) / MIN_NOTE_DECRYPTORS_PER_THREAD));
+    TRY_LOCK(cs_notedecryptqueue, lockQueue);
+    if (!lockQueue)
+        nChunks = 1;
+    size_t nChunk = (vDecryptors.size() + nChunks - 1) / nChunks;
+    std::vector<std::vector<size_t>> vMatches(nChunks);
+    std::vector<CNoteDecryptCheck> vChecks;
+    for (size_t c = 0; c < nChunks; c++) {
+        vChecks.push_back(CNoteDecryptCheck(tx, vhSig, vDecryptors, c * nChunk,
+                                            std::min(vDecryptors.size(), (c + 1) * nChunk), vMatches[c]));
+    }
+    if (nChunks == 1) {
+        vChecks[0]();
+    } else {
+        CCheckQueueControl<CNoteDecryptCheck> control(&notedecryptqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    const size_t nOutputs = tx.vjoinsplit.size() * ZC_NUM_JS_OUTPUTS;
+
+    for (size_t nOutput = 0; nOutput < nOutputs; nOutput++) {
+        for (const std::vector<size_t>& vMatch : vMatches) {
+            if (vMatch[nOutput] == vDecryptors.size()) {
+                continue;
+            }
+            size_t i = nOutput / ZC_NUM_JS_OUTPUTS;
+            uint8_t j = nOutput % ZC_NUM_JS_OUTPUTS;
+            const NoteDecryptorMap::value_type& item = *vDecryptors[vMatch[nOutput]];
+            try {
+                auto address = item.first;
+                JSOutPoint jsoutpt {hash, i, j};
+                auto nullifier = GetNoteNullifier(
+                    tx.vjoinsplit[i],
+                    address,
+                    item.second,
+                    vhSig[i], j);
+                if (nullifier) {
+                    CNoteData nd {address, *nullifier};
+                    noteData.insert(std::make_pair(jsoutpt, nd));
+                } else {
+                    CNoteData nd {address};
+                    noteData.insert(std::make_pair(jsoutpt, nd));
                 }
+            } catch (const std::exception &exc) {
+                // Unexpected failure
+                LogPrintf("FindMyNotes(): Unexpected error while testing decrypt:\n");
+                LogPrintf("%s\n", exc.what());
             }
+            break;
         }
     }
     return noteData;
@@ -1344,24 +1513,24 @@ void CWallet::GetNoteWitnesses(std::vector<JSOutPoint> notes,
     {
         LOCK(cs_wallet);
         witnesses.resize(notes.size());
-        boost::optional<uint256> rt;
+        std::vector<const ZCIncrementalWitness*> found;
         int i = 0;
         for (JSOutPoint note : notes) {
             if (mapWallet.count(note.hash) &&
                     mapWallet[note.hash].mapNoteData.count(note) &&
                     mapWallet[note.hash].mapNoteData[note].witnesses.size() > 0) {
                 witnesses[i] = mapWallet[note.hash].mapNoteData[note].witnesses.front();
-                if (!rt) {
-                    rt = witnesses[i]->root();
-                } else {
-                    assert(*rt == witnesses[i]->root());
-                }
+                found.push_back(&*witnesses[i]);
             }
             i++;
         }
         // All returned witnesses have the same anchor
-        if (rt) {
-            final_anchor = *rt;
+        std::vector<libzcash::SHA256Compress> roots = ZCIncrementalWitness::roots(found);
+        for (const libzcash::SHA256Compress& rt : roots) {
+            assert(rt == roots.front());
+        }
+        if (!roots.empty()) {
+            final_anchor = roots.front();
         }
     }
 }
@@ -1770,11 +1939,15 @@ void CWallet::WitnessNoteCommitment(std::vector<uint256> commitments,
     // TODO: #93; Select a root via some heuristic.
     final_anchor = tree.root();
 
+    std::vector<const ZCIncrementalWitness*> found;
     BOOST_FOREACH(boost::optional<ZCIncrementalWitness>& wit, witnesses) {
         if (wit) {
-            assert(final_anchor == wit->root());
+            found.push_back(&*wit);
         }
     }
+    BOOST_FOREACH(const libzcash::SHA256Compress& rt, ZCIncrementalWitness::roots(found)) {
+        assert(final_anchor == rt);
+    }
 }
 
 /**
@@ -1805,9 +1978,13 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            // The block's header is checked against the index when it is
+            // read, so its proof of work does not need checking again
+            CBlockView view;
+            CBlock blockEmpty;
+            const CBlock* pblock = view.Read(pindex) ? view.GetBlock() : NULL;
+            const CBlock& block = pblock ? *pblock : blockEmpty;
+            BOOST_FOREACH(const CTransaction& tx, block.vtx)
             {
                 if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
                     ret++;
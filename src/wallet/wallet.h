@@ -43,6 +43,10 @@ extern unsigned int nTxConfirmTarget;
 extern bool bSpendZeroConfChange;
 extern bool fSendFreeTransactions;
 extern bool fPayAtLeastCustomFee;
+extern int nNoteDecryptThreads;
+
+/** Run a note trial decryption worker; -notedecryptthreads minus one of them are started */
+void ThreadNoteDecrypt();
 
 //! -paytxfee default
 static const CAmount DEFAULT_TRANSACTION_FEE = 0;
@@ -54,6 +58,10 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 0.1 * COIN;
 static const unsigned int DEFAULT_TX_CONFIRM_TARGET = 2;
 //! -maxtxfee will warn if called with a higher fee than this amount (in satoshis)
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
+//! -notedecryptthreads default (0 = number of cores)
+static const int DEFAULT_NOTE_DECRYPT_THREADS = 0;
+//! Trial decryption is only split across threads in chunks of at least this many decryptors
+static const size_t MIN_NOTE_DECRYPTORS_PER_THREAD = 64;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
 //! Size of witness cache
@@ -695,10 +703,19 @@ private:
      */
     typedef TxSpendMap<uint256> TxNullifiers;
     TxNullifiers mapTxNullifiers;
+    /**
+     * Notes whose witnesses are kept up to date, which is every note in
+     * mapWallet except those spent at least WITNESS_CACHE_SIZE blocks deep.
+     * Entries whose transaction has left mapWallet are dropped lazily.
+     */
+    std::set<JSOutPoint> setUnspentNotes;
 
     void AddToSpends(const COutPoint& outpoint, const uint256& wtxid);
     void AddToSpends(const uint256& nullifier, const uint256& wtxid);
     void AddToSpends(const uint256& wtxid);
+    void AddToUnspentNotes(const CWalletTx& wtx);
+    /** Look up a note of setUnspentNotes, or return NULL if it is gone */
+    CNoteData* GetUnspentNoteData(const JSOutPoint& jsop);
 
 public:
     /*
@@ -897,6 +914,7 @@ public:
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
     bool IsSpent(const uint256& nullifier) const;
+    int GetSpendDepth(const uint256& nullifier) const;
 
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);
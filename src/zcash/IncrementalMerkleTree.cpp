@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <stdexcept>
 
 #include <boost/foreach.hpp>
@@ -20,6 +21,17 @@ SHA256Compress SHA256Compress::combine(const SHA256Compress& a, const SHA256Comp
     return res;
 }
 
+void SHA256Compress::combine_many(const std::vector<SHA256Compress>& in, std::vector<SHA256Compress>& out)
+{
+    static_assert(sizeof(SHA256Compress) == 32, "SHA256Compress must be a plain 32-byte hash");
+    assert(in.size() % 2 == 0);
+
+    out.resize(in.size() / 2);
+    if (!out.empty()) {
+        SHA256Compress64(out[0].begin(), in[0].begin(), out.size());
+    }
+}
+
 template <size_t Depth, typename Hash>
 class PathFiller {
 private:
@@ -229,6 +241,53 @@ Hash IncrementalMerkleTree<Depth, Hash>::root(size_t depth,
     return root;
 }
 
+template<size_t Depth, typename Hash>
+std::vector<Hash> IncrementalMerkleTree<Depth, Hash>::roots(const std::vector<const IncrementalMerkleTree*>& trees)
+{
+    return roots(trees, std::vector<std::deque<Hash>>(trees.size()));
+}
+
+// Computes the same value as root(Depth, filler_hashes[i]) for every tree.
+// Each level of root() is a single combine for every tree, so the trees
+// can be walked in lockstep with all of a level's combines done together.
+template<size_t Depth, typename Hash>
+std::vector<Hash> IncrementalMerkleTree<Depth, Hash>::roots(const std::vector<const IncrementalMerkleTree*>& trees,
+                                                            const std::vector<std::deque<Hash>>& filler_hashes)
+{
+    assert(trees.size() == filler_hashes.size());
+
+    std::vector<PathFiller<Depth, Hash>> fillers;
+    fillers.reserve(trees.size());
+    for (const std::deque<Hash>& filler : filler_hashes) {
+        fillers.push_back(PathFiller<Depth, Hash>(filler));
+    }
+
+    std::vector<Hash> pairs(2 * trees.size());
+    std::vector<Hash> level;
+
+    for (size_t i = 0; i < trees.size(); i++) {
+        pairs[2*i] = trees[i]->left ? *trees[i]->left : fillers[i].next(0);
+        pairs[2*i+1] = trees[i]->right ? *trees[i]->right : fillers[i].next(0);
+    }
+    Hash::combine_many(pairs, level);
+
+    for (size_t d = 1; d < Depth; d++) {
+        for (size_t i = 0; i < trees.size(); i++) {
+            const std::vector<boost::optional<Hash>>& parents = trees[i]->parents;
+            if (d - 1 < parents.size() && parents[d-1]) {
+                pairs[2*i] = *parents[d-1];
+                pairs[2*i+1] = level[i];
+            } else {
+                pairs[2*i] = level[i];
+                pairs[2*i+1] = fillers[i].next(d);
+            }
+        }
+        Hash::combine_many(pairs, level);
+    }
+
+    return level;
+}
+
 // This constructs an authentication path into the tree in the format that the circuit
 // wants. The caller provides `filler_hashes` to fill in the uncle subtrees.
 template<size_t Depth, typename Hash>
@@ -295,6 +354,21 @@ std::deque<Hash> IncrementalWitness<Depth, Hash>::partial_path() const {
     return uncles;
 }
 
+template<size_t Depth, typename Hash>
+std::vector<Hash> IncrementalWitness<Depth, Hash>::roots(const std::vector<const IncrementalWitness*>& witnesses)
+{
+    std::vector<const IncrementalMerkleTree<Depth, Hash>*> trees;
+    std::vector<std::deque<Hash>> filler_hashes;
+    trees.reserve(witnesses.size());
+    filler_hashes.reserve(witnesses.size());
+    for (const IncrementalWitness* witness : witnesses) {
+        trees.push_back(&witness->tree);
+        filler_hashes.push_back(witness->partial_path());
+    }
+
+    return IncrementalMerkleTree<Depth, Hash>::roots(trees, filler_hashes);
+}
+
 template<size_t Depth, typename Hash>
 void IncrementalWitness<Depth, Hash>::append(Hash obj) {
     if (cursor) {
@@ -320,10 +394,113 @@ void IncrementalWitness<Depth, Hash>::append(Hash obj) {
     }
 }
 
+template<size_t Depth, typename Hash>
+void IncrementalWitnessUpdater<Depth, Hash>::add(IncrementalWitness<Depth, Hash>* witness) {
+    if (!witness->cursor) {
+        wait(witness);
+        return;
+    }
+
+    // The witness is part way through a subtree, which is shared with any
+    // other witness that has the same cursor.
+    const IncrementalMerkleTree<Depth, Hash>& cursor = *witness->cursor;
+    Subtree& subtree = subtrees[std::make_pair(witness->cursor_depth, position - cursor.size())];
+    if (!subtree.cursor) {
+        subtree.cursor = cursor;
+    } else if (subtree.cursor->size() != cursor.size() || subtree.cursor->last() != cursor.last()) {
+        // Not a witness of the same tree; keep it to itself.
+        independent.push_back(witness);
+        return;
+    }
+    subtree.witnesses.push_back(witness);
+}
+
+template<size_t Depth, typename Hash>
+void IncrementalWitnessUpdater<Depth, Hash>::remove(IncrementalWitness<Depth, Hash>* witness) {
+    for (auto& item : subtrees) {
+        auto& witnesses = item.second.witnesses;
+        witnesses.erase(std::remove(witnesses.begin(), witnesses.end(), witness), witnesses.end());
+    }
+    independent.erase(std::remove(independent.begin(), independent.end(), witness), independent.end());
+}
+
+// Waits for the next subtree of a witness with no cursor, which starts at
+// the next commitment.
+template<size_t Depth, typename Hash>
+void IncrementalWitnessUpdater<Depth, Hash>::wait(IncrementalWitness<Depth, Hash>* witness) {
+    size_t depth = witness->tree.next_depth(witness->filled.size());
+    subtrees[std::make_pair(depth, position)].witnesses.push_back(witness);
+}
+
+template<size_t Depth, typename Hash>
+void IncrementalWitnessUpdater<Depth, Hash>::append(Hash obj) {
+    std::vector<IncrementalWitness<Depth, Hash>*> completed;
+
+    for (auto it = subtrees.begin(); it != subtrees.end(); ) {
+        size_t depth = it->first.first;
+        Subtree& subtree = it->second;
+
+        if (depth >= Depth) {
+            throw std::runtime_error("tree is full");
+        }
+
+        Hash root;
+        if (depth == 0) {
+            root = obj;
+        } else {
+            if (!subtree.cursor) {
+                subtree.cursor = IncrementalMerkleTree<Depth, Hash>();
+            }
+            subtree.cursor->append(obj);
+            if (!subtree.cursor->is_complete(depth)) {
+                it++;
+                continue;
+            }
+            root = subtree.cursor->root(depth);
+        }
+
+        for (IncrementalWitness<Depth, Hash>* witness : subtree.witnesses) {
+            witness->filled.push_back(root);
+            witness->cursor = boost::none;
+            witness->cursor_depth = depth;
+            completed.push_back(witness);
+        }
+        it = subtrees.erase(it);
+    }
+
+    for (IncrementalWitness<Depth, Hash>* witness : independent) {
+        witness->append(obj);
+    }
+
+    position++;
+
+    for (IncrementalWitness<Depth, Hash>* witness : completed) {
+        wait(witness);
+    }
+}
+
+template<size_t Depth, typename Hash>
+void IncrementalWitnessUpdater<Depth, Hash>::finish() {
+    for (const auto& item : subtrees) {
+        const Subtree& subtree = item.second;
+        if (!subtree.cursor) {
+            // Nothing has been appended to this subtree yet.
+            continue;
+        }
+        for (IncrementalWitness<Depth, Hash>* witness : subtree.witnesses) {
+            witness->cursor = subtree.cursor;
+            witness->cursor_depth = item.first.first;
+        }
+    }
+}
+
 template class IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH, SHA256Compress>;
 template class IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, SHA256Compress>;
 
 template class IncrementalWitness<INCREMENTAL_MERKLE_TREE_DEPTH, SHA256Compress>;
 template class IncrementalWitness<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, SHA256Compress>;
 
+template class IncrementalWitnessUpdater<INCREMENTAL_MERKLE_TREE_DEPTH, SHA256Compress>;
+template class IncrementalWitnessUpdater<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, SHA256Compress>;
+
 } // end namespace `libzcash`
@@ -2,6 +2,7 @@
 #define ZC_INCREMENTALMERKLETREE_H_
 
 #include <deque>
+#include <map>
 #include <boost/optional.hpp>
 #include <boost/static_assert.hpp>
 
@@ -59,10 +60,14 @@ bool operator==(const EmptyMerkleRoots<Depth, Hash>& a,
 template<size_t Depth, typename Hash>
 class IncrementalWitness;
 
+template<size_t Depth, typename Hash>
+class IncrementalWitnessUpdater;
+
 template<size_t Depth, typename Hash>
 class IncrementalMerkleTree {
 
 friend class IncrementalWitness<Depth, Hash>;
+friend class IncrementalWitnessUpdater<Depth, Hash>;
 
 public:
     BOOST_STATIC_ASSERT(Depth >= 1);
@@ -83,6 +88,10 @@ public:
     }
     Hash last() const;
 
+    // Same as calling root() on each tree, but the trees are hashed a level
+    // at a time so that Hash::combine_many can work on several at once.
+    static std::vector<Hash> roots(const std::vector<const IncrementalMerkleTree*>& trees);
+
     IncrementalWitness<Depth, Hash> witness() const {
         return IncrementalWitness<Depth, Hash>(*this);
     }
@@ -115,6 +124,8 @@ private:
     std::vector<boost::optional<Hash>> parents;
     MerklePath path(std::deque<Hash> filler_hashes = std::deque<Hash>()) const;
     Hash root(size_t depth, std::deque<Hash> filler_hashes = std::deque<Hash>()) const;
+    static std::vector<Hash> roots(const std::vector<const IncrementalMerkleTree*>& trees,
+                                   const std::vector<std::deque<Hash>>& filler_hashes);
     bool is_complete(size_t depth = Depth) const;
     size_t next_depth(size_t skip) const;
     void wfcheck() const;
@@ -132,6 +143,7 @@ bool operator==(const IncrementalMerkleTree<Depth, Hash>& a,
 template <size_t Depth, typename Hash>
 class IncrementalWitness {
 friend class IncrementalMerkleTree<Depth, Hash>;
+friend class IncrementalWitnessUpdater<Depth, Hash>;
 
 public:
     // Required for Unserialize()
@@ -151,6 +163,10 @@ public:
         return tree.root(Depth, partial_path());
     }
 
+    // Same as calling root() on each witness, batched like
+    // IncrementalMerkleTree::roots.
+    static std::vector<Hash> roots(const std::vector<const IncrementalWitness*>& witnesses);
+
     void append(Hash obj);
 
     ADD_SERIALIZE_METHODS;
@@ -186,12 +202,59 @@ bool operator==(const IncrementalWitness<Depth, Hash>& a,
             a.cursor_depth == b.cursor_depth);
 }
 
+// Appends the same commitments to many witnesses of one tree, with the
+// same result as calling IncrementalWitness::append on each of them.
+//
+// A witness only ever waits on one subtree (to the right of its path) to
+// be completed, and all witnesses waiting on the same subtree see the same
+// commitments, so they share a single cursor: each commitment is hashed
+// into at most one cursor per subtree depth, however many witnesses there
+// are. Witnesses are only written to when their subtree is complete, and
+// by finish().
+template<size_t Depth, typename Hash>
+class IncrementalWitnessUpdater {
+public:
+    // `tree` is the tree the witnesses have been incremented to so far.
+    IncrementalWitnessUpdater(const IncrementalMerkleTree<Depth, Hash>& tree) : position(tree.size()) { }
+
+    // The witness must outlive the updater, or be removed from it.
+    void add(IncrementalWitness<Depth, Hash>* witness);
+    void remove(IncrementalWitness<Depth, Hash>* witness);
+
+    void append(Hash obj);
+
+    // Writes the shared cursors back to the witnesses that are still
+    // waiting on a subtree. Must be called before the witnesses are used.
+    void finish();
+
+private:
+    struct Subtree {
+        boost::optional<IncrementalMerkleTree<Depth, Hash>> cursor;
+        std::vector<IncrementalWitness<Depth, Hash>*> witnesses;
+    };
+
+    // Number of commitments in the tree, i.e. the position of the next one
+    uint64_t position;
+
+    // Subtrees being filled, keyed by (depth, position of first commitment)
+    std::map<std::pair<size_t, uint64_t>, Subtree> subtrees;
+
+    // Witnesses that could not share a cursor, and are appended to directly
+    std::vector<IncrementalWitness<Depth, Hash>*> independent;
+
+    void wait(IncrementalWitness<Depth, Hash>* witness);
+};
+
 class SHA256Compress : public uint256 {
 public:
     SHA256Compress() : uint256() {}
     SHA256Compress(uint256 contents) : uint256(contents) { }
 
     static SHA256Compress combine(const SHA256Compress& a, const SHA256Compress& b);
+
+    // Sets out[i] to combine(in[2*i], in[2*i+1]) for every pair in `in`,
+    // using the multi-lane SHA256 compression where available.
+    static void combine_many(const std::vector<SHA256Compress>& in, std::vector<SHA256Compress>& out);
 };
 
 } // end namespace `libzcash`
@@ -202,4 +265,7 @@ typedef libzcash::IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, l
 typedef libzcash::IncrementalWitness<INCREMENTAL_MERKLE_TREE_DEPTH, libzcash::SHA256Compress> ZCIncrementalWitness;
 typedef libzcash::IncrementalWitness<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, libzcash::SHA256Compress> ZCTestingIncrementalWitness;
 
+typedef libzcash::IncrementalWitnessUpdater<INCREMENTAL_MERKLE_TREE_DEPTH, libzcash::SHA256Compress> ZCIncrementalWitnessUpdater;
+typedef libzcash::IncrementalWitnessUpdater<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, libzcash::SHA256Compress> ZCTestingIncrementalWitnessUpdater;
+
 #endif /* ZC_INCREMENTALMERKLETREE_H_ */
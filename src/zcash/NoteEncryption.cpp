@@ -110,20 +110,41 @@ typename NoteDecryption<MLEN>::Plaintext NoteDecryption<MLEN>::decrypt
 {
     uint256 dhsecret;
 
-    if (crypto_scalarmult(dhsecret.begin(), sk_enc.begin(), epk.begin()) != 0) {
+    if (!get_dhsecret(dhsecret, epk)) {
         throw std::logic_error("Could not create DH secret");
     }
 
-    try {
-        return decrypt_INTERNAL(ciphertext, dhsecret, epk, pk_enc, hSig, nonce);
-    } catch (note_decryption_failed) {
-        return decrypt_INTERNAL(ciphertext, dhsecret, epk, sk_enc, hSig, nonce);
+    NoteDecryption<MLEN>::Plaintext plaintext;
+    if (!try_decrypt(plaintext, ciphertext, dhsecret, epk, hSig, nonce)) {
+        throw note_decryption_failed();
     }
+
+    return plaintext;
 }
 
 template<size_t MLEN>
-typename NoteDecryption<MLEN>::Plaintext NoteDecryption<MLEN>::decrypt_INTERNAL
-                                         (const NoteDecryption<MLEN>::Ciphertext &ciphertext,
+bool NoteDecryption<MLEN>::get_dhsecret(uint256 &dhsecret, const uint256 &epk) const
+{
+    return crypto_scalarmult(dhsecret.begin(), sk_enc.begin(), epk.begin()) == 0;
+}
+
+template<size_t MLEN>
+bool NoteDecryption<MLEN>::try_decrypt(NoteDecryption<MLEN>::Plaintext &plaintext,
+                                       const NoteDecryption<MLEN>::Ciphertext &ciphertext,
+                                       const uint256 &dhsecret,
+                                       const uint256 &epk,
+                                       const uint256 &hSig,
+                                       unsigned char nonce
+                                      ) const
+{
+    return decrypt_INTERNAL(plaintext, ciphertext, dhsecret, epk, pk_enc, hSig, nonce) ||
+           decrypt_INTERNAL(plaintext, ciphertext, dhsecret, epk, sk_enc, hSig, nonce);
+}
+
+template<size_t MLEN>
+bool NoteDecryption<MLEN>::decrypt_INTERNAL
+                                         (NoteDecryption<MLEN>::Plaintext &plaintext,
+                                          const NoteDecryption<MLEN>::Ciphertext &ciphertext,
                                           const uint256 &dhsecret,
                                           const uint256 &epk,
                                           const uint256 &ck_enc,
@@ -136,20 +157,14 @@ typename NoteDecryption<MLEN>::Plaintext NoteDecryption<MLEN>::decrypt_INTERNAL
     // The nonce is zero because we never reuse keys
     unsigned char cipher_nonce[crypto_aead_chacha20poly1305_IETF_NPUBBYTES] = {};
 
-    NoteDecryption<MLEN>::Plaintext plaintext;
-
     // Message length is always NOTEENCRYPTION_AUTH_BYTES less than
     // the ciphertext length.
-    if (crypto_aead_chacha20poly1305_ietf_decrypt(plaintext.begin(), NULL,
-                                             NULL,
-                                             ciphertext.begin(), NoteDecryption<MLEN>::CLEN,
-                                             NULL,
-                                             0,
-                                             cipher_nonce, K) != 0) {
-        throw note_decryption_failed();
-    }
-
-    return plaintext;
+    return crypto_aead_chacha20poly1305_ietf_decrypt(plaintext.begin(), NULL,
+                                                     NULL,
+                                                     ciphertext.begin(), NoteDecryption<MLEN>::CLEN,
+                                                     NULL,
+                                                     0,
+                                                     cipher_nonce, K) == 0;
 }
 
 //
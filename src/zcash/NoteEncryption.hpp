@@ -71,14 +71,32 @@ public:
     NoteDecryption() { }
     NoteDecryption(uint256 sk_enc);
 
+    // Decrypts `ciphertext`, throwing note_decryption_failed if it was
+    // not encrypted to this key.
     Plaintext decrypt(const Ciphertext &ciphertext,
                       const uint256 &epk,
                       const uint256 &hSig,
                       unsigned char nonce
                      ) const;
 
+    // Computes the Diffie-Hellman secret shared with the sender of the
+    // ciphertexts encrypted under `epk`. Returns false if `epk` is invalid.
+    bool get_dhsecret(uint256 &dhsecret, const uint256 &epk) const;
+
+    // Trial-decrypts `ciphertext` with a secret from get_dhsecret, so that
+    // the ciphertexts of a JoinSplit can share one scalar multiplication.
+    // Returns false, without throwing, if it was not encrypted to this key.
+    bool try_decrypt(Plaintext &plaintext,
+                     const Ciphertext &ciphertext,
+                     const uint256 &dhsecret,
+                     const uint256 &epk,
+                     const uint256 &hSig,
+                     unsigned char nonce
+                    ) const;
+
 private:
-    static Plaintext decrypt_INTERNAL(
+    static bool decrypt_INTERNAL(
+            Plaintext &plaintext,
             const Ciphertext &ciphertext,
             const uint256 &dhsecret,
             const uint256 &epk,
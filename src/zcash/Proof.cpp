@@ -1,10 +1,12 @@
 #include "Proof.hpp"
 
 #include "crypto/common.h"
+#include "random.h"
 
 #include <boost/static_assert.hpp>
 #include <libsnark/common/default_types/r1cs_ppzksnark_pp.hpp>
 #include <libsnark/zk_proof_systems/ppzksnark/r1cs_ppzksnark/r1cs_ppzksnark.hpp>
+#include <map>
 #include <mutex>
 
 using namespace libsnark;
@@ -223,6 +225,30 @@ void initialize_curve_params()
     std::call_once (init_public_params_once_flag, curve_pp::init_public_params);
 }
 
+// A proof whose pairing checks have been deferred. The accumulated
+// input commitment is computed up front since it is needed both by
+// the batched check and by the per-proof fallback.
+struct DeferredProof {
+    const r1cs_ppzksnark_verification_key<curve_pp>* vk;
+    const r1cs_ppzksnark_processed_verification_key<curve_pp>* pvk;
+    r1cs_primary_input<curve_Fr> primary_input;
+    r1cs_ppzksnark_proof<curve_pp> proof;
+    curve_G1 acc;
+};
+
+struct ProofBatch {
+    std::vector<DeferredProof> proofs;
+};
+
+ProofVerifier::ProofVerifier(bool perform_verification, bool fBatch) :
+    perform_verification(perform_verification),
+    batch(fBatch ? new ProofBatch() : nullptr) { }
+
+ProofVerifier::~ProofVerifier() { }
+
+ProofVerifier::ProofVerifier(ProofVerifier&&) = default;
+ProofVerifier& ProofVerifier::operator=(ProofVerifier&&) = default;
+
 ProofVerifier ProofVerifier::Strict() {
     initialize_curve_params();
     return ProofVerifier(true);
@@ -233,6 +259,11 @@ ProofVerifier ProofVerifier::Disabled() {
     return ProofVerifier(false);
 }
 
+ProofVerifier ProofVerifier::Batch() {
+    initialize_curve_params();
+    return ProofVerifier(true, true);
+}
+
 template<>
 bool ProofVerifier::check(
     const r1cs_ppzksnark_verification_key<curve_pp>& vk,
@@ -241,11 +272,135 @@ bool ProofVerifier::check(
     const r1cs_ppzksnark_proof<curve_pp>& proof
 )
 {
-    if (perform_verification) {
+    if (!perform_verification) {
+        return true;
+    }
+
+    if (!batch) {
         return r1cs_ppzksnark_online_verifier_strong_IC<curve_pp>(pvk, primary_input, proof);
-    } else {
+    }
+
+    // Reject anything that would also be rejected by the strong IC
+    // verifier before the pairings are computed.
+    if (pvk.encoded_IC_query.domain_size() != primary_input.size() || !proof.is_well_formed()) {
+        return false;
+    }
+
+    DeferredProof deferred;
+    deferred.vk = &vk;
+    deferred.pvk = &pvk;
+    deferred.primary_input = primary_input;
+    deferred.proof = proof;
+    deferred.acc = pvk.encoded_IC_query.template accumulate_chunk<curve_Fr>(
+        primary_input.begin(), primary_input.end(), 0).first;
+    batch->proofs.push_back(std::move(deferred));
+    return true;
+}
+
+size_t ProofVerifier::BatchSize() const
+{
+    return batch ? batch->proofs.size() : 0;
+}
+
+// 128-bit scalars are enough to make a forged batch pass with
+// probability at most 2^-128, and halve the cost of each
+// scalar multiplication compared to full-width elements of Fr.
+// They are drawn from the node's RNG, as a prover who could predict them
+// could forge a batch.
+static bigint<2> random_batch_scalar()
+{
+    bigint<2> r;
+    GetRandBytes(reinterpret_cast<unsigned char*>(r.data), sizeof(r.data));
+    return r;
+}
+
+// Checks all the given proofs (which must share a verification key)
+// at once. Each of the five pairing-product equations of every proof
+// is raised to an independent random power, and the products are
+// combined. Pairings against fixed G2 elements of the verification key
+// collapse into a single Miller loop over the sum of their G1 inputs;
+// the pairings against each proof's g_B are merged into one Miller loop
+// per proof. Only one final exponentiation is needed for the batch.
+static bool verify_batch_single_key(const std::vector<const DeferredProof*>& proofs)
+{
+    const auto& vk = *proofs.front()->vk;
+    const auto& pvk = *proofs.front()->pvk;
+
+    curve_G1 sum_alphaA = curve_G1::zero();
+    curve_G1 sum_alphaC = curve_G1::zero();
+    curve_G1 sum_gamma = curve_G1::zero();
+    curve_G1 sum_one = curve_G1::zero();
+    curve_G1 sum_rC_Z = curve_G1::zero();
+    curve_G1 sum_gamma_beta = curve_G1::zero();
+
+    curve_pp::Fqk_type ml = curve_pp::Fqk_type::one();
+
+    for (const DeferredProof* d : proofs) {
+        const auto& p = d->proof;
+        auto a = random_batch_scalar();
+        auto b = random_batch_scalar();
+        auto c = random_batch_scalar();
+        auto q = random_batch_scalar();
+        auto k = random_batch_scalar();
+
+        curve_G1 A_acc = p.g_A.g + d->acc;
+
+        // e(g_A, alphaA_g2) = e(g_A', P2)
+        sum_alphaA = sum_alphaA + a * p.g_A.g;
+        sum_one = sum_one - a * p.g_A.h;
+        // e(alphaB_g1, g_B) = e(g_B', P2)
+        sum_one = sum_one - b * p.g_B.h;
+        // e(g_C, alphaC_g2) = e(g_C', P2)
+        sum_alphaC = sum_alphaC + c * p.g_C.g;
+        sum_one = sum_one - c * p.g_C.h;
+        // e(g_A + acc, g_B) = e(g_H, rC_Z_g2) * e(g_C, P2)
+        sum_rC_Z = sum_rC_Z - q * p.g_H;
+        sum_one = sum_one - q * p.g_C.g;
+        // e(g_K, gamma_g2) = e(g_A + acc + g_C, gamma_beta_g2) * e(gamma_beta_g1, g_B)
+        sum_gamma = sum_gamma + k * p.g_K;
+        sum_gamma_beta = sum_gamma_beta - k * (A_acc + p.g_C.g);
+
+        // All of the pairings against this proof's g_B
+        curve_G1 B_coeff = b * vk.alphaB_g1 + q * A_acc - k * vk.gamma_beta_g1;
+        ml = ml * curve_pp::miller_loop(
+            curve_pp::precompute_G1(B_coeff),
+            curve_pp::precompute_G2(p.g_B.g));
+    }
+
+    ml = ml * curve_pp::double_miller_loop(
+        curve_pp::precompute_G1(sum_alphaA), pvk.vk_alphaA_g2_precomp,
+        curve_pp::precompute_G1(sum_alphaC), pvk.vk_alphaC_g2_precomp);
+    ml = ml * curve_pp::double_miller_loop(
+        curve_pp::precompute_G1(sum_gamma), pvk.vk_gamma_g2_precomp,
+        curve_pp::precompute_G1(sum_one), pvk.pp_G2_one_precomp);
+    ml = ml * curve_pp::double_miller_loop(
+        curve_pp::precompute_G1(sum_rC_Z), pvk.vk_rC_Z_g2_precomp,
+        curve_pp::precompute_G1(sum_gamma_beta), pvk.vk_gamma_beta_g2_precomp);
+
+    return curve_pp::final_exponentiation(ml) == curve_GT::one();
+}
+
+bool ProofVerifier::VerifyBatch()
+{
+    if (!batch || batch->proofs.empty()) {
         return true;
     }
+
+    std::vector<DeferredProof> proofs;
+    proofs.swap(batch->proofs);
+
+    // Group by verification key; in practice there is only one.
+    std::map<const void*, std::vector<const DeferredProof*>> groups;
+    for (const DeferredProof& d : proofs) {
+        groups[d.pvk].push_back(&d);
+    }
+
+    for (const auto& group : groups) {
+        if (!verify_batch_single_key(group.second)) {
+            return false;
+        }
+    }
+    return true;
 }
 
 }
@@ -4,6 +4,8 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <memory>
+
 namespace libzcash {
 
 const unsigned char G1_PREFIX_MASK = 0x02;
@@ -237,13 +239,19 @@ public:
 
 void initialize_curve_params();
 
+// Proofs deferred by a batching ProofVerifier, defined in Proof.cpp
+struct ProofBatch;
+
 class ProofVerifier {
 private:
     bool perform_verification;
+    std::unique_ptr<ProofBatch> batch;
 
-    ProofVerifier(bool perform_verification) : perform_verification(perform_verification) { }
+    ProofVerifier(bool perform_verification, bool fBatch = false);
 
 public:
+    ~ProofVerifier();
+
     // ProofVerifier should never be copied
     ProofVerifier(const ProofVerifier&) = delete;
     ProofVerifier& operator=(const ProofVerifier&) = delete;
@@ -259,6 +267,13 @@ public:
     // such as during reindexing.
     static ProofVerifier Disabled();
 
+    // Creates a verification context that only performs the
+    // cheap structural checks in check(), and defers the pairing
+    // checks until VerifyBatch() is called. All deferred proofs
+    // are then checked together using a random linear combination
+    // and a single final exponentiation.
+    static ProofVerifier Batch();
+
     template <typename VerificationKey,
               typename ProcessedVerificationKey,
               typename PrimaryInput,
@@ -270,6 +285,16 @@ public:
         const PrimaryInput& pi,
         const Proof& p
     );
+
+    // Number of proofs waiting for VerifyBatch().
+    size_t BatchSize() const;
+
+    // Verifies every proof deferred since the last call and clears
+    // the batch. Returns true if all of them are valid. It does not
+    // say which proof is invalid; callers that need to know check
+    // the proofs again with a strict verifier. Always returns true
+    // for non-batching verifiers.
+    bool VerifyBatch();
 };
 
 }
@@ -1,27 +1,37 @@
+#include <atomic>
 #include <cstdio>
 #include <future>
 #include <map>
 #include <thread>
 #include <unistd.h>
 #include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
 
 #include "coins.h"
 #include "util.h"
 #include "init.h"
 #include "primitives/transaction.h"
 #include "base58.h"
+#include "blockencoding.h"
+#include "crypto/common.h"
 #include "crypto/equihash.h"
+#include "crypto/sha256.h"
+#include "cuckoocache.h"
 #include "chain.h"
 #include "chainparams.h"
+#include "compactblock.h"
 #include "consensus/validation.h"
 #include "main.h"
 #include "miner.h"
 #include "pow.h"
 #include "rpc/server.h"
+#include "random.h"
+#include "script/sigcache.h"
 #include "script/sign.h"
 #include "sodium.h"
 #include "streams.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "utiltest.h"
 #include "wallet/wallet.h"
 
@@ -160,6 +170,105 @@ double benchmark_verify_joinsplit(const JSDescription &joinsplit)
     return timer_stop(tv_start);
 }
 
+// Returns the time taken to verify nProofs copies of the given JoinSplit
+// one at a time, followed by the time taken to verify them as one batch.
+std::vector<double> benchmark_verify_joinsplit_batch(const JSDescription &joinsplit, size_t nProofs)
+{
+    std::vector<double> ret;
+    struct timeval tv_start;
+    uint256 pubKeyHash;
+
+    timer_start(tv_start);
+    {
+        auto verifier = libzcash::ProofVerifier::Strict();
+        for (size_t i = 0; i < nProofs; i++) {
+            joinsplit.Verify(*pzcashParams, verifier, pubKeyHash);
+        }
+    }
+    ret.push_back(timer_stop(tv_start));
+
+    timer_start(tv_start);
+    {
+        auto verifier = libzcash::ProofVerifier::Batch();
+        for (size_t i = 0; i < nProofs; i++) {
+            joinsplit.Verify(*pzcashParams, verifier, pubKeyHash);
+        }
+        verifier.VerifyBatch();
+    }
+    ret.push_back(timer_stop(tv_start));
+
+    return ret;
+}
+
+// Each thread performs nOps signature cache operations, nine lookups (half
+// of which are of prefilled entries) for every insert, with the same locking as CSignatureCache.
+// Returns the time taken by each thread.
+std::vector<double> benchmark_sigcache_threaded(int nThreads)
+{
+    const size_t nOps = 1000000;
+    const size_t nPrefill = 500000;
+
+    CuckooCache::cache<uint256, SignatureCacheHasher> cache;
+    boost::shared_mutex cs_cache;
+    cache.setup_bytes(DEFAULT_MAX_SIG_CACHE_SIZE << 20);
+
+    seed_insecure_rand();
+    auto randomEntry = []() {
+        uint256 entry;
+        for (unsigned char* p = entry.begin(); p != entry.end(); p += 4) {
+            WriteLE32(p, insecure_rand());
+        }
+        return entry;
+    };
+    std::vector<uint256> vPrefill(nPrefill);
+    for (uint256& entry : vPrefill) {
+        entry = randomEntry();
+        cache.insert(entry);
+    }
+    std::vector<std::vector<uint256>> vNew(nThreads);
+    for (auto& v : vNew) {
+        v.resize(nOps / 10);
+        for (uint256& entry : v) {
+            entry = randomEntry();
+        }
+    }
+
+    auto worker = [&](int nThread) {
+        struct timeval tv_start;
+        timer_start(tv_start);
+        size_t nInserted = 0;
+        for (size_t i = 0; i < nOps; i++) {
+            if (i % 10 == 9) {
+                boost::unique_lock<boost::shared_mutex> lock(cs_cache);
+                cache.insert(vNew[nThread][nInserted++]);
+            } else {
+                const uint256& entry = (i & 1) ? vPrefill[(i * 7919 + nThread) % nPrefill]
+                                               : vNew[nThread][(i / 10) % vNew[nThread].size()];
+                boost::shared_lock<boost::shared_mutex> lock(cs_cache);
+                cache.contains(entry, false);
+            }
+        }
+        return timer_stop(tv_start);
+    };
+
+    std::vector<double> ret;
+    std::vector<std::future<double>> tasks;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nThreads; i++) {
+        std::packaged_task<double(void)> task(std::bind(worker, i));
+        tasks.emplace_back(task.get_future());
+        threads.emplace_back(std::move(task));
+    }
+    for (auto it = tasks.begin(); it != tasks.end(); it++) {
+        it->wait();
+        ret.push_back(it->get());
+    }
+    for (auto it = threads.begin(); it != threads.end(); it++) {
+        it->join();
+    }
+    return ret;
+}
+
 #ifdef ENABLE_MINING
 double benchmark_solve_equihash()
 {
@@ -221,6 +330,282 @@ double benchmark_verify_equihash()
     return timer_stop(tv_start);
 }
 
+// Checks the Equihash solutions of a full headers message (copies of the
+// genesis header), first one at a time and then split between nThreads
+// threads, as CheckBlockHeaders does. Returns the two running times.
+std::vector<double> benchmark_verify_equihash_threaded(int nThreads)
+{
+    CChainParams params = Params(CBaseChainParams::MAIN);
+    std::vector<CBlockHeader> vHeaders(MAX_HEADERS_RESULTS, params.GenesisBlock().GetBlockHeader());
+
+    std::vector<double> ret;
+    struct timeval tv_start;
+
+    timer_start(tv_start);
+    for (const CBlockHeader& header : vHeaders) {
+        if (!CheckEquihashSolution(&header, params))
+            throw std::runtime_error("Equihash solution invalid");
+    }
+    ret.push_back(timer_stop(tv_start));
+
+    std::atomic<bool> fAllOk(true);
+    auto worker = [&](int nThread) {
+        for (size_t i = nThread; i < vHeaders.size(); i += nThreads) {
+            if (!CheckEquihashSolution(&vHeaders[i], params))
+                fAllOk = false;
+        }
+    };
+    timer_start(tv_start);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nThreads; i++) {
+        threads.emplace_back(worker, i);
+    }
+    for (auto it = threads.begin(); it != threads.end(); it++) {
+        it->join();
+    }
+    ret.push_back(timer_stop(tv_start));
+    if (!fAllOk)
+        throw std::runtime_error("Equihash solution invalid");
+
+    return ret;
+}
+
+// Hashes nBlocks 64-byte blocks as Merkle tree nodes (double SHA256), as
+// note commitment tree nodes (one compression) and as one long message,
+// first with the standard SHA256 implementation and then with the best one
+// for this CPU. Returns the two running times. The implementations in use
+// by the rest of the node are not switched.
+std::vector<double> benchmark_sha256(size_t nBlocks)
+{
+    std::vector<unsigned char> in(64 * nBlocks);
+    std::vector<unsigned char> out(32 * nBlocks);
+    GetRandBytes(in.data(), in.size());
+
+    std::vector<double> ret;
+    for (auto use : {sha256_implementation::STANDARD, sha256_implementation::USE_ALL}) {
+        uint32_t state[8] = {0};
+        struct timeval tv_start;
+        timer_start(tv_start);
+        SHA256D64(out.data(), in.data(), nBlocks, use);
+        SHA256Compress64(out.data(), in.data(), nBlocks, use);
+        SHA256Transform(state, in.data(), nBlocks, use);
+        ret.push_back(timer_stop(tv_start));
+    }
+
+    return ret;
+}
+
+// Returns the time taken to store the last nBlocks blocks of the active chain
+// as they are and compressed, then to read each of those back, followed by
+// the total size in bytes of the blocks in each format.
+std::vector<double> benchmark_block_storage(size_t nBlocks)
+{
+    std::vector<CBlock> vBlocks;
+    for (CBlockIndex* pindex = chainActive.Tip(); pindex && vBlocks.size() < nBlocks; pindex = pindex->pprev) {
+        vBlocks.push_back(CBlock());
+        if (!ReadBlockFromDisk(vBlocks.back(), pindex))
+            throw std::runtime_error("Failed to read block from disk");
+    }
+
+    std::vector<std::vector<char> > vRaw(vBlocks.size());
+    std::vector<std::vector<char> > vCompressed(vBlocks.size());
+    std::vector<double> ret;
+    struct timeval tv_start;
+
+    timer_start(tv_start);
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << vBlocks[i];
+        vRaw[i].assign(ss.begin(), ss.end());
+    }
+    ret.push_back(timer_stop(tv_start));
+
+    timer_start(tv_start);
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << vBlocks[i];
+        std::vector<char> vRecord(ss.begin(), ss.end());
+        if (!CompressBlockRecord(vRecord.data(), vRecord.size(), vCompressed[i]))
+            vCompressed[i].swap(vRecord);
+    }
+    ret.push_back(timer_stop(tv_start));
+
+    timer_start(tv_start);
+    for (size_t i = 0; i < vRaw.size(); i++) {
+        CBlock block;
+        CMemoryReader reader(vRaw[i].data(), vRaw[i].data() + vRaw[i].size(), SER_DISK, CLIENT_VERSION);
+        reader >> block;
+    }
+    ret.push_back(timer_stop(tv_start));
+
+    timer_start(tv_start);
+    for (size_t i = 0; i < vCompressed.size(); i++) {
+        std::vector<char> vRecord;
+        if (!DecompressRecord(vCompressed[i].data(), vCompressed[i].size(), vRecord))
+            vRecord = vCompressed[i];
+        CBlock block;
+        CMemoryReader reader(vRecord.data(), vRecord.data() + vRecord.size(), SER_DISK, CLIENT_VERSION);
+        reader >> block;
+    }
+    ret.push_back(timer_stop(tv_start));
+
+    double nRawSize = 0, nCompressedSize = 0;
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        nRawSize += vRaw[i].size();
+        nCompressedSize += vCompressed[i].size();
+    }
+    ret.push_back(nRawSize);
+    ret.push_back(nCompressedSize);
+    return ret;
+}
+
+// Returns the time taken to relay the last nBlocks blocks of the active chain
+// in full, that is encoding and decoding each, then as compact blocks, that is
+// encoding each and rebuilding it from a mempool holding all but
+// nMissingPercent percent of its transactions, followed by the total size in
+// bytes sent on the wire in each case. The size of a compact block includes
+// the getblocktxn and blocktxn round trip for the missing transactions.
+std::vector<double> benchmark_compact_block(size_t nBlocks, int nMissingPercent)
+{
+    std::vector<CBlock> vBlocks;
+    for (CBlockIndex* pindex = chainActive.Tip(); pindex && vBlocks.size() < nBlocks; pindex = pindex->pprev) {
+        vBlocks.push_back(CBlock());
+        if (!ReadBlockFromDisk(vBlocks.back(), pindex))
+            throw std::runtime_error("Failed to read block from disk");
+    }
+
+    CTxMemPool pool(CFeeRate(0));
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        for (size_t j = 1; j < vBlocks[i].vtx.size(); j++) {
+            const CTransaction& tx = vBlocks[i].vtx[j];
+            if ((int)GetRand(100) >= nMissingPercent)
+                pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, 0, 0.0, 1));
+        }
+    }
+
+    std::vector<CDataStream> vFull(vBlocks.size(), CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+    std::vector<CDataStream> vCompact(vBlocks.size(), CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+    std::vector<double> ret;
+    struct timeval tv_start;
+
+    timer_start(tv_start);
+    for (size_t i = 0; i < vBlocks.size(); i++)
+        vFull[i] << vBlocks[i];
+    ret.push_back(timer_stop(tv_start));
+
+    double nFullSize = 0;
+    for (size_t i = 0; i < vFull.size(); i++)
+        nFullSize += vFull[i].size();
+
+    timer_start(tv_start);
+    for (size_t i = 0; i < vFull.size(); i++) {
+        CBlock block;
+        vFull[i] >> block;
+    }
+    ret.push_back(timer_stop(tv_start));
+
+    timer_start(tv_start);
+    for (size_t i = 0; i < vBlocks.size(); i++)
+        vCompact[i] << CBlockHeaderAndShortTxIDs(vBlocks[i]);
+    ret.push_back(timer_stop(tv_start));
+
+    double nCompactSize = 0;
+    for (size_t i = 0; i < vCompact.size(); i++)
+        nCompactSize += vCompact[i].size();
+
+    timer_start(tv_start);
+    for (size_t i = 0; i < vCompact.size(); i++) {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vCompact[i] >> cmpctblock;
+        PartiallyDownloadedBlock partialBlock(&pool);
+        if (partialBlock.InitData(cmpctblock) != READ_STATUS_OK)
+            throw std::runtime_error("Failed to decode compact block");
+
+        BlockTransactionsRequest req;
+        req.blockhash = cmpctblock.header.GetHash();
+        req.indexes = partialBlock.GetMissingIndexes();
+        BlockTransactions resp(req);
+        for (size_t j = 0; j < req.indexes.size(); j++)
+            resp.txn[j] = vBlocks[i].vtx[req.indexes[j]];
+        if (!req.indexes.empty()) {
+            nCompactSize += ::GetSerializeSize(req, SER_NETWORK, PROTOCOL_VERSION);
+            nCompactSize += ::GetSerializeSize(resp, SER_NETWORK, PROTOCOL_VERSION);
+        }
+
+        CBlock block;
+        if (partialBlock.FillBlock(block, resp.txn) != READ_STATUS_OK)
+            throw std::runtime_error("Failed to rebuild compact block");
+    }
+    ret.push_back(timer_stop(tv_start));
+
+    ret.push_back(nFullSize);
+    ret.push_back(nCompactSize);
+    return ret;
+}
+
+// Returns the time taken to compute the median time past of every block of a
+// synthetic chain of nHeight blocks through CBlockIndex and through CChain,
+// then to look up ancestors at random heights through the skiplist and
+// through CChain.
+std::vector<double> benchmark_chain_index(size_t nHeight)
+{
+    // Allocate the entries one by one, with other allocations in between, so
+    // they end up scattered over the heap as in a long-running node.
+    std::vector<CBlockIndex*> vIndex(nHeight);
+    std::vector<std::vector<char> > vPadding(nHeight);
+    std::vector<uint256> vHashes(nHeight);
+    for (size_t i = 0; i < nHeight; i++) {
+        vIndex[i] = new CBlockIndex();
+        vPadding[i].resize(GetRand(512));
+        vHashes[i] = GetRandHash();
+        vIndex[i]->phashBlock = &vHashes[i];
+        vIndex[i]->pprev = i ? vIndex[i - 1] : NULL;
+        vIndex[i]->nHeight = i;
+        vIndex[i]->nTime = 1477641360 + i * 150 + GetRand(300);
+        vIndex[i]->nChainWork = i ? vIndex[i - 1]->nChainWork + 1 : arith_uint256(1);
+        vIndex[i]->BuildSkip();
+    }
+    CChain chain;
+    chain.SetTip(vIndex.back());
+
+    const size_t nQueries = 1000000;
+    std::vector<std::pair<int, int> > vQueries(nQueries);
+    for (size_t i = 0; i < nQueries; i++) {
+        vQueries[i].first = GetRand(nHeight);
+        vQueries[i].second = GetRand(vQueries[i].first + 1);
+    }
+
+    std::vector<double> ret;
+    struct timeval tv_start;
+    int64_t nSum = 0;
+
+    timer_start(tv_start);
+    for (size_t i = 0; i < nHeight; i++)
+        nSum += vIndex[i]->GetMedianTimePast();
+    ret.push_back(timer_stop(tv_start));
+
+    timer_start(tv_start);
+    for (size_t i = 0; i < nHeight; i++)
+        nSum -= chain.GetMedianTimePast(vIndex[i]);
+    ret.push_back(timer_stop(tv_start));
+    assert(nSum == 0);
+
+    timer_start(tv_start);
+    for (size_t i = 0; i < nQueries; i++)
+        nSum += vIndex[vQueries[i].first]->GetAncestor(vQueries[i].second)->nHeight;
+    ret.push_back(timer_stop(tv_start));
+
+    timer_start(tv_start);
+    for (size_t i = 0; i < nQueries; i++)
+        nSum -= chain.GetAncestor(vIndex[vQueries[i].first], vQueries[i].second)->nHeight;
+    ret.push_back(timer_stop(tv_start));
+    assert(nSum == 0);
+
+    for (size_t i = 0; i < nHeight; i++)
+        delete vIndex[i];
+    return ret;
+}
+
 double benchmark_large_tx()
 {
     // Number of inputs in the spending transaction that we will simulate
@@ -283,7 +668,10 @@ double benchmark_large_tx()
     return timer_stop(tv_start);
 }
 
-double benchmark_try_decrypt_notes(size_t nAddrs)
+// Returns the time taken by FindMyNotes on a transaction that none of the
+// nAddrs addresses can decrypt, followed by the number of trial decryptions
+// per second.
+std::vector<double> benchmark_try_decrypt_notes(size_t nAddrs, int nThreads)
 {
     CWallet wallet;
     for (int i = 0; i < nAddrs; i++) {
@@ -294,12 +682,23 @@ double benchmark_try_decrypt_notes(size_t nAddrs)
     auto sk = libzcash::SpendingKey::random();
     auto tx = GetValidReceive(*pzcashParams, sk, 10, true);
 
+    int nPrevThreads = nNoteDecryptThreads;
+    nNoteDecryptThreads = nThreads;
+
     struct timeval tv_start;
     timer_start(tv_start);
     auto nd = wallet.FindMyNotes(tx);
-    return timer_stop(tv_start);
+    double elapsed = timer_stop(tv_start);
+
+    nNoteDecryptThreads = nPrevThreads;
+
+    size_t nTrials = nAddrs * tx.vjoinsplit.size() * ZC_NUM_JS_OUTPUTS;
+    return {elapsed, nTrials / elapsed};
 }
 
+// Returns the time taken to increment the witnesses of nTxs notes by a
+// block containing one more note. Only the commitments of the notes are
+// used, so they are random rather than the result of real JoinSplits.
 double benchmark_increment_note_witnesses(size_t nTxs)
 {
     CWallet wallet;
@@ -308,45 +707,45 @@ double benchmark_increment_note_witnesses(size_t nTxs)
     auto sk = libzcash::SpendingKey::random();
     wallet.AddSpendingKey(sk);
 
-    // First block
-    CBlock block1;
-    for (int i = 0; i < nTxs; i++) {
-        auto wtx = GetValidReceive(*pzcashParams, sk, 10, true);
-        auto note = GetNote(*pzcashParams, sk, wtx, 0, 1);
-        auto nullifier = note.nullifier(sk);
+    auto addNote = [&](CBlock& block) {
+        CMutableTransaction mtx;
+        mtx.nVersion = 2;
+        mtx.vjoinsplit.resize(1);
+        for (uint256& commitment : mtx.vjoinsplit[0].commitments) {
+            commitment = GetRandHash();
+        }
+        CWalletTx wtx {&wallet, mtx};
 
         mapNoteData_t noteData;
         JSOutPoint jsoutpt {wtx.GetHash(), 0, 1};
-        CNoteData nd {sk.address(), nullifier};
+        CNoteData nd {sk.address(), GetRandHash()};
         noteData[jsoutpt] = nd;
 
         wtx.SetNoteData(noteData);
         wallet.AddToWallet(wtx, true, NULL);
-        block1.vtx.push_back(wtx);
+        block.vtx.push_back(wtx);
+    };
+
+    // First block
+    CBlock block1;
+    for (int i = 0; i < nTxs; i++) {
+        addNote(block1);
     }
     CBlockIndex index1(block1);
     index1.nHeight = 1;
 
     // Increment to get transactions witnessed
     wallet.ChainTip(&index1, &block1, tree, true);
+    for (const CTransaction& tx : block1.vtx) {
+        for (const uint256& commitment : tx.vjoinsplit[0].commitments) {
+            tree.append(commitment);
+        }
+    }
 
     // Second block
     CBlock block2;
     block2.hashPrevBlock = block1.GetHash();
-    {
-        auto wtx = GetValidReceive(*pzcashParams, sk, 10, true);
-        auto note = GetNote(*pzcashParams, sk, wtx, 0, 1);
-        auto nullifier = note.nullifier(sk);
-
-        mapNoteData_t noteData;
-        JSOutPoint jsoutpt {wtx.GetHash(), 0, 1};
-        CNoteData nd {sk.address(), nullifier};
-        noteData[jsoutpt] = nd;
-
-        wtx.SetNoteData(noteData);
-        wallet.AddToWallet(wtx, true, NULL);
-        block2.vtx.push_back(wtx);
-    }
+    addNote(block2);
     CBlockIndex index2(block2);
     index2.nHeight = 2;
 
@@ -388,7 +787,8 @@ public:
                     const uint256 &hashBlock,
                     const uint256 &hashAnchor,
                     CAnchorsMap &mapAnchors,
-                    CNullifiersMap &mapNullifiers) {
+                    CNullifiersMap &mapNullifiers,
+                    const CCoinsSetCommitment *pcommitment) {
         return false;
     }
 
@@ -11,9 +11,16 @@ extern std::vector<double> benchmark_create_joinsplit_threaded(int nThreads);
 extern double benchmark_solve_equihash();
 extern std::vector<double> benchmark_solve_equihash_threaded(int nThreads);
 extern double benchmark_verify_joinsplit(const JSDescription &joinsplit);
+extern std::vector<double> benchmark_verify_joinsplit_batch(const JSDescription &joinsplit, size_t nProofs);
+extern std::vector<double> benchmark_sigcache_threaded(int nThreads);
 extern double benchmark_verify_equihash();
+extern std::vector<double> benchmark_verify_equihash_threaded(int nThreads);
+extern std::vector<double> benchmark_sha256(size_t nBlocks);
+extern std::vector<double> benchmark_block_storage(size_t nBlocks);
+extern std::vector<double> benchmark_compact_block(size_t nBlocks, int nMissingPercent);
+extern std::vector<double> benchmark_chain_index(size_t nHeight);
 extern double benchmark_large_tx();
-extern double benchmark_try_decrypt_notes(size_t nAddrs);
+extern std::vector<double> benchmark_try_decrypt_notes(size_t nAddrs, int nThreads);
 extern double benchmark_increment_note_witnesses(size_t nTxs);
 extern double benchmark_connectblock_slow();
 extern double benchmark_sendtoaddress(CAmount amount);